@@ -6,6 +6,8 @@
 #include "Hashtable.h"
 
 #define MAX_BUCKET_SIZE 64
+/* Keys between two consecutive steps of a batched lookup */
+#define BATCH_PREFETCH_DISTANCE 4
 
 /**
  * Compares keys of type int
@@ -74,7 +76,8 @@ hash_function_string(void *a)
 }
 
 /**
- * Allocs and initializes a hashtable
+ * Allocs and initializes a hashtable. No bucket is allocated until the
+ * first object is inserted.
  * @param hmax initial number of buckets
  * @param hash_function hash function used
  * @param compare_function compare function used
@@ -86,14 +89,10 @@ ht_create(unsigned int hmax, unsigned int (*hash_function)(void*),
 	hashtable_t *ht = (hashtable_t *)malloc(sizeof(hashtable_t));
 	DIE(ht == NULL, "malloc() failed\n");
 
-	ht->buckets = (linked_list_t **)malloc(hmax * sizeof(linked_list_t *));
-	DIE(ht->buckets == NULL, "malloc() failed");
-
-	for (unsigned int i = 0; i < hmax; ++i)
-		ht->buckets[i] = ll_create(sizeof(struct info));
-
+	ht->buckets = NULL;
 	ht->size = 0;
 	ht->hmax = hmax;
+	ht->bytes = 0;
 	ht->compare_function = compare_function;
 	ht->hash_function = hash_function;
 
@@ -101,153 +100,554 @@ ht_create(unsigned int hmax, unsigned int (*hash_function)(void*),
 }
 
 /**
- * Inserts an object (key, value) in the hashtable
+ * Returns the list of a bucket, or NULL if the bucket is empty
  * @param ht the hashtable
- * @param key pointer to key
- * @param key_size key size in bytes
- * @param value pointer to the data
- * @param value_size data size in bytes
+ * @param index the bucket
  */
-void
-ht_put(hashtable_t *ht, void *key, unsigned int key_size,
-	void *value, unsigned int value_size)
+static linked_list_t *
+bucket(hashtable_t *ht, unsigned int index)
 {
-	int index = ht->hash_function(key) % ht->hmax;
-
-	ll_node_t *it = ht->buckets[index]->head;
-	int found = 0;
-	while (it != NULL) {
-		struct info *node_info =(struct info *)it->data;
-		if (ht->compare_function(node_info->key, key) == 0) {
-			found = 1;
-			memcpy(((struct info *)it->data)->value, value, value_size);
-		}
-		it = it->next;
+	return ht->buckets ? ht->buckets[index] : NULL;
+}
+
+/**
+ * Returns the list of a bucket, allocating the array of buckets and the
+ * list first if needed
+ * @param ht the hashtable
+ * @param index the bucket
+ */
+static linked_list_t *
+bucket_for_insert(hashtable_t *ht, unsigned int index)
+{
+	if (ht->buckets == NULL) {
+		ht->buckets = (linked_list_t **)calloc(ht->hmax,
+											   sizeof(linked_list_t *));
+		DIE(ht->buckets == NULL, "calloc() failed");
 	}
-	if (found == 0) {
-		struct info *new_info = (struct info *)malloc(sizeof(struct info));
-		DIE(new_info == NULL, "malloc() failed\n");
+	if (ht->buckets[index] == NULL)
+		ht->buckets[index] = ll_create(sizeof(struct info));
+
+	return ht->buckets[index];
+}
+
+/**
+ * Returns the first node of a bucket, or NULL if it is empty
+ * @param ht the hashtable
+ * @param index the bucket (below ht->hmax)
+ */
+ll_node_t *
+ht_bucket_head(hashtable_t *ht, unsigned int index)
+{
+	linked_list_t *list = bucket(ht, index);
+
+	return list ? list->head : NULL;
+}
+
+/**
+ * Frees the key and the value of an object, unless they are inline
+ * @param obj the object
+ */
+static void
+free_info(hashtable_t *ht, struct info *obj)
+{
+	ht->bytes -= obj->key_size + obj->value_size;
+
+	if (obj->key != obj->inline_data)
+		free(obj->key);
+	if (obj->chunked)
+		value_chunks_free((value_chunk *)obj->value);
+	else if (!obj->value_inline)
+		free(obj->value);
+}
+
+/*
+ * Key policies of the tables generated by HT_DEFINE below. A hash function
+ * returns the hash of a key and sets *size to its size in bytes (0 if it
+ * can't be known); a match function returns 1 if an object holds the key.
+ * Both are inlined in the generated lookups, so only the generic table
+ * calls through the function pointers of the hashtable.
+ */
 
+static inline unsigned int
+generic_hash(hashtable_t *ht, void *key, unsigned int *size)
+{
+	*size = 0;
+	return ht->hash_function(key);
+}
+
+/* Objects with another hash are rejected without reading their key */
+static inline int
+generic_matches(hashtable_t *ht, struct info *obj, void *key,
+	unsigned int hash, unsigned int size)
+{
+	(void)size;
+	return obj->key_hash == hash && ht->compare_function(obj->key, key) == 0;
+}
+
+/* hash_function_string, measuring the key (terminator included) on the way;
+ * 32 bit arithmetic gives the same hash as its truncated unsigned long */
+static inline unsigned int
+string_hash(hashtable_t *ht, const char *key, unsigned int *size)
+{
+	const unsigned char *it = (const unsigned char *)key;
+	unsigned int hash = 5381;
+
+	(void)ht;
+	while (*it)
+		hash = ((hash << 5u) + hash) + *it++;
+	*size = (unsigned int)((const char *)it - key) + 1;
+	return hash;
+}
+
+/* hash_function_int */
+static inline unsigned int
+int_hash(hashtable_t *ht, const int *key, unsigned int *size)
+{
+	unsigned int uint_key = (unsigned int)*key;
+
+	(void)ht;
+	uint_key = ((uint_key >> 16u) ^ uint_key) * 0x45d9f3b;
+	uint_key = ((uint_key >> 16u) ^ uint_key) * 0x45d9f3b;
+	*size = sizeof(int);
+	return (uint_key >> 16u) ^ uint_key;
+}
+
+/* Keys are compared only when their hashes and sizes are equal, as bytes */
+static inline int
+sized_matches(hashtable_t *ht, struct info *obj, const void *key,
+	unsigned int hash, unsigned int size)
+{
+	(void)ht;
+	return obj->key_hash == hash && obj->key_size == size
+		   && memcmp(obj->key, key, size) == 0;
+}
+
+/**
+ * Appends a new object at the end of its bucket. The list node, the
+ * object and its short key and value are a single allocation, so a
+ * lookup finds the key on the cache lines it already loaded.
+ * @param ht the hashtable
+ * @param hash hash of the key
+ * @param key pointer to key
+ * @param key_size key size in bytes
+ * @param value value: a buffer which is copied, or a chain of chunks
+ *              which the new object takes
+ * @param value_size value size in bytes
+ * @param chunked 1 if value is a chain of chunks
+ */
+static void
+add_info(hashtable_t *ht, unsigned int hash, const void *key,
+	unsigned int key_size, void *value, unsigned int value_size, int chunked)
+{
+	int key_inline = key_size <= INLINE_KEY_MAX;
+	int value_inline = !chunked && value_size <= INLINE_VALUE_MAX;
+	unsigned int inline_size = (key_inline ? key_size : 0)
+							   + (value_inline ? value_size : 0);
+
+	ll_node_t *node = (ll_node_t *)malloc(sizeof(ll_node_t)
+										  + sizeof(struct info) + inline_size);
+	DIE(node == NULL, "malloc() failed\n");
+	struct info *new_info = (struct info *)(node + 1);
+	char *inline_end = new_info->inline_data;
+
+	if (key_inline) {
+		new_info->key = inline_end;
+		inline_end += key_size;
+	} else {
 		new_info->key = (void *)malloc(key_size);
 		DIE(new_info->key == NULL, "malloc() failed\n");
-		new_info->value = (void *)malloc(value_size);
-		DIE(new_info->value == NULL, "malloc() failed\n");
+	}
+	memcpy(new_info->key, key, key_size);
 
-		memcpy(new_info->key, key, key_size);
+	if (chunked) {
+		new_info->value = value;
+	} else {
+		new_info->value = value_inline ? inline_end : malloc(value_size);
+		DIE(new_info->value == NULL, "malloc() failed\n");
 		memcpy(new_info->value, value, value_size);
-
-		ll_add_nth_node(ht->buckets[index], ht->buckets[index]->size + 1, new_info);
-		ht->size++;
-		free(new_info);
 	}
+
+	new_info->value_size = value_size;
+	new_info->value_capacity = chunked ? 0 : value_size;
+	new_info->key_size = key_size;
+	new_info->key_hash = hash;
+	new_info->chunked = chunked;
+	new_info->referenced = 1;
+	new_info->value_inline = value_inline;
+	new_info->compressed = 0;
+	new_info->expires_at = 0;
+
+	/* Linked by hand: ll_add_nth_node would allocate the node itself */
+	linked_list_t *list = bucket_for_insert(ht, hash % ht->hmax);
+	ll_node_t **tail = &list->head;
+	while (*tail != NULL)
+		tail = &(*tail)->next;
+	node->data = new_info;
+	node->next = NULL;
+	*tail = node;
+	list->size++;
+
+	ht->size++;
+	ht->bytes += key_size + value_size;
 }
+
 /**
- * Returns a pointer to the data matching the key in the hashtable
- * @param ht the hashtable in which we search the data
- * @param key the key
+ * Looks up many keys at once, each in its own hashtable. A lookup is a
+ * chain of dependent loads (bucket slot, list, first node, object, key),
+ * so the keys go through it in a software pipeline: while key i has its
+ * bucket slot prefetched, the keys before it are one load further, and
+ * the cache misses of independent lookups overlap.
+ * @param hts hts[i] is the hashtable of key i (NULL to skip the key)
+ * @param keys the keys
+ * @param n number of keys
+ * @param out out[i] is set to the object of key i, or NULL
  */
-void *
-ht_get(hashtable_t *ht, void *key)
+void
+ht_get_info_batch(hashtable_t **hts, void **keys, unsigned int n,
+	struct info **out)
 {
-	if (ht == NULL)
-		return NULL;
+	const unsigned int d = BATCH_PREFETCH_DISTANCE;
+	unsigned int *index = (unsigned int *)malloc((n + 1) * sizeof(unsigned int));
+	unsigned int *hashes = (unsigned int *)malloc((n + 1)
+												  * sizeof(unsigned int));
+	DIE(index == NULL || hashes == NULL, "malloc() failed\n");
+
+	for (unsigned int i = 0; i < n + 5 * d; ++i) {
+		unsigned int j;
+
+		if (i < n && hts[i] != NULL) {
+			hashes[i] = hts[i]->hash_function(keys[i]);
+			index[i] = hashes[i] % hts[i]->hmax;
+			if (hts[i]->buckets != NULL)
+				__builtin_prefetch(&hts[i]->buckets[index[i]]);
+		}
 
-	int index = ht->hash_function(key) % ht->hmax;
+		j = i - d;
+		if (i >= d && j < n && hts[j] != NULL && bucket(hts[j], index[j]))
+			__builtin_prefetch(bucket(hts[j], index[j]));
+
+		j = i - 2 * d;
+		if (i >= 2 * d && j < n && hts[j] != NULL
+			&& ht_bucket_head(hts[j], index[j]) != NULL)
+			__builtin_prefetch(ht_bucket_head(hts[j], index[j]));
+
+		j = i - 3 * d;
+		if (i >= 3 * d && j < n && hts[j] != NULL
+			&& ht_bucket_head(hts[j], index[j]) != NULL)
+			__builtin_prefetch(ht_bucket_head(hts[j], index[j])->data);
+
+		j = i - 4 * d;
+		if (i >= 4 * d && j < n && hts[j] != NULL
+			&& ht_bucket_head(hts[j], index[j]) != NULL) {
+			struct info *first = ht_bucket_head(hts[j], index[j])->data;
+			__builtin_prefetch(first->key);
+		}
 
-	ll_node_t *it = ht->buckets[index]->head;
-	while (it != NULL) {
-		struct info *node_info = (struct info *)it->data;
-		if (ht->compare_function(node_info->key, key) == 0)
-			return node_info->value;
-		it = it->next;
+		j = i - 5 * d;
+		if (i < 5 * d || j >= n)
+			continue;
+
+		out[j] = NULL;
+		if (hts[j] == NULL)
+			continue;
+
+		for (ll_node_t *it = ht_bucket_head(hts[j], index[j]); it;
+			 it = it->next) {
+			struct info *node_info = (struct info *)it->data;
+			if (generic_matches(hts[j], node_info, keys[j], hashes[j], 0)) {
+				out[j] = node_info;
+				break;
+			}
+		}
 	}
-	return NULL;
+
+	free(index);
+	free(hashes);
 }
 
 /**
- * Function which returns:
- * 	1, if the key is already in the hashtable
- * 	0, otherwise.
- * @param ht the hashtable where we search the key
- * @param key the key that we want to search
+ * Gives an existing object a new contiguous value
+ * It is replaced in place when it fits in the old buffer and reallocated
+ * otherwise. A replaced value loses its expiry time.
+ * @param ht the hashtable
+ * @param node_info the object
+ * @param value pointer to the data
+ * @param value_size data size in bytes
  */
-int
-ht_has_key(hashtable_t *ht, void *key)
+static void
+replace_value(hashtable_t *ht, struct info *node_info, void *value,
+	unsigned int value_size)
 {
-	if (ht == NULL)
-		return 0;
-
-	int index = ht->hash_function(key) % ht->hmax;
-
-	ll_node_t *it = ht->buckets[index]->head;
-	while (it != NULL) {
-		struct info *node_info = (struct info *)it->data;
-		if (ht->compare_function(node_info->key, key) == 0)
-			return 1;
-		it = it->next;
+	if (node_info->chunked) {
+		value_chunks_free((value_chunk *)node_info->value);
+		node_info->value = NULL;
+		node_info->value_capacity = 0;
+		node_info->chunked = 0;
+	}
+	/* A value outgrowing its inline bytes moves to the heap */
+	if (value_size > node_info->value_capacity) {
+		void *new_value = node_info->value_inline
+						  ? malloc(value_size)
+						  : realloc(node_info->value, value_size);
+		DIE(new_value == NULL, "realloc() failed\n");
+		node_info->value = new_value;
+		node_info->value_capacity = value_size;
+		node_info->value_inline = 0;
 	}
-	return 0;
+	memcpy(node_info->value, value, value_size);
+	ht->bytes = ht->bytes + value_size - node_info->value_size;
+	node_info->value_size = value_size;
+	node_info->referenced = 1;
+	node_info->compressed = 0;
+	node_info->expires_at = 0;
 }
 
 /**
- * Removes the (key, value) pair from the hashtable
+ * Gives an existing object a chain of chunks as its value, which it takes
  * @param ht the hashtable
- * @param key the key of the data which we want to remove
+ * @param node_info the object
+ * @param chunks the value
+ * @param value_size total number of bytes in the chain
  */
-void
-ht_remove_entry(hashtable_t *ht, void *key)
+static void
+replace_chunks(hashtable_t *ht, struct info *node_info, value_chunk *chunks,
+	unsigned int value_size)
 {
-	int index = ht->hash_function(key) % ht->hmax;
-
-	ll_node_t *it = ht->buckets[index]->head;
-	int cnt = 0;
-	while (it != NULL) {
-		struct info *node_info = (struct info *)it->data;
-		if (ht->compare_function(node_info->key, key) == 0) {
-			ll_node_t *removedNode = ll_remove_nth_node(ht->buckets[index], cnt);
-
-			free(((struct info *)removedNode->data)->key);
-			free(((struct info *)removedNode->data)->value);
-			free(removedNode->data);
-			free(removedNode);
-
-			ht->size--;
-			return;
-		}
-		++cnt;
-		it = it->next;
+	if (node_info->chunked)
+		value_chunks_free((value_chunk *)node_info->value);
+	else if (!node_info->value_inline)
+		free(node_info->value);
+	node_info->value = chunks;
+	ht->bytes = ht->bytes + value_size - node_info->value_size;
+	node_info->value_size = value_size;
+	node_info->referenced = 1;
+	node_info->expires_at = 0;
+	node_info->value_capacity = 0;
+	node_info->chunked = 1;
+	node_info->value_inline = 0;
+	node_info->compressed = 0;
+}
+
+/**
+ * Frees the n-th object of a bucket
+ * A bucket left empty is freed, and so is the array of buckets once the
+ * hashtable is empty. The other nodes don't move, so a walk of the
+ * buckets may remove the node it is on.
+ * @param ht the hashtable
+ * @param index the bucket
+ * @param n position of the object in the bucket
+ */
+static void
+remove_nth(hashtable_t *ht, unsigned int index, unsigned int n)
+{
+	ll_node_t *removedNode = ll_remove_nth_node(ht->buckets[index], n);
+
+	/* The object shares the allocation of its node */
+	free_info(ht, (struct info *)removedNode->data);
+	free(removedNode);
+
+	ht->size--;
+	if (ht->buckets[index]->size == 0)
+		ll_free(&ht->buckets[index]);
+	if (ht->size == 0) {
+		free(ht->buckets);
+		ht->buckets = NULL;
 	}
 }
+
+/*
+ * Defines the operations on the keys of a hashtable for one type of key:
+ *
+ * prefix_put(ht, key, key_size, value, value_size)
+ *	inserts an object, or replaces its value (see replace_value)
+ * prefix_put_chunks(ht, key, key_size, chunks, value_size)
+ *	the same with a chain of chunks the hashtable takes
+ * prefix_get_info(ht, key)
+ *	returns the object of key, or NULL (also if ht is NULL)
+ * prefix_has_key(ht, key)
+ *	returns 1 if key is in the hashtable, 0 otherwise
+ * prefix_probe_length(ht, key)
+ *	returns the number of objects a lookup of key walks: up to the key, or
+ *	the whole bucket if it is missing
+ * prefix_remove_entry(ht, key)
+ *	removes the object of key, if any (see remove_nth)
+ *
+ * The hash and match functions are the key policies above; a specialized
+ * table is the same hashtable_t as the generic one, so both can be used on
+ * it as long as they hash its keys the same way.
+ */
+#define HT_DEFINE(prefix, key_type, HASH, MATCHES)			\
+static ll_node_t *							\
+prefix##_find_node(hashtable_t *ht, key_type key, unsigned int hash,	\
+	unsigned int size)						\
+{									\
+	ll_node_t *it = ht_bucket_head(ht, hash % ht->hmax);		\
+	while (it != NULL) {						\
+		if (MATCHES(ht, (struct info *)it->data, key, hash, size)) \
+			return it;					\
+		it = it->next;						\
+	}								\
+	return NULL;							\
+}									\
+									\
+void									\
+prefix##_put(hashtable_t *ht, key_type key, unsigned int key_size,	\
+	void *value, unsigned int value_size)				\
+{									\
+	unsigned int size;						\
+	unsigned int hash = HASH(ht, key, &size);			\
+	ll_node_t *node = prefix##_find_node(ht, key, hash, size);	\
+									\
+	if (node != NULL)						\
+		replace_value(ht, (struct info *)node->data, value,	\
+					  value_size);				\
+	else								\
+		add_info(ht, hash, key, key_size, value, value_size, 0); \
+}									\
+									\
+void									\
+prefix##_put_chunks(hashtable_t *ht, key_type key,			\
+	unsigned int key_size, value_chunk *chunks, unsigned int value_size) \
+{									\
+	unsigned int size;						\
+	unsigned int hash = HASH(ht, key, &size);			\
+	ll_node_t *node = prefix##_find_node(ht, key, hash, size);	\
+									\
+	if (node != NULL)						\
+		replace_chunks(ht, (struct info *)node->data, chunks,	\
+					   value_size);				\
+	else								\
+		add_info(ht, hash, key, key_size, chunks, value_size, 1); \
+}									\
+									\
+struct info *								\
+prefix##_get_info(hashtable_t *ht, key_type key)			\
+{									\
+	unsigned int size;						\
+									\
+	if (ht == NULL)							\
+		return NULL;						\
+									\
+	unsigned int hash = HASH(ht, key, &size);			\
+	ll_node_t *node = prefix##_find_node(ht, key, hash, size);	\
+	return node ? (struct info *)node->data : NULL;			\
+}									\
+									\
+int									\
+prefix##_has_key(hashtable_t *ht, key_type key)				\
+{									\
+	return prefix##_get_info(ht, key) != NULL;			\
+}									\
+									\
+unsigned int								\
+prefix##_probe_length(hashtable_t *ht, key_type key)			\
+{									\
+	unsigned int size;						\
+	unsigned int hash = HASH(ht, key, &size);			\
+	unsigned int probes = 0;					\
+									\
+	for (ll_node_t *it = ht_bucket_head(ht, hash % ht->hmax);	\
+		 it != NULL; it = it->next) {				\
+		probes++;						\
+		if (MATCHES(ht, (struct info *)it->data, key, hash, size)) \
+			break;						\
+	}								\
+	return probes;							\
+}									\
+									\
+void									\
+prefix##_remove_entry(hashtable_t *ht, key_type key)			\
+{									\
+	unsigned int size;						\
+	unsigned int hash = HASH(ht, key, &size);			\
+	unsigned int index = hash % ht->hmax;				\
+	unsigned int cnt = 0;						\
+									\
+	for (ll_node_t *it = ht_bucket_head(ht, index); it != NULL;	\
+		 it = it->next, ++cnt) {				\
+		if (MATCHES(ht, (struct info *)it->data, key, hash, size)) { \
+			remove_nth(ht, index, cnt);			\
+			return;						\
+		}							\
+	}								\
+}
+
+/* Any key, through the functions given to ht_create */
+HT_DEFINE(ht, void *, generic_hash, generic_matches)
+/* Strings, in tables created with the string functions */
+HT_DEFINE(ht_str, const char *, string_hash, sized_matches)
+/* Ints, in tables created with the int functions */
+HT_DEFINE(ht_int, const int *, int_hash, sized_matches)
+
 /**
- * Resizes a hashtable that contains strings
- * @param hash_table pointer to the hashtable that needs to be resized
+ * Returns a pointer to the data matching the key in the hashtable
+ * @param ht the hashtable in which we search the data
+ * @param key the key
  */
-void ht_resize_string(hashtable_t **hash_table)
+void *
+ht_get(hashtable_t *ht, void *key)
 {
-    hashtable_t *old_ht = *hash_table;
-    int hmax = old_ht->hmax;
+	struct info *node_info = ht_get_info(ht, key);
 
-    hashtable_t *new_ht = ht_create(hmax * 2, hash_function_string,
-									compare_function_strings);
-	DIE(!new_ht, "hashtable resize failed");
-	new_ht->hmax = 2 * hmax;
+	return node_info ? node_info->value : NULL;
+}
+
+/**
+ * Moves the objects of a hashtable to a new number of buckets
+ * The nodes are relinked, keys and values are not copied, and the
+ * hashtable keeps its address.
+ * @param ht the hashtable
+ * @param hmax the new number of buckets
+ */
+void
+ht_rehash(hashtable_t *ht, unsigned int hmax)
+{
+	linked_list_t **old_buckets = ht->buckets;
+	unsigned int old_hmax = ht->hmax;
 
-    for (int i = 0; i < hmax; ++i) {
-        ll_node_t *it = old_ht->buckets[i]->head;
+	ht->buckets = NULL;
+	ht->hmax = hmax;
+	if (old_buckets == NULL)
+		return;
 
-        while (it != NULL) {
-            struct info *data = (struct info *)it->data;
+	/* Last node of every new bucket, so the order in a bucket is kept */
+	ll_node_t **tails = (ll_node_t **)calloc(hmax, sizeof(ll_node_t *));
+	DIE(tails == NULL, "calloc() failed");
 
-			unsigned int key_size = 1 + strlen((char *)data->key);
-			unsigned int value_size = 1 + strlen((char *)data->value);
+	for (unsigned int i = 0; i < old_hmax; ++i) {
+		if (old_buckets[i] == NULL)
+			continue;
 
-			ht_put(new_ht, data->key, key_size, data->value, value_size);
+		ll_node_t *it = old_buckets[i]->head;
+		while (it != NULL) {
+			ll_node_t *next = it->next;
+			struct info *data = (struct info *)it->data;
+			unsigned int index = data->key_hash % hmax;
+			linked_list_t *list = bucket_for_insert(ht, index);
+
+			it->next = NULL;
+			if (tails[index] == NULL)
+				list->head = it;
+			else
+				tails[index]->next = it;
+			tails[index] = it;
+			list->size++;
+
+			it = next;
+		}
+		free(old_buckets[i]);
+	}
+	free(old_buckets);
+	free(tails);
+}
 
-            it = it->next;
-        }
-    }
-	ht_free(old_ht);
-	*hash_table = new_ht;
+/**
+ * Resizes a hashtable that contains strings (doubles its buckets)
+ * @param hash_table pointer to the hashtable that needs to be resized
+ */
+void ht_resize_string(hashtable_t **hash_table)
+{
+	ht_rehash(*hash_table, 2 * (*hash_table)->hmax);
 }
 
 /**
@@ -259,15 +659,16 @@ ht_free(hashtable_t *ht)
 {
 	DIE(ht == NULL, "Hashtable is not allocated");
 
-	for (unsigned int i = 0; i < ht->hmax; ++i) {
+	for (unsigned int i = 0; ht->buckets != NULL && i < ht->hmax; ++i) {
+		if (ht->buckets[i] == NULL)
+			continue;
+
 		ll_node_t *it = ht->buckets[i]->head;
 		while (it != NULL) {
 			ll_node_t *aux = it;
 			it = it->next;
 
-			free(((struct info *)aux->data)->key);
-			free(((struct info *)aux->data)->value);
-			free(aux->data);
+			free_info(ht, (struct info *)aux->data);
 			free(aux);
 		}
 		free(ht->buckets[i]);
@@ -2,18 +2,53 @@
 #define HASHTABLE_H_
 
 #include "LinkedList.h"
+#include "value.h"
+
+/* Keys and values up to these sizes (terminator included) are stored in
+ * the same allocation as their object instead of buffers of their own */
+#define INLINE_KEY_MAX 24
+#define INLINE_VALUE_MAX 32
 
 struct info {
+	/* Points to inline_data for short keys */
 	void *key;
+	/* Contiguous buffer, or the first chunk of the value if chunked;
+	 * short values are inline, after the key if it is inline too */
 	void *value;
+	/* Number of bytes of the value */
+	unsigned int value_size;
+	/* Number of bytes allocated for a contiguous value */
+	unsigned int value_capacity;
+	/* Number of bytes of the key */
+	unsigned int key_size;
+	/* Hash of the key, compared before the keys themselves */
+	unsigned int key_hash;
+	/* 1 if value is a chain of value_chunk */
+	unsigned char chunked;
+	/* Set when the object is written or read, cleared by the CLOCK sweep */
+	unsigned char referenced;
+	/* 1 if value points into inline_data */
+	unsigned char value_inline;
+	/* 1 if value is compressed, set by its server: the bytes are opaque here */
+	unsigned char compressed;
+	/* Time (ms) when the object expires, 0 if it never does */
+	unsigned long expires_at;
+	/* Short key and value, allocated with the object */
+	char inline_data[];
 };
 
 typedef struct hashtable_t hashtable_t;
 struct hashtable_t {
-	linked_list_t **buckets; /* Array of Singly Linked Lists */
+	/*
+	 * Array of Singly Linked Lists, NULL while the hashtable is empty;
+	 * empty buckets are NULL too
+	 */
+	linked_list_t **buckets;
 	/* Total number of objects in the hashtable */
 	unsigned int size;
 	unsigned int hmax; /* Number of buckets */
+	/* Total number of key and value bytes of the objects */
+	unsigned long bytes;
 	/* Function to calculate the hash value of a key */
 	unsigned int (*hash_function)(void*);
 	/* Function to compare two keys */
@@ -28,17 +63,85 @@ void
 ht_put(hashtable_t *ht, void *key, unsigned int key_size,
 	void *value, unsigned int value_size);
 
+void
+ht_put_chunks(hashtable_t *ht, void *key, unsigned int key_size,
+	value_chunk *chunks, unsigned int value_size);
+
 void *
 ht_get(hashtable_t *ht, void *key);
 
+struct info *
+ht_get_info(hashtable_t *ht, void *key);
+
+void
+ht_get_info_batch(hashtable_t **hts, void **keys, unsigned int n,
+	struct info **out);
+
 int
 ht_has_key(hashtable_t *ht, void *key);
 
+unsigned int
+ht_probe_length(hashtable_t *ht, void *key);
+
 void
 ht_remove_entry(hashtable_t *ht, void *key);
 
+/*
+ * The same operations specialized for string keys (the key size includes
+ * the terminator) and for int keys, without calls through the function
+ * pointers: only for tables created with hash_function_string and
+ * compare_function_strings, or hash_function_int and
+ * compare_function_ints. Keys are matched by hash and size before their
+ * bytes are compared.
+ */
+void
+ht_str_put(hashtable_t *ht, const char *key, unsigned int key_size,
+	void *value, unsigned int value_size);
+
+void
+ht_str_put_chunks(hashtable_t *ht, const char *key, unsigned int key_size,
+	value_chunk *chunks, unsigned int value_size);
+
+struct info *
+ht_str_get_info(hashtable_t *ht, const char *key);
+
+int
+ht_str_has_key(hashtable_t *ht, const char *key);
+
+unsigned int
+ht_str_probe_length(hashtable_t *ht, const char *key);
+
+void
+ht_str_remove_entry(hashtable_t *ht, const char *key);
+
+void
+ht_int_put(hashtable_t *ht, const int *key, unsigned int key_size,
+	void *value, unsigned int value_size);
+
+void
+ht_int_put_chunks(hashtable_t *ht, const int *key, unsigned int key_size,
+	value_chunk *chunks, unsigned int value_size);
+
+struct info *
+ht_int_get_info(hashtable_t *ht, const int *key);
+
+int
+ht_int_has_key(hashtable_t *ht, const int *key);
+
+unsigned int
+ht_int_probe_length(hashtable_t *ht, const int *key);
+
+void
+ht_int_remove_entry(hashtable_t *ht, const int *key);
+
 void ht_resize_string(hashtable_t **hash_table);
 
+void
+ht_rehash(hashtable_t *ht, unsigned int hmax);
+
+ll_node_t *
+ht_bucket_head(hashtable_t *ht, unsigned int index);
+
 unsigned int
 ht_get_size(hashtable_t *ht);
 
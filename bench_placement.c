@@ -0,0 +1,262 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "load_balancer.h"
+#include "load_balancer_utils.h"
+
+// Compares the placements: cost of finding the owner of a key, how evenly
+// the keys are spread, how many move when a server joins or leaves and
+// how many points the hashring holds.
+//
+//   make bench_placement && ./bench_placement [keys]
+
+#define DEFAULT_KEYS 1000000
+#define ROUNDS 3
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int mix(unsigned int h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * Unweighted rendezvous one server at a time, to measure what the vector
+ * scoring saves
+ */
+static int scalar_owner(const rendezvous_t *r, unsigned int object_hash)
+{
+    int owner = 0;
+    unsigned int best = mix(r->seeds[0] ^ object_hash);
+
+    for (int i = 1; i < r->n; ++i) {
+        unsigned int score = mix(r->seeds[i] ^ object_hash);
+        if (score > best) {
+            best = score;
+            owner = i;
+        }
+    }
+    return owner;
+}
+
+static load_balancer *build(enum placement placement, int vnodes, int n,
+                            unsigned int *weights, int probes)
+{
+    int *ids = (int *)malloc(n * sizeof(int));
+    DIE(!ids, "bench malloc failed");
+    for (int i = 0; i < n; ++i)
+        ids[i] = i + 1;
+
+    load_balancer *main;
+    if (placement == PLACEMENT_RING) {
+        main = init_load_balancer_with_servers(ids, n, vnodes);
+    } else {
+        main = init_load_balancer();
+        loader_set_placement(main, placement);
+        if (probes > 0)
+            loader_set_probes(main, probes);
+        for (int i = 0; i < n; ++i)
+            loader_add_server_weighted(main, ids[i], weights ? weights[i] : 1);
+    }
+
+    free(ids);
+    return main;
+}
+
+/*
+ * Lookup time in ns per key, best of a few rounds; owners[] gets the ID
+ * of the server of every key
+ */
+static double lookups(load_balancer *main, unsigned int *hashes, int n_keys,
+                      int *owners)
+{
+    double best = 1e30;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        double start = now_s();
+        for (int k = 0; k < n_keys; ++k)
+            owners[k] = binary_search_object(main, hashes[k]);
+        double elapsed = now_s() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return best * 1e9 / n_keys;
+}
+
+static double scalar_lookups(load_balancer *main, unsigned int *hashes,
+                             int n_keys, int *owners)
+{
+    double best = 1e30;
+    int mismatches = 0;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        double start = now_s();
+        for (int k = 0; k < n_keys; ++k)
+            mismatches += main->hashring[scalar_owner(main->rendezvous,
+                                                      hashes[k])].id
+                          != owners[k];
+        double elapsed = now_s() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+
+    if (mismatches)
+        printf("  scalar and vector owners differ for %d keys\n", mismatches);
+    return best * 1e9 / n_keys;
+}
+
+/*
+ * Largest load over the mean, and coefficient of variation of the loads
+ * relative to the weights
+ */
+static void spread(int *owners, int n_keys, int n, unsigned int *weights,
+                   double *max_over_mean, double *cv)
+{
+    long *load = (long *)calloc(n + 1, sizeof(long));
+    DIE(!load, "bench malloc failed");
+    for (int k = 0; k < n_keys; ++k)
+        load[owners[k]]++;
+
+    double total_weight = 0;
+    for (int i = 0; i < n; ++i)
+        total_weight += weights ? weights[i] : 1;
+
+    double worst = 0, sum_sq = 0;
+    for (int i = 0; i < n; ++i) {
+        double share = (weights ? weights[i] : 1) / total_weight;
+        double ratio = load[i + 1] / (share * n_keys);
+        if (ratio > worst)
+            worst = ratio;
+        sum_sq += (ratio - 1) * (ratio - 1);
+    }
+
+    *max_over_mean = worst;
+    *cv = sqrt(sum_sq / n);
+    free(load);
+}
+
+/*
+ * Adds a server and counts the keys which change owner (100 / (n + 1) %
+ * would be ideal), then removes it again
+ */
+static double add_moves(load_balancer *main, unsigned int *hashes,
+                        int n_keys, int *owners, int added)
+{
+    long moved = 0;
+
+    loader_add_server(main, added);
+    for (int k = 0; k < n_keys; ++k)
+        if (binary_search_object(main, hashes[k]) != owners[k])
+            moved++;
+    loader_remove_server(main, added);
+
+    return 100.0 * moved / n_keys;
+}
+
+/*
+ * Removes a server and counts the keys which change owner although their
+ * server is still there (0 would be ideal)
+ */
+static double extra_moves(load_balancer *main, unsigned int *hashes,
+                          int n_keys, int *owners, int removed)
+{
+    long extra = 0;
+
+    loader_remove_server(main, removed);
+    for (int k = 0; k < n_keys; ++k)
+        if (owners[k] != removed
+            && binary_search_object(main, hashes[k]) != owners[k])
+            extra++;
+
+    return 100.0 * extra / n_keys;
+}
+
+static void run(const char *name, enum placement placement, int vnodes,
+                int probes, int n, unsigned int *weights,
+                unsigned int *hashes, int n_keys, int *owners)
+{
+    load_balancer *main = build(placement, vnodes, n, weights, probes);
+    int points = main->hashring_len;
+    double ns = lookups(main, hashes, n_keys, owners);
+    double max_over_mean, cv;
+    spread(owners, n_keys, n, weights, &max_over_mean, &cv);
+
+    printf("%-18s %4d %9.1f", name, n, ns);
+    if (placement == PLACEMENT_RENDEZVOUS)
+        printf(" %9.1f", scalar_lookups(main, hashes, n_keys, owners));
+    else
+        printf(" %9s", "-");
+    printf(" %8.3f %8.3f %7d", max_over_mean, cv, points);
+    if (weights)
+        printf(" %7s", "-");
+    else
+        printf(" %7.2f", add_moves(main, hashes, n_keys, owners, n + 1));
+    printf(" %9.3f\n", extra_moves(main, hashes, n_keys, owners, n / 2 + 1));
+
+    free_load_balancer(main);
+}
+
+int main(int argc, char *argv[])
+{
+    int n_keys = argc > 1 ? atoi(argv[1]) : DEFAULT_KEYS;
+    unsigned int *hashes = (unsigned int *)malloc(n_keys * sizeof(int));
+    int *owners = (int *)malloc(n_keys * sizeof(int));
+    DIE(!hashes || !owners, "bench malloc failed");
+
+    char key[32];
+    for (int k = 0; k < n_keys; ++k) {
+        snprintf(key, sizeof(key), "key%d", k);
+        hashes[k] = hash_function_key(key);
+    }
+
+    printf("%d keys; ns per lookup, load of the busiest server over its "
+           "share,\ncoefficient of variation of the loads, points on the "
+           "hashring, %% of the keys\nmoved by adding a server, %% of the "
+           "other keys moved by a removal\n\n", n_keys);
+    printf("%-18s %4s %9s %9s %8s %8s %7s %7s %9s\n", "placement", "n",
+           "ns", "scalar ns", "max", "cv", "points", "add %", "moved %");
+
+    int sizes[] = {4, 8, 16, 32, 64};
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        int n = sizes[s];
+        unsigned int *weights = (unsigned int *)malloc(n * sizeof(int));
+        DIE(!weights, "bench malloc failed");
+        for (int i = 0; i < n; ++i)
+            weights[i] = 1 + i % 4;
+
+        run("ring, 3 points", PLACEMENT_RING, 3, 0, n, NULL, hashes, n_keys,
+            owners);
+        run("ring, 100 points", PLACEMENT_RING, 100, 0, n, NULL, hashes,
+            n_keys, owners);
+        run("multi-probe, 5", PLACEMENT_MULTI_PROBE, 0, 5, n, NULL, hashes,
+            n_keys, owners);
+        run("multi-probe, 21", PLACEMENT_MULTI_PROBE, 0, MULTI_PROBES, n,
+            NULL, hashes, n_keys, owners);
+        run("rendezvous", PLACEMENT_RENDEZVOUS, 0, 0, n, NULL, hashes, n_keys,
+            owners);
+        run("weighted (1..4)", PLACEMENT_WEIGHTED_RENDEZVOUS, 0, 0, n,
+            weights, hashes, n_keys, owners);
+        printf("\n");
+        free(weights);
+    }
+
+    free(hashes);
+    free(owners);
+    return 0;
+}
@@ -0,0 +1,256 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "load_balancer.h"
+#include "range_transfer.h"
+
+// Streams half of the ring from one load balancer to another, first
+// through a file in the same process, then through a pipe to a second
+// process, while stores keep reaching the source. Every key of the arc
+// must arrive with its latest value and no other key may: the exit status
+// is 1 otherwise. The throughput of the pipe is compared to memcpy.
+//
+//   make bench_range && ./bench_range [keys]
+
+#define DEFAULT_KEYS 500000
+#define VALUE_LEN 100
+// Start (excluded) and end of the arc streamed
+#define ARC_LO 0x40000000u
+#define ARC_HI 0xc0000000u
+// Buckets scanned between two batches of stores
+#define STEP_BUCKETS 64
+// Every UPDATE_EVERY-th key is stored again while the export runs
+#define UPDATE_EVERY 5
+#define PIPE_BUFFER (1 << 20)
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_key(char *key, unsigned long i)
+{
+    sprintf(key, "key%lu", i);
+}
+
+/*
+ * Value of key i: a second generation for the keys stored again during
+ * the export
+ */
+static void make_value(char *value, unsigned long i, int generation)
+{
+    int len = sprintf(value, "%s-%lu-", generation ? "new" : "value", i);
+
+    memset(value + len, 'a' + i % 26, VALUE_LEN - len);
+    value[VALUE_LEN] = 0;
+}
+
+static load_balancer *build(int first_id, int n_servers, unsigned long keys)
+{
+    load_balancer *main = init_load_balancer();
+    char key[32], value[VALUE_LEN + 1];
+    int server_id;
+
+    for (int i = 0; i < n_servers; ++i)
+        loader_add_server(main, first_id + i);
+    for (unsigned long i = 0; i < keys; ++i) {
+        make_key(key, i);
+        make_value(value, i, 0);
+        loader_store(main, key, value, &server_id);
+    }
+    return main;
+}
+
+/*
+ * Streams the arc to out, storing the second generation of the updated
+ * keys between the steps
+ * Returns the number of bytes written, -1 if the export failed
+ */
+static long export_arc(load_balancer *main, unsigned long keys, FILE *out)
+{
+    char key[32], value[VALUE_LEN + 1];
+    int server_id;
+    unsigned long next = 0;
+
+    range_export_t *export = range_export_begin(main, ARC_LO, ARC_HI, out);
+    if (export == NULL)
+        return -1;
+
+    int more;
+    do {
+        more = range_export_step(export, STEP_BUCKETS);
+        for (int k = 0; k < 8 && next < keys; ++k, next += UPDATE_EVERY) {
+            make_key(key, next);
+            make_value(value, next, 1);
+            loader_store(main, key, value, &server_id);
+        }
+    } while (more);
+    for (; next < keys; next += UPDATE_EVERY) {
+        make_key(key, next);
+        make_value(value, next, 1);
+        loader_store(main, key, value, &server_id);
+    }
+
+    long bytes = export->bytes;
+    return range_export_end(export) == 0 ? bytes : -1;
+}
+
+/*
+ * Checks every key of the target against the expected contents
+ * Returns the number of wrong keys
+ */
+static unsigned long verify(load_balancer *target, unsigned long keys)
+{
+    char key[32], value[VALUE_LEN + 1];
+    unsigned long wrong = 0;
+    int server_id;
+
+    for (unsigned long i = 0; i < keys; ++i) {
+        make_key(key, i);
+        make_value(value, i, i % UPDATE_EVERY == 0);
+
+        char *found = loader_retrieve(target, key, &server_id);
+        int expected = range_contains(ARC_LO, ARC_HI, hash_function_key(key));
+        if (expected ? found == NULL || strcmp(found, value)
+                     : found != NULL) {
+            if (wrong < 5)
+                fprintf(stderr, "%s: %s\n", key,
+                        found == NULL ? "missing"
+                                      : expected ? "stale value"
+                                                 : "outside the arc");
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+/*
+ * Memory bandwidth of memcpy over a buffer of the size of the stream
+ */
+static double memcpy_mbs(long bytes)
+{
+    char *src = (char *)malloc(bytes), *dst = (char *)malloc(bytes);
+    DIE(!src || !dst, "bench malloc failed");
+    memset(src, 1, bytes);
+    memset(dst, 0, bytes);
+
+    double best = 0;
+    for (int round = 0; round < 3; ++round) {
+        double start = now_s();
+        memcpy(dst, src, bytes);
+        double mbs = bytes / 1e6 / (now_s() - start);
+        if (mbs > best)
+            best = mbs;
+    }
+    if (dst[bytes - 1] != 1)
+        fprintf(stderr, "memcpy: copy lost\n");
+    free(src);
+    free(dst);
+    return best;
+}
+
+/*
+ * Source and target in this process, through a temporary file
+ */
+static unsigned long in_process(unsigned long keys)
+{
+    load_balancer *source = build(1, 8, keys);
+    load_balancer *target = init_load_balancer();
+    for (int i = 0; i < 4; ++i)
+        loader_add_server(target, 100 + i);
+
+    FILE *stream = tmpfile();
+    DIE(!stream, "bench tmpfile failed");
+    long bytes = export_arc(source, keys, stream);
+    rewind(stream);
+    long objects = range_import(target, stream);
+    fclose(stream);
+
+    unsigned long wrong = bytes < 0 || objects < 0 ? keys
+                                                   : verify(target, keys);
+    printf("in process: %ld objects, %.1f MB, %lu wrong keys\n", objects,
+           bytes / 1e6, wrong);
+
+    free_load_balancer(source);
+    free_load_balancer(target);
+    return wrong;
+}
+
+/*
+ * Source in this process, target in a child reading a pipe
+ */
+static unsigned long two_processes(unsigned long keys)
+{
+    load_balancer *source = build(1, 8, keys);
+    int fds[2];
+    DIE(pipe(fds) < 0, "bench pipe failed");
+
+    pid_t pid = fork();
+    DIE(pid < 0, "bench fork failed");
+    if (pid == 0) {
+        close(fds[1]);
+        free_load_balancer(source);
+
+        load_balancer *target = init_load_balancer();
+        for (int i = 0; i < 4; ++i)
+            loader_add_server(target, 100 + i);
+        FILE *in = fdopen(fds[0], "rb");
+        DIE(!in, "bench fdopen failed");
+        setvbuf(in, NULL, _IOFBF, PIPE_BUFFER);
+
+        double start = now_s();
+        long objects = range_import(target, in);
+        double seconds = now_s() - start;
+        fclose(in);
+
+        unsigned long wrong = objects < 0 ? keys : verify(target, keys);
+        printf("pipe import: %ld objects in %.3f s, %lu wrong keys\n",
+               objects, seconds, wrong);
+        free_load_balancer(target);
+        exit(wrong != 0);
+    }
+
+    close(fds[0]);
+    FILE *out = fdopen(fds[1], "wb");
+    DIE(!out, "bench fdopen failed");
+    setvbuf(out, NULL, _IOFBF, PIPE_BUFFER);
+
+    double start = now_s();
+    long bytes = export_arc(source, keys, out);
+    fclose(out);
+    // Returns once the last write fits in the pipe
+    double seconds = now_s() - start;
+    int status;
+    waitpid(pid, &status, 0);
+
+    printf("pipe: %.1f MB in %.3f s, %.0f MB/s (memcpy %.0f MB/s)\n",
+           bytes / 1e6, seconds, bytes / 1e6 / seconds,
+           memcpy_mbs(bytes > 0 ? bytes : 1));
+    free_load_balancer(source);
+    return bytes < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long keys = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_KEYS;
+
+    if (keys == 0) {
+        printf("Usage:%s [keys]\n", argv[0]);
+        return -1;
+    }
+
+    unsigned long wrong = in_process(keys);
+    // Nothing buffered may be printed again by the child
+    fflush(stdout);
+    wrong += two_processes(keys);
+    return wrong != 0;
+}
@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "utils.h"
+
+#define MAX_HASHES 16
+#define LN2 0.69314718055994530942
+
+/**
+ * Allocs an empty filter
+ * @param capacity number of keys the filter is sized for
+ * @param fp_rate target false positive rate (between 0 and 1)
+ */
+bloom_t *bloom_create(unsigned int capacity, double fp_rate)
+{
+    bloom_t *filter = (bloom_t *)malloc(sizeof(bloom_t));
+    DIE(!filter, "bloom filter malloc failed");
+
+    if (capacity == 0)
+        capacity = 1;
+
+    // Classic sizing: m / n = -ln(p) / ln(2)^2 and k = m / n * ln(2)
+    double bits_per_key = -log(fp_rate) / (LN2 * LN2);
+    unsigned int k = (unsigned int)(bits_per_key * LN2 + 0.5);
+    if (k < 1)
+        k = 1;
+    if (k > MAX_HASHES)
+        k = MAX_HASHES;
+
+    double bits = bits_per_key * capacity;
+    filter->n_blocks = (unsigned int)(bits / BLOOM_BLOCK_BITS) + 1;
+    filter->k = k;
+    filter->capacity = capacity;
+    filter->fp_rate = fp_rate;
+
+    size_t size = (size_t)filter->n_blocks * BLOOM_BLOCK_WORDS
+                  * sizeof(uint64_t);
+    void *blocks = NULL;
+    DIE(posix_memalign(&blocks, BLOOM_BLOCK_WORDS * sizeof(uint64_t), size),
+        "bloom filter malloc failed");
+    memset(blocks, 0, size);
+    filter->blocks = (uint64_t *)blocks;
+
+    return filter;
+}
+
+/*
+ * 64-bit FNV-1a followed by a finalizer, independent from the hash used
+ * to pick the bucket of the key
+ */
+uint64_t bloom_hash(const char *key)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+/*
+ * Builds the bit pattern of a key inside its block. Bit positions come from
+ * double hashing on the low 32 bits; the pattern is kept per word so the
+ * test below is a fixed 8-word loop the compiler can vectorize.
+ */
+static uint64_t *block_mask(bloom_t *filter, uint64_t hash, uint64_t *mask)
+{
+    uint64_t *block = filter->blocks
+        + (size_t)((hash >> 32) % filter->n_blocks) * BLOOM_BLOCK_WORDS;
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 16) | 1;
+
+    memset(mask, 0, BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    for (unsigned int i = 0; i < filter->k; ++i) {
+        uint32_t bit = (h1 + i * h2) % BLOOM_BLOCK_BITS;
+        mask[bit / 64] |= 1ull << (bit % 64);
+    }
+
+    return block;
+}
+
+/**
+ * Adds a key to the filter
+ * @param filter the filter
+ * @param hash hash of the key (see bloom_hash)
+ */
+void bloom_add(bloom_t *filter, uint64_t hash)
+{
+    uint64_t mask[BLOOM_BLOCK_WORDS];
+    uint64_t *block = block_mask(filter, hash, mask);
+
+    for (int w = 0; w < BLOOM_BLOCK_WORDS; ++w)
+        block[w] |= mask[w];
+}
+
+/**
+ * Returns 0 if the key was surely never added, 1 if it may have been
+ * @param filter the filter
+ * @param hash hash of the key (see bloom_hash)
+ */
+int bloom_may_contain(bloom_t *filter, uint64_t hash)
+{
+    uint64_t mask[BLOOM_BLOCK_WORDS];
+    uint64_t *block = block_mask(filter, hash, mask);
+    uint64_t missing = 0;
+
+    for (int w = 0; w < BLOOM_BLOCK_WORDS; ++w)
+        missing |= mask[w] & ~block[w];
+
+    return missing == 0;
+}
+
+/**
+ * Frees the filter
+ * @param filter the filter
+ */
+void bloom_free(bloom_t *filter)
+{
+    if (filter == NULL)
+        return;
+    free(filter->blocks);
+    free(filter);
+}
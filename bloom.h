@@ -0,0 +1,35 @@
+#ifndef BLOOM_H_
+#define BLOOM_H_
+
+#include <stdint.h>
+
+// One block is one cache line: all the bits of a key live in the same block
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_BLOCK_BITS (BLOOM_BLOCK_WORDS * 64)
+
+typedef struct bloom_t bloom_t;
+
+// Blocked Bloom filter: a probe touches a single 64-byte block
+struct bloom_t {
+    // Array of n_blocks * BLOOM_BLOCK_WORDS words, aligned to a cache line
+    uint64_t *blocks;
+    unsigned int n_blocks;
+    // Number of bits set per key
+    unsigned int k;
+    // Number of keys the filter was sized for
+    unsigned int capacity;
+    // Target false positive rate
+    double fp_rate;
+};
+
+bloom_t *bloom_create(unsigned int capacity, double fp_rate);
+
+uint64_t bloom_hash(const char *key);
+
+void bloom_add(bloom_t *filter, uint64_t hash);
+
+int bloom_may_contain(bloom_t *filter, uint64_t hash);
+
+void bloom_free(bloom_t *filter);
+
+#endif  // BLOOM_H_
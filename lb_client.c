@@ -0,0 +1,436 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "shm_store.h"
+#include "utils.h"
+
+#define DEFAULT_PORT 7000
+#define READ_SIZE (64 * 1024)
+
+typedef struct client_conn client_conn;
+
+// One connection of the load generator, with up to depth requests in flight
+struct client_conn {
+    int fd;
+    // Send times of the requests in flight, oldest first (circular)
+    unsigned long *sent_ns;
+    unsigned int head;
+    unsigned int in_flight;
+    // Requests formatted and not yet written
+    char *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    // Events the connection is registered for
+    unsigned int events;
+};
+
+struct options {
+    const char *host;
+    int port;
+    int connections;
+    unsigned long requests;
+    unsigned int depth;
+    unsigned int keys;
+    unsigned int value_size;
+    unsigned int store_percent;
+    int servers;
+    // Segment of a server on this host to read from directly (NULL if none)
+    const char *shm_name;
+};
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static unsigned int next_random(unsigned int *state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int connect_to(const char *host, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    DIE(fd < 0, "socket failed");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    DIE(inet_pton(AF_INET, host, &addr.sin_addr) != 1, "bad address");
+    DIE(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0,
+        "connect failed");
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        DIE(sent < 0, "send failed");
+        data += sent;
+        len -= sent;
+    }
+}
+
+/**
+ * Reads from a blocking socket until lines newlines were received
+ */
+static void read_lines(int fd, unsigned long lines)
+{
+    char buffer[READ_SIZE];
+
+    while (lines > 0) {
+        ssize_t got = recv(fd, buffer, sizeof(buffer), 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        DIE(got <= 0, "connection closed by the server");
+        for (ssize_t i = 0; i < got; ++i)
+            if (buffer[i] == '\n')
+                lines--;
+    }
+}
+
+static void append_request(client_conn *conn, const char *line, size_t len)
+{
+    if (conn->out_len + len > conn->out_cap) {
+        while (conn->out_len + len > conn->out_cap)
+            conn->out_cap = conn->out_cap ? 2 * conn->out_cap : 4096;
+        conn->out = realloc(conn->out, conn->out_cap);
+        DIE(!conn->out, "client buffer realloc failed");
+    }
+    memcpy(conn->out + conn->out_len, line, len);
+    conn->out_len += len;
+}
+
+/**
+ * Adds the servers and stores every key once, so retrieves hit
+ */
+static void setup(struct options *opts, const char *value)
+{
+    int fd = connect_to(opts->host, opts->port);
+    char *line = (char *)malloc(opts->value_size + 64);
+    DIE(!line, "client malloc failed");
+
+    for (int i = 0; i < opts->servers; ++i) {
+        int len = sprintf(line, "add_server %d\n", i);
+        send_all(fd, line, len);
+    }
+
+    // add_server has no reply, every store has one line
+    for (unsigned int k = 0; k < opts->keys; ++k) {
+        int len = sprintf(line, "store \"key%u\" \"%s\"\n", k, value);
+        send_all(fd, line, len);
+        if ((k + 1) % 1024 == 0)
+            read_lines(fd, 1024);
+    }
+    read_lines(fd, opts->keys % 1024);
+
+    free(line);
+    close(fd);
+}
+
+/**
+ * Tops a connection up to depth requests in flight and writes them
+ * Returns -1 if the connection failed
+ */
+static int fill_and_send(client_conn *conn, struct options *opts,
+                         unsigned long *issued, unsigned int *rng,
+                         const char *value, char *line)
+{
+    unsigned long now = now_ns();
+
+    while (conn->in_flight < opts->depth && *issued < opts->requests) {
+        unsigned int key = next_random(rng) % opts->keys;
+        int len;
+
+        if (next_random(rng) % 100 < opts->store_percent)
+            len = sprintf(line, "store \"key%u\" \"%s\"\n", key, value);
+        else
+            len = sprintf(line, "retrieve \"key%u\"\n", key);
+        append_request(conn, line, len);
+
+        conn->sent_ns[(conn->head + conn->in_flight) % opts->depth] = now;
+        conn->in_flight++;
+        (*issued)++;
+    }
+
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + conn->out_sent,
+                            conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+    conn->out_len = conn->out_sent = 0;
+    return 0;
+}
+
+/**
+ * Waits for writability only while there is unsent output
+ */
+static void update_events(int epoll_fd, client_conn *conn)
+{
+    unsigned int wanted = EPOLLIN;
+    if (conn->out_sent < conn->out_len)
+        wanted |= EPOLLOUT;
+    if (wanted == conn->events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = wanted;
+    ev.data.ptr = conn;
+    DIE(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0,
+        "epoll_ctl failed");
+    conn->events = wanted;
+}
+
+static int compare_ul(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double percentile(unsigned long *sorted, unsigned long n, double p)
+{
+    unsigned long i = (unsigned long)(p * (n - 1));
+    return sorted[i] / 1000.0;
+}
+
+static void print_latencies(unsigned long *latencies, unsigned long n)
+{
+    qsort(latencies, n, sizeof(unsigned long), compare_ul);
+    printf("latency us: p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+           percentile(latencies, n, 0.5), percentile(latencies, n, 0.9),
+           percentile(latencies, n, 0.99), percentile(latencies, n, 0.999),
+           latencies[n - 1] / 1000.0);
+}
+
+/**
+ * Same retrieves as the TCP run, answered from the shared memory segment
+ * of the server without a round trip
+ */
+static void shm_reads(struct options *opts, unsigned long *latencies)
+{
+    shm_store_t *shm = shm_attach(opts->shm_name);
+    DIE(shm == NULL, "can't attach the shared memory segment");
+
+    unsigned int rng = 2463534242u;
+    unsigned long misses = 0;
+    char key[32];
+    unsigned long start = now_ns();
+
+    for (unsigned long i = 0; i < opts->requests; ++i) {
+        int server_id;
+
+        sprintf(key, "key%u", next_random(&rng) % opts->keys);
+        unsigned long sent = now_ns();
+        if (shm_retrieve(shm, key, &server_id) == NULL)
+            misses++;
+        latencies[i] = now_ns() - sent;
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    printf("%lu shared memory retrieves (%lu misses): %.3f s, %.0f req/s\n",
+           opts->requests, misses, seconds, opts->requests / seconds);
+    print_latencies(latencies, opts->requests);
+
+    shm_close(shm);
+}
+
+static int parse_options(int argc, char *argv[], struct options *opts)
+{
+    opts->host = "127.0.0.1";
+    opts->port = DEFAULT_PORT;
+    opts->connections = 8;
+    opts->requests = 200000;
+    opts->depth = 16;
+    opts->keys = 10000;
+    opts->value_size = 32;
+    opts->store_percent = 20;
+    opts->servers = 8;
+    opts->shm_name = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+        char *eq = strchr(arg, '=');
+        if (eq == NULL)
+            return -1;
+        unsigned long n = strtoul(eq + 1, NULL, 10);
+
+        if (!strncmp(arg, "--host=", sizeof("--host=") - 1))
+            opts->host = eq + 1;
+        else if (!strncmp(arg, "--port=", sizeof("--port=") - 1))
+            opts->port = n;
+        else if (!strncmp(arg, "--connections=", sizeof("--connections=") - 1))
+            opts->connections = n;
+        else if (!strncmp(arg, "--requests=", sizeof("--requests=") - 1))
+            opts->requests = n;
+        else if (!strncmp(arg, "--depth=", sizeof("--depth=") - 1))
+            opts->depth = n;
+        else if (!strncmp(arg, "--keys=", sizeof("--keys=") - 1))
+            opts->keys = n;
+        else if (!strncmp(arg, "--value-size=", sizeof("--value-size=") - 1))
+            opts->value_size = n;
+        else if (!strncmp(arg, "--store-percent=",
+                          sizeof("--store-percent=") - 1))
+            opts->store_percent = n;
+        else if (!strncmp(arg, "--servers=", sizeof("--servers=") - 1))
+            opts->servers = n;
+        else if (!strncmp(arg, "--shm=", sizeof("--shm=") - 1))
+            opts->shm_name = eq + 1;
+        else
+            return -1;
+    }
+
+    if (opts->connections < 1 || opts->depth < 1 || opts->keys < 1
+        || opts->requests < 1)
+        return -1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct options opts;
+
+    if (parse_options(argc, argv, &opts) < 0) {
+        printf("Usage:%s [--host=addr] [--port=N] [--connections=C]"
+               " [--requests=N] [--depth=D] [--keys=K] [--value-size=B]"
+               " [--store-percent=P] [--servers=S] [--shm=name]\n", argv[0]);
+        return -1;
+    }
+
+    char *value = (char *)malloc(opts.value_size + 1);
+    char *line = (char *)malloc(opts.value_size + 64);
+    unsigned long *latencies = (unsigned long *)malloc(opts.requests
+                                                       * sizeof(unsigned long));
+    client_conn *conns = (client_conn *)calloc(opts.connections,
+                                               sizeof(client_conn));
+    DIE(!value || !line || !latencies || !conns, "client malloc failed");
+    memset(value, 'v', opts.value_size);
+    value[opts.value_size] = 0;
+
+    setup(&opts, value);
+
+    int epoll_fd = epoll_create1(0);
+    DIE(epoll_fd < 0, "epoll_create1 failed");
+
+    for (int i = 0; i < opts.connections; ++i) {
+        conns[i].fd = connect_to(opts.host, opts.port);
+        conns[i].sent_ns = (unsigned long *)malloc(opts.depth
+                                                   * sizeof(unsigned long));
+        DIE(!conns[i].sent_ns, "client malloc failed");
+
+        int flags = fcntl(conns[i].fd, F_GETFL, 0);
+        fcntl(conns[i].fd, F_SETFL, flags | O_NONBLOCK);
+
+        struct epoll_event ev;
+        ev.events = conns[i].events = EPOLLIN;
+        ev.data.ptr = &conns[i];
+        DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev) < 0,
+            "epoll_ctl failed");
+    }
+
+    unsigned long issued = 0, completed = 0;
+    unsigned int rng = 2463534242u;
+    char buffer[READ_SIZE];
+    struct epoll_event events[64];
+    unsigned long start = now_ns();
+
+    for (int i = 0; i < opts.connections; ++i) {
+        DIE(fill_and_send(&conns[i], &opts, &issued, &rng, value, line) < 0,
+            "send failed");
+        update_events(epoll_fd, &conns[i]);
+    }
+
+    while (completed < opts.requests) {
+        int n = epoll_wait(epoll_fd, events, 64, -1);
+        if (n < 0) {
+            DIE(errno != EINTR, "epoll_wait failed");
+            continue;
+        }
+
+        for (int e = 0; e < n; ++e) {
+            client_conn *conn = events[e].data.ptr;
+
+            if (events[e].events & EPOLLIN) {
+                ssize_t got = recv(conn->fd, buffer, sizeof(buffer), 0);
+                DIE(got == 0, "connection closed by the server");
+                if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                    DIE(1, "recv failed");
+
+                // Replies come back in order, one line per request
+                unsigned long now = now_ns();
+                for (ssize_t i = 0; i < got; ++i) {
+                    if (buffer[i] != '\n')
+                        continue;
+                    DIE(conn->in_flight == 0, "unexpected reply");
+                    latencies[completed++] = now - conn->sent_ns[conn->head];
+                    conn->head = (conn->head + 1) % opts.depth;
+                    conn->in_flight--;
+                }
+            }
+
+            DIE(fill_and_send(conn, &opts, &issued, &rng, value, line) < 0,
+                "send failed");
+            update_events(epoll_fd, conn);
+        }
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("%lu requests, %d connections, depth %u: %.3f s, %.0f req/s\n",
+           completed, opts.connections, opts.depth, seconds,
+           completed / seconds);
+    print_latencies(latencies, completed);
+
+    if (opts.shm_name)
+        shm_reads(&opts, latencies);
+
+    for (int i = 0; i < opts.connections; ++i) {
+        close(conns[i].fd);
+        free(conns[i].sent_ns);
+        free(conns[i].out);
+    }
+    close(epoll_fd);
+    free(conns);
+    free(latencies);
+    free(line);
+    free(value);
+
+    return 0;
+}
@@ -0,0 +1,489 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "load_balancer.h"
+#include "request.h"
+#include "trace.h"
+#include "utils.h"
+
+#define DEFAULT_PORT 7000
+#define MAX_EVENTS 256
+#define READ_SIZE (64 * 1024)
+// Reads done for one connection before the others get their turn
+#define READS_PER_EVENT 16
+// A client whose replies pile up beyond this is not read until they drain
+#define OUT_HIGH_WATER (4 * 1024 * 1024)
+// Size of the shared memory segment unless --shm-size says otherwise
+#define DEFAULT_SHM_MB 64
+
+typedef struct connection connection;
+
+struct connection {
+    int fd;
+    // Bytes received and not yet parsed (incomplete last line)
+    char *in;
+    size_t in_len;
+    size_t in_cap;
+    // Replies formatted and not yet sent
+    reply_buffer out;
+    size_t out_sent;
+    // Key and value buffers of the parser, as long as the longest line
+    char *key;
+    char *value;
+    size_t buffer_cap;
+    // Events the connection is registered for
+    unsigned int events;
+    // Set once the client closed its side; replies are still sent
+    int closing;
+};
+
+static volatile sig_atomic_t stop;
+
+// Directory the files named by clients are written to, NULL if clients
+// may not name files
+static const char *dump_dir;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    DIE(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0,
+        "fcntl failed");
+}
+
+static int listen_on(const char *address, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    DIE(fd < 0, "socket failed");
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    DIE(inet_pton(AF_INET, address, &addr.sin_addr) != 1, "bad address");
+
+    DIE(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0, "bind failed");
+    DIE(listen(fd, SOMAXCONN) < 0, "listen failed");
+    set_nonblocking(fd);
+
+    return fd;
+}
+
+static void update_events(int epoll_fd, connection *conn, unsigned int events)
+{
+    if (conn->events == events)
+        return;
+
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    DIE(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0,
+        "epoll_ctl failed");
+    conn->events = events;
+}
+
+static void close_connection(int epoll_fd, connection *conn)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->key);
+    free(conn->value);
+    reply_free(&conn->out);
+    free(conn);
+}
+
+static void accept_connections(int epoll_fd, int listen_fd)
+{
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept failed");
+            return;
+        }
+
+        set_nonblocking(fd);
+        // Replies are already batched, don't let Nagle delay them further
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        connection *conn = (connection *)calloc(1, sizeof(connection));
+        DIE(!conn, "connection malloc failed");
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+
+        struct epoll_event ev;
+        ev.events = conn->events;
+        ev.data.ptr = conn;
+        DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0,
+            "epoll_ctl failed");
+    }
+}
+
+/**
+ * Keeps the files of trace dump and snapshot requests inside the dump
+ * directory: clients only give a plain name, which is looked up there
+ * Returns 0 if the request can run, -1 if it was refused (with a reply)
+ * @param req the parsed request, whose key has room for the directory
+ * @param out where the refusal is written
+ */
+static int confine_file(request *req, reply_buffer *out)
+{
+    if ((req->type != REQUEST_TRACE_DUMP && req->type != REQUEST_SNAPSHOT)
+        || req->key[0] == 0)
+        return 0;
+
+    if (dump_dir == NULL) {
+        reply_printf(out, "Can't write %s, the server has no --dump-dir.\n",
+                     req->key);
+        return -1;
+    }
+    if (strchr(req->key, '/') || !strcmp(req->key, ".")
+        || !strcmp(req->key, "..")) {
+        reply_printf(out, "Can't write %s, only a file name is accepted.\n",
+                     req->key);
+        return -1;
+    }
+
+    size_t dir_len = strlen(dump_dir);
+    memmove(req->key + dir_len + 1, req->key, strlen(req->key) + 1);
+    memcpy(req->key, dump_dir, dir_len);
+    req->key[dir_len] = '/';
+    return 0;
+}
+
+/**
+ * Executes every complete line received on a connection; the replies are
+ * appended to its output buffer, so a pipelined batch is answered at once
+ * @param main the load balancer
+ * @param conn the connection
+ */
+static void process_input(load_balancer *main, connection *conn)
+{
+    size_t start = 0;
+    request req;
+
+    while (start < conn->in_len) {
+        char *line = conn->in + start;
+        char *newline = memchr(line, '\n', conn->in_len - start);
+        if (newline == NULL)
+            break;
+
+        size_t line_len = newline - line;
+        *newline = 0;
+        start += line_len + 1;
+        if (line_len > 0 && line[line_len - 1] == '\r')
+            line[--line_len] = 0;
+
+        // The key may get the dump directory in front of it
+        size_t needed = line_len + 1 + (dump_dir ? strlen(dump_dir) + 1 : 0);
+        if (needed > conn->buffer_cap) {
+            conn->buffer_cap = needed;
+            conn->key = realloc(conn->key, conn->buffer_cap);
+            conn->value = realloc(conn->value, conn->buffer_cap);
+            DIE(!conn->key || !conn->value, "request buffer realloc failed");
+        }
+
+        req.key = conn->key;
+        req.value = conn->value;
+        request_parse(line, &req);
+        if (confine_file(&req, &conn->out) == 0)
+            request_execute(main, &req, &conn->out);
+    }
+
+    // Keep the incomplete line at the start of the buffer
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+}
+
+/**
+ * Sends as much of the pending output as the socket takes
+ * Returns -1 if the connection failed
+ */
+static int flush_output(connection *conn)
+{
+    while (conn->out_sent < conn->out.len) {
+        ssize_t sent = send(conn->fd, conn->out.data + conn->out_sent,
+                            conn->out.len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        conn->out_sent += sent;
+    }
+
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    return 0;
+}
+
+/**
+ * Reads what the client sent, bounded so one client can't starve the rest
+ * Returns -1 if the connection failed
+ */
+static int read_input(load_balancer *main, connection *conn)
+{
+    for (int i = 0; i < READS_PER_EVENT; ++i) {
+        if (conn->in_cap - conn->in_len < READ_SIZE) {
+            conn->in_cap = conn->in_len + READ_SIZE;
+            conn->in = realloc(conn->in, conn->in_cap);
+            DIE(!conn->in, "connection buffer realloc failed");
+        }
+
+        ssize_t got = recv(conn->fd, conn->in + conn->in_len,
+                           conn->in_cap - conn->in_len, 0);
+        if (got == 0) {
+            conn->closing = 1;
+            break;
+        }
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+
+        conn->in_len += got;
+        process_input(main, conn);
+        if (conn->out.len - conn->out_sent > OUT_HIGH_WATER)
+            break;
+    }
+
+    return 0;
+}
+
+static void serve_connection(load_balancer *main, int epoll_fd,
+                             connection *conn, unsigned int events)
+{
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+        close_connection(epoll_fd, conn);
+        return;
+    }
+
+    if ((events & EPOLLIN) && read_input(main, conn) < 0) {
+        close_connection(epoll_fd, conn);
+        return;
+    }
+
+    if (flush_output(conn) < 0) {
+        close_connection(epoll_fd, conn);
+        return;
+    }
+
+    size_t pending = conn->out.len - conn->out_sent;
+    if (pending == 0 && conn->closing) {
+        close_connection(epoll_fd, conn);
+        return;
+    }
+
+    // Wait for the socket to drain before reading more from a slow client
+    unsigned int wanted = 0;
+    if (!conn->closing && pending <= OUT_HIGH_WATER)
+        wanted |= EPOLLIN;
+    if (pending > 0)
+        wanted |= EPOLLOUT;
+    update_events(epoll_fd, conn, wanted);
+}
+
+struct options {
+    const char *address;
+    int port;
+    int replicas;
+    double filter_fp;
+    unsigned long server_budget;
+    // Values of at least this many bytes are compressed (0 if never)
+    unsigned int compress;
+    // NUMA node the load balancer and its servers run on (-1 if any)
+    int numa_node;
+    // Operations traced from the start if at least this slow (us), -1 if
+    // tracing starts off
+    long trace_us;
+    unsigned int rebalance_step;
+    enum placement placement;
+    // Zone reads prefer with zone placement (NULL if none)
+    const char *zone;
+    // Shared memory segment for local readers (NULL if none), size in MB
+    const char *shm_name;
+    unsigned long shm_mb;
+    // Where trace dumps and snapshots named by clients go (NULL if they
+    // can't name files)
+    const char *dump_dir;
+};
+
+static int parse_options(int argc, char *argv[], struct options *opts)
+{
+    opts->address = "127.0.0.1";
+    opts->port = DEFAULT_PORT;
+    opts->replicas = 1;
+    opts->filter_fp = 0;
+    opts->server_budget = 0;
+    opts->compress = 0;
+    opts->numa_node = -1;
+    opts->trace_us = -1;
+    opts->rebalance_step = 0;
+    opts->placement = PLACEMENT_RING;
+    opts->zone = NULL;
+    opts->shm_name = NULL;
+    opts->shm_mb = DEFAULT_SHM_MB;
+    opts->dump_dir = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+
+        if (!strncmp(arg, "--bind=", sizeof("--bind=") - 1))
+            opts->address = arg + sizeof("--bind=") - 1;
+        else if (!strncmp(arg, "--port=", sizeof("--port=") - 1))
+            opts->port = atoi(arg + sizeof("--port=") - 1);
+        else if (!strncmp(arg, "--replicas=", sizeof("--replicas=") - 1))
+            opts->replicas = atoi(arg + sizeof("--replicas=") - 1);
+        else if (!strncmp(arg, "--filter-fp=", sizeof("--filter-fp=") - 1))
+            opts->filter_fp = atof(arg + sizeof("--filter-fp=") - 1);
+        else if (!strncmp(arg, "--server-budget=",
+                          sizeof("--server-budget=") - 1))
+            opts->server_budget = strtoul(arg + sizeof("--server-budget=") - 1,
+                                          NULL, 10);
+        else if (!strncmp(arg, "--compress=", sizeof("--compress=") - 1))
+            opts->compress = strtoul(arg + sizeof("--compress=") - 1, NULL, 10);
+        else if (!strncmp(arg, "--numa-node=", sizeof("--numa-node=") - 1))
+            opts->numa_node = atoi(arg + sizeof("--numa-node=") - 1);
+        else if (!strcmp(arg, "--trace"))
+            opts->trace_us = 0;
+        else if (!strncmp(arg, "--trace=", sizeof("--trace=") - 1))
+            opts->trace_us = strtoul(arg + sizeof("--trace=") - 1, NULL, 10);
+        else if (!strncmp(arg, "--rebalance-step=",
+                          sizeof("--rebalance-step=") - 1))
+            opts->rebalance_step = atoi(arg + sizeof("--rebalance-step=") - 1);
+        else if (!strcmp(arg, "--placement=ring"))
+            opts->placement = PLACEMENT_RING;
+        else if (!strcmp(arg, "--placement=rendezvous"))
+            opts->placement = PLACEMENT_RENDEZVOUS;
+        else if (!strcmp(arg, "--placement=weighted"))
+            opts->placement = PLACEMENT_WEIGHTED_RENDEZVOUS;
+        else if (!strcmp(arg, "--placement=multi-probe"))
+            opts->placement = PLACEMENT_MULTI_PROBE;
+        else if (!strcmp(arg, "--placement=zones"))
+            opts->placement = PLACEMENT_ZONES;
+        else if (!strncmp(arg, "--zone=", sizeof("--zone=") - 1))
+            opts->zone = arg + sizeof("--zone=") - 1;
+        else if (!strncmp(arg, "--shm=", sizeof("--shm=") - 1))
+            opts->shm_name = arg + sizeof("--shm=") - 1;
+        else if (!strncmp(arg, "--shm-size=", sizeof("--shm-size=") - 1))
+            opts->shm_mb = strtoul(arg + sizeof("--shm-size=") - 1, NULL, 10);
+        else if (!strncmp(arg, "--dump-dir=", sizeof("--dump-dir=") - 1)
+                 && arg[sizeof("--dump-dir=") - 1] != 0)
+            opts->dump_dir = arg + sizeof("--dump-dir=") - 1;
+        else
+            return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct options opts;
+
+    if (parse_options(argc, argv, &opts) < 0) {
+        printf("Usage:%s [--bind=addr] [--port=N] [--replicas=R]"
+               " [--filter-fp=P] [--server-budget=B] [--compress=N]"
+               " [--numa-node=N] [--trace[=US]] [--rebalance-step=N]"
+               " [--placement=ring|rendezvous|weighted|multi-probe|zones"
+               " [--zone=name]] [--shm=name [--shm-size=MB]]"
+               " [--dump-dir=dir]\n",
+               argv[0]);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    load_balancer *main_server = init_load_balancer();
+    loader_set_replication(main_server, opts.replicas);
+    loader_set_placement(main_server, opts.placement);
+    if (opts.zone)
+        loader_set_local_zone(main_server, opts.zone);
+    loader_set_filter(main_server, opts.filter_fp);
+    loader_set_memory_budget(main_server, opts.server_budget);
+    loader_set_compression(main_server, opts.compress);
+    if (opts.numa_node >= 0)
+        DIE(loader_set_numa_node(main_server, opts.numa_node) < 0,
+            "bad NUMA node");
+    if (opts.trace_us >= 0)
+        trace_enable(opts.trace_us);
+    loader_set_rebalance_step(main_server, opts.rebalance_step);
+
+    // Processes on this host may read the objects from the segment
+    if (opts.shm_name) {
+        shm_store_t *shm = shm_create(opts.shm_name, opts.shm_mb << 20);
+        DIE(shm == NULL, "can't create the shared memory segment");
+        loader_attach_shm(main_server, shm);
+    }
+
+    // Clients can't reach past the directory, whatever address is bound
+    dump_dir = opts.dump_dir;
+
+    int listen_fd = listen_on(opts.address, opts.port);
+    int epoll_fd = epoll_create1(0);
+    DIE(epoll_fd < 0, "epoll_create1 failed");
+
+    // The listening socket is the only one registered without a connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    DIE(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0,
+        "epoll_ctl failed");
+
+    fprintf(stderr, "listening on %s:%d\n", opts.address, opts.port);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            DIE(errno != EINTR, "epoll_wait failed");
+            continue;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == NULL)
+                accept_connections(epoll_fd, listen_fd);
+            else
+                serve_connection(main_server, epoll_fd, events[i].data.ptr,
+                                 events[i].events);
+        }
+    }
+
+    // Connections still open are dropped with the process
+    close(epoll_fd);
+    close(listen_fd);
+    free_load_balancer(main_server);
+
+    return 0;
+}
@@ -1,13 +1,26 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <time.h>
 
 #include "load_balancer.h"
 #include "load_balancer_utils.h"
+#include "numa.h"
+#include "snapshot.h"
+#include "trace.h"
 
-#define INIT_SIZE 10000
+// Initial capacity of the hashring (it doubles when full)
+#define INIT_SIZE 64
 #define REPLICA_FACTOR 100000
+// Number of points (replicas) every server has on the hashring, by default
+#define SERVER_POINTS 3
+// Most points a server can have on the hashring
+#define MAX_SERVER_POINTS 256
+// Most expired keys reclaimed by a single operation
+#define EXPIRE_BUDGET 32
 
 typedef unsigned int u_int;
 
@@ -31,16 +44,22 @@ unsigned int hash_function_key(void *a) {
     return hash;
 }
 
+/*
+ * Default clock: wall time, so expiry times survive a restart
+ */
+static unsigned long realtime_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 load_balancer* init_load_balancer() {
 
     load_balancer *main_server = (load_balancer*) malloc(sizeof(load_balancer));
     DIE(!main_server, "load balancer malloc failed");
 
-    main_server->servers = (server_memory **)malloc(INIT_SIZE
-                                            * sizeof(server_memory *));
-    DIE(!main_server->servers, "load balancer malloc failed");
-    for (int i = 0; i < INIT_SIZE; ++i)
-        main_server->servers[i] = NULL;
+    main_server->servers = server_dir_create();
 
     // Allocate the hashring with an initial dimension
     main_server->hashring = (hashring_t *)malloc(INIT_SIZE
@@ -48,79 +67,1254 @@ load_balancer* init_load_balancer() {
     DIE(!main_server->hashring, "load balancer malloc failed");
 
     // Set the initial maximum dimensions
-    main_server->max_server_id = INIT_SIZE;
     main_server->hashring_len = 0;
     main_server->max_hr_len = INIT_SIZE;
+    main_server->wal = NULL;
+    main_server->replicas = 1;
+    main_server->rng_state = 2463534242u;
+    main_server->filter_fp = 0;
+    main_server->server_budget = 0;
+    main_server->compress_threshold = 0;
+    main_server->numa_node = -1;
+    main_server->clock = realtime_ms;
+    main_server->now = realtime_ms();
+    main_server->expiry = timer_wheel_create(main_server->now);
+    main_server->batch_scratch = NULL;
+    main_server->batch_scratch_size = 0;
+    main_server->rebalance = rebalance_create();
+    main_server->vnodes = SERVER_POINTS;
+    main_server->rendezvous = NULL;
+    main_server->probes = 0;
+    main_server->shm = NULL;
+    main_server->topology = NULL;
+    main_server->exporter = NULL;
+    main_server->snapshot = NULL;
 
     return main_server;
 }
 
+/*
+ * Fills ids with the servers an object is stored on, returns their number
+ */
+static int key_owners(load_balancer* main, char* key, int* ids) {
+    u_int object_hash = hash_function_key(key);
+
+    if (main->hashring_len == 0)
+        return 0;
+    if (main->replicas > 1)
+        return get_replicas(main, object_hash, -1, ids);
+
+    ids[0] = binary_search_object(main, object_hash);
+    return 1;
+}
+
+/*
+ * Moves the time forward and reclaims a bounded number of the keys whose
+ * expiry time has passed, so the cost is spread over the operations.
+ * Nothing is done (not even reading the clock) while no key expires.
+ */
+static void expire_objects(load_balancer* main) {
+    if (main->expiry->count == 0)
+        return;
+
+    main->now = main->clock();
+    timer_wheel_advance(main->expiry, main->now);
+
+    for (int i = 0; i < EXPIRE_BUDGET; ++i) {
+        timer_entry *entry = timer_wheel_pop_due(main->expiry);
+        if (entry == NULL)
+            break;
+
+        // Only the copies still carrying the scheduled time are removed
+        int owners[MAX_REPLICATION];
+        int n = key_owners(main, entry->key, owners);
+        for (int j = 0; j < n; ++j) {
+            server_memory *server = get_server(main, owners[j]);
+            if (server_reap(server, entry->key, entry->expires))
+                server_compact(server);
+        }
+        free(entry);
+    }
+}
+
+/*
+ * Work spread over the operations: expiry, then the pending migrations
+ */
+static void housekeeping(load_balancer* main) {
+    expire_objects(main);
+    if (main->rebalance->n_tasks > 0)
+        rebalance_step(main, main->rebalance->step);
+}
+
+/*
+ * Membership changes only move objects in steps without replication
+ */
+static int incremental(load_balancer* main) {
+    return main->replicas == 1 && main->rebalance->step > 0;
+}
+
+/*
+ * Records a store or a retrieve if it was slow enough, with the objects
+ * its lookup walks on the server it ran on
+ */
+static void trace_key_op(load_balancer* main, unsigned long start,
+                         trace_type type, int server_id, char* key) {
+    unsigned long duration = trace_elapsed(start);
+    if (duration == 0)
+        return;
+
+    server_memory *server = get_server(main, server_id);
+    unsigned int chain = server ? ht_str_probe_length(server->hashtable, key)
+                                : 0;
+    trace_record(type, start, duration, server_id, hash_function_key(key),
+                 chain, 0);
+}
+
 void loader_store(load_balancer* main, char* key, char* value, int* server_id) {
+    unsigned long start = trace_begin();
+
+    housekeeping(main);
 
     // Binary search the server which the object will be stored on
     u_int object_hash = hash_function_key(key);
-    *server_id = binary_search_object(main, object_hash);
 
-    // Place the object in the found server
-    server_store(main->servers[*server_id], key, value);
+    if (main->replicas > 1) {
+        // Write every replica, the first one is reported as the owner
+        int replicas[MAX_REPLICATION];
+        int n = get_replicas(main, object_hash, -1, replicas);
+
+        for (int i = 0; i < n; ++i)
+            server_store(get_server(main, replicas[i]), key, value);
+        *server_id = replicas[0];
+    } else {
+        int pos = binary_search_object_pos(main, object_hash);
+        *server_id = main->hashring[pos].id;
+
+        // Place the object in the found server
+        server_store(ring_server(main, pos), key, value);
+        if (main->rebalance->n_tasks > 0)
+            rebalance_forget(main, key, ring_server(main, pos));
+    }
+
+    if (main->wal)
+        wal_log_store(main->wal, key, value);
+    if (main->exporter)
+        range_export_note(main->exporter, key);
+    trace_key_op(main, start, TRACE_STORE, *server_id, key);
 }
 
-char* loader_retrieve(load_balancer* main, char* key, int* server_id) {
+void loader_store_ttl(load_balancer* main, char* key, char* value,
+                      unsigned long ttl_ms, int* server_id) {
+    loader_store(main, key, value, server_id);
+    loader_expire_at(main, key, main->clock() + ttl_ms);
+}
+
+int loader_expire_at(load_balancer* main, char* key, unsigned long expires_at) {
+    int owners[MAX_REPLICATION];
+    int found = 0;
+
+    main->now = main->clock();
+    timer_wheel_advance(main->expiry, main->now);
+
+    // The expiry is set on the owner, so the object can't wait elsewhere
+    if (main->rebalance->n_tasks > 0)
+        rebalance_pull(main, key);
+
+    int n = key_owners(main, key, owners);
+    for (int i = 0; i < n; ++i)
+        found |= server_set_expiry(get_server(main, owners[i]), key,
+                                   expires_at);
+    if (!found)
+        return 0;
+
+    // A previous entry of the key is ignored when it fires: its time no
+    // longer matches the one of the object
+    if (expires_at != 0)
+        timer_wheel_add(main->expiry, key, expires_at);
+
+    if (main->wal)
+        wal_log_expire(main->wal, key, expires_at);
+    if (main->exporter)
+        range_export_note(main->exporter, key);
+    return 1;
+}
+
+void loader_set_clock(load_balancer* main, unsigned long (*clock)(void)) {
+    if (main->expiry->count > 0) {
+        fprintf(stderr, "clock can't change while keys are set to expire\n");
+        return;
+    }
+    main->clock = clock;
+    main->now = clock();
+    main->expiry->now = main->now;
+}
+
+/*
+ * xorshift32, only used to pick replicas, so it doesn't need to be good
+ */
+static u_int next_random(load_balancer* main) {
+    u_int x = main->rng_state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    main->rng_state = x;
+    return x;
+}
+
+/*
+ * Power of two choices: out of two random replicas pick the less loaded one
+ */
+static int pick_replica(load_balancer* main, int* replicas, int n) {
+    if (n == 1)
+        return 0;
+
+    int first = next_random(main) % n;
+    int second = next_random(main) % (n - 1);
+    if (second >= first)
+        second++;
+
+    if (get_server(main, replicas[second])->load
+        < get_server(main, replicas[first])->load)
+        return second;
+    return first;
+}
+
+/*
+ * Reads go to the copy in the local zone if there is one, otherwise to
+ * one picked by pick_replica
+ */
+static int choose_replica(load_balancer* main, u_int object_hash,
+                          int* replicas, int n) {
+    if (main->topology && main->topology->local_zone >= 0) {
+        int local = topology_zone_owner(main->topology,
+                                        main->topology->local_zone,
+                                        object_hash, -1);
+        for (int i = 0; i < n; ++i)
+            if (replicas[i] == local)
+                return i;
+    }
+    return pick_replica(main, replicas, n);
+}
+
+static char* retrieve(load_balancer* main, char* key, int* server_id) {
+
+    housekeeping(main);
 
     // Search the server which the object is stored on and return the object's value
     u_int object_hash = hash_function_key(key);
-    *server_id = binary_search_object(main, object_hash);
-    return server_retrieve(main->servers[*server_id], key);
+
+    if (main->replicas > 1) {
+        int replicas[MAX_REPLICATION];
+        int n = get_replicas(main, object_hash, -1, replicas);
+        int chosen = choose_replica(main, object_hash, replicas, n);
+
+        // Try the chosen replica first, then the others
+        for (int i = 0; i < n; ++i) {
+            int id = replicas[(chosen + i) % n];
+            char *value = server_retrieve(get_server(main, id), key);
+
+            get_server(main, id)->load++;
+            if (value != NULL) {
+                *server_id = id;
+                return value;
+            }
+        }
+        *server_id = replicas[chosen];
+        return NULL;
+    }
+
+    int pos = binary_search_object_pos(main, object_hash);
+    *server_id = main->hashring[pos].id;
+    char *value = server_retrieve(ring_server(main, pos), key);
+
+    // The object may not have been moved to its new owner yet
+    if (value == NULL && main->rebalance->n_tasks > 0) {
+        migration *task = rebalance_holder(main, key, ring_server(main, pos));
+        if (task != NULL) {
+            *server_id = task->source_id;
+            value = server_retrieve(task->source, key);
+        }
+    }
+    return value;
+}
+
+char* loader_retrieve(load_balancer* main, char* key, int* server_id) {
+    unsigned long start = trace_begin();
+    char *value = retrieve(main, key, server_id);
+
+    trace_key_op(main, start, TRACE_RETRIEVE, *server_id, key);
+    return value;
+}
+
+typedef struct batch_key batch_key;
+
+// A key of a batch, with the hashring position that owns it
+struct batch_key {
+    u_int hash;
+    unsigned int index;
+    int pos;
+};
+
+static int compare_batch_keys(const void* a, const void* b) {
+    const batch_key *key_a = (const batch_key *)a;
+    const batch_key *key_b = (const batch_key *)b;
+
+    if (key_a->hash != key_b->hash)
+        return (key_a->hash > key_b->hash) - (key_a->hash < key_b->hash);
+    return (key_a->index > key_b->index) - (key_a->index < key_b->index);
+}
+
+/*
+ * Hashes the keys of a batch and sorts them by hash (equal hashes keep
+ * their order), so a single walk of the hashring finds all their owners
+ * and the keys of a server end up next to each other
+ */
+static batch_key* resolve_owners(load_balancer* main, char** keys,
+                                 unsigned int n) {
+    batch_key *order = (batch_key *)malloc((n + 1) * sizeof(batch_key));
+    DIE(!order, "batch malloc failed");
+
+    for (unsigned int i = 0; i < n; ++i) {
+        order[i].hash = hash_function_key(keys[i]);
+        order[i].index = i;
+    }
+    qsort(order, n, sizeof(batch_key), compare_batch_keys);
+
+    if (main->rendezvous || main->probes || main->topology) {
+        for (unsigned int k = 0; k < n; ++k)
+            order[k].pos = binary_search_object_pos(main, order[k].hash);
+        return order;
+    }
+
+    // Same answer as binary_search_object_pos for every key
+    int pos = 0;
+    for (unsigned int k = 0; k < n; ++k) {
+        while (pos < main->hashring_len
+               && main->hashring[pos].hash < order[k].hash)
+            pos++;
+        order[k].pos = pos == main->hashring_len ? 0 : pos;
+    }
+
+    return order;
+}
+
+void loader_store_batch(load_balancer* main, char** keys, char** values,
+                        unsigned int n, int* server_ids) {
+    if (main->hashring_len == 0) {
+        fprintf(stderr, "there are no servers to store on\n");
+        for (unsigned int i = 0; i < n; ++i)
+            server_ids[i] = -1;
+        return;
+    }
+
+    unsigned long start = trace_begin();
+    housekeeping(main);
+
+    batch_key *order = resolve_owners(main, keys, n);
+
+    for (unsigned int k = 0; k < n; ++k) {
+        unsigned int i = order[k].index;
+
+        if (main->replicas > 1) {
+            int replicas[MAX_REPLICATION];
+            int count = get_replicas(main, order[k].hash, -1, replicas);
+
+            for (int r = 0; r < count; ++r)
+                server_store(get_server(main, replicas[r]), keys[i], values[i]);
+            server_ids[i] = replicas[0];
+        } else {
+            server_memory *owner = ring_server(main, order[k].pos);
+
+            server_ids[i] = main->hashring[order[k].pos].id;
+            server_store(owner, keys[i], values[i]);
+            if (main->rebalance->n_tasks > 0)
+                rebalance_forget(main, keys[i], owner);
+        }
+    }
+    free(order);
+
+    if (main->wal)
+        for (unsigned int i = 0; i < n; ++i)
+            wal_log_store(main->wal, keys[i], values[i]);
+    if (main->exporter)
+        for (unsigned int i = 0; i < n; ++i)
+            range_export_note(main->exporter, keys[i]);
+    trace_end(start, TRACE_MSTORE, -1, 0, 0, n);
+}
+
+void loader_retrieve_batch(load_balancer* main, char** keys, unsigned int n,
+                           char** values, int* server_ids) {
+    if (main->hashring_len == 0) {
+        for (unsigned int i = 0; i < n; ++i) {
+            values[i] = NULL;
+            server_ids[i] = -1;
+        }
+        return;
+    }
+
+    unsigned long start = trace_begin();
+    housekeeping(main);
+
+    batch_key *order = resolve_owners(main, keys, n);
+    server_memory **servers = (server_memory **)malloc((n + 1)
+                                                       * sizeof(server_memory *));
+    char **sorted_keys = (char **)malloc((n + 1) * sizeof(char *));
+    struct info **objs = (struct info **)malloc((n + 1) * sizeof(struct info *));
+    DIE(!servers || !sorted_keys || !objs, "batch malloc failed");
+
+    for (unsigned int k = 0; k < n; ++k) {
+        unsigned int i = order[k].index;
+
+        sorted_keys[k] = keys[i];
+        if (main->replicas > 1) {
+            int replicas[MAX_REPLICATION];
+            int count = get_replicas(main, order[k].hash, -1, replicas);
+
+            server_ids[i] = replicas[choose_replica(main, order[k].hash,
+                                                    replicas, count)];
+            servers[k] = get_server(main, server_ids[i]);
+            servers[k]->load++;
+        } else {
+            server_ids[i] = main->hashring[order[k].pos].id;
+            servers[k] = ring_server(main, order[k].pos);
+        }
+    }
+
+    server_lookup_batch(servers, sorted_keys, n, objs);
+
+    // Misses on the chosen replica try the others, like loader_retrieve
+    for (unsigned int k = 0; k < n && main->replicas > 1; ++k) {
+        if (objs[k] != NULL)
+            continue;
+
+        unsigned int i = order[k].index;
+        int replicas[MAX_REPLICATION];
+        int count = get_replicas(main, order[k].hash, -1, replicas);
+        int chosen = 0;
+        while (replicas[chosen] != server_ids[i])
+            chosen++;
+
+        for (int r = 1; r < count && objs[k] == NULL; ++r) {
+            int id = replicas[(chosen + r) % count];
+            server_memory *server = get_server(main, id);
+
+            server->load++;
+            server_lookup_batch(&server, &sorted_keys[k], 1, &objs[k]);
+            if (objs[k] != NULL)
+                server_ids[i] = id;
+        }
+    }
+
+    // Objects not moved to their new owner yet are read where they wait
+    for (unsigned int k = 0; k < n && main->rebalance->n_tasks > 0; ++k) {
+        if (objs[k] != NULL || main->replicas > 1)
+            continue;
+
+        migration *task = rebalance_holder(main, sorted_keys[k], servers[k]);
+        if (task != NULL) {
+            server_lookup_batch(&task->source, &sorted_keys[k], 1, &objs[k]);
+            server_ids[order[k].index] = task->source_id;
+        }
+    }
+
+    // Chunked and compressed values are flattened, one after the other,
+    // in a buffer which stays valid until the next batch
+    unsigned long scratch_needed = 0;
+    for (unsigned int k = 0; k < n; ++k)
+        if (objs[k] != NULL && (objs[k]->chunked || objs[k]->compressed))
+            scratch_needed += server_value_length(objs[k]) + 1;
+    if (scratch_needed > main->batch_scratch_size) {
+        char *scratch = (char *)realloc(main->batch_scratch, scratch_needed);
+        DIE(!scratch, "batch scratch realloc failed");
+        main->batch_scratch = scratch;
+        main->batch_scratch_size = scratch_needed;
+    }
+
+    unsigned long offset = 0;
+    for (unsigned int k = 0; k < n; ++k) {
+        unsigned int i = order[k].index;
+        struct info *obj = objs[k];
+
+        if (obj == NULL) {
+            values[i] = NULL;
+        } else if (!obj->chunked && !obj->compressed) {
+            values[i] = obj->value;
+        } else {
+            unsigned int len = server_value_length(obj);
+            values[i] = main->batch_scratch + offset;
+            server_value_copy(get_server(main, server_ids[i]), obj, values[i]);
+            values[i][len] = 0;
+            offset += len + 1;
+        }
+    }
+
+    free(objs);
+    free(sorted_keys);
+    free(servers);
+    free(order);
+    trace_end(start, TRACE_MRETRIEVE, -1, 0, 0, n);
+}
+
+loader_stream* loader_store_begin(load_balancer* main, char* key) {
+    loader_stream *stream = (loader_stream *)malloc(sizeof(loader_stream));
+    DIE(!stream, "loader stream malloc failed");
+
+    unsigned int key_size = strlen(key) + 1;
+    stream->key = (char *)malloc(key_size);
+    DIE(!stream->key, "loader stream malloc failed");
+    memcpy(stream->key, key, key_size);
+
+    stream->main = main;
+    value_builder_init(&stream->value);
+
+    return stream;
+}
+
+void loader_store_append(loader_stream* stream, const char* data,
+                         unsigned long len) {
+    value_builder_append(&stream->value, data, len);
+}
+
+void loader_store_cancel(loader_stream* stream) {
+    value_chunks_free(stream->value.head);
+    free(stream->key);
+    free(stream);
+}
+
+void loader_store_end(loader_stream* stream, int* server_id) {
+    load_balancer *main = stream->main;
+
+    housekeeping(main);
+
+    if (stream->value.size <= VALUE_CHUNK_SIZE) {
+        char *value = (char *)malloc(stream->value.size + 1);
+        DIE(!value, "loader stream malloc failed");
+        value_chunks_flatten(stream->value.head, value);
+        value[stream->value.size] = 0;
+
+        loader_store(main, stream->key, value, server_id);
+        free(value);
+        loader_store_cancel(stream);
+        return;
+    }
+
+    u_int object_hash = hash_function_key(stream->key);
+    value_chunk *chunks = stream->value.head;
+    unsigned int value_len = stream->value.size;
+
+    // Logged first: the chain belongs to the servers afterwards
+    if (main->wal)
+        wal_log_store_chunks(main->wal, stream->key, chunks, value_len);
+
+    int replicas[MAX_REPLICATION];
+    int n = 1;
+    if (main->replicas > 1)
+        n = get_replicas(main, object_hash, -1, replicas);
+    else
+        replicas[0] = binary_search_object(main, object_hash);
+
+    // The first replica takes the chain, the others get copies
+    for (int i = n - 1; i >= 0; --i) {
+        value_chunk *value = i == 0 ? chunks : value_chunks_copy(chunks);
+        server_store_chunks(get_server(main, replicas[i]), stream->key, value,
+                            value_len);
+    }
+    *server_id = replicas[0];
+    if (main->replicas == 1 && main->rebalance->n_tasks > 0)
+        rebalance_forget(main, stream->key, get_server(main, replicas[0]));
+    if (main->exporter)
+        range_export_note(main->exporter, stream->key);
+
+    free(stream->key);
+    free(stream);
+}
+
+int loader_retrieve_stream(load_balancer* main, char* key, int* server_id,
+                           int (*sink)(void *ctx, const char *data,
+                                       unsigned int len),
+                           void* ctx) {
+    housekeeping(main);
+
+    u_int object_hash = hash_function_key(key);
+
+    if (main->replicas > 1) {
+        int replicas[MAX_REPLICATION];
+        int n = get_replicas(main, object_hash, -1, replicas);
+        int chosen = choose_replica(main, object_hash, replicas, n);
+
+        for (int i = 0; i < n; ++i) {
+            int id = replicas[(chosen + i) % n];
+
+            get_server(main, id)->load++;
+            if (server_retrieve_stream(get_server(main, id), key, sink, ctx)) {
+                *server_id = id;
+                return 1;
+            }
+        }
+        *server_id = replicas[chosen];
+        return 0;
+    }
+
+    int pos = binary_search_object_pos(main, object_hash);
+    *server_id = main->hashring[pos].id;
+    if (server_retrieve_stream(ring_server(main, pos), key, sink, ctx))
+        return 1;
+
+    // The object may not have been moved to its new owner yet
+    migration *task = NULL;
+    if (main->rebalance->n_tasks > 0)
+        task = rebalance_holder(main, key, ring_server(main, pos));
+    if (task == NULL)
+        return 0;
+
+    *server_id = task->source_id;
+    return server_retrieve_stream(task->source, key, sink, ctx);
+}
+
+/*
+ * Computes the hashes of the points (replicas) of a server
+ */
+static void server_point_hashes(load_balancer* main, int server_id,
+                                u_int* hashes) {
+    for (int i = 0; i < main->vnodes; ++i) {
+        int replica_id = i * REPLICA_FACTOR + server_id;
+        hashes[i] = hash_function_servers(&replica_id);
+    }
+}
+
+/*
+ * Inserts the points of a server and repairs the replica sets of the
+ * objects whose clockwise walk now meets the new server
+ */
+static void add_server_replicated(load_balancer* main, int server_id) {
+    u_int hashes[MAX_SERVER_POINTS];
+    int holders[MAX_SERVER_POINTS];
+    int n_holders = 0;
+
+    server_point_hashes(main, server_id, hashes);
+    for (int i = 0; i < main->vnodes; ++i) {
+        int pos = binary_search_server(main, hashes[i], server_id);
+        insert_ring_point(main, server_id, pos, hashes[i]);
+    }
+
+    // Every object affected by a new point is held by the first other
+    // server after that point
+    for (int i = 0; i < main->vnodes; ++i) {
+        int pos = binary_search_server(main, hashes[i], server_id);
+
+        for (int step = 1; step < main->hashring_len; ++step) {
+            int id = main->hashring[(pos + step) % main->hashring_len].id;
+            if (id == server_id)
+                continue;
+
+            int known = 0;
+            for (int j = 0; j < n_holders; ++j)
+                if (holders[j] == id)
+                    known = 1;
+            if (!known)
+                holders[n_holders++] = id;
+            break;
+        }
+    }
+
+    for (int i = 0; i < n_holders; ++i)
+        repair_replicas(main, holders[i], server_id, 1);
+}
+
+/*
+ * Inserts the points of a server; the objects it takes over are moved
+ * later, from the first other server after every point
+ */
+static void add_server_incremental(load_balancer* main, int server_id) {
+    u_int hashes[MAX_SERVER_POINTS];
+
+    server_point_hashes(main, server_id, hashes);
+    for (int i = 0; i < main->vnodes; ++i) {
+        int pos = binary_search_server(main, hashes[i], server_id);
+        insert_ring_point(main, server_id, pos, hashes[i]);
+    }
+
+    for (int i = 0; i < main->vnodes; ++i) {
+        int pos = binary_search_server(main, hashes[i], server_id);
+
+        for (int step = 1; step < main->hashring_len; ++step) {
+            int id = main->hashring[(pos + step) % main->hashring_len].id;
+            if (id != server_id) {
+                rebalance_add_source(main, get_server(main, id), id);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Hands a new server the objects it takes over from the server at a
+ * position of the hashring
+ */
+static void claim_from(load_balancer* main, int server_id, int pos) {
+    int id = main->hashring[pos].id;
+
+    if (main->replicas > 1)
+        repair_replicas(main, id, server_id, 1);
+    else if (incremental(main))
+        rebalance_add_source(main, get_server(main, id), id);
+    else
+        remap_objects_insert(main, pos);
+}
+
+/*
+ * Hands a new server the objects it takes over when they may be on any
+ * other server (rendezvous and multi-probe placement)
+ */
+static void claim_objects(load_balancer* main, int server_id) {
+    for (int i = 0; i < main->hashring_len; ++i)
+        if (main->hashring[i].id != server_id)
+            claim_from(main, server_id, i);
+}
+
+/*
+ * Inserts a server scored by rendezvous hashing. Objects which now rank
+ * it first may be on any other server.
+ */
+static void add_server_rendezvous(load_balancer* main, int server_id,
+                                  unsigned int weight) {
+    int pos = server_position(main, server_id);
+    u_int seed = hash_function_servers(&server_id);
+
+    insert_ring_point(main, server_id, pos, seed);
+    rendezvous_insert(main->rendezvous, pos, seed, weight);
+    claim_objects(main, server_id);
+}
+
+/*
+ * Inserts a server in its zone. The zone of an object doesn't depend on
+ * the servers in it, so objects only move between servers of the zone,
+ * unless the zone was empty and takes objects from all the others. With
+ * replication every object has a copy in the zone whenever its set can
+ * change, so the servers of the zone are the only ones to repair too.
+ */
+static void add_server_zoned(load_balancer* main, int server_id,
+                             const char* zone, const char* rack) {
+    int pos = server_position(main, server_id);
+    u_int seed = hash_function_servers(&server_id);
+
+    insert_ring_point(main, server_id, pos, seed);
+    int z = topology_insert(main->topology, server_id, seed, zone, rack);
+
+    zone_t *members = &main->topology->zones[z];
+    if (members->n == 1) {
+        claim_objects(main, server_id);
+        return;
+    }
+    for (int i = 0; i < members->n; ++i)
+        if (members->ids[i] != server_id)
+            claim_from(main, server_id,
+                       server_position(main, members->ids[i]));
+}
+
+/*
+ * Inserts the single point of a server with multi-probe placement. An
+ * object moves when one of its probes now lands closer to the new point
+ * than the probe which placed it, wherever that was.
+ */
+static void add_server_multi_probe(load_balancer* main, int server_id) {
+    u_int hash;
+    server_point_hashes(main, server_id, &hash);
+    int pos = binary_search_server(main, hash, server_id);
+
+    insert_ring_point(main, server_id, pos, hash);
+    claim_objects(main, server_id);
+}
+
+/*
+ * Membership changes are a single change of the shared memory segment:
+ * readers wait for its end instead of seeing objects halfway moved
+ */
+static void membership_begin(load_balancer* main) {
+    if (main->shm)
+        shm_write_begin(main->shm);
+    // Objects are about to move, possibly to servers the export already
+    // scanned: the export sends what is left while they are still in place
+    if (main->exporter)
+        range_export_step(main->exporter, 0);
+}
+
+static void membership_end(load_balancer* main) {
+    if (main->shm) {
+        shm_publish(main->shm, main);
+        shm_write_end(main->shm);
+    }
+}
+
+/*
+ * Allocs the memory of a server and registers it, returns its slot
+ */
+static int new_server(load_balancer* main, int server_id) {
+    server_memory *server = init_server_memory();
+    server->id = server_id;
+    if (main->filter_fp > 0)
+        server_enable_filter(server, main->filter_fp);
+    server_set_budget(server, main->server_budget);
+    server_set_compression(server, main->compress_threshold);
+    if (main->numa_node >= 0)
+        server_set_node(server, main->numa_node);
+    server->clock = &main->now;
+    if (main->shm)
+        server_attach_shm(server, main->shm);
+
+    return server_dir_insert(main->servers, server_id, server);
 }
 
 void loader_add_server(load_balancer* main, int server_id) {
+    loader_add_server_weighted(main, server_id, 1);
+}
+
+/*
+ * Adds a server with a weight (rendezvous placement) or a zone and a rack
+ * (zone placement, NULL for the default ones)
+ */
+static void add_server(load_balancer* main, int server_id, unsigned int weight,
+                       const char* zone, const char* rack) {
+
+    housekeeping(main);
+
+    if (get_server(main, server_id) != NULL) {
+        fprintf(stderr, "server %d already exists\n", server_id);
+        return;
+    }
+    if (zone != NULL && !main->topology) {
+        fprintf(stderr, "zones need zone placement\n");
+        zone = rack = NULL;
+    }
+    if (weight != 1 && (!main->rendezvous || !main->rendezvous->weighted)) {
+        fprintf(stderr, "weights need weighted rendezvous placement\n");
+        weight = 1;
+    }
+    if (weight == 0) {
+        fprintf(stderr, "server weight must be positive\n");
+        return;
+    }
+
+    membership_begin(main);
+    new_server(main, server_id);
+
+    if (main->rendezvous) {
+        add_server_rendezvous(main, server_id, weight);
+    } else if (main->topology) {
+        add_server_zoned(main, server_id, zone ? zone : DEFAULT_ZONE,
+                         rack ? rack : "");
+    } else if (main->probes) {
+        add_server_multi_probe(main, server_id);
+    } else if (main->replicas > 1) {
+        add_server_replicated(main, server_id);
+    } else if (incremental(main)) {
+        add_server_incremental(main, server_id);
+    } else {
+        u_int hashes[MAX_SERVER_POINTS];
+        server_point_hashes(main, server_id, hashes);
+
+        // Search binary for every replica and insert in the hashring
+        for (int i = 0; i < main->vnodes; ++i) {
+            int pos = binary_search_server(main, hashes[i], server_id);
+            insert_server(main, server_id, pos, hashes[i]);
+        }
+    }
+    membership_end(main);
 
-    // If a bigger ID is needed resize the array
-    while (server_id >= main->max_server_id)
-        resize_server_array(main);
+    if (main->wal && zone != NULL)
+        wal_log_server_at(main->wal, server_id, zone, rack ? rack : "");
+    else if (main->wal)
+        wal_log_server(main->wal, WAL_OP_ADD_SERVER, server_id, weight);
+}
+
+void loader_add_server_weighted(load_balancer* main, int server_id,
+                                unsigned int weight) {
+    add_server(main, server_id, weight, NULL, NULL);
+}
+
+void loader_add_server_at(load_balancer* main, int server_id,
+                          const char* zone, const char* rack) {
+    add_server(main, server_id, 1, zone, rack);
+}
+
+void loader_add_servers(load_balancer* main, int* server_ids, int n) {
+    // Objects may have to move, so the servers go in one by one; the
+    // rendezvous hashring is sorted by ID, not by hash
+    if (main->hashring_len > 0 || main->rendezvous || main->topology) {
+        for (int i = 0; i < n; ++i)
+            loader_add_server(main, server_ids[i]);
+        return;
+    }
+
+    hashring_t *points = (hashring_t *)malloc(((long)n * main->vnodes + 1)
+                                              * sizeof(hashring_t));
+    DIE(!points, "hashring malloc failed");
+
+    membership_begin(main);
+    int len = 0;
+    for (int i = 0; i < n; ++i) {
+        if (get_server(main, server_ids[i]) != NULL) {
+            fprintf(stderr, "server %d already exists\n", server_ids[i]);
+            continue;
+        }
 
-    // Alloc memory for the new server
-    main->servers[server_id] = init_server_memory();
+        int slot = new_server(main, server_ids[i]);
+        u_int hashes[MAX_SERVER_POINTS];
+        server_point_hashes(main, server_ids[i], hashes);
+        for (int j = 0; j < main->vnodes; ++j) {
+            points[len].hash = hashes[j];
+            points[len].id = server_ids[i];
+            points[len].slot = slot;
+            len++;
+        }
 
-    // Calculate the ID of the replicas of the new server
-    int replica_id_1 = 1 * REPLICA_FACTOR + server_id;
-    int replica_id_2 = 2 * REPLICA_FACTOR + server_id;
+        if (main->wal)
+            wal_log_server(main->wal, WAL_OP_ADD_SERVER, server_ids[i], 1);
+    }
 
-    // Calculate the hashes
-    u_int server_hash = hash_function_servers(&server_id);
-    u_int replica_hash_1 = hash_function_servers(&replica_id_1);
-    u_int replica_hash_2 = hash_function_servers(&replica_id_2);
+    // Same order as inserting the points one by one
+    sort_ring_points(points, len);
 
-    // Search binary for every replica and insert in the hashring
-    int pos = binary_search_server(main, server_hash, server_id);
-    insert_server(main, server_id, pos, server_hash);
-    int pos_1 = binary_search_server(main, replica_hash_1, server_id);
-    insert_server(main, server_id, pos_1, replica_hash_1);
-    int pos_2 = binary_search_server(main, replica_hash_2, server_id);
-    insert_server(main, server_id, pos_2, replica_hash_2);
+    while (main->max_hr_len < len)
+        resize_hashring(main);
+    memcpy(main->hashring, points, len * sizeof(hashring_t));
+    main->hashring_len = len;
+    membership_end(main);
+
+    free(points);
+}
+
+load_balancer* init_load_balancer_with_servers(int* server_ids, int n,
+                                               int vnodes) {
+    load_balancer *main = init_load_balancer();
+
+    if (vnodes > MAX_SERVER_POINTS) {
+        fprintf(stderr, "servers can have at most %d points\n",
+                MAX_SERVER_POINTS);
+        vnodes = MAX_SERVER_POINTS;
+    }
+    if (vnodes > 0)
+        main->vnodes = vnodes;
+
+    loader_add_servers(main, server_ids, n);
+    return main;
 }
 
 void loader_remove_server(load_balancer* main, int server_id) {
 
-    int replica_id_1 = 1 * REPLICA_FACTOR + server_id;
-    int replica_id_2 = 2 * REPLICA_FACTOR + server_id;
+    housekeeping(main);
+
+    if (get_server(main, server_id) == NULL) {
+        fprintf(stderr, "server %d does not exist\n", server_id);
+        return;
+    }
+
+    membership_begin(main);
+    u_int hashes[MAX_SERVER_POINTS];
+    server_point_hashes(main, server_id, hashes);
 
-    u_int server_hash = hash_function_servers(&server_id);
-    u_int replica_hash_1 = hash_function_servers(&replica_id_1);
-    u_int replica_hash_2 = hash_function_servers(&replica_id_2);
+    // All objects which lose this server from their replica set are stored
+    // on it, so they are handed over while its points are still on the ring
+    if (main->replicas > 1)
+        repair_replicas(main, server_id, server_id, 0);
 
-    int pos = binary_search_server(main, server_hash, server_id);
-    remove_server(main, server_id, pos);
-    int pos_1 = binary_search_server(main, replica_hash_1, server_id);
-    remove_server(main, server_id, pos_1);
-    int pos_2 = binary_search_server(main, replica_hash_2, server_id);
-    remove_server(main, server_id, pos_2);
+    if (main->rendezvous) {
+        int pos = server_position(main, server_id);
+        remove_ring_point(main, pos);
+        rendezvous_remove(main->rendezvous, pos);
+    } else if (main->topology) {
+        remove_ring_point(main, server_position(main, server_id));
+        topology_remove(main->topology, server_id);
+    } else {
+        for (int i = 0; i < main->vnodes; ++i) {
+            int pos = binary_search_server(main, hashes[i], server_id);
+            if (main->replicas > 1 || incremental(main) || main->probes)
+                remove_ring_point(main, pos);
+            else
+                remove_server(main, server_id, pos);
+        }
+    }
+
+    server_memory *server = server_dir_remove(main->servers, server_id);
+
+    // The server is off the ring and empty, it is not needed anymore,
+    // unless its objects are moved in steps: then it is freed once drained
+    if (incremental(main)) {
+        rebalance_drain(main, server, server_id);
+        server = NULL;
+    } else if ((main->rendezvous || main->probes || main->topology)
+               && main->replicas == 1 && main->hashring_len > 0) {
+        // Only the objects of the server move, every other object keeps
+        // its best server (in the same zone, unless it is empty now)
+        remap_objects_drain(main, server);
+    }
+    free_server_memory(server);
+    membership_end(main);
+
+    if (main->wal)
+        wal_log_server(main->wal, WAL_OP_REMOVE_SERVER, server_id, 0);
+}
+
+void loader_set_replication(load_balancer* main, int replicas) {
+    if (main->hashring_len > 0) {
+        fprintf(stderr, "replication can't change once servers are added\n");
+        return;
+    }
+    if (replicas < 1)
+        replicas = 1;
+    if (replicas > MAX_REPLICATION)
+        replicas = MAX_REPLICATION;
+    main->replicas = replicas;
+}
+
+void loader_set_placement(load_balancer* main, enum placement placement) {
+    if (main->hashring_len > 0) {
+        fprintf(stderr, "placement can't change once servers are added\n");
+        return;
+    }
+
+    rendezvous_free(main->rendezvous);
+    main->rendezvous = NULL;
+    topology_free(main->topology);
+    main->topology = NULL;
+    if (placement == PLACEMENT_ZONES)
+        main->topology = topology_create();
+    if (placement == PLACEMENT_RENDEZVOUS
+        || placement == PLACEMENT_WEIGHTED_RENDEZVOUS)
+        main->rendezvous = rendezvous_create(
+            placement == PLACEMENT_WEIGHTED_RENDEZVOUS);
+
+    // The probes spread the keys instead of the points
+    if (placement == PLACEMENT_MULTI_PROBE) {
+        main->probes = MULTI_PROBES;
+        main->vnodes = 1;
+    } else if (main->probes) {
+        main->probes = 0;
+        main->vnodes = SERVER_POINTS;
+    }
+}
+
+void loader_set_local_zone(load_balancer* main, const char* zone) {
+    if (main->topology == NULL) {
+        fprintf(stderr, "zones need zone placement\n");
+        return;
+    }
+    // The zone may only get its servers later
+    main->topology->local_zone = zone ? topology_add_zone(main->topology, zone)
+                                      : -1;
+}
+
+void loader_set_probes(load_balancer* main, int probes) {
+    if (main->probes == 0) {
+        fprintf(stderr, "probes need multi-probe placement\n");
+        return;
+    }
+    if (main->hashring_len > 0) {
+        fprintf(stderr, "probes can't change once servers are added\n");
+        return;
+    }
+    main->probes = probes < 1 ? 1 : probes;
+}
+
+void loader_set_filter(load_balancer* main, double fp_rate) {
+    if (fp_rate >= 1) {
+        fprintf(stderr, "filter false positive rate must be below 1\n");
+        return;
+    }
+    main->filter_fp = fp_rate;
+    if (fp_rate <= 0)
+        return;
+
+    for (int i = 0; i < main->hashring_len; ++i)
+        if (ring_server(main, i)->filter == NULL)
+            server_enable_filter(ring_server(main, i), fp_rate);
+}
+
+void loader_set_memory_budget(load_balancer* main, unsigned long budget) {
+    main->server_budget = budget;
+
+    for (int i = 0; i < main->servers->n_slots; ++i)
+        if (main->servers->slots[i].server != NULL)
+            server_set_budget(main->servers->slots[i].server, budget);
+}
+
+void loader_set_compression(load_balancer* main, unsigned int threshold) {
+    main->compress_threshold = threshold;
+
+    for (int i = 0; i < main->servers->n_slots; ++i)
+        if (main->servers->slots[i].server != NULL)
+            server_set_compression(main->servers->slots[i].server, threshold);
+}
+
+int loader_set_numa_node(load_balancer* main, int node) {
+    if (node < 0 || node >= numa_node_count()) {
+        fprintf(stderr, "there is no NUMA node %d\n", node);
+        return -1;
+    }
+
+    numa_pin_thread(node);
+    numa_prefer(node);
+    main->numa_node = node;
+
+    for (int i = 0; i < main->servers->n_slots; ++i)
+        if (main->servers->slots[i].server != NULL)
+            server_set_node(main->servers->slots[i].server, node);
+    return 0;
+}
+
+void loader_set_server_node(load_balancer* main, int server_id, int node) {
+    server_memory *server = get_server(main, server_id);
+
+    if (server == NULL || node < 0 || node >= numa_node_count()) {
+        fprintf(stderr, "can't place server %d on NUMA node %d\n", server_id,
+                node);
+        return;
+    }
+    server_set_node(server, node);
+}
+
+void loader_set_rebalance_step(load_balancer* main, unsigned int buckets) {
+    main->rebalance->step = buckets;
+    if (buckets == 0)
+        rebalance_finish(main);
+}
+
+int loader_rebalance_status(load_balancer* main, rebalance_status* status) {
+    return rebalance_get_status(main, status);
+}
+
+void loader_rebalance_finish(load_balancer* main) {
+    rebalance_finish(main);
+}
+
+static int compare_slots(const void* a, const void* b) {
+    int id_a = ((const server_slot *)a)->id;
+    int id_b = ((const server_slot *)b)->id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+void loader_print_stats(load_balancer* main, FILE* out) {
+    server_dir_t *dir = main->servers;
+    server_slot *live = (server_slot *)malloc((dir->count + 1)
+                                              * sizeof(server_slot));
+    DIE(!live, "stats malloc failed");
+
+    int n = 0;
+    for (int i = 0; i < dir->n_slots; ++i)
+        if (dir->slots[i].server != NULL)
+            live[n++] = dir->slots[i];
+    qsort(live, n, sizeof(server_slot), compare_slots);
+
+    for (int i = 0; i < n; ++i) {
+        server_memory *server = live[i].server;
+
+        fprintf(out, "Server %d: %u keys, %lu bytes, budget %lu, "
+                "%lu evictions (%lu bytes), %lu misses, %lu expired, "
+                "%lu filtered.\n",
+                live[i].id, ht_get_size(server->hashtable),
+                server_used_bytes(server), server->budget, server->evictions,
+                server->evicted_bytes, server->misses, server->expired,
+                server->filter_negatives);
+        if (main->compress_threshold > 0)
+            fprintf(out, "Server %d compression: %lu bytes stored as %lu "
+                    "(ratio %.2f), %.1f ns/KB compressing, %.1f ns/KB "
+                    "decompressing.\n", live[i].id, server->compress_raw,
+                    server->compress_stored,
+                    server->compress_stored
+                        ? 1.0 * server->compress_raw / server->compress_stored
+                        : 1.0,
+                    server->compress_raw
+                        ? 1024.0 * server->compress_ns / server->compress_raw
+                        : 0.0,
+                    server->decompress_raw
+                        ? 1024.0 * server->decompress_ns
+                          / server->decompress_raw
+                        : 0.0);
+        if (server->numa_node >= 0) {
+            unsigned long sampled, remote;
+            server_numa_sample(server, &sampled, &remote);
+            fprintf(out, "Server %d NUMA: node %d, %lu accesses, %.1f%% of "
+                    "%lu sampled addresses on another node.\n", live[i].id,
+                    server->numa_node, server->numa_accesses,
+                    sampled ? 100.0 * remote / sampled : 0.0, sampled);
+        }
+    }
+
+    topology_t *t = main->topology;
+    for (int z = 0; t != NULL && z < t->n_zones; ++z) {
+        unsigned long keys = 0;
+        for (int i = 0; i < t->zones[z].n; ++i)
+            keys += ht_get_size(get_server(main, t->zones[z].ids[i])->hashtable);
+
+        fprintf(out, "Zone %s: %d servers, %lu keys%s.\n", t->zones[z].name,
+                t->zones[z].n, keys, z == t->local_zone ? ", local" : "");
+    }
+
+    rebalance_status status;
+    if (rebalance_get_status(main, &status))
+        fprintf(out, "Rebalancing: %d servers, %lu/%lu buckets, %lu moved, "
+                "about %lu ms left.\n", status.sources, status.buckets_done,
+                status.buckets_total, status.moved, status.eta_ms);
+    snapshot_print_stats(main, out);
+
+    free(live);
+}
+
+int loader_has_server(load_balancer* main, int server_id) {
+    return get_server(main, server_id) != NULL;
+}
+
+unsigned int loader_server_weight(load_balancer* main, int server_id) {
+    if (main->rendezvous == NULL || !loader_has_server(main, server_id))
+        return 1;
+    return main->rendezvous->weights[server_position(main, server_id)];
+}
+
+int loader_server_location(load_balancer* main, int server_id,
+                           const char** zone, const char** rack) {
+    int i;
+    int z = main->topology ? topology_locate(main->topology, server_id, &i)
+                           : -1;
+
+    if (z < 0) {
+        *zone = *rack = "";
+        return 0;
+    }
+    *zone = main->topology->zones[z].name;
+    *rack = main->topology->zones[z].racks[i];
+    return 1;
+}
+
+void loader_attach_wal(load_balancer* main, wal_t* wal) {
+    main->wal = wal;
+}
+
+void loader_attach_shm(load_balancer* main, shm_store_t* shm) {
+    server_dir_t *dir = main->servers;
+
+    main->shm = shm;
+    shm_write_begin(shm);
+    for (int i = 0; i < dir->n_slots; ++i)
+        if (dir->slots[i].server != NULL)
+            server_attach_shm(dir->slots[i].server, shm);
+    membership_end(main);
 }
 
 void free_load_balancer(load_balancer* main) {
-    for (int i = 0; i < main->max_server_id; ++i)
-        free_server_memory(main->servers[i]);
-    free(main->servers);
+    // A running snapshot is collected first, so a failure gets reported
+    snapshot_poll(main, SNAPSHOT_WAIT);
+    snapshot_job_free(main->snapshot);
+    wal_close(main->wal);
+
+    server_dir_free(main->servers);
+    timer_wheel_free(main->expiry);
+    free(main->batch_scratch);
+    rebalance_free(main->rebalance);
+    rendezvous_free(main->rendezvous);
+    topology_free(main->topology);
+    shm_close(main->shm);
 
     free(main->hashring);
     free(main);
@@ -1,14 +1,49 @@
 #ifndef LOAD_BALANCER_H_
 #define LOAD_BALANCER_H_
 
+#include "range_transfer.h"
+#include "rebalance.h"
+#include "rendezvous.h"
 #include "server.h"
+#include "server_dir.h"
+#include "shm_store.h"
+#include "topology.h"
+#include "timer_wheel.h"
+#include "wal.h"
 #include "utils.h"
 
 typedef unsigned int u_int;
 
+// Maximum number of servers an object can be replicated on
+#define MAX_REPLICATION 16
+
 struct load_balancer;
 typedef struct load_balancer load_balancer;
 
+struct snapshot_job;
+
+// How objects are assigned to servers
+enum placement {
+    // Consistent hashing: the first server clockwise on the hashring
+    PLACEMENT_RING,
+    // Rendezvous hashing: the server with the best score for the object
+    PLACEMENT_RENDEZVOUS,
+    // Rendezvous hashing with a weight per server
+    PLACEMENT_WEIGHTED_RENDEZVOUS,
+    // Multi-probe consistent hashing: one point per server, the key is
+    // hashed several times and goes to the point closest to a probe
+    PLACEMENT_MULTI_PROBE,
+    // Hierarchical: a zone by rendezvous hashing, then a server in it
+    PLACEMENT_ZONES
+};
+
+// Zone of the servers added without one, with zone placement
+#define DEFAULT_ZONE "default"
+
+// Probes of every key with multi-probe placement (about 5% over the mean
+// load for the busiest server)
+#define MULTI_PROBES 21
+
 struct hashring_t;
 typedef struct hashring_t hashring_t;
 
@@ -18,28 +53,83 @@ struct hashring_t {
     u_int hash;
     // ID of the server (the three replicas will have the same ID)
     int id;
+    // Slot of the server in the server directory
+    int slot;
 };
 
 struct load_balancer {
-    // Array of pointers to elements of type server_memory
-    // On i-th position, we have a pointer to the memory of the server with ID = i
-    server_memory **servers;
+    // Maps the ID of every live server to its memory
+    server_dir_t *servers;
     // Array of hashring_t type elements (the hashring)
     hashring_t *hashring;
-    // Maximum server ID
-    int max_server_id;
     // Length of the hashring
     int hashring_len;
     // Maximum length of the hashring
     int max_hr_len;
+    // Write-ahead log of stores and membership changes (NULL if disabled)
+    wal_t *wal;
+    // Number of distinct servers every object is stored on
+    int replicas;
+    // State of the generator used to pick the replica serving a read
+    u_int rng_state;
+    // False positive target of the per-server filters (0 if disabled)
+    double filter_fp;
+    // Memory budget of every server in bytes (0 if unlimited)
+    unsigned long server_budget;
+    // Values of at least this many bytes are compressed (0 if disabled)
+    unsigned int compress_threshold;
+    // NUMA node new servers are placed on (-1 if they aren't placed)
+    int numa_node;
+    // Keys with an expiry time, by the time they have to be checked
+    timer_wheel_t *expiry;
+    // Time (ms) as of the last operation, seen by the servers
+    unsigned long now;
+    // Source of the time, in ms
+    unsigned long (*clock)(void);
+    // Chunked values returned by the last loader_retrieve_batch, flattened
+    char *batch_scratch;
+    unsigned long batch_scratch_size;
+    // Objects still moving to their owners after membership changes
+    rebalance_t *rebalance;
+    // Number of points (replicas) every server has on the hashring
+    int vnodes;
+    // Scores of the servers with rendezvous placement (NULL on the ring);
+    // the hashring then has one point per server, sorted by ID
+    rendezvous_t *rendezvous;
+    // Hashes of every key with multi-probe placement (0 on the ring)
+    int probes;
+    // Zones and racks of the servers with zone placement (NULL otherwise);
+    // the hashring then has one point per server, sorted by ID
+    topology_t *topology;
+    // Shared memory copy of the servers for reader processes (NULL if none)
+    shm_store_t *shm;
+    // Arc of the ring being streamed to another load balancer (NULL if none)
+    range_export_t *exporter;
+    // Background snapshots (NULL until the first one)
+    struct snapshot_job *snapshot;
 };
 
+unsigned int hash_function_servers(void *a);
+
 unsigned int hash_function_key(void *a);
 
 load_balancer* init_load_balancer();
 
 void free_load_balancer(load_balancer* main);
 
+/**
+ * init_load_balancer_with_servers() - Creates a load balancer with servers.
+ * @arg1: IDs of the servers.
+ * @arg2: Number of servers.
+ * @arg3: Number of points every server has on the hashring
+ *        (0 for the default of 3).
+ *
+ * The hashring is built at once, sorting all the points, instead of
+ * inserting them one by one.
+ */
+load_balancer* init_load_balancer_with_servers(int* server_ids, int n,
+                                               int vnodes);
+
 /**
  * load_store() - Stores the key-value pair inside the system.
  * @arg1: Load balancer which distributes the work.
@@ -54,6 +144,121 @@ void free_load_balancer(load_balancer* main);
  */
 void loader_store(load_balancer* main, char* key, char* value, int* server_id);
 
+/**
+ * loader_store_batch() - Stores many key-value pairs.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Keys represented as strings.
+ * @arg3: Values represented as strings (values[i] belongs to keys[i]).
+ * @arg4: Number of pairs.
+ * @arg5: This function will RETURN via this parameter the server ID
+ *        which stores every object (server_ids[i] for keys[i]), -1 if
+ *        there are no servers.
+ *
+ * Same as n calls of loader_store; when a key appears more than once,
+ * the last value wins.
+ */
+void loader_store_batch(load_balancer* main, char** keys, char** values,
+                        unsigned int n, int* server_ids);
+
+/**
+ * loader_retrieve_batch() - Gets the values of many keys.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Keys represented as strings.
+ * @arg3: Number of keys.
+ * @arg4: This function will RETURN via this parameter the value of
+ *        every key (NULL if the key does not exist).
+ * @arg5: This function will RETURN via this parameter the server ID
+ *        of every key.
+ *
+ * The owners of all the keys are found in a single walk of the ring and
+ * the hashtable lookups are interleaved, so their cache misses overlap.
+ * The values are valid until the next operation on the load balancer.
+ */
+void loader_retrieve_batch(load_balancer* main, char** keys, unsigned int n,
+                           char** values, int* server_ids);
+
+/**
+ * loader_store_ttl() - Stores a key-value pair which expires.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Key represented as a string.
+ * @arg3: Value represented as a string.
+ * @arg4: Time to live in ms.
+ * @arg5: This function will RETURN via this parameter
+ *        the server ID which stores the object.
+ *
+ * Once expired the object is invisible to retrieves and is not moved when
+ * servers join or leave; its memory is reclaimed a few keys per operation.
+ */
+void loader_store_ttl(load_balancer* main, char* key, char* value,
+                      unsigned long ttl_ms, int* server_id);
+
+/**
+ * loader_expire_at() - Sets the time when a stored key expires.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Key represented as a string.
+ * @arg3: Expiry time in ms (on the clock of the load balancer),
+ *        0 to make the key permanent again.
+ *
+ * Storing the key again also makes it permanent.
+ *
+ * Return: 1 if the key exists, 0 otherwise.
+ */
+int loader_expire_at(load_balancer* main, char* key, unsigned long expires_at);
+
+/**
+ * loader_set_clock() - Replaces the clock used for expiry.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Function returning the current time in ms (wall clock by default).
+ *
+ * Must be called before the first expiry time is set.
+ */
+void loader_set_clock(load_balancer* main, unsigned long (*clock)(void));
+
+typedef struct loader_stream loader_stream;
+
+// A store whose value is handed over in pieces
+struct loader_stream {
+    load_balancer *main;
+    char *key;
+    value_builder value;
+};
+
+/**
+ * loader_store_begin() - Starts storing a value which arrives in pieces.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Key represented as a string.
+ *
+ * Return: Handle passed to loader_store_append and loader_store_end.
+ */
+loader_stream* loader_store_begin(load_balancer* main, char* key);
+
+/**
+ * loader_store_append() - Appends a piece of the value.
+ * @arg1: Handle returned by loader_store_begin.
+ * @arg2: The bytes of the piece.
+ * @arg3: Number of bytes.
+ */
+void loader_store_append(loader_stream* stream, const char* data,
+                         unsigned long len);
+
+/**
+ * loader_store_end() - Stores the value and frees the handle.
+ * @arg1: Handle returned by loader_store_begin.
+ * @arg2: This function will RETURN via this parameter
+ *        the server ID which stores the object.
+ *
+ * A big value is kept as the chain of chunks it was built in, it is never
+ * copied into a single buffer. Values up to VALUE_CHUNK_SIZE bytes are
+ * stored contiguously, like the ones given to loader_store.
+ */
+void loader_store_end(loader_stream* stream, int* server_id);
+
+/**
+ * loader_store_cancel() - Drops a value which was not completely received.
+ * @arg1: Handle returned by loader_store_begin (freed by the call).
+ */
+void loader_store_cancel(loader_stream* stream);
+
 /**
  * load_retrieve() - Gets a value associated with the key.
  * @arg1: Load balancer which distributes the work.
@@ -67,6 +272,22 @@ void loader_store(load_balancer* main, char* key, char* value, int* server_id);
  */
 char* loader_retrieve(load_balancer* main, char* key, int* server_id);
 
+/**
+ * loader_retrieve_stream() - Gets a value piece by piece.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Key represented as a string.
+ * @arg3: This function will RETURN the server ID
+ *        which stores the value via this parameter.
+ * @arg4: Function called with every piece of the value, in order.
+ * @arg5: Argument passed to the function.
+ *
+ * Return: 1 if the key exists, 0 otherwise.
+ */
+int loader_retrieve_stream(load_balancer* main, char* key, int* server_id,
+                           int (*sink)(void *ctx, const char *data,
+                                       unsigned int len),
+                           void* ctx);
+
 /**
  * load_add_server() - Adds a new server to the system.
  * @arg1: Load balancer which distributes the work.
@@ -78,6 +299,44 @@ char* loader_retrieve(load_balancer* main, char* key, int* server_id);
  */
 void loader_add_server(load_balancer* main, int server_id);
 
+/**
+ * loader_add_server_weighted() - Adds a server with a weight.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: ID of the new server.
+ * @arg3: Share of the objects the server gets, relative to the others.
+ *
+ * Weights need PLACEMENT_WEIGHTED_RENDEZVOUS; the other placements treat
+ * every server as having weight 1.
+ */
+void loader_add_server_weighted(load_balancer* main, int server_id,
+                                unsigned int weight);
+
+/**
+ * loader_add_server_at() - Adds a server in a failure domain.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: ID of the new server.
+ * @arg3: Zone of the server.
+ * @arg4: Rack of the server in its zone.
+ *
+ * Needs PLACEMENT_ZONES; the other placements ignore the labels. Only
+ * servers of the same zone give objects to the new one, unless the zone
+ * is new. Copies of an object go to distinct zones first, then to
+ * distinct racks.
+ */
+void loader_add_server_at(load_balancer* main, int server_id,
+                          const char* zone, const char* rack);
+
+/**
+ * loader_add_servers() - Adds many servers to the system.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: IDs of the new servers.
+ * @arg3: Number of servers.
+ *
+ * Same as n calls of loader_add_server. When there are no servers yet,
+ * no object has to move and the hashring is built in a single sort.
+ */
+void loader_add_servers(load_balancer* main, int* server_ids, int n);
+
 /**
  * load_remove_server() - Removes a specific server from the system.
  * @arg1: Load balancer which distributes the work.
@@ -88,4 +347,199 @@ void loader_add_server(load_balancer* main, int server_id);
  */
 void loader_remove_server(load_balancer* main, int server_id);
 
+/**
+ * loader_set_replication() - Sets the number of copies of every object.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Replication factor (between 1 and MAX_REPLICATION).
+ *
+ * Objects are written to the next R distinct servers clockwise on the
+ * hash ring and read from one of them. Must be called before the first
+ * server is added.
+ */
+void loader_set_replication(load_balancer* main, int replicas);
+
+/**
+ * loader_set_placement() - Chooses how objects are assigned to servers.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: PLACEMENT_RING (default), PLACEMENT_RENDEZVOUS,
+ *        PLACEMENT_WEIGHTED_RENDEZVOUS, PLACEMENT_MULTI_PROBE or
+ *        PLACEMENT_ZONES.
+ *
+ * Rendezvous hashing scores every server for every key (8 servers per
+ * vector instruction), so it is meant for small clusters. Multi-probe
+ * hashing keeps a single ring point per server and pays with
+ * MULTI_PROBES binary searches per key. With both, removing a server
+ * only moves its own objects, but a new server may take objects from any
+ * other one. Zone placement scores the zones, then the servers of one
+ * zone, so membership changes only move objects inside the zone (see
+ * loader_add_server_at). Must be called before the first server is added.
+ */
+void loader_set_placement(load_balancer* main, enum placement placement);
+
+/**
+ * loader_set_local_zone() - Sets the zone this load balancer runs in.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Name of the zone, NULL for none.
+ *
+ * With replication, reads then go to the copy in this zone when there is
+ * one, instead of the less loaded of two random copies. Needs
+ * PLACEMENT_ZONES.
+ */
+void loader_set_local_zone(load_balancer* main, const char* zone);
+
+/**
+ * loader_set_probes() - Sets the probes of multi-probe placement.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Hashes of every key (at least 1, MULTI_PROBES by default).
+ *
+ * More probes spread the keys more evenly and make lookups slower. Only
+ * valid with PLACEMENT_MULTI_PROBE, before the first server is added.
+ */
+void loader_set_probes(load_balancer* main, int probes);
+
+/**
+ * loader_set_filter() - Enables per-server membership filters.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Target false positive rate (0 disables filters for new servers).
+ *
+ * Misses are then mostly answered without walking a hash chain.
+ */
+void loader_set_filter(load_balancer* main, double fp_rate);
+
+/**
+ * loader_set_memory_budget() - Caps the memory used by every server.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Budget of each server in bytes (0 removes the limit).
+ *
+ * Servers over budget evict objects (CLOCK policy); retrieving an
+ * evicted key is a miss.
+ */
+void loader_set_memory_budget(load_balancer* main, unsigned long budget);
+
+/**
+ * loader_set_compression() - Compresses the large values of every server.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Values of at least this many bytes (and up to the chunk size)
+ *        are compressed, 0 disables it.
+ *
+ * Reads return the values as they were stored. Budgets count the
+ * compressed bytes; objects moved between servers are not recompressed.
+ */
+void loader_set_compression(load_balancer* main, unsigned int threshold);
+
+/**
+ * loader_set_numa_node() - Keeps the load balancer on one NUMA node.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: The node.
+ *
+ * Pins the calling thread (and the threads it creates afterwards) to the
+ * CPUs of the node and prefers its memory, then places every server on it
+ * (see server_set_node(): only the buckets are bound, objects follow the
+ * preference when they are allocated). Statistics sample the pages of
+ * every server and report the share found on another node. Does nothing
+ * but the accounting on machines with a single node.
+ * Return: 0 on success, -1 if the node doesn't exist.
+ */
+int loader_set_numa_node(load_balancer* main, int node);
+
+/**
+ * loader_set_server_node() - Places one server on a NUMA node.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: ID of the server.
+ * @arg3: The node.
+ *
+ * For servers meant to be served by threads of another node. Stores on
+ * the server prefer its node and give the thread its own preference back
+ * afterwards.
+ */
+void loader_set_server_node(load_balancer* main, int server_id, int node);
+
+/**
+ * loader_set_rebalance_step() - Makes membership changes incremental.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Buckets of the affected servers scanned by every operation
+ *        (0 moves all the objects before the change returns).
+ *
+ * The ring changes at once and the objects follow a few buckets per
+ * operation. Until an object is moved, reads which miss on its new owner
+ * are answered by the server which still holds it, and stores go to the
+ * new owner. Only used without replication: with R > 1 the replica sets
+ * are always repaired before the change returns.
+ */
+void loader_set_rebalance_step(load_balancer* main, unsigned int buckets);
+
+/**
+ * loader_rebalance_status() - Reports the progress of the rebalancing.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: This function will RETURN via this parameter the progress.
+ *
+ * Return: 1 if objects are still being moved, 0 otherwise.
+ */
+int loader_rebalance_status(load_balancer* main, rebalance_status* status);
+
+/**
+ * loader_rebalance_finish() - Moves all the objects which are still due.
+ * @arg1: Load balancer which distributes the work.
+ */
+void loader_rebalance_finish(load_balancer* main);
+
+/**
+ * loader_print_stats() - Prints per-server statistics.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Where the statistics are written.
+ */
+void loader_print_stats(load_balancer* main, FILE* out);
+
+/**
+ * loader_has_server() - Checks if a server is part of the system.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: ID of the server.
+ *
+ * Return: 1 if the server is on the hash ring, 0 otherwise.
+ */
+int loader_has_server(load_balancer* main, int server_id);
+
+/**
+ * loader_server_weight() - Gets the weight of a server.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: ID of the server.
+ *
+ * Return: the weight the server was added with, 1 without weights.
+ */
+unsigned int loader_server_weight(load_balancer* main, int server_id);
+
+/**
+ * loader_server_location() - Gets the zone and rack of a server.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: ID of the server.
+ * @arg3: This function will RETURN the zone via this parameter.
+ * @arg4: This function will RETURN the rack via this parameter.
+ *
+ * Return: 1 if the server has a location (zone placement), 0 otherwise.
+ */
+int loader_server_location(load_balancer* main, int server_id,
+                           const char** zone, const char** rack);
+
+/**
+ * loader_attach_wal() - Starts logging every operation to a write-ahead log.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Opened log (owned by the load balancer from now on).
+ *
+ * The log should be attached after recovery, so replayed operations
+ * are not logged a second time.
+ */
+void loader_attach_wal(load_balancer* main, wal_t* wal);
+
+/**
+ * loader_attach_shm() - Mirrors the system to a shared memory segment.
+ * @arg1: Load balancer which distributes the work.
+ * @arg2: Segment from shm_create (owned by the load balancer from now on).
+ *
+ * The hashring and the objects of every server are copied, and every
+ * later change is applied to the copy, so other processes can serve
+ * reads with shm_retrieve without asking this one. Objects waiting for
+ * an incremental rebalance step are not visible there until they move.
+ */
+void loader_attach_shm(load_balancer* main, shm_store_t* shm);
+
 #endif  // LOAD_BALANCER_H_
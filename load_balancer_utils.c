@@ -4,6 +4,7 @@
 
 #include "load_balancer.h"
 #include "load_balancer_utils.h"
+#include "trace.h"
 #include "utils.h"
 
 /**
@@ -15,18 +16,7 @@
  */
 void insert_server(load_balancer *main, int server_id, int pos, u_int hash)
 {
-    // Increase hashring size and resize if necessary
-    main->hashring_len++;
-    if (main->hashring_len > main->max_hr_len)
-        resize_hashring(main);
-
-    // Shift hashring with 1 position to the right
-    for (int i = main->hashring_len - 1; i > pos; --i)
-        main->hashring[i] = main->hashring[i - 1];
-
-    // Put server data on that position
-    main->hashring[pos].hash = hash;
-    main->hashring[pos].id = server_id;
+    insert_ring_point(main, server_id, pos, hash);
 
     // Redistribute objects stored on the server after the one just added
     int next_pos = pos + 1;
@@ -57,6 +47,40 @@ void remove_server(load_balancer *main, int server_id, int pos)
     if (server_id != next_server_id)
         remap_objects_remove(main, prev_pos, next_pos, main->hashring[pos]);
 
+    remove_ring_point(main, pos);
+}
+
+/**
+ * Inserts a server (a replica) in the hashring without moving any object
+ * @param main the load balancer
+ * @param server_id ID of the server
+ * @param pos position in the hashring where the point is inserted
+ * @param hash the hash of the point
+ */
+void insert_ring_point(load_balancer *main, int server_id, int pos, u_int hash)
+{
+    // Increase hashring size and resize if necessary
+    main->hashring_len++;
+    if (main->hashring_len > main->max_hr_len)
+        resize_hashring(main);
+
+    // Shift hashring with 1 position to the right
+    for (int i = main->hashring_len - 1; i > pos; --i)
+        main->hashring[i] = main->hashring[i - 1];
+
+    // Put server data on that position
+    main->hashring[pos].hash = hash;
+    main->hashring[pos].id = server_id;
+    main->hashring[pos].slot = server_dir_find(main->servers, server_id);
+}
+
+/**
+ * Removes a point from the hashring without moving any object
+ * @param main the load balancer
+ * @param pos position of the point
+ */
+void remove_ring_point(load_balancer *main, int pos)
+{
     for (int i = pos; i < main->hashring_len - 1; ++i)
         main->hashring[i] = main->hashring[i + 1];
     if (main->hashring_len > 0)
@@ -65,6 +89,249 @@ void remove_server(load_balancer *main, int server_id, int pos)
         fprintf(stderr, "there are no servers left to be removed\n");
 }
 
+static int contains_id(int *ids, int n, int id)
+{
+    for (int i = 0; i < n; ++i)
+        if (ids[i] == id)
+            return 1;
+    return 0;
+}
+
+/*
+ * Position of the first point clockwise from a hash: the smallest hash
+ * greater or equal, or the first point past the end of the ring
+ */
+static int ring_successor(load_balancer *main, u_int object_hash)
+{
+    int hashring_len = main->hashring_len;
+    int left = 0, right = hashring_len, pos = -1;
+
+    // Special case
+    if (object_hash < main->hashring[0].hash)
+        return 0;
+
+    // If the object's hash is greater than the one of the last server on the hashring,
+    // then it will be stored in the server from the first position of the hashring
+    if (object_hash > main->hashring[hashring_len - 1].hash)
+        return 0;
+
+    // The binary search finds the server whith the smallest hash greater than the hash of the object
+    while (left <= right) {
+        int mid = (left + right) / 2;
+        if (main->hashring[mid].hash < object_hash) {
+            left = mid + 1;
+        } else if (main->hashring[mid].hash >= object_hash) {
+                pos = mid;
+                right = mid - 1;
+        }
+    }
+
+    return pos;
+}
+
+/*
+ * Hash of the probe-th probe of an object (murmur3 finalizer of the hash
+ * plus a different odd step for every probe)
+ */
+static u_int probe_hash(u_int object_hash, int probe)
+{
+    u_int h = object_hash + (u_int)probe * 0x9e3779b9u;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * With multi-probe placement, position of the server of an object: every
+ * probe hash finds the first point clockwise, and the point closest to its
+ * probe wins. Returns -1 if exclude_id is the only server.
+ */
+static int multi_probe_pos(load_balancer *main, u_int object_hash,
+                           int exclude_id)
+{
+    int best = -1;
+    u_int best_distance = 0;
+
+    for (int i = 0; i < main->probes; ++i) {
+        u_int probe = probe_hash(object_hash, i);
+
+        // Same answer as ring_successor, but the probes land anywhere, so
+        // the halving uses conditional moves instead of branches
+        int pos = 0, len = main->hashring_len;
+        while (len > 1) {
+            int half = len / 2;
+            pos = main->hashring[pos + half - 1].hash < probe ? pos + half
+                                                              : pos;
+            len -= half;
+        }
+        pos += main->hashring[pos].hash < probe;
+        if (pos == main->hashring_len)
+            pos = 0;
+
+        // Servers have a single point, the one after is another server
+        if (main->hashring[pos].id == exclude_id) {
+            if (main->hashring_len == 1)
+                return -1;
+            pos = (pos + 1) % main->hashring_len;
+        }
+
+        // Distances wrap around like the ring
+        u_int distance = main->hashring[pos].hash - probe;
+        int closer = best < 0 || distance < best_distance;
+        best = closer ? pos : best;
+        best_distance = closer ? distance : best_distance;
+    }
+
+    return best;
+}
+
+/**
+ * Same as get_replicas with rendezvous placement: the servers with the
+ * best ranks, best first
+ */
+static int get_replicas_rendezvous(load_balancer *main, u_int object_hash,
+                                   int exclude_id, int *ids)
+{
+    rendezvous_t *r = main->rendezvous;
+    unsigned int small[4 * HRW_LANES];
+    unsigned int *ranks = small;
+    if (r->cap > 4 * HRW_LANES) {
+        ranks = (unsigned int *)malloc(r->cap * sizeof(int));
+        DIE(!ranks, "replicas malloc failed");
+    }
+    rendezvous_ranks(r, object_hash, ranks);
+
+    // The sets are small, every pick is a scan for the next best
+    int n = 0;
+    while (n < main->replicas) {
+        int best = -1;
+
+        for (int i = 0; i < r->n; ++i) {
+            int id = main->hashring[i].id;
+            if (id == exclude_id || contains_id(ids, n, id))
+                continue;
+            if (best < 0 || ranks[i] > ranks[best])
+                best = i;
+        }
+        if (best < 0)
+            break;
+        ids[n++] = main->hashring[best].id;
+    }
+
+    if (ranks != small)
+        free(ranks);
+    return n;
+}
+
+/**
+ * Fills ids with the replica set of an object: the first main->replicas
+ * distinct servers met walking the hashring clockwise from the object
+ * (from its closest point with multi-probe placement, the ones with the
+ * best ranks with rendezvous placement, one per zone first with zone
+ * placement).
+ * Returns the size of the set (smaller if there are not enough servers).
+ * @param main the load balancer
+ * @param object_hash the hash of the object
+ * @param exclude_id server which is ignored (-1 to ignore nothing), used
+ *                   to compute the set as if that server was not on the ring
+ * @param ids array of at least main->replicas elements
+ */
+int get_replicas(load_balancer *main, u_int object_hash, int exclude_id,
+                 int *ids)
+{
+    if (main->rendezvous)
+        return get_replicas_rendezvous(main, object_hash, exclude_id, ids);
+    if (main->topology)
+        return topology_replicas(main->topology, object_hash, exclude_id, ids,
+                                 main->replicas);
+
+    int n = 0;
+    int pos = main->probes ? multi_probe_pos(main, object_hash, exclude_id)
+                           : binary_search_object_pos(main, object_hash);
+    if (pos < 0)
+        return 0;
+
+    for (int step = 0; step < main->hashring_len && n < main->replicas;
+         ++step) {
+        int id = main->hashring[(pos + step) % main->hashring_len].id;
+        int duplicate = (id == exclude_id);
+
+        for (int i = 0; i < n && !duplicate; ++i)
+            if (ids[i] == id)
+                duplicate = 1;
+        if (!duplicate)
+            ids[n++] = id;
+    }
+
+    return n;
+}
+
+/**
+ * Repairs the replica sets of the objects stored on a server after another
+ * server joined or left the ring. Only the objects whose replica set changed
+ * are touched: they are copied to the servers that joined their set and
+ * removed from the servers that left it.
+ * @param main the load balancer
+ * @param holder_id server whose objects are checked
+ * @param changed_id server which is added or removed
+ * @param added 1 if changed_id joined the ring, 0 if it is leaving it
+ *              (in that case it must still be on the ring)
+ */
+void repair_replicas(load_balancer *main, int holder_id, int changed_id,
+                     int added)
+{
+    int with[MAX_REPLICATION], without[MAX_REPLICATION];
+    hashtable_t *ht = get_server(main, holder_id)->hashtable;
+
+    for (u_int i = 0; i < ht->hmax; ++i) {
+        ll_node_t *it = ht_bucket_head(ht, i);
+
+        while (it != NULL) {
+            ll_node_t *next = it->next;
+            struct info *obj = (struct info *)it->data;
+            u_int obj_hash = hash_function_key(obj->key);
+
+            int n_with = get_replicas(main, obj_hash, -1, with);
+            int n_without = get_replicas(main, obj_hash, changed_id, without);
+            int *old_set = added ? without : with;
+            int *new_set = added ? with : without;
+            int n_old = added ? n_without : n_with;
+            int n_new = added ? n_with : n_without;
+
+            // Expired objects are reclaimed from their old set, not copied
+            if (server_expired(get_server(main, holder_id), obj)) {
+                for (int r = 0; r < n_old; ++r)
+                    if (old_set[r] != holder_id)
+                        server_reap(get_server(main, old_set[r]), obj->key, 0);
+                server_reap(get_server(main, holder_id), obj->key, 0);
+                it = next;
+                continue;
+            }
+
+            for (int r = 0; r < n_new; ++r)
+                if (new_set[r] != holder_id
+                    && !contains_id(old_set, n_old, new_set[r]))
+                    server_store_object(get_server(main, new_set[r]), obj);
+
+            // The holder itself is handled last, obj still points into it
+            for (int r = 0; r < n_old; ++r)
+                if (old_set[r] != holder_id
+                    && !contains_id(new_set, n_new, old_set[r]))
+                    server_remove(get_server(main, old_set[r]), obj->key);
+            if (!contains_id(new_set, n_new, holder_id))
+                server_remove(get_server(main, holder_id), obj->key);
+
+            it = next;
+        }
+    }
+
+    server_compact(get_server(main, holder_id));
+}
+
 /**
  * Remaps the objects on the servers in case a new server is added
  * @param main the load balancer we are working on
@@ -72,21 +339,21 @@ void remove_server(load_balancer *main, int server_id, int pos)
  */
 void remap_objects_insert(load_balancer *main, int next_pos)
 {
-    int next_id = 0;
-
     // Get the ID of the server situated after the one we want to remove
     // Because of the circular structure, the server after the last one is the one
     // on position 0
     if (next_pos == main->hashring_len)
-        next_id = main->hashring[0].id;
-    else
-        next_id = main->hashring[next_pos].id;
+        next_pos = 0;
+    int next_id = main->hashring[next_pos].id;
+    server_memory *next_server = ring_server(main, next_pos);
+    unsigned long start = trace_begin();
+    unsigned int moved = 0;
 
-    hashtable_t *old_ht = main->servers[next_id]->hashtable;
+    hashtable_t *old_ht = next_server->hashtable;
 
     // Remap (if we have to) every object from the server after the newly added one
     for (u_int i = 0; i < old_ht->hmax; ++i) {
-        ll_node_t *it = old_ht->buckets[i]->head;
+        ll_node_t *it = ht_bucket_head(old_ht, i);
 
         // Iterate through the buckets
         while (it != NULL) {
@@ -94,17 +361,28 @@ void remap_objects_insert(load_balancer *main, int next_pos)
             struct info *obj = (struct info *)it->data;
             u_int obj_hash = hash_function_key(obj->key);
 
+            // Expired objects are reclaimed instead of being moved
+            if (server_expired(next_server, obj)) {
+                server_reap(next_server, obj->key, 0);
+                it = next;
+                continue;
+            }
+
             // We search on what server the current object should be stored
-            int new_id = binary_search_object(main, obj_hash);
+            int new_pos = binary_search_object_pos(main, obj_hash);
 
-            if (new_id != next_id) {
-                server_store(main->servers[new_id], obj->key, obj->value);
-                server_remove(main->servers[next_id], obj->key);
+            if (main->hashring[new_pos].id != next_id) {
+                server_store_object(ring_server(main, new_pos), obj);
+                server_remove(next_server, obj->key);
+                moved++;
             }
 
             it = next;
         }
     }
+
+    server_compact(next_server);
+    trace_end(start, TRACE_REMAP_INSERT, next_id, 0, 0, moved);
 }
 
 /**
@@ -119,8 +397,7 @@ void remap_objects_remove(load_balancer *main, int prev_pos, int next_pos,
 {
     u_int prev_hash = 0;
     u_int curr_hash = old_server.hash;
-    int curr_id = old_server.id;
-    int next_id = 0;
+    server_memory *curr_server = main->servers->slots[old_server.slot].server;
 
     // Find out the hash of the server before the removed one
     if (prev_pos == -1)
@@ -128,16 +405,17 @@ void remap_objects_remove(load_balancer *main, int prev_pos, int next_pos,
     else
         prev_hash = main->hashring[prev_pos].hash;
 
-    // Find out the ID of the server after the removed one
+    // Find out the server after the removed one
     if (next_pos == main->hashring_len)
-        next_id = main->hashring[0].id;
-    else
-        next_id = main->hashring[next_pos].id;
+        next_pos = 0;
+    server_memory *next_server = ring_server(main, next_pos);
+    unsigned long start = trace_begin();
+    unsigned int moved = 0;
 
-    hashtable_t *old_ht = main->servers[curr_id]->hashtable;
+    hashtable_t *old_ht = curr_server->hashtable;
 
     for (u_int i = 0; i < old_ht->hmax; ++i) {
-        ll_node_t *it = old_ht->buckets[i]->head;
+        ll_node_t *it = ht_bucket_head(old_ht, i);
 
         // Iterate the objects stored on the removed server.
         // Remap only the objects stored on the removed server, so the ones which satify
@@ -148,13 +426,53 @@ void remap_objects_remove(load_balancer *main, int prev_pos, int next_pos,
             struct info *obj = (struct info *)it->data;
             u_int obj_hash = hash_function_key(obj->key);
 
-            if (obj_hash > prev_hash && obj_hash <= curr_hash) {
-                server_store(main->servers[next_id], obj->key, obj->value);
-                server_remove(main->servers[curr_id], obj->key);
+            if (server_expired(curr_server, obj)) {
+                // Expired objects are reclaimed instead of being moved
+                server_reap(curr_server, obj->key, 0);
+            } else if (obj_hash > prev_hash && obj_hash <= curr_hash) {
+                server_store_object(next_server, obj);
+                server_remove(curr_server, obj->key);
+                moved++;
             }
             it = next;
         }
     }
+    trace_end(start, TRACE_REMAP_REMOVE, old_server.id, 0, 0, moved);
+}
+
+/**
+ * Moves every object of a server which is no longer on the hashring to
+ * the server it belongs to now
+ * @param main the load balancer
+ * @param old_server memory of the server, not on the hashring
+ */
+void remap_objects_drain(load_balancer *main, server_memory *old_server)
+{
+    hashtable_t *old_ht = old_server->hashtable;
+    unsigned long start = trace_begin();
+    unsigned int moved = 0;
+
+    for (u_int i = 0; i < old_ht->hmax; ++i) {
+        ll_node_t *it = ht_bucket_head(old_ht, i);
+
+        while (it != NULL) {
+            ll_node_t *next = it->next;
+            struct info *obj = (struct info *)it->data;
+
+            // Expired objects are reclaimed instead of being moved
+            if (server_expired(old_server, obj)) {
+                server_reap(old_server, obj->key, 0);
+            } else {
+                int pos = binary_search_object_pos(main,
+                                                   hash_function_key(obj->key));
+                server_store_object(ring_server(main, pos), obj);
+                server_remove(old_server, obj->key);
+                moved++;
+            }
+            it = next;
+        }
+    }
+    trace_end(start, TRACE_REMAP_DRAIN, old_server->id, 0, 0, moved);
 }
 
 /**
@@ -173,21 +491,51 @@ void resize_hashring(load_balancer *main)
 }
 
 /**
- * Resize the server array
- * @param main the load balancer whose server array will be resized
+ * Finds the server whose copy of a key is the one to read: the first of its
+ * replica set holding a live copy (each replica evicts on its own budget),
+ * or else the source still holding it until a rebalance moves it
+ * Returns the server, or NULL if no live copy is left
+ * @param main the load balancer
+ * @param key the key
  */
-void resize_server_array(load_balancer *main)
+server_memory *object_holder(load_balancer *main, char *key)
 {
-    int max_server_id = main->max_server_id;
+    int ids[MAX_REPLICATION];
+    int n = get_replicas(main, hash_function_key(key), -1, ids);
+
+    for (int i = 0; i < n; ++i) {
+        server_memory *server = get_server(main, ids[i]);
+        struct info *obj = ht_str_get_info(server->hashtable, key);
+        if (obj != NULL && !server_expired(server, obj))
+            return server;
+    }
 
-    server_memory **new_array = realloc(main->servers,
-                                max_server_id * 2 * sizeof(server_memory *));
-    DIE(!new_array, "server array resize failed");
-    main->servers = new_array;
-    main->max_server_id = max_server_id * 2;
+    if (n == 0 || main->rebalance->n_tasks == 0)
+        return NULL;
+    migration *task = rebalance_holder(main, key, get_server(main, ids[0]));
+    return task ? task->source : NULL;
+}
+
+/**
+ * Returns the memory of a server, or NULL if there is no server with that ID
+ * @param main the load balancer
+ * @param server_id ID of the server
+ */
+server_memory *get_server(load_balancer *main, int server_id)
+{
+    int slot = server_dir_find(main->servers, server_id);
+
+    return slot < 0 ? NULL : main->servers->slots[slot].server;
+}
 
-    for (int i = max_server_id; i < max_server_id * 2; ++i)
-        main->servers[i] = NULL;
+/**
+ * Returns the memory of the server owning a point of the hashring
+ * @param main the load balancer
+ * @param pos position in the hashring
+ */
+server_memory *ring_server(load_balancer *main, int pos)
+{
+    return main->servers->slots[main->hashring[pos].slot].server;
 }
 
 /**
@@ -197,30 +545,45 @@ void resize_server_array(load_balancer *main)
  */
 int binary_search_object(load_balancer *main, u_int object_hash)
 {
-    int hashring_len = main->hashring_len;
-    int left = 0, right = hashring_len, pos = -1;
+    return main->hashring[binary_search_object_pos(main, object_hash)].id;
+}
 
-    // Special case
-    if (object_hash < main->hashring[0].hash)
-        return main->hashring[0].id;
+/**
+ * Same as binary_search_object, but returns the position in the hashring
+ * @param main the load balancer we are working on
+ * @param object_hash the hash of the object
+ */
+int binary_search_object_pos(load_balancer *main, u_int object_hash)
+{
+    if (main->rendezvous)
+        return rendezvous_owner(main->rendezvous, object_hash);
+    if (main->topology)
+        return server_position(main, topology_owner(main->topology,
+                                                    object_hash, -1));
+    if (main->probes)
+        return multi_probe_pos(main, object_hash, -1);
+
+    return ring_successor(main, object_hash);
+}
 
-    // If the object's hash is greater than the one of the last server on the hashring,
-    // then it will be stored in the server from the first position of the hashring
-    if (object_hash > main->hashring[hashring_len - 1].hash)
-        return main->hashring[0].id;
+/**
+ * With rendezvous and zone placement, position of a server on the hashring
+ * (sorted by ID), or where it has to be inserted if it is not there
+ * @param main the load balancer
+ * @param server_id ID of the server
+ */
+int server_position(load_balancer *main, int server_id)
+{
+    int left = 0, right = main->hashring_len;
 
-    // The binary search finds the server whith the smallest hash greater than the hash of the object
-    while (left <= right) {
+    while (left < right) {
         int mid = (left + right) / 2;
-        if (main->hashring[mid].hash < object_hash) {
+        if (main->hashring[mid].id < server_id)
             left = mid + 1;
-        } else if (main->hashring[mid].hash >= object_hash) {
-                pos = mid;
-                right = mid - 1;
-        }
+        else
+            right = mid;
     }
-
-    return main->hashring[pos].id;
+    return left;
 }
 
 /**
@@ -272,3 +635,48 @@ int binary_search_server(load_balancer *main, u_int server_hash, int server_id)
 
     return pos;
 }
+
+/**
+ * Sorts points of the hashring by hash, points with the same hash by ID
+ * (the order binary_search_server inserts them in). LSD radix sort on the
+ * hash, one byte per pass, so building a ring is O(n) after hashing.
+ * @param points the points
+ * @param n number of points
+ */
+void sort_ring_points(hashring_t *points, int n)
+{
+    hashring_t *tmp = (hashring_t *)malloc((n + 1) * sizeof(hashring_t));
+    DIE(!tmp, "hashring sort malloc failed");
+
+    hashring_t *from = points, *to = tmp;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count[257] = {0};
+
+        for (int i = 0; i < n; ++i)
+            count[((from[i].hash >> shift) & 0xff) + 1]++;
+        for (int b = 0; b < 256; ++b)
+            count[b + 1] += count[b];
+        for (int i = 0; i < n; ++i)
+            to[count[(from[i].hash >> shift) & 0xff]++] = from[i];
+
+        hashring_t *swap = from;
+        from = to;
+        to = swap;
+    }
+    // An even number of passes ends back in points
+
+    // Collisions are rare, a run of equal hashes is sorted by insertion
+    for (int i = 1; i < n; ++i) {
+        hashring_t point = points[i];
+        int j = i - 1;
+
+        while (j >= 0 && points[j].hash == point.hash
+               && points[j].id > point.id) {
+            points[j + 1] = points[j];
+            j--;
+        }
+        points[j + 1] = point;
+    }
+
+    free(tmp);
+}
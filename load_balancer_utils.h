@@ -11,17 +11,39 @@ void insert_server(load_balancer *main, int server_id, int pos, u_int hash);
 
 void remove_server(load_balancer *main, int server_id, int pos);
 
+void insert_ring_point(load_balancer *main, int server_id, int pos, u_int hash);
+
+void remove_ring_point(load_balancer *main, int pos);
+
+int get_replicas(load_balancer *main, u_int object_hash, int exclude_id,
+                 int *ids);
+
+void repair_replicas(load_balancer *main, int holder_id, int changed_id,
+                     int added);
+
 void remap_objects_insert(load_balancer *main, int next_pos);
 
 void remap_objects_remove(load_balancer *main, int prev_pos, int next_pos,
                           hashring_t old_server);
 
-void resize_server_array(load_balancer *main);
+void remap_objects_drain(load_balancer *main, server_memory *old_server);
+
+server_memory *object_holder(load_balancer *main, char *key);
+
+server_memory *get_server(load_balancer *main, int server_id);
+
+server_memory *ring_server(load_balancer *main, int pos);
 
 void resize_hashring(load_balancer *main);
 
+void sort_ring_points(hashring_t *points, int n);
+
 int binary_search_object(load_balancer *main, u_int object_hash);
 
+int binary_search_object_pos(load_balancer *main, u_int object_hash);
+
 int binary_search_server(load_balancer *main, u_int server_hash, int server_id);
 
+int server_position(load_balancer *main, int server_id);
+
 #endif  // LOAD_BALANCER_UTILS_H_
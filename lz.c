@@ -0,0 +1,217 @@
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Byte-oriented LZ77 in the LZ4 block format: every sequence is a token
+ * (literal count in the high nibble, match length - 4 in the low one),
+ * the extra literal count bytes, the literals, a 16 bit little endian
+ * offset and the extra match length bytes. The last sequence has only
+ * literals
+ */
+
+#define MIN_MATCH 4
+// The last bytes of the input are always literals, and no match starts
+// in the last MATCH_LIMIT bytes
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_LOG 12
+
+static unsigned int read32(const unsigned char *p)
+{
+    unsigned int v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned int hash4(unsigned int v)
+{
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/*
+ * Writes the bytes of a length past the 15 held by its nibble
+ */
+static unsigned char *write_length(unsigned char *op, unsigned int len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*
+ * Writes a sequence: the literals from anchor and a match of mlen bytes at
+ * offset (no match if mlen is 0, for the last sequence)
+ * Returns the end of the output, NULL if it does not fit
+ */
+static unsigned char *write_sequence(unsigned char *op, unsigned char *oend,
+                                     const unsigned char *anchor,
+                                     unsigned int lit, unsigned int offset,
+                                     unsigned int mlen)
+{
+    unsigned long need = 1 + lit + lit / 255 + 1
+                         + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (need > (unsigned long)(oend - op))
+        return NULL;
+
+    unsigned char *token = op++;
+    *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+        op = write_length(op, lit);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (mlen) {
+        mlen -= MIN_MATCH;
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        *token |= mlen >= 15 ? 15 : mlen;
+        if (mlen >= 15)
+            op = write_length(op, mlen);
+    }
+    return op;
+}
+
+/**
+ * Compresses a buffer. Matches are found greedily through a table of the
+ * last position of every hash of 4 bytes, and the search skips faster
+ * through data which does not match, so incompressible inputs cost little
+ * Returns the compressed size, 0 if it would be bigger than cap
+ * @param src the data, at most LZ_MAX_INPUT bytes
+ * @param len its size
+ * @param dst where the compressed form is written
+ * @param cap size of dst
+ */
+unsigned int lz_compress(const char *src, unsigned int len, char *dst,
+                         unsigned int cap)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *ip = in, *anchor = in, *end = in + len;
+    unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+    unsigned short table[1 << HASH_LOG];
+
+    if (len > LZ_MAX_INPUT)
+        return 0;
+
+    if (len > MATCH_LIMIT) {
+        const unsigned char *mflimit = end - MATCH_LIMIT;
+        const unsigned char *match_end = end - LAST_LITERALS;
+
+        memset(table, 0, sizeof(table));
+        for (ip++; ip < mflimit; ) {
+            unsigned int h = hash4(read32(ip));
+            const unsigned char *ref = in + table[h];
+            table[h] = (unsigned short)(ip - in);
+
+            if (ref >= ip || ip - ref > MAX_OFFSET
+                || read32(ref) != read32(ip)) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip + MIN_MATCH;
+            for (ref += MIN_MATCH; mp < match_end && *mp == *ref; ref++)
+                mp++;
+
+            op = write_sequence(op, oend, anchor, ip - anchor,
+                                (unsigned int)(mp - ref),
+                                (unsigned int)(mp - ip));
+            if (!op)
+                return 0;
+
+            ip = anchor = mp;
+            if (ip < mflimit)
+                table[hash4(read32(ip - 2))] = (unsigned short)(ip - 2 - in);
+        }
+    }
+
+    op = write_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - (unsigned char *)dst;
+}
+
+/*
+ * Reads the bytes of a length past the 15 held by its nibble
+ * Returns -1 if the input ends first
+ */
+static int read_length(const unsigned char **ip, const unsigned char *iend,
+                       unsigned int *len)
+{
+    unsigned char b;
+
+    do {
+        if (*ip >= iend)
+            return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/**
+ * Decompresses what lz_compress wrote. Every read and write is checked,
+ * so a corrupt input is reported, never overruns
+ * Returns 0 on success, -1 if the input is malformed or does not
+ * decompress to exactly raw_len bytes
+ * @param src the compressed data
+ * @param len its size
+ * @param dst where the data is written
+ * @param raw_len size of the decompressed data
+ */
+int lz_decompress(const char *src, unsigned int len, char *dst,
+                  unsigned int raw_len)
+{
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    unsigned char *out = (unsigned char *)dst, *op = out;
+    unsigned char *oend = out + raw_len;
+
+    while (ip < iend) {
+        unsigned int token = *ip++;
+
+        unsigned int lit = token >> 4;
+        if (lit == 15 && read_length(&ip, iend, &lit) < 0)
+            return -1;
+        if (lit > (unsigned long)(iend - ip)
+            || lit > (unsigned long)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        unsigned int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (unsigned long)(op - out))
+            return -1;
+
+        unsigned int mlen = token & 15;
+        if (mlen == 15 && read_length(&ip, iend, &mlen) < 0)
+            return -1;
+        mlen += MIN_MATCH;
+        if (mlen > (unsigned long)(oend - op))
+            return -1;
+
+        const unsigned char *match = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, match, mlen);
+            op += mlen;
+        } else {
+            // The match overlaps what it writes: a run of a short pattern
+            while (mlen--)
+                *op++ = *match++;
+        }
+    }
+
+    return op == oend ? 0 : -1;
+}
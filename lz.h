@@ -0,0 +1,17 @@
+#ifndef LZ_H_
+#define LZ_H_
+
+// Worst case size of the compressed form of len bytes (incompressible data
+// grows by a length byte every 255 literals)
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Inputs are at most this long: match offsets are 16 bits
+#define LZ_MAX_INPUT (64 * 1024)
+
+unsigned int lz_compress(const char *src, unsigned int len, char *dst,
+                         unsigned int cap);
+
+int lz_decompress(const char *src, unsigned int len, char *dst,
+                  unsigned int raw_len);
+
+#endif  // LZ_H_
@@ -1,115 +1,247 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "load_balancer.h"
+#include "pipeline.h"
+#include "request.h"
+#include "snapshot.h"
+#include "trace.h"
 #include "utils.h"
 
-#define REQUEST_LENGTH 1024
-#define KEY_LENGTH 128
-#define VALUE_LENGTH 65536
-
-void get_key_value(char* key, char* value, char* request) {
-	int key_start = 0, value_start = 0;
-	int key_finish = 0, value_finish = 0;
-	int key_index = 0, value_index = 0;
-
-	for (unsigned int i = 0; i < strlen(request); ++i) {
-		if (request[i] == '"' && value_start != 1) {
-			if (key_start == 0) {
-				key_start = 1;
-			} else if (key_finish == 0) {
-				key_finish = 1;
-			} else if (value_start == 0) {
-				value_start = 1;
-			}
-		} else {
-			if (key_start == 1 && key_finish == 0) {
-				key[key_index++] = request[i];
-			} else if (value_start == 1 && value_finish == 0) {
-				value[value_index++] = request[i];
-			}
+void apply_requests(FILE* input_file, load_balancer* main_server) {
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	// Key and value buffers grow with the longest line seen so far
+	char *key = NULL, *value = NULL;
+	size_t buffer_cap = 0;
+	reply_buffer reply = {NULL, 0, 0};
+	request req;
+
+	while ((line_len = getline(&line, &line_cap, input_file)) > 0) {
+		line[line_len - 1] = 0;
+		if ((size_t)line_len > buffer_cap) {
+			buffer_cap = line_len;
+			key = realloc(key, buffer_cap);
+			value = realloc(value, buffer_cap);
+			DIE(!key || !value, "request buffer realloc failed");
 		}
-	}
-
-	value[value_index - 1] = 0;
-}
-
-void get_key(char* key, char* request) {
-	int key_start = 0, key_index = 0;
 
-	for (unsigned int i = 0; i < strlen(request); ++i) {
-		if (request[i] == '"') {
-			key_start = 1;
-		} else if (key_start == 1) {
-			key[key_index++] = request[i];
-		}
+		req.key = key;
+		req.value = value;
+		DIE(request_parse(line, &req) < 0, "unknown function call");
+
+		// Input files are run in one go: a bare snapshot waits for the
+		// running one, so its outcome is what gets reported
+		if (req.type == REQUEST_SNAPSHOT && req.key[0] == 0)
+			snapshot_poll(main_server, SNAPSHOT_WAIT);
+		request_execute(main_server, &req, &reply);
+		// The buffer stays NULL until a request has a reply
+		if (reply.len)
+			fwrite(reply.data, 1, reply.len, stdout);
+		reply.len = 0;
 	}
-}
-
-void apply_requests(FILE* input_file) {
-	char request[REQUEST_LENGTH] = {0};
-	char key[KEY_LENGTH] = {0};
-	char value[VALUE_LENGTH] = {0};
-	load_balancer* main_server = init_load_balancer();
-
-	while (fgets(request, REQUEST_LENGTH, input_file)) {
-		request[strlen(request) - 1] = 0;
-		if (!strncmp(request, "store", sizeof("store") - 1)) {
-			get_key_value(key, value, request);
-
-			int index_server = 0;
-			loader_store(main_server, key, value, &index_server);
-			printf("Stored %s on server %d.\n", value, index_server);
-
-			memset(key, 0, sizeof(key));
-			memset(value, 0, sizeof(value));
-
-		} else if (!strncmp(request, "retrieve", sizeof("retrieve") - 1)) {
-			get_key(key, request);
-
-			int index_server = 0;
-			char *retrieved_value = loader_retrieve(main_server,
-											key, &index_server);
-			if (retrieved_value) {
-				printf("Retrieved %s from server %d.\n",
-						retrieved_value, index_server);
-			} else {
-				printf("Key %s not present.\n", key);
-			}
 
-			memset(key, 0, sizeof(key));
-		} else if (!strncmp(request, "add_server", sizeof("add_server") - 1)) {
-			int server_id = atoi(request + sizeof("add_server"));
-
-			loader_add_server(main_server, server_id);
-
-		} else if (!strncmp(request, "remove_server",
-					sizeof("remove_server") - 1)) {
-			int server_id = atoi(request + sizeof("remove_server"));
-
-			loader_remove_server(main_server, server_id);
+	free(line);
+	free(key);
+	free(value);
+	reply_free(&reply);
+}
 
+struct options {
+	char *input_path;
+	/* write-ahead log, NULL if the run is not persisted */
+	char *wal_path;
+	char *snapshot_path;
+	wal_durability durability;
+	unsigned int sync_ops;
+	unsigned int sync_us;
+	/* number of servers every object is stored on */
+	int replicas;
+	/* false positive target of the per-server filters, 0 = no filters */
+	double filter_fp;
+	/* memory budget of every server in bytes, 0 = unlimited */
+	unsigned long server_budget;
+	/* values of at least this many bytes are compressed, 0 = never */
+	unsigned int compress;
+	/* NUMA node the load balancer and its servers run on, -1 = any */
+	int numa_node;
+	/* operations traced from the start if at least this slow (us), -1 = off */
+	long trace_us;
+	/* parse, run and print on three threads */
+	int pipeline;
+	/* buckets moved per operation after membership changes, 0 = all */
+	unsigned int rebalance_step;
+	/* ring, rendezvous, weighted rendezvous, multi-probe or zones */
+	enum placement placement;
+	/* zone reads prefer with zone placement, NULL if none */
+	char *zone;
+	/* shared memory segment mirroring the servers, NULL if none */
+	char *shm_name;
+	unsigned long shm_mb;
+};
+
+/*
+ * Parses "input_file [--option=value ...]". Returns 0 on success.
+ */
+int parse_options(int argc, char* argv[], struct options* opts) {
+	opts->input_path = NULL;
+	opts->wal_path = NULL;
+	opts->snapshot_path = NULL;
+	opts->durability = WAL_DURABILITY_GROUP;
+	opts->sync_ops = 64;
+	opts->sync_us = 1000;
+	opts->replicas = 1;
+	opts->filter_fp = 0;
+	opts->server_budget = 0;
+	opts->compress = 0;
+	opts->numa_node = -1;
+	opts->trace_us = -1;
+	opts->pipeline = 0;
+	opts->rebalance_step = 0;
+	opts->placement = PLACEMENT_RING;
+	opts->zone = NULL;
+	opts->shm_name = NULL;
+	opts->shm_mb = 64;
+
+	for (int i = 1; i < argc; ++i) {
+		char *arg = argv[i];
+
+		if (!strncmp(arg, "--wal=", sizeof("--wal=") - 1)) {
+			opts->wal_path = arg + sizeof("--wal=") - 1;
+		} else if (!strncmp(arg, "--snapshot=", sizeof("--snapshot=") - 1)) {
+			opts->snapshot_path = arg + sizeof("--snapshot=") - 1;
+		} else if (!strncmp(arg, "--durability=",
+					sizeof("--durability=") - 1)) {
+			char *level = arg + sizeof("--durability=") - 1;
+			if (!strcmp(level, "none"))
+				opts->durability = WAL_DURABILITY_NONE;
+			else if (!strcmp(level, "group"))
+				opts->durability = WAL_DURABILITY_GROUP;
+			else if (!strcmp(level, "sync"))
+				opts->durability = WAL_DURABILITY_SYNC;
+			else
+				return -1;
+		} else if (!strncmp(arg, "--sync-ops=", sizeof("--sync-ops=") - 1)) {
+			opts->sync_ops = atoi(arg + sizeof("--sync-ops=") - 1);
+		} else if (!strncmp(arg, "--sync-us=", sizeof("--sync-us=") - 1)) {
+			opts->sync_us = atoi(arg + sizeof("--sync-us=") - 1);
+		} else if (!strncmp(arg, "--replicas=", sizeof("--replicas=") - 1)) {
+			opts->replicas = atoi(arg + sizeof("--replicas=") - 1);
+		} else if (!strncmp(arg, "--filter-fp=", sizeof("--filter-fp=") - 1)) {
+			opts->filter_fp = atof(arg + sizeof("--filter-fp=") - 1);
+		} else if (!strncmp(arg, "--server-budget=",
+					sizeof("--server-budget=") - 1)) {
+			opts->server_budget = strtoul(arg + sizeof("--server-budget=") - 1,
+										  NULL, 10);
+		} else if (!strncmp(arg, "--compress=", sizeof("--compress=") - 1)) {
+			opts->compress = strtoul(arg + sizeof("--compress=") - 1, NULL, 10);
+		} else if (!strncmp(arg, "--numa-node=", sizeof("--numa-node=") - 1)) {
+			opts->numa_node = atoi(arg + sizeof("--numa-node=") - 1);
+		} else if (!strcmp(arg, "--trace")) {
+			opts->trace_us = 0;
+		} else if (!strncmp(arg, "--trace=", sizeof("--trace=") - 1)) {
+			opts->trace_us = strtoul(arg + sizeof("--trace=") - 1, NULL, 10);
+		} else if (!strcmp(arg, "--pipeline")) {
+			opts->pipeline = 1;
+		} else if (!strncmp(arg, "--rebalance-step=",
+					sizeof("--rebalance-step=") - 1)) {
+			opts->rebalance_step = atoi(arg + sizeof("--rebalance-step=") - 1);
+		} else if (!strncmp(arg, "--placement=", sizeof("--placement=") - 1)) {
+			char *placement = arg + sizeof("--placement=") - 1;
+			if (!strcmp(placement, "ring"))
+				opts->placement = PLACEMENT_RING;
+			else if (!strcmp(placement, "rendezvous"))
+				opts->placement = PLACEMENT_RENDEZVOUS;
+			else if (!strcmp(placement, "weighted"))
+				opts->placement = PLACEMENT_WEIGHTED_RENDEZVOUS;
+			else if (!strcmp(placement, "multi-probe"))
+				opts->placement = PLACEMENT_MULTI_PROBE;
+			else if (!strcmp(placement, "zones"))
+				opts->placement = PLACEMENT_ZONES;
+			else
+				return -1;
+		} else if (!strncmp(arg, "--zone=", sizeof("--zone=") - 1)) {
+			opts->zone = arg + sizeof("--zone=") - 1;
+		} else if (!strncmp(arg, "--shm=", sizeof("--shm=") - 1)) {
+			opts->shm_name = arg + sizeof("--shm=") - 1;
+		} else if (!strncmp(arg, "--shm-size=", sizeof("--shm-size=") - 1)) {
+			opts->shm_mb = strtoul(arg + sizeof("--shm-size=") - 1, NULL, 10);
+		} else if (arg[0] != '-' && opts->input_path == NULL) {
+			opts->input_path = arg;
 		} else {
-			DIE(1, "unknown function call");
+			return -1;
 		}
 	}
 
-	free_load_balancer(main_server);
+	return opts->input_path == NULL ? -1 : 0;
 }
 
 int main(int argc, char* argv[]) {
 	FILE *input;
-
-	if (argc != 2) {
-		printf("Usage:%s input_file \n", argv[0]);
+	struct options opts;
+
+	if (parse_options(argc, argv, &opts) < 0) {
+		printf("Usage:%s input_file [--wal=file [--snapshot=file]"
+			   " [--durability=none|group|sync] [--sync-ops=N]"
+			   " [--sync-us=N]] [--replicas=R] [--filter-fp=P]"
+			   " [--server-budget=B] [--compress=N] [--numa-node=N]"
+			   " [--trace[=US]] [--pipeline]"
+			   " [--rebalance-step=N]"
+			   " [--placement=ring|rendezvous|weighted|multi-probe|zones"
+			   " [--zone=name]] [--shm=name [--shm-size=MB]]\n",
+			   argv[0]);
 		return -1;
 	}
 
-	input = fopen(argv[1], "rt");
+	input = fopen(opts.input_path, "rt");
 	DIE(input == NULL, "missing input file");
 
-	apply_requests(input);
+	load_balancer* main_server = init_load_balancer();
+	loader_set_replication(main_server, opts.replicas);
+	loader_set_placement(main_server, opts.placement);
+	if (opts.zone)
+		loader_set_local_zone(main_server, opts.zone);
+	loader_set_filter(main_server, opts.filter_fp);
+	loader_set_memory_budget(main_server, opts.server_budget);
+	loader_set_compression(main_server, opts.compress);
+	/* Before the WAL and pipeline threads start, so they stay on the node */
+	if (opts.numa_node >= 0)
+		DIE(loader_set_numa_node(main_server, opts.numa_node) < 0,
+			"bad NUMA node");
+	if (opts.trace_us >= 0)
+		trace_enable(opts.trace_us);
+	loader_set_rebalance_step(main_server, opts.rebalance_step);
+
+	if (opts.wal_path) {
+		// Rebuild the previous state before logging anything new
+		long replayed = wal_recover(main_server, opts.snapshot_path,
+									opts.wal_path);
+		DIE(replayed < 0, "recovery failed");
+
+		loader_attach_wal(main_server, wal_open(opts.wal_path, opts.durability,
+										opts.sync_ops, opts.sync_us));
+	}
+
+	if (opts.shm_name) {
+		shm_store_t *shm = shm_create(opts.shm_name, opts.shm_mb << 20);
+		DIE(shm == NULL, "can't create the shared memory segment");
+		loader_attach_shm(main_server, shm);
+	}
+
+	if (opts.pipeline)
+		apply_requests_pipelined(input, main_server);
+	else
+		apply_requests(input, main_server);
+
+	// On a clean exit fold the log into a fresh snapshot
+	if (main_server->wal && opts.snapshot_path)
+		wal_checkpoint(main_server->wal, main_server, opts.snapshot_path);
+
+	free_load_balancer(main_server);
 
 	fclose(input);
 
@@ -0,0 +1,635 @@
+#define _GNU_SOURCE
+
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "load_balancer.h"
+#include "load_balancer_utils.h"
+
+// Cost of the primitives under the load balancer, one at a time and at
+// several sizes: time, and where the hardware allows it, cycles,
+// instructions, cache misses and branch misses per operation. Results can
+// be saved and later compared against, failing on regressions.
+//
+//   make microbench && ./microbench [--sizes=1000,100000] [--only=ht_get]
+//       [--save=file] [--baseline=file [--threshold=percent]]
+
+#define ROUNDS 3
+#define MAX_SIZES 8
+#define MAX_RESULTS 64
+#define DEFAULT_THRESHOLD 10.0
+// Nodes walked by all the list insertions of one round, at most
+#define LIST_WALK_BUDGET 100000000UL
+
+enum counter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    N_COUNTERS
+};
+
+static const unsigned long long counter_configs[N_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// The counters are one group, so they count over the same interval; fds
+// of the ones which could not be opened are -1
+static int counter_fds[N_COUNTERS] = {-1, -1, -1, -1};
+
+typedef struct sample sample;
+
+// A measure of ops operations; counters are -1 when not available
+struct sample {
+    double ns;
+    double counters[N_COUNTERS];
+};
+
+typedef struct result result;
+
+struct result {
+    char name[32];
+    unsigned long size;
+    // Per operation
+    sample per_op;
+};
+
+static result results[MAX_RESULTS];
+static int n_results;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned int next_random(unsigned int *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/*
+ * Opens the counters of this thread in user mode. Containers and
+ * perf_event_paranoid often forbid it: the benchmarks then report time only
+ */
+static void open_counters(void)
+{
+    int leader = -1;
+
+    for (int i = 0; i < N_COUNTERS; ++i) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counter_configs[i];
+        attr.disabled = leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        counter_fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, leader,
+                                 0);
+        if (counter_fds[i] >= 0 && leader < 0)
+            leader = counter_fds[i];
+    }
+
+    if (leader < 0)
+        fprintf(stderr, "perf_event_open unavailable, reporting time only\n");
+}
+
+static int counters_leader(void)
+{
+    for (int i = 0; i < N_COUNTERS; ++i)
+        if (counter_fds[i] >= 0)
+            return counter_fds[i];
+    return -1;
+}
+
+static void close_counters(void)
+{
+    for (int i = 0; i < N_COUNTERS; ++i)
+        if (counter_fds[i] >= 0)
+            close(counter_fds[i]);
+}
+
+static void measure_start(sample *s)
+{
+    int leader = counters_leader();
+
+    if (leader >= 0) {
+        ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    s->ns = now_ns();
+}
+
+/*
+ * Ends a measure started by measure_start, as values per operation
+ */
+static void measure_stop(sample *s, unsigned long ops)
+{
+    double end = now_ns();
+    int leader = counters_leader();
+    struct {
+        unsigned long long nr;
+        unsigned long long values[N_COUNTERS];
+    } group;
+
+    s->ns = (end - s->ns) / ops;
+    for (int i = 0; i < N_COUNTERS; ++i)
+        s->counters[i] = -1;
+    if (leader < 0)
+        return;
+
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(leader, &group, sizeof(group)) < (ssize_t)sizeof(group.nr))
+        return;
+
+    // The group lists the counters which could be opened, in order
+    unsigned int at = 0;
+    for (int i = 0; i < N_COUNTERS && at < group.nr; ++i)
+        if (counter_fds[i] >= 0)
+            s->counters[i] = (double)group.values[at++] / ops;
+}
+
+/*
+ * Keeps the fastest of the rounds
+ */
+static void keep_best(sample *best, const sample *s, int round)
+{
+    if (round == 0 || s->ns < best->ns)
+        *best = *s;
+}
+
+static char *make_keys(unsigned long n)
+{
+    char *keys = (char *)malloc(n * 16);
+    DIE(!keys, "microbench malloc failed");
+
+    for (unsigned long i = 0; i < n; ++i)
+        snprintf(keys + i * 16, 16, "key%010u", (unsigned int)i);
+    return keys;
+}
+
+static void shuffle(unsigned long *order, unsigned long n)
+{
+    unsigned int state = 2463534242u;
+
+    for (unsigned long i = 0; i < n; ++i)
+        order[i] = i;
+    for (unsigned long i = n - 1; i > 0; --i) {
+        unsigned long j = next_random(&state) % (i + 1);
+        unsigned long tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+}
+
+/*
+ * Inserts size distinct keys in a table of size buckets (load factor 1,
+ * so no resize happens)
+ */
+static void bench_ht_put(unsigned long size, sample *best)
+{
+    char *keys = make_keys(size);
+    char value[] = "value-0123456789";
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        hashtable_t *ht = ht_create(size, hash_function_string,
+                                    compare_function_strings);
+        sample s;
+        measure_start(&s);
+        for (unsigned long i = 0; i < size; ++i)
+            ht_put(ht, keys + i * 16, strlen(keys + i * 16) + 1, value,
+                   sizeof(value));
+        measure_stop(&s, size);
+        keep_best(best, &s, round);
+        ht_free(ht);
+    }
+    free(keys);
+}
+
+// Lookups of bench_lookup: through the function pointers of the
+// hashtable, or the functions specialized for the type of its keys
+enum lookup {
+    LOOKUP_STRING,
+    LOOKUP_STRING_SPECIALIZED,
+    LOOKUP_INT,
+    LOOKUP_INT_SPECIALIZED,
+};
+
+/*
+ * Looks up every key of a table of size keys, in random order; string
+ * keys are 15 bytes long
+ */
+static void bench_lookup(unsigned long size, sample *best, enum lookup kind)
+{
+    int ints = kind == LOOKUP_INT || kind == LOOKUP_INT_SPECIALIZED;
+    char *keys = make_keys(size);
+    int *int_keys = (int *)malloc(size * sizeof(int));
+    unsigned long *order = (unsigned long *)malloc(size * sizeof(long));
+    DIE(!int_keys || !order, "microbench malloc failed");
+    shuffle(order, size);
+
+    char value[] = "value-0123456789";
+    hashtable_t *ht = ints
+                      ? ht_create(size, hash_function_int,
+                                  compare_function_ints)
+                      : ht_create(size, hash_function_string,
+                                  compare_function_strings);
+    for (unsigned long i = 0; i < size; ++i) {
+        int_keys[i] = (int)(i * 2654435761u);
+        if (ints)
+            ht_put(ht, &int_keys[i], sizeof(int), value, sizeof(value));
+        else
+            ht_put(ht, keys + i * 16, strlen(keys + i * 16) + 1, value,
+                   sizeof(value));
+    }
+
+    unsigned long found = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        sample s;
+        measure_start(&s);
+        for (unsigned long i = 0; i < size; ++i) {
+            char *key = keys + order[i] * 16;
+            int *int_key = &int_keys[order[i]];
+
+            switch (kind) {
+            case LOOKUP_STRING:
+                found += ht_get_info(ht, key) != NULL;
+                break;
+            case LOOKUP_STRING_SPECIALIZED:
+                found += ht_str_get_info(ht, key) != NULL;
+                break;
+            case LOOKUP_INT:
+                found += ht_get_info(ht, int_key) != NULL;
+                break;
+            case LOOKUP_INT_SPECIALIZED:
+                found += ht_int_get_info(ht, int_key) != NULL;
+                break;
+            }
+        }
+        measure_stop(&s, size);
+        keep_best(best, &s, round);
+    }
+    if (found != ROUNDS * size)
+        fprintf(stderr, "lookups: %lu keys missing\n", ROUNDS * size - found);
+
+    ht_free(ht);
+    free(order);
+    free(int_keys);
+    free(keys);
+}
+
+static void bench_ht_get(unsigned long size, sample *best)
+{
+    bench_lookup(size, best, LOOKUP_STRING);
+}
+
+static void bench_ht_str_get(unsigned long size, sample *best)
+{
+    bench_lookup(size, best, LOOKUP_STRING_SPECIALIZED);
+}
+
+static void bench_ht_get_int(unsigned long size, sample *best)
+{
+    bench_lookup(size, best, LOOKUP_INT);
+}
+
+static void bench_ht_int_get(unsigned long size, sample *best)
+{
+    bench_lookup(size, best, LOOKUP_INT_SPECIALIZED);
+}
+
+/*
+ * Retrieves every key of a server holding size objects, in random order:
+ * the hashtable lookup with the bookkeeping of a server around it
+ */
+static void bench_server_retrieve(unsigned long size, sample *best)
+{
+    char *keys = make_keys(size);
+    unsigned long *order = (unsigned long *)malloc(size * sizeof(long));
+    DIE(!order, "microbench malloc failed");
+    shuffle(order, size);
+
+    server_memory *server = init_server_memory();
+    for (unsigned long i = 0; i < size; ++i)
+        server_store(server, keys + i * 16, "value-0123456789");
+
+    unsigned long found = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        sample s;
+        measure_start(&s);
+        for (unsigned long i = 0; i < size; ++i)
+            found += server_retrieve(server, keys + order[i] * 16) != NULL;
+        measure_stop(&s, size);
+        keep_best(best, &s, round);
+    }
+    if (found != ROUNDS * size)
+        fprintf(stderr, "server_retrieve: %lu keys missing\n",
+                ROUNDS * size - found);
+
+    free_server_memory(server);
+    free(order);
+    free(keys);
+}
+
+/*
+ * Inserts nodes at random positions of a list of size nodes; the number
+ * of insertions is capped so a round walks at most LIST_WALK_BUDGET nodes
+ */
+static void bench_ll_add_nth_node(unsigned long size, sample *best)
+{
+    unsigned long ops = 2 * LIST_WALK_BUDGET / (size + 1);
+    if (ops > size)
+        ops = size;
+    if (ops == 0)
+        ops = 1;
+
+    unsigned int state = 88172645u;
+    for (int round = 0; round < ROUNDS; ++round) {
+        linked_list_t *list = ll_create(sizeof(unsigned long));
+        for (unsigned long i = 0; i < size; ++i)
+            ll_add_nth_node(list, 0, &i);
+
+        sample s;
+        measure_start(&s);
+        for (unsigned long i = 0; i < ops; ++i)
+            ll_add_nth_node(list, next_random(&state) % (list->size + 1), &i);
+        measure_stop(&s, ops);
+        keep_best(best, &s, round);
+        ll_free(&list);
+    }
+}
+
+/*
+ * Finds the owner of a million keys on a ring of size servers (each with
+ * its default points)
+ */
+static void bench_binary_search_object(unsigned long size, sample *best)
+{
+    const unsigned long lookups = 1000000;
+    int *ids = (int *)malloc(size * sizeof(int));
+    unsigned int *hashes = (unsigned int *)malloc(lookups * sizeof(int));
+    DIE(!ids || !hashes, "microbench malloc failed");
+
+    for (unsigned long i = 0; i < size; ++i)
+        ids[i] = i + 1;
+    load_balancer *main = init_load_balancer_with_servers(ids, size, 0);
+
+    unsigned int state = 362436069u;
+    for (unsigned long k = 0; k < lookups; ++k)
+        hashes[k] = next_random(&state);
+
+    unsigned long sum = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        sample s;
+        measure_start(&s);
+        for (unsigned long k = 0; k < lookups; ++k)
+            sum += binary_search_object(main, hashes[k]);
+        measure_stop(&s, lookups);
+        keep_best(best, &s, round);
+    }
+    // Keeps the lookups from being optimized away
+    if (sum == 0)
+        fprintf(stderr, "binary_search_object: no owners\n");
+
+    free_load_balancer(main);
+    free(hashes);
+    free(ids);
+}
+
+/*
+ * Adds a server to a ring of 8 servers holding size objects: each of its
+ * points runs remap_objects_insert on the server after it. The cost is
+ * per object stored
+ */
+static void bench_remap_objects_insert(unsigned long size, sample *best)
+{
+    char *keys = make_keys(size);
+    int ids[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    int server_id;
+
+    for (int round = 0; round < ROUNDS; ++round) {
+        load_balancer *main = init_load_balancer_with_servers(ids, 8, 0);
+        for (unsigned long i = 0; i < size; ++i)
+            loader_store(main, keys + i * 16, "value-0123456789", &server_id);
+
+        sample s;
+        measure_start(&s);
+        loader_add_server(main, 9);
+        measure_stop(&s, size);
+        keep_best(best, &s, round);
+        free_load_balancer(main);
+    }
+    free(keys);
+}
+
+typedef struct benchmark benchmark;
+
+struct benchmark {
+    const char *name;
+    void (*run)(unsigned long size, sample *best);
+    // The sizes are numbers of servers, not of objects
+    int servers;
+};
+
+static const benchmark benchmarks[] = {
+    {"ht_put", bench_ht_put, 0},
+    {"ht_get", bench_ht_get, 0},
+    {"ht_str_get", bench_ht_str_get, 0},
+    {"ht_get_int", bench_ht_get_int, 0},
+    {"ht_int_get", bench_ht_int_get, 0},
+    {"server_retrieve", bench_server_retrieve, 0},
+    {"ll_add_nth_node", bench_ll_add_nth_node, 0},
+    {"binary_search_object", bench_binary_search_object, 1},
+    {"remap_objects_insert", bench_remap_objects_insert, 0},
+};
+
+static void print_value(double value, const char *format)
+{
+    if (value < 0)
+        printf(" %10s", "-");
+    else
+        printf(format, value);
+}
+
+static void print_result(const result *r)
+{
+    const double *c = r->per_op.counters;
+
+    printf("%-22s %9lu %10.1f", r->name, r->size, r->per_op.ns);
+    print_value(c[COUNTER_CYCLES], " %10.1f");
+    print_value(c[COUNTER_INSTRUCTIONS], " %10.1f");
+    print_value(c[COUNTER_CYCLES] > 0 && c[COUNTER_INSTRUCTIONS] >= 0
+                ? c[COUNTER_INSTRUCTIONS] / c[COUNTER_CYCLES] : -1, " %10.2f");
+    print_value(c[COUNTER_CACHE_MISSES], " %10.3f");
+    print_value(c[COUNTER_BRANCH_MISSES], " %10.3f");
+    printf("\n");
+}
+
+/*
+ * Baselines are text, one result per line:
+ * name size ns cycles instructions cache_misses branch_misses
+ */
+static int save_results(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror("microbench: can't save the results");
+        return -1;
+    }
+
+    for (int i = 0; i < n_results; ++i) {
+        const sample *s = &results[i].per_op;
+        fprintf(out, "%s %lu %.3f %.3f %.3f %.4f %.4f\n", results[i].name,
+                results[i].size, s->ns, s->counters[COUNTER_CYCLES],
+                s->counters[COUNTER_INSTRUCTIONS],
+                s->counters[COUNTER_CACHE_MISSES],
+                s->counters[COUNTER_BRANCH_MISSES]);
+    }
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+/*
+ * Compares the results against a baseline: cycles when both runs have
+ * them (they don't depend on the frequency), time otherwise
+ * Returns the number of regressions, -1 if the baseline can't be read
+ */
+static int compare_baseline(const char *path, double threshold)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        perror("microbench: can't read the baseline");
+        return -1;
+    }
+
+    int regressions = 0, compared = 0;
+    result base;
+    while (fscanf(in, "%31s %lu %lf %lf %lf %lf %lf", base.name, &base.size,
+                  &base.per_op.ns, &base.per_op.counters[COUNTER_CYCLES],
+                  &base.per_op.counters[COUNTER_INSTRUCTIONS],
+                  &base.per_op.counters[COUNTER_CACHE_MISSES],
+                  &base.per_op.counters[COUNTER_BRANCH_MISSES]) == 7) {
+        for (int i = 0; i < n_results; ++i) {
+            result *r = &results[i];
+            if (strcmp(r->name, base.name) || r->size != base.size)
+                continue;
+
+            int cycles = r->per_op.counters[COUNTER_CYCLES] > 0
+                         && base.per_op.counters[COUNTER_CYCLES] > 0;
+            double now = cycles ? r->per_op.counters[COUNTER_CYCLES]
+                                : r->per_op.ns;
+            double then = cycles ? base.per_op.counters[COUNTER_CYCLES]
+                                 : base.per_op.ns;
+            double change = 100.0 * (now - then) / then;
+            compared++;
+
+            if (change > threshold) {
+                printf("REGRESSION %s %lu: %s %.1f -> %.1f (%+.1f%%)\n",
+                       r->name, r->size, cycles ? "cycles/op" : "ns/op",
+                       then, now, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(in);
+
+    printf("%d results compared with %s, %d over +%.1f%%\n", compared, path,
+           regressions, threshold);
+    return regressions;
+}
+
+static int parse_sizes(const char *list, unsigned long *sizes)
+{
+    int n = 0;
+    char *end;
+
+    while (*list && n < MAX_SIZES) {
+        sizes[n] = strtoul(list, &end, 10);
+        if (end == list || sizes[n] == 0)
+            return -1;
+        n++;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long sizes[MAX_SIZES] = {1000, 100000, 1000000};
+    unsigned long server_sizes[] = {8, 64, 512};
+    int n_sizes = 3;
+    const char *only = NULL, *save = NULL, *baseline = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+
+    for (int i = 1; i < argc; ++i) {
+        char *arg = argv[i];
+
+        if (!strncmp(arg, "--sizes=", sizeof("--sizes=") - 1)) {
+            n_sizes = parse_sizes(arg + sizeof("--sizes=") - 1, sizes);
+        } else if (!strncmp(arg, "--only=", sizeof("--only=") - 1)) {
+            only = arg + sizeof("--only=") - 1;
+        } else if (!strncmp(arg, "--save=", sizeof("--save=") - 1)) {
+            save = arg + sizeof("--save=") - 1;
+        } else if (!strncmp(arg, "--baseline=", sizeof("--baseline=") - 1)) {
+            baseline = arg + sizeof("--baseline=") - 1;
+        } else if (!strncmp(arg, "--threshold=",
+                            sizeof("--threshold=") - 1)) {
+            threshold = atof(arg + sizeof("--threshold=") - 1);
+        } else {
+            n_sizes = -1;
+        }
+        if (n_sizes <= 0) {
+            printf("Usage:%s [--sizes=n,n,...] [--only=primitive]"
+                   " [--save=file] [--baseline=file [--threshold=percent]]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+
+    open_counters();
+    printf("%-22s %9s %10s %10s %10s %10s %10s %10s\n", "primitive", "size",
+           "ns/op", "cycles/op", "instr/op", "IPC", "cache-miss", "br-miss");
+
+    int n_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    for (int b = 0; b < n_benchmarks; ++b) {
+        if (only && strcmp(only, benchmarks[b].name))
+            continue;
+
+        // Rings are measured by servers: a few up to a big cluster
+        unsigned long *these = benchmarks[b].servers ? server_sizes : sizes;
+        int n = benchmarks[b].servers ? 3 : n_sizes;
+        for (int s = 0; s < n && n_results < MAX_RESULTS; ++s) {
+            result *r = &results[n_results++];
+            snprintf(r->name, sizeof(r->name), "%s", benchmarks[b].name);
+            r->size = these[s];
+            benchmarks[b].run(these[s], &r->per_op);
+            print_result(r);
+        }
+    }
+    close_counters();
+
+    if (save && save_results(save) < 0)
+        return -1;
+    if (baseline) {
+        int regressions = compare_baseline(baseline, threshold);
+        if (regressions != 0)
+            return 1;
+    }
+    return 0;
+}
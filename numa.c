@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "numa.h"
+
+/*
+ * Memory policies are set with the raw system calls, so nothing has to be
+ * linked; on machines with a single node every call below is a no-op
+ */
+
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+
+#define MASK_WORDS ((NUMA_MAX_NODES + 63) / 64)
+
+static int n_nodes;
+// Set once the kernel refused a memory policy, which is reported once
+static int policy_broken;
+
+// Node the calling thread prefers (-1 for the default policy)
+static __thread int thread_preferred = -1;
+
+/**
+ * Returns the number of memory nodes of the machine (1 if it can't be read)
+ */
+int numa_node_count(void)
+{
+    if (n_nodes > 0)
+        return n_nodes;
+
+    // "0" or "0-1", or a list of ranges: the last number is the highest
+    int highest = 0;
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file) {
+        char line[256];
+        if (fgets(line, sizeof(line), file)) {
+            char *last = line + strcspn(line, "\n");
+            while (last > line && last[-1] >= '0' && last[-1] <= '9')
+                last--;
+            highest = atoi(last);
+        }
+        fclose(file);
+    }
+
+    n_nodes = highest + 1 < NUMA_MAX_NODES ? highest + 1 : NUMA_MAX_NODES;
+    return n_nodes;
+}
+
+static void node_mask(int node, unsigned long *mask)
+{
+    memset(mask, 0, MASK_WORDS * sizeof(unsigned long));
+    mask[node / 64] = 1ul << (node % 64);
+}
+
+/**
+ * Restricts the calling thread to the CPUs of a node; threads it creates
+ * afterwards inherit it
+ * Returns 0 on success (or on a single node), -1 otherwise
+ * @param node the node
+ */
+int numa_pin_thread(int node)
+{
+    if (numa_node_count() <= 1)
+        return 0;
+
+    char path[64], list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    FILE *file = fopen(path, "r");
+    if (!file || !fgets(list, sizeof(list), file)) {
+        if (file)
+            fclose(file);
+        fprintf(stderr, "can't read the CPUs of node %d\n", node);
+        return -1;
+    }
+    fclose(file);
+
+    // "0-3,8-11"
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (char *it = list; *it >= '0' && *it <= '9'; ) {
+        int first = strtol(it, &it, 10), last = first;
+        if (*it == '-')
+            last = strtol(it + 1, &it, 10);
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, &set);
+        if (*it == ',')
+            it++;
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        perror("can't pin the thread to its node");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Makes the pages the calling thread touches first come from a node when
+ * it has free memory. Setting the node the thread already prefers costs
+ * nothing, so it can be called before every allocation
+ * Returns 0 on success (or on a single node), -1 otherwise
+ * @param node the node, -1 for the default policy (the local node)
+ */
+int numa_prefer(int node)
+{
+    if (node == thread_preferred || policy_broken || numa_node_count() <= 1)
+        return 0;
+
+    unsigned long mask[MASK_WORDS];
+    node_mask(node < 0 ? 0 : node, mask);
+    if (syscall(SYS_set_mempolicy, node < 0 ? MPOL_DEFAULT : MPOL_PREFERRED,
+                node < 0 ? NULL : mask, node < 0 ? 0 : NUMA_MAX_NODES + 1)
+        < 0) {
+        perror("can't set the memory policy");
+        policy_broken = 1;
+        return -1;
+    }
+    thread_preferred = node;
+    return 0;
+}
+
+/**
+ * Returns the node the calling thread prefers, -1 for the default policy
+ */
+int numa_preferred(void)
+{
+    return thread_preferred;
+}
+
+/**
+ * Returns the node the page holding an address was placed on, -1 if the
+ * kernel can't tell (the page is then counted nowhere)
+ * @param addr an address of a page already touched
+ */
+int numa_page_node(const void *addr)
+{
+    int node;
+
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, addr,
+                MPOL_F_NODE | MPOL_F_ADDR) < 0)
+        return numa_node_count() <= 1 ? 0 : -1;
+    return node;
+}
+
+/**
+ * Moves the pages of a buffer to a node and keeps its later pages there.
+ * Only the pages entirely inside the buffer are touched, neighbouring
+ * allocations don't move
+ * Returns 0 on success (or on a single node), -1 otherwise
+ * @param addr the buffer
+ * @param len its size
+ * @param node the node
+ */
+int numa_bind(void *addr, unsigned long len, int node)
+{
+    if (node < 0 || policy_broken || numa_node_count() <= 1)
+        return 0;
+
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + len) & ~(page - 1);
+    if (start >= end)
+        return 0;
+
+    unsigned long mask[MASK_WORDS];
+    node_mask(node, mask);
+    if (syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask,
+                NUMA_MAX_NODES + 1, MPOL_MF_MOVE) < 0) {
+        perror("can't bind memory to its node");
+        policy_broken = 1;
+        return -1;
+    }
+    return 0;
+}
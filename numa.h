@@ -0,0 +1,19 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+// Nodes beyond this one are ignored
+#define NUMA_MAX_NODES 64
+
+int numa_node_count(void);
+
+int numa_pin_thread(int node);
+
+int numa_prefer(int node);
+
+int numa_preferred(void);
+
+int numa_page_node(const void *addr);
+
+int numa_bind(void *addr, unsigned long len, int node);
+
+#endif  // NUMA_H_
@@ -0,0 +1,206 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "request.h"
+#include "snapshot.h"
+#include "spsc_ring.h"
+#include "utils.h"
+
+// Commands in flight between two stages
+#define PIPELINE_RING_SIZE 1024
+// Failed ring operations retried right away before backing off
+#define PIPELINE_SPINS 64
+// How long a stage sleeps when its ring stays full or empty
+#define PIPELINE_IDLE_NS 20000
+// Output is written in blocks of about this size
+#define PIPELINE_OUT_SIZE (64 * 1024)
+
+typedef struct command command;
+
+// A request travelling through the stages
+struct command {
+    request req;
+    // Holds the key and the value of the request
+    char *buffer;
+    // 1 if the retrieved value is a copy owned by the command
+    int owns_found;
+    // Set on the last element, after the input ended
+    int end;
+};
+
+typedef struct pipeline pipeline;
+
+struct pipeline {
+    FILE *input;
+    // Parser -> executor
+    spsc_ring_t *parsed;
+    // Executor -> emitter
+    spsc_ring_t *executed;
+};
+
+static void backoff(unsigned int *tries)
+{
+    if (++*tries < PIPELINE_SPINS) {
+        sched_yield();
+        return;
+    }
+
+    struct timespec ts = {0, PIPELINE_IDLE_NS};
+    nanosleep(&ts, NULL);
+}
+
+static void push_wait(spsc_ring_t *ring, const command *cmd)
+{
+    unsigned int tries = 0;
+
+    while (!spsc_ring_push(ring, cmd))
+        backoff(&tries);
+}
+
+static void pop_wait(spsc_ring_t *ring, command *cmd)
+{
+    unsigned int tries = 0;
+
+    while (!spsc_ring_pop(ring, cmd))
+        backoff(&tries);
+}
+
+/**
+ * First stage: reads and parses the lines of the input
+ */
+static void *parse_stage(void *arg)
+{
+    pipeline *pipe = (pipeline *)arg;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    command cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    while ((line_len = getline(&line, &line_cap, pipe->input)) > 0) {
+        line[line_len - 1] = 0;
+
+        // Key and value share one buffer, each has room for the whole line
+        cmd.buffer = (char *)malloc(2 * line_len);
+        DIE(!cmd.buffer, "command malloc failed");
+        cmd.req.key = cmd.buffer;
+        cmd.req.value = cmd.buffer + line_len;
+
+        int unknown = request_parse(line, &cmd.req) < 0;
+        push_wait(pipe->parsed, &cmd);
+        // Nothing after an unknown request is run
+        if (unknown)
+            break;
+    }
+    free(line);
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.end = 1;
+    push_wait(pipe->parsed, &cmd);
+
+    return NULL;
+}
+
+/**
+ * Last stage: formats the replies, in order, and writes them
+ */
+static void *emit_stage(void *arg)
+{
+    pipeline *pipe = (pipeline *)arg;
+    reply_buffer out = {NULL, 0, 0};
+    command cmd;
+
+    while (1) {
+        pop_wait(pipe->executed, &cmd);
+        if (cmd.end)
+            break;
+
+        if (cmd.req.type == REQUEST_UNKNOWN) {
+            if (out.len)
+                fwrite(out.data, 1, out.len, stdout);
+            fflush(stdout);
+            DIE(1, "unknown function call");
+        }
+
+        request_format(&cmd.req, &out);
+        if (out.len >= PIPELINE_OUT_SIZE) {
+            fwrite(out.data, 1, out.len, stdout);
+            out.len = 0;
+        }
+
+        free(cmd.req.text);
+        if (cmd.owns_found)
+            free(cmd.req.found);
+        free(cmd.buffer);
+    }
+
+    if (out.len)
+        fwrite(out.data, 1, out.len, stdout);
+    reply_free(&out);
+
+    return NULL;
+}
+
+/**
+ * Same as apply_requests, but reading and parsing, running the requests
+ * and formatting the replies are done by three threads linked by rings,
+ * so I/O and formatting overlap with the work on the hashtables. The
+ * load balancer is only touched by the calling thread, and the output is
+ * the same, in the same order.
+ * @param input the request file
+ * @param main the load balancer
+ */
+void apply_requests_pipelined(FILE *input, load_balancer *main)
+{
+    pipeline pipe;
+    pthread_t parser, emitter;
+
+    pipe.input = input;
+    pipe.parsed = spsc_ring_create(PIPELINE_RING_SIZE, sizeof(command));
+    pipe.executed = spsc_ring_create(PIPELINE_RING_SIZE, sizeof(command));
+
+    DIE(pthread_create(&parser, NULL, parse_stage, &pipe) != 0,
+        "pthread_create failed");
+    DIE(pthread_create(&emitter, NULL, emit_stage, &pipe) != 0,
+        "pthread_create failed");
+
+    // The calling thread is the executor
+    command cmd;
+    do {
+        pop_wait(pipe.parsed, &cmd);
+
+        if (!cmd.end && cmd.req.type != REQUEST_UNKNOWN) {
+            // As in apply_requests, a bare snapshot waits for the running one
+            if (cmd.req.type == REQUEST_SNAPSHOT && cmd.req.key[0] == 0)
+                snapshot_poll(main, SNAPSHOT_WAIT);
+            request_run(main, &cmd.req);
+            cmd.owns_found = 0;
+
+            // The value belongs to the load balancer and can change with
+            // the next request, the emitter gets its own copy
+            if (cmd.req.found) {
+                size_t len = strlen(cmd.req.found) + 1;
+                char *copy = (char *)malloc(len);
+                DIE(!copy, "command malloc failed");
+                memcpy(copy, cmd.req.found, len);
+                cmd.req.found = copy;
+                cmd.owns_found = 1;
+            }
+        }
+
+        push_wait(pipe.executed, &cmd);
+    } while (!cmd.end);
+
+    pthread_join(parser, NULL);
+    pthread_join(emitter, NULL);
+
+    spsc_ring_free(pipe.parsed);
+    spsc_ring_free(pipe.executed);
+}
@@ -0,0 +1,10 @@
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+#include <stdio.h>
+
+#include "load_balancer.h"
+
+void apply_requests_pipelined(FILE *input, load_balancer *main);
+
+#endif  // PIPELINE_H_
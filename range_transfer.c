@@ -0,0 +1,273 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "range_transfer.h"
+#include "load_balancer.h"
+#include "load_balancer_utils.h"
+#include "utils.h"
+
+#define RANGE_MAGIC 0x3152424cu /* "LBR1" */
+// Key length of the record which ends a stream
+#define RANGE_END 0xffffffffu
+// Records up to this size are written with a single call
+#define RANGE_SMALL_RECORD 1024
+
+typedef struct range_record range_record;
+
+// Header of every object of a stream, followed by the key and the value
+// (both without terminator)
+struct range_record {
+    uint32_t key_len;
+    uint32_t value_len;
+    uint64_t expires;
+};
+
+/**
+ * Checks if a hash is in the arc (lo, hi] of the ring, which wraps past
+ * the biggest hash when lo >= hi (lo == hi is the whole ring)
+ * @param lo start of the arc, excluded
+ * @param hi end of the arc, included
+ * @param hash the hash
+ */
+int range_contains(unsigned int lo, unsigned int hi, unsigned int hash)
+{
+    if (lo < hi)
+        return hash > lo && hash <= hi;
+    return hash > lo || hash <= hi;
+}
+
+static int write_piece(void *ctx, const char *data, unsigned int len)
+{
+    return fwrite(data, 1, len, (FILE *)ctx) != len;
+}
+
+static void write_object(range_export_t *export, server_memory *server,
+                         struct info *obj)
+{
+    range_record rec;
+    rec.key_len = obj->key_size - 1;
+    rec.value_len = server_value_length(obj);
+    rec.expires = obj->expires_at;
+
+    FILE *out = export->out;
+    unsigned long len = sizeof(rec) + rec.key_len + rec.value_len;
+    int failed;
+    if (!obj->chunked && len <= RANGE_SMALL_RECORD) {
+        // Small objects are copied out whole: one call into stdio each
+        char record[RANGE_SMALL_RECORD];
+        memcpy(record, &rec, sizeof(rec));
+        memcpy(record + sizeof(rec), obj->key, rec.key_len);
+        server_value_copy(server, obj, record + sizeof(rec) + rec.key_len);
+        failed = fwrite(record, 1, len, out) != len;
+    } else {
+        failed = fwrite(&rec, sizeof(rec), 1, out) != 1
+                 || fwrite(obj->key, 1, rec.key_len, out) != rec.key_len;
+        failed |= server_value_visit(server, obj, write_piece, out);
+    }
+
+    export->failed |= failed;
+    export->objects++;
+    export->bytes += len;
+}
+
+/*
+ * Every live object is written once, by the server its reads go to
+ */
+static int exported(range_export_t *export, server_memory *server,
+                    struct info *obj)
+{
+    return range_contains(export->lo, export->hi,
+                          hash_function_key(obj->key))
+           && object_holder(export->main, obj->key) == server;
+}
+
+/**
+ * Starts streaming the objects of an arc of the ring. Moves still pending
+ * after membership changes are done first, so every object is on its owner
+ * Returns the export, to be passed to range_export_step and range_export_end
+ * @param main the load balancer
+ * @param lo start of the arc, excluded
+ * @param hi end of the arc, included
+ * @param out where the stream is written
+ */
+range_export_t *range_export_begin(load_balancer *main, unsigned int lo,
+                                   unsigned int hi, FILE *out)
+{
+    if (main->exporter) {
+        fprintf(stderr, "an export is already running\n");
+        return NULL;
+    }
+
+    range_export_t *export = (range_export_t *)calloc(1, sizeof(*export));
+    DIE(!export, "range export malloc failed");
+    export->main = main;
+    export->out = out;
+    export->lo = lo;
+    export->hi = hi;
+
+    unsigned int header[3] = {RANGE_MAGIC, lo, hi};
+    export->failed = fwrite(header, sizeof(header), 1, out) != 1;
+
+    loader_rebalance_finish(main);
+    main->exporter = export;
+    return export;
+}
+
+/**
+ * Streams the objects of the next buckets. A membership change scans
+ * every bucket left before objects move, stores are streamed by
+ * range_export_note whether their bucket was scanned or not, so the
+ * scan never has to start over
+ * Returns 1 if there are buckets left, 0 once every server was scanned
+ * @param export the export
+ * @param buckets number of buckets to scan, 0 for all of them
+ */
+int range_export_step(range_export_t *export, unsigned int buckets)
+{
+    server_dir_t *dir = export->main->servers;
+    unsigned int done = 0;
+
+    while (export->slot < dir->n_slots && (buckets == 0 || done < buckets)) {
+        server_slot *slot = &dir->slots[export->slot];
+        if (slot->server == NULL) {
+            export->slot++;
+            continue;
+        }
+
+        // The hashtable may have been resized (or replaced) since the
+        // last step: objects changed buckets, so the server starts over
+        hashtable_t *ht = slot->server->hashtable;
+        if (export->hmax != ht->hmax) {
+            export->hmax = ht->hmax;
+            export->bucket = 0;
+        }
+
+        for (ll_node_t *it = ht_bucket_head(ht, export->bucket); it;
+             it = it->next)
+            if (exported(export, slot->server, it->data))
+                write_object(export, slot->server, it->data);
+        done++;
+
+        if (++export->bucket == export->hmax) {
+            export->slot++;
+            export->bucket = 0;
+            export->hmax = 0;
+        }
+    }
+
+    return export->slot < dir->n_slots;
+}
+
+/**
+ * Streams the current object of a key right after it was stored or its
+ * expiry changed, if it is in the arc; called by the load balancer
+ * @param export the export
+ * @param key the key
+ */
+void range_export_note(range_export_t *export, char *key)
+{
+    u_int obj_hash = hash_function_key(key);
+    if (!range_contains(export->lo, export->hi, obj_hash))
+        return;
+
+    server_memory *server = object_holder(export->main, key);
+    if (server != NULL)
+        write_object(export, server, ht_str_get_info(server->hashtable, key));
+}
+
+/**
+ * Scans what is left, ends the stream and frees the export. The stream
+ * is flushed, not closed
+ * Returns 0 on success, -1 if a write failed
+ * @param export the export
+ */
+int range_export_end(range_export_t *export)
+{
+    range_export_step(export, 0);
+
+    range_record end = {RANGE_END, 0, 0};
+    export->failed |= fwrite(&end, sizeof(end), 1, export->out) != 1;
+    export->failed |= fflush(export->out) != 0;
+
+    int failed = export->failed;
+    if (failed)
+        perror("range export write failed");
+    export->main->exporter = NULL;
+    free(export);
+    return failed ? -1 : 0;
+}
+
+/**
+ * Stores the objects of a stream written by range_export_*
+ * Returns the number of objects read, -1 if the stream is malformed or
+ * truncated (the objects read before stay stored)
+ * @param main the load balancer the objects are stored to
+ * @param in the stream
+ */
+long range_import(load_balancer *main, FILE *in)
+{
+    unsigned int header[3];
+    if (fread(header, sizeof(header), 1, in) != 1 || header[0] != RANGE_MAGIC) {
+        fprintf(stderr, "range import: not a range stream\n");
+        return -1;
+    }
+
+    // Keys and small values are read in one buffer, reused by every object
+    unsigned long cap = 2 * VALUE_CHUNK_SIZE + 2;
+    char *buffer = (char *)malloc(cap);
+    DIE(!buffer, "range import malloc failed");
+    long objects = 0;
+    int server_id_unused;
+    range_record rec;
+
+    while (fread(&rec, sizeof(rec), 1, in) == 1 && rec.key_len != RANGE_END) {
+        if ((unsigned long)rec.key_len + VALUE_CHUNK_SIZE + 2 > cap) {
+            cap = (unsigned long)rec.key_len + VALUE_CHUNK_SIZE + 2;
+            buffer = (char *)realloc(buffer, cap);
+            DIE(!buffer, "range import realloc failed");
+        }
+        char *key = buffer;
+        if (fread(key, 1, rec.key_len, in) != rec.key_len)
+            goto truncated;
+        key[rec.key_len] = 0;
+
+        if (rec.value_len <= VALUE_CHUNK_SIZE) {
+            char *value = buffer + rec.key_len + 1;
+            if (fread(value, 1, rec.value_len, in) != rec.value_len)
+                goto truncated;
+            value[rec.value_len] = 0;
+            loader_store(main, key, value, &server_id_unused);
+        } else {
+            // Big values are streamed, they never sit in a single buffer
+            char *piece = buffer + rec.key_len + 1;
+            loader_stream *stream = loader_store_begin(main, key);
+            for (unsigned int left = rec.value_len; left > 0; ) {
+                unsigned int len = left < VALUE_CHUNK_SIZE ? left
+                                                           : VALUE_CHUNK_SIZE;
+                if (fread(piece, 1, len, in) != len) {
+                    loader_store_cancel(stream);
+                    goto truncated;
+                }
+                loader_store_append(stream, piece, len);
+                left -= len;
+            }
+            loader_store_end(stream, &server_id_unused);
+        }
+
+        if (rec.expires != 0)
+            loader_expire_at(main, key, rec.expires);
+        objects++;
+    }
+    if (ferror(in) || feof(in))
+        goto truncated;
+
+    free(buffer);
+    return objects;
+
+truncated:
+    fprintf(stderr, "range import: the stream is truncated\n");
+    free(buffer);
+    return -1;
+}
@@ -0,0 +1,44 @@
+#ifndef RANGE_TRANSFER_H_
+#define RANGE_TRANSFER_H_
+
+#include <stdio.h>
+
+struct load_balancer;
+
+typedef struct range_export_t range_export_t;
+
+// Streams the objects whose hash is in an arc (lo, hi] of the ring, a few
+// buckets at a time. Stores done between the steps are streamed as they
+// happen, so the receiver ends up with the latest value of every key.
+struct range_export_t {
+    struct load_balancer *main;
+    FILE *out;
+    unsigned int lo;
+    unsigned int hi;
+    // Next server slot and bucket to scan, and the bucket count of the
+    // server when its scan started (a resize restarts it)
+    int slot;
+    unsigned int bucket;
+    unsigned int hmax;
+    // Records written so far, including the ones of stores
+    unsigned long objects;
+    unsigned long bytes;
+    // Set once a write failed
+    int failed;
+};
+
+int range_contains(unsigned int lo, unsigned int hi, unsigned int hash);
+
+range_export_t *range_export_begin(struct load_balancer *main,
+                                   unsigned int lo, unsigned int hi,
+                                   FILE *out);
+
+int range_export_step(range_export_t *export, unsigned int buckets);
+
+void range_export_note(range_export_t *export, char *key);
+
+int range_export_end(range_export_t *export);
+
+long range_import(struct load_balancer *main, FILE *in);
+
+#endif  // RANGE_TRANSFER_H_
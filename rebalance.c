@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rebalance.h"
+#include "load_balancer.h"
+#include "load_balancer_utils.h"
+#include "trace.h"
+#include "utils.h"
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/**
+ * Allocs an idle rebalancer (synchronous until a step is set)
+ */
+rebalance_t *rebalance_create(void)
+{
+    rebalance_t *rebalance = (rebalance_t *)calloc(1, sizeof(rebalance_t));
+    DIE(!rebalance, "rebalance malloc failed");
+
+    return rebalance;
+}
+
+/**
+ * Frees the rebalancer and the servers which were still being drained
+ * @param rebalance the rebalancer
+ */
+void rebalance_free(rebalance_t *rebalance)
+{
+    if (rebalance == NULL)
+        return;
+
+    for (int i = 0; i < rebalance->n_tasks; ++i)
+        if (rebalance->tasks[i].owned)
+            free_server_memory(rebalance->tasks[i].source);
+    free(rebalance->tasks);
+    free(rebalance);
+}
+
+static void add_task(rebalance_t *rebalance, server_memory *source,
+                     int source_id, int owned)
+{
+    if (rebalance->n_tasks == 0) {
+        rebalance->buckets_done = 0;
+        rebalance->buckets_total = 0;
+        rebalance->moved = 0;
+        rebalance->started_ns = now_ns();
+    }
+
+    if (rebalance->n_tasks == rebalance->tasks_cap) {
+        int cap = rebalance->tasks_cap ? 2 * rebalance->tasks_cap : 4;
+        migration *tasks = (migration *)realloc(rebalance->tasks,
+                                                cap * sizeof(migration));
+        DIE(!tasks, "rebalance realloc failed");
+        rebalance->tasks = tasks;
+        rebalance->tasks_cap = cap;
+    }
+
+    migration *task = &rebalance->tasks[rebalance->n_tasks++];
+    task->source = source;
+    task->source_id = source_id;
+    task->owned = owned;
+    task->cursor = 0;
+    task->hmax = source->hashtable->hmax;
+    rebalance->buckets_total += task->hmax;
+}
+
+static void remove_task(rebalance_t *rebalance, int index)
+{
+    migration *task = &rebalance->tasks[index];
+
+    // Buckets a dropped task will never scan are not left to do
+    rebalance->buckets_total -= task->hmax - task->cursor;
+    if (task->owned)
+        free_server_memory(task->source);
+    rebalance->tasks[index] = rebalance->tasks[--rebalance->n_tasks];
+}
+
+/**
+ * Schedules the scan of a server on the ring which may hold objects that
+ * now belong to another server (after a server joined next to it)
+ * @param main the load balancer
+ * @param source the server
+ * @param source_id ID of the server
+ */
+void rebalance_add_source(load_balancer *main, server_memory *source,
+                          int source_id)
+{
+    rebalance_t *rebalance = main->rebalance;
+
+    // A scan which is still running covers the new arcs too, but it may be
+    // past some of their objects, so it starts over
+    for (int i = 0; i < rebalance->n_tasks; ++i) {
+        if (rebalance->tasks[i].source == source) {
+            rebalance->buckets_total += rebalance->tasks[i].cursor;
+            rebalance->tasks[i].cursor = 0;
+            return;
+        }
+    }
+
+    add_task(rebalance, source, source_id, 0);
+}
+
+/**
+ * Schedules moving every object of a server which left the ring. The
+ * rebalancer owns the server from now on.
+ * @param main the load balancer
+ * @param source memory of the server
+ * @param source_id ID of the server
+ */
+void rebalance_drain(load_balancer *main, server_memory *source, int source_id)
+{
+    rebalance_t *rebalance = main->rebalance;
+
+    for (int i = 0; i < rebalance->n_tasks; ++i)
+        if (rebalance->tasks[i].source == source)
+            rebalance->tasks[i].owned = 0, remove_task(rebalance, i--);
+
+    // The last server left, the objects have nowhere to go
+    if (main->hashring_len == 0) {
+        while (rebalance->n_tasks > 0)
+            remove_task(rebalance, rebalance->n_tasks - 1);
+        free_server_memory(source);
+        return;
+    }
+
+    add_task(rebalance, source, source_id, 1);
+}
+
+/**
+ * Moves the objects of one bucket of a source which belong elsewhere
+ */
+static void migrate_bucket(load_balancer *main, migration *task,
+                           unsigned int bucket)
+{
+    server_memory *source = task->source;
+    ll_node_t *it = ht_bucket_head(source->hashtable, bucket);
+
+    while (it != NULL) {
+        ll_node_t *next = it->next;
+        struct info *obj = (struct info *)it->data;
+
+        if (server_expired(source, obj)) {
+            // Expired objects are reclaimed instead of being moved
+            server_reap(source, obj->key, 0);
+        } else {
+            int pos = binary_search_object_pos(main,
+                                               hash_function_key(obj->key));
+            server_memory *owner = ring_server(main, pos);
+
+            if (owner != source) {
+                // A copy already on the owner was written after the move
+                // started, so it is the newer one
+                if (ht_str_get_info(owner->hashtable, obj->key) == NULL)
+                    server_store_object(owner, obj);
+                server_remove(source, obj->key);
+                main->rebalance->moved++;
+            }
+        }
+        it = next;
+    }
+}
+
+/**
+ * Scans up to buckets buckets of the pending sources
+ * @param main the load balancer
+ * @param buckets how many buckets to scan
+ */
+void rebalance_step(load_balancer *main, unsigned int buckets)
+{
+    rebalance_t *rebalance = main->rebalance;
+    unsigned long start = trace_begin();
+    unsigned long moved = rebalance->moved;
+    int source_id = rebalance->n_tasks > 0
+                    ? rebalance->tasks[rebalance->n_tasks - 1].source_id : -1;
+
+    while (buckets > 0 && rebalance->n_tasks > 0) {
+        migration *task = &rebalance->tasks[rebalance->n_tasks - 1];
+        hashtable_t *ht = task->source->hashtable;
+
+        // The source was resized, objects may have moved behind the cursor
+        if (ht->hmax != task->hmax) {
+            rebalance->buckets_total += ht->hmax - (task->hmax - task->cursor);
+            task->hmax = ht->hmax;
+            task->cursor = 0;
+        }
+
+        while (buckets > 0 && task->cursor < task->hmax) {
+            migrate_bucket(main, task, task->cursor++);
+            rebalance->buckets_done++;
+            buckets--;
+        }
+
+        if (task->cursor == task->hmax) {
+            // A source which stays on the ring may have lost most objects
+            if (!task->owned)
+                server_compact(task->source);
+            remove_task(rebalance, rebalance->n_tasks - 1);
+        }
+    }
+    trace_end(start, TRACE_REBALANCE, source_id, 0, 0,
+              rebalance->moved - moved);
+}
+
+/**
+ * Completes every pending migration
+ * @param main the load balancer
+ */
+void rebalance_finish(load_balancer *main)
+{
+    while (main->rebalance->n_tasks > 0)
+        rebalance_step(main, main->rebalance->tasks[0].hmax + 1);
+}
+
+/**
+ * Finds the source which still holds a key that belongs to another server
+ * Returns its migration, or NULL
+ * @param main the load balancer
+ * @param key the key
+ * @param owner the server which owns the key on the ring
+ */
+migration *rebalance_holder(load_balancer *main, char *key,
+                            server_memory *owner)
+{
+    rebalance_t *rebalance = main->rebalance;
+
+    for (int i = 0; i < rebalance->n_tasks; ++i) {
+        migration *task = &rebalance->tasks[i];
+        if (task->source == owner)
+            continue;
+
+        struct info *obj = ht_str_get_info(task->source->hashtable, key);
+        if (obj != NULL && !server_expired(task->source, obj))
+            return task;
+    }
+
+    return NULL;
+}
+
+/**
+ * Drops the copies of a key which wait to be moved, after its owner got a
+ * newer value
+ * @param main the load balancer
+ * @param key the key
+ * @param owner the server which owns the key on the ring
+ */
+void rebalance_forget(load_balancer *main, char *key, server_memory *owner)
+{
+    rebalance_t *rebalance = main->rebalance;
+
+    for (int i = 0; i < rebalance->n_tasks; ++i)
+        if (rebalance->tasks[i].source != owner)
+            server_remove(rebalance->tasks[i].source, key);
+}
+
+/**
+ * Moves a single key to its owner right away, if it waits to be moved
+ * @param main the load balancer
+ * @param key the key
+ */
+void rebalance_pull(load_balancer *main, char *key)
+{
+    int pos = binary_search_object_pos(main, hash_function_key(key));
+    server_memory *owner = ring_server(main, pos);
+    migration *task = rebalance_holder(main, key, owner);
+
+    if (task == NULL)
+        return;
+
+    if (ht_str_get_info(owner->hashtable, key) == NULL)
+        server_store_object(owner,
+                            ht_str_get_info(task->source->hashtable, key));
+    server_remove(task->source, key);
+    main->rebalance->moved++;
+}
+
+/**
+ * Reports the progress of the pending migrations
+ * Returns 1 if objects are still being moved, 0 otherwise
+ * @param main the load balancer
+ * @param status where the progress is written
+ */
+int rebalance_get_status(load_balancer *main, rebalance_status *status)
+{
+    rebalance_t *rebalance = main->rebalance;
+
+    memset(status, 0, sizeof(*status));
+    if (rebalance->n_tasks == 0)
+        return 0;
+
+    status->sources = rebalance->n_tasks;
+    status->buckets_done = rebalance->buckets_done;
+    status->buckets_total = rebalance->buckets_total;
+    status->moved = rebalance->moved;
+
+    unsigned long elapsed_ns = now_ns() - rebalance->started_ns;
+    unsigned long left = rebalance->buckets_total - rebalance->buckets_done;
+    if (rebalance->buckets_done > 0)
+        status->eta_ms = (unsigned long)((double)elapsed_ns / 1e6
+                                         * left / rebalance->buckets_done);
+
+    return 1;
+}
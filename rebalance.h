@@ -0,0 +1,76 @@
+#ifndef REBALANCE_H_
+#define REBALANCE_H_
+
+#include "server.h"
+
+struct load_balancer;
+
+typedef struct migration migration;
+
+// A server whose objects are being moved to their owners on the ring
+struct migration {
+    server_memory *source;
+    int source_id;
+    // 1 if the source left the ring: it is freed once drained
+    int owned;
+    // Next bucket of the source to move, and its bucket count when the
+    // scan started (a resize restarts the scan)
+    unsigned int cursor;
+    unsigned int hmax;
+};
+
+typedef struct rebalance_t rebalance_t;
+
+// Incremental rebalancing: ring changes take effect at once and the
+// objects follow a few buckets per operation
+struct rebalance_t {
+    // Buckets scanned per operation, 0 means membership changes move
+    // every object before returning
+    unsigned int step;
+    migration *tasks;
+    int n_tasks;
+    int tasks_cap;
+    // Progress since the last time no migration was running
+    unsigned long buckets_done;
+    unsigned long buckets_total;
+    unsigned long moved;
+    unsigned long started_ns;
+};
+
+typedef struct rebalance_status rebalance_status;
+
+struct rebalance_status {
+    // Servers still being drained
+    int sources;
+    unsigned long buckets_done;
+    unsigned long buckets_total;
+    unsigned long moved;
+    // Estimated time left, from the speed so far
+    unsigned long eta_ms;
+};
+
+rebalance_t *rebalance_create(void);
+
+void rebalance_free(rebalance_t *rebalance);
+
+void rebalance_add_source(struct load_balancer *main, server_memory *source,
+                          int source_id);
+
+void rebalance_drain(struct load_balancer *main, server_memory *source,
+                     int source_id);
+
+void rebalance_step(struct load_balancer *main, unsigned int buckets);
+
+void rebalance_finish(struct load_balancer *main);
+
+migration *rebalance_holder(struct load_balancer *main, char *key,
+                            server_memory *owner);
+
+void rebalance_forget(struct load_balancer *main, char *key,
+                      server_memory *owner);
+
+void rebalance_pull(struct load_balancer *main, char *key);
+
+int rebalance_get_status(struct load_balancer *main, rebalance_status *status);
+
+#endif  // REBALANCE_H_
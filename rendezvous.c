@@ -0,0 +1,252 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rendezvous.h"
+#include "utils.h"
+
+// GCC vector extensions: the scores of HRW_LANES servers are computed by
+// the same instructions, SSE2 by default and AVX2 where the CPU has it
+typedef unsigned int v8u __attribute__((vector_size(4 * HRW_LANES)));
+typedef int v8i __attribute__((vector_size(4 * HRW_LANES)));
+typedef float v8f __attribute__((vector_size(4 * HRW_LANES)));
+
+#if defined(__x86_64__)
+#define HRW_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define HRW_CLONES
+#endif
+
+// The helpers are inlined in every clone and take their vectors by
+// address, which keeps them out of the calling convention
+#define HRW_INLINE static inline __attribute__((always_inline))
+
+/*
+ * Finalizer of murmur3, makes every bit of the score depend on every bit
+ * of the seed and of the hash
+ */
+HRW_INLINE void mix(v8u *h)
+{
+    *h ^= *h >> 16;
+    *h *= 0x85ebca6bu;
+    *h ^= *h >> 13;
+    *h *= 0xc2b2ae35u;
+    *h ^= *h >> 16;
+}
+
+/*
+ * -log2(u) for u in (0, 1), from the exponent and a polynomial of the
+ * mantissa (error about 1e-6, increasing like the logarithm)
+ */
+HRW_INLINE void neg_log2(v8f *u)
+{
+    v8i bits = (v8i)*u;
+    v8i exponent = (bits >> 23) - 127;
+    v8f t = (v8f)((bits & 0x7fffff) | 0x3f800000) - 1.0f;
+
+    v8f p = t * 0.020016650f - 0.094626810f;
+    p = p * t + 0.213943212f;
+    p = p * t - 0.338377198f;
+    p = p * t + 0.477496364f;
+    p = p * t - 0.721144092f;
+    p = p * t + 1.442692983f;
+
+    *u = -(__builtin_convertvector(exponent, v8f) + p * t);
+}
+
+/*
+ * Ranks of the servers of a block for an object, the higher the better.
+ * Unweighted the rank is the score itself. Weighted the score is
+ * w / -ln(u) (u uniform in (0, 1)), so a server with twice the weight
+ * wins twice as often; the rank orders the costs -ln(u) / w by their
+ * bits, which sort like the (positive) floats.
+ */
+HRW_INLINE void block_ranks(const rendezvous_t *r, int block,
+                            unsigned int object_hash, v8u *rank)
+{
+    v8u score;
+    memcpy(&score, r->seeds + block * HRW_LANES, sizeof(score));
+    score ^= object_hash;
+    mix(&score);
+
+    if (!r->weighted) {
+        *rank = score;
+        return;
+    }
+
+    // The top 24 bits convert to a float exactly
+    v8f u = (__builtin_convertvector((v8i)(score >> 8), v8f) + 0.5f)
+            * (1.0f / 16777216.0f);
+    v8f inv_weights;
+    memcpy(&inv_weights, r->inv_weights + block * HRW_LANES,
+           sizeof(inv_weights));
+    neg_log2(&u);
+    v8f cost = u * inv_weights;
+
+    *rank = ~(v8u)cost;
+}
+
+/*
+ * Replaces every lane of a and a_index by the better of itself and the
+ * lane order points to: the higher rank, then the lower index
+ */
+HRW_INLINE void keep_better(v8u *a, v8i *a_index, const v8i *order)
+{
+    v8u b = __builtin_shuffle(*a, *order);
+    v8i b_index = __builtin_shuffle(*a_index, *order);
+    v8i better = (b > *a) | ((b == *a) & (b_index < *a_index));
+
+    *a = (v8u)(((v8i)b & better) | ((v8i)*a & ~better));
+    *a_index = (b_index & better) | (*a_index & ~better);
+}
+
+static int blocks(const rendezvous_t *r)
+{
+    return (r->n + HRW_LANES - 1) / HRW_LANES;
+}
+
+/**
+ * Allocs an empty set of servers
+ * @param weighted 1 if the servers have weights, 0 if they all get the
+ *                 same share (cheaper scores)
+ */
+rendezvous_t *rendezvous_create(int weighted)
+{
+    rendezvous_t *r = (rendezvous_t *)calloc(1, sizeof(rendezvous_t));
+    DIE(!r, "rendezvous malloc failed");
+    r->weighted = weighted;
+
+    return r;
+}
+
+/**
+ * Frees the set of servers
+ * @param r the set
+ */
+void rendezvous_free(rendezvous_t *r)
+{
+    if (r == NULL)
+        return;
+
+    free(r->seeds);
+    free(r->inv_weights);
+    free(r->weights);
+    free(r);
+}
+
+/*
+ * The lanes after the last server never win
+ */
+static void pad(rendezvous_t *r)
+{
+    for (int i = r->n; i < blocks(r) * HRW_LANES; ++i) {
+        r->seeds[i] = 0;
+        r->inv_weights[i] = INFINITY;
+    }
+}
+
+/**
+ * Inserts a server
+ * @param r the set
+ * @param index position of the server (same as on the hashring)
+ * @param seed seed of the server, it has to be unique
+ * @param weight share of the objects the server gets, relative to the
+ *               others (ignored unless the set is weighted)
+ */
+void rendezvous_insert(rendezvous_t *r, int index, unsigned int seed,
+                       unsigned int weight)
+{
+    if (r->n + 1 > r->cap) {
+        int cap = r->cap ? 2 * r->cap : HRW_LANES;
+
+        r->seeds = (unsigned int *)realloc(r->seeds, cap * sizeof(int));
+        r->inv_weights = (float *)realloc(r->inv_weights,
+                                          cap * sizeof(float));
+        r->weights = (unsigned int *)realloc(r->weights, cap * sizeof(int));
+        DIE(!r->seeds || !r->inv_weights || !r->weights,
+            "rendezvous realloc failed");
+        r->cap = cap;
+    }
+
+    int after = r->n - index;
+    memmove(r->seeds + index + 1, r->seeds + index, after * sizeof(int));
+    memmove(r->inv_weights + index + 1, r->inv_weights + index,
+            after * sizeof(float));
+    memmove(r->weights + index + 1, r->weights + index, after * sizeof(int));
+
+    r->seeds[index] = seed;
+    r->weights[index] = weight;
+    r->inv_weights[index] = 1.0f / weight;
+    r->n++;
+    pad(r);
+}
+
+/**
+ * Removes a server
+ * @param r the set
+ * @param index position of the server
+ */
+void rendezvous_remove(rendezvous_t *r, int index)
+{
+    int after = r->n - index - 1;
+    memmove(r->seeds + index, r->seeds + index + 1, after * sizeof(int));
+    memmove(r->inv_weights + index, r->inv_weights + index + 1,
+            after * sizeof(float));
+    memmove(r->weights + index, r->weights + index + 1, after * sizeof(int));
+    r->n--;
+    pad(r);
+}
+
+/**
+ * Returns the position of the server an object belongs to (the first one
+ * if several have the best rank)
+ * @param r the set, not empty
+ * @param object_hash the hash of the object
+ */
+HRW_CLONES
+int rendezvous_owner(const rendezvous_t *r, unsigned int object_hash)
+{
+    v8u best = {0};
+    v8i best_index = {0};
+    v8i index = {0, 1, 2, 3, 4, 5, 6, 7};
+
+    // Every lane keeps the best server it saw, ties keep the first one
+    for (int block = 0; block < blocks(r); ++block) {
+        v8u rank;
+        block_ranks(r, block, object_hash, &rank);
+        v8i better = (rank > best) & (index < r->n);
+
+        best = (v8u)(((v8i)rank & better) | ((v8i)best & ~better));
+        best_index = (index & better) | (best_index & ~better);
+        index += HRW_LANES;
+    }
+
+    // Reduce the lanes with shuffles: comparing them one by one is a
+    // branch the predictor gets wrong about half of the time
+    static const v8i halves = {4, 5, 6, 7, 0, 1, 2, 3};
+    static const v8i pairs = {2, 3, 0, 1, 6, 7, 4, 5};
+    static const v8i neighbours = {1, 0, 3, 2, 5, 4, 7, 6};
+
+    keep_better(&best, &best_index, &halves);
+    keep_better(&best, &best_index, &pairs);
+    keep_better(&best, &best_index, &neighbours);
+
+    return best_index[0];
+}
+
+/**
+ * Computes the rank of every server for an object, to pick several
+ * @param r the set
+ * @param object_hash the hash of the object
+ * @param ranks where the ranks are written (room for r->cap elements)
+ */
+HRW_CLONES
+void rendezvous_ranks(const rendezvous_t *r, unsigned int object_hash,
+                      unsigned int *ranks)
+{
+    for (int block = 0; block < blocks(r); ++block) {
+        v8u rank;
+        block_ranks(r, block, object_hash, &rank);
+        memcpy(ranks + block * HRW_LANES, &rank, sizeof(rank));
+    }
+}
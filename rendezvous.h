@@ -0,0 +1,39 @@
+#ifndef RENDEZVOUS_H_
+#define RENDEZVOUS_H_
+
+// Servers scored by a single vector operation (8 x 32 bits, one AVX2
+// register)
+#define HRW_LANES 8
+
+typedef struct rendezvous_t rendezvous_t;
+
+// Rendezvous (highest random weight) placement: an object belongs to the
+// server with the best score for its hash. Arrays are indexed like the
+// servers on the hashring and padded to a multiple of HRW_LANES.
+struct rendezvous_t {
+    // Seed of every server, mixed with the hash of the object
+    unsigned int *seeds;
+    // 1 / weight of every server (infinite for the padding)
+    float *inv_weights;
+    unsigned int *weights;
+    int n;
+    int cap;
+    // 0 if all the servers get the same share of the objects
+    int weighted;
+};
+
+rendezvous_t *rendezvous_create(int weighted);
+
+void rendezvous_free(rendezvous_t *r);
+
+void rendezvous_insert(rendezvous_t *r, int index, unsigned int seed,
+                       unsigned int weight);
+
+void rendezvous_remove(rendezvous_t *r, int index);
+
+int rendezvous_owner(const rendezvous_t *r, unsigned int object_hash);
+
+void rendezvous_ranks(const rendezvous_t *r, unsigned int object_hash,
+                      unsigned int *ranks);
+
+#endif  // RENDEZVOUS_H_
@@ -0,0 +1,496 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "request.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "utils.h"
+
+#define REPLY_INIT_SIZE 256
+
+/**
+ * Extracts the key and the value of a store line
+ * @param key buffer of at least strlen(line) + 1 bytes
+ * @param value buffer of at least strlen(line) + 1 bytes
+ * @param line the request line
+ */
+void get_key_value(char *key, char *value, char *line)
+{
+    int key_start = 0, value_start = 0;
+    int key_finish = 0, value_finish = 0;
+    size_t key_index = 0, value_index = 0;
+    size_t line_len = strlen(line);
+
+    for (size_t i = 0; i < line_len; ++i) {
+        if (line[i] == '"' && value_start != 1) {
+            if (key_start == 0) {
+                key_start = 1;
+            } else if (key_finish == 0) {
+                key_finish = 1;
+            } else if (value_start == 0) {
+                value_start = 1;
+            }
+        } else {
+            if (key_start == 1 && key_finish == 0) {
+                key[key_index++] = line[i];
+            } else if (value_start == 1 && value_finish == 0) {
+                value[value_index++] = line[i];
+            }
+        }
+    }
+
+    key[key_index] = 0;
+    // Drop the closing quote of the value
+    value[value_index > 0 ? value_index - 1 : 0] = 0;
+}
+
+/**
+ * Extracts the key of a retrieve line
+ * @param key buffer of at least strlen(line) + 1 bytes
+ * @param line the request line
+ */
+void get_key(char *key, char *line)
+{
+    int key_start = 0;
+    size_t key_index = 0;
+    size_t line_len = strlen(line);
+
+    for (size_t i = 0; i < line_len; ++i) {
+        if (line[i] == '"') {
+            key_start = 1;
+        } else if (key_start == 1) {
+            key[key_index++] = line[i];
+        }
+    }
+    key[key_index] = 0;
+}
+
+/**
+ * Extracts every quoted string of a line, one after the other, each with
+ * its terminator. Returns the number of strings
+ * @param dest buffer of at least strlen(line) + 1 bytes
+ * @param line the request line
+ */
+unsigned int get_strings(char *dest, char *line)
+{
+    unsigned int count = 0;
+    int inside = 0;
+
+    for (char *it = line; *it; ++it) {
+        if (*it == '"') {
+            if (inside)
+                *dest++ = 0;
+            else
+                count++;
+            inside = !inside;
+        } else if (inside) {
+            *dest++ = *it;
+        }
+    }
+    if (inside)
+        *dest = 0;
+
+    return count;
+}
+
+/**
+ * Extracts the value of a name=value label of a line, up to the next
+ * whitespace; dest is left empty if the label is missing
+ * @param dest buffer of at least strlen(line) + 1 bytes
+ * @param line the request line
+ * @param name the label followed by '='
+ */
+static void get_label(char *dest, char *line, const char *name)
+{
+    char *it = strstr(line, name);
+
+    *dest = 0;
+    if (!it)
+        return;
+    it += strlen(name);
+    size_t len = strcspn(it, " \t\r\n");
+    memcpy(dest, it, len);
+    dest[len] = 0;
+}
+
+/**
+ * Parses a request line (without its newline)
+ * Returns 0 on success, -1 if the command is unknown
+ * @param line the request line
+ * @param req the request; req->key and req->value must point to buffers of
+ *            at least strlen(line) + 1 bytes
+ */
+int request_parse(char *line, request *req)
+{
+    // store_ttl has to be checked before store, it starts the same way
+    if (!strncmp(line, "store_ttl", sizeof("store_ttl") - 1)) {
+        // store_ttl <ms> "key" "value"
+        req->type = REQUEST_STORE_TTL;
+        req->ttl = strtoul(line + sizeof("store_ttl") - 1, NULL, 10);
+        get_key_value(req->key, req->value, line);
+    } else if (!strncmp(line, "store", sizeof("store") - 1)) {
+        req->type = REQUEST_STORE;
+        get_key_value(req->key, req->value, line);
+    } else if (!strncmp(line, "retrieve", sizeof("retrieve") - 1)) {
+        req->type = REQUEST_RETRIEVE;
+        get_key(req->key, line);
+    } else if (!strncmp(line, "add_server", sizeof("add_server") - 1)) {
+        // add_server <id> [weight] [zone=<zone> [rack=<rack>]] [node=<node>]
+        char *end, *node;
+        req->type = REQUEST_ADD_SERVER;
+        req->server_id = strtol(line + sizeof("add_server") - 1, &end, 10);
+        req->weight = strtoul(end, NULL, 10);
+        if (req->weight == 0)
+            req->weight = 1;
+        get_label(req->key, end, "zone=");
+        get_label(req->value, end, "rack=");
+        node = strstr(end, "node=");
+        req->node = node ? atoi(node + sizeof("node=") - 1) : -1;
+    } else if (!strncmp(line, "remove_server", sizeof("remove_server") - 1)) {
+        req->type = REQUEST_REMOVE_SERVER;
+        req->server_id = atoi(line + sizeof("remove_server") - 1);
+    } else if (!strncmp(line, "stats", sizeof("stats") - 1)) {
+        req->type = REQUEST_STATS;
+    } else if (!strncmp(line, "mstore", sizeof("mstore") - 1)) {
+        // mstore "key1" "value1" "key2" "value2" ...
+        req->type = REQUEST_MSTORE;
+        req->count = get_strings(req->key, line);
+        // A key without its value is a malformed line, not a shorter batch
+        if (req->count % 2 != 0) {
+            req->type = REQUEST_UNKNOWN;
+            return -1;
+        }
+    } else if (!strncmp(line, "mretrieve", sizeof("mretrieve") - 1)) {
+        // mretrieve "key1" "key2" ...
+        req->type = REQUEST_MRETRIEVE;
+        req->count = get_strings(req->key, line);
+    } else if (!strncmp(line, "trace", sizeof("trace") - 1)) {
+        // trace on [threshold_us] | trace off | trace dump [file]
+        char *arg = line + sizeof("trace") - 1;
+        arg += strspn(arg, " \t");
+        if (!strncmp(arg, "on", sizeof("on") - 1)) {
+            req->type = REQUEST_TRACE_ON;
+            req->threshold = strtoul(arg + sizeof("on") - 1, NULL, 10);
+        } else if (!strncmp(arg, "off", sizeof("off") - 1)) {
+            req->type = REQUEST_TRACE_OFF;
+        } else if (!strncmp(arg, "dump", sizeof("dump") - 1)) {
+            req->type = REQUEST_TRACE_DUMP;
+            if (sscanf(arg + sizeof("dump") - 1, "%s", req->key) != 1)
+                req->key[0] = 0;
+        } else {
+            req->type = REQUEST_UNKNOWN;
+            return -1;
+        }
+    } else if (!strncmp(line, "snapshot", sizeof("snapshot") - 1)) {
+        // snapshot [file]
+        req->type = REQUEST_SNAPSHOT;
+        if (sscanf(line + sizeof("snapshot") - 1, "%s", req->key) != 1)
+            req->key[0] = 0;
+    } else {
+        req->type = REQUEST_UNKNOWN;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs mstore or mretrieve as one batch; the replies, one line per key as
+ * for store and retrieve, are kept in req->text
+ */
+static void run_batch(load_balancer *main, request *req)
+{
+    unsigned int n = req->type == REQUEST_MSTORE ? req->count / 2 : req->count;
+    char **keys = (char **)malloc((n + 1) * sizeof(char *));
+    char **values = (char **)malloc((n + 1) * sizeof(char *));
+    int *owners = (int *)malloc((n + 1) * sizeof(int));
+    DIE(!keys || !values || !owners, "batch request malloc failed");
+
+    char *it = req->key;
+    for (unsigned int i = 0; i < n; ++i) {
+        keys[i] = it;
+        it += strlen(it) + 1;
+        if (req->type == REQUEST_MSTORE) {
+            values[i] = it;
+            it += strlen(it) + 1;
+        }
+    }
+
+    reply_buffer out = {NULL, 0, 0};
+    if (req->type == REQUEST_MSTORE) {
+        loader_store_batch(main, keys, values, n, owners);
+        for (unsigned int i = 0; i < n; ++i) {
+            if (owners[i] >= 0)
+                reply_printf(&out, "Stored %s on server %d.\n", values[i],
+                             owners[i]);
+            else
+                reply_printf(&out, "Can't store %s, there are no servers.\n",
+                             values[i]);
+        }
+    } else {
+        loader_retrieve_batch(main, keys, n, values, owners);
+        for (unsigned int i = 0; i < n; ++i) {
+            if (values[i])
+                reply_printf(&out, "Retrieved %s from server %d.\n",
+                             values[i], owners[i]);
+            else
+                reply_printf(&out, "Key %s not present.\n", keys[i]);
+        }
+    }
+    req->text = out.data;
+    req->text_len = out.len;
+
+    free(keys);
+    free(values);
+    free(owners);
+}
+
+/**
+ * Writes the trace to the file of the request, or to req->text as JSON if
+ * it has none; the reply of the first case says how many events there were
+ */
+static void run_trace_dump(request *req)
+{
+    if (req->key[0] == 0) {
+        FILE *mem = open_memstream(&req->text, &req->text_len);
+        DIE(!mem, "trace buffer open failed");
+
+        trace_dump(mem);
+        fclose(mem);
+        return;
+    }
+
+    reply_buffer out = {NULL, 0, 0};
+    FILE *file = fopen(req->key, "w");
+    long events = file ? trace_dump(file) : -1;
+    if (file && fclose(file) != 0)
+        events = -1;
+
+    if (events < 0)
+        reply_printf(&out, "Can't write the trace to %s.\n", req->key);
+    else
+        reply_printf(&out, "Dumped %ld trace events to %s.\n", events,
+                     req->key);
+    req->text = out.data;
+    req->text_len = out.len;
+}
+
+/*
+ * Starts a background snapshot to the file of the request or, without a
+ * file, waits for the running one and reports the last one; the outcome
+ * is the text of the request
+ */
+static void run_snapshot(load_balancer *main, request *req)
+{
+    reply_buffer out = {NULL, 0, 0};
+
+    if (req->key[0] != 0) {
+        if (snapshot_start(main, req->key) < 0)
+            reply_printf(&out, "Can't start a snapshot to %s.\n", req->key);
+        else
+            reply_printf(&out, "Snapshot to %s started, fork took %.1f us.\n",
+                         req->key, main->snapshot->fork_ns / 1e3);
+    } else {
+        // Never waits: the client asks again while the child is running
+        snapshot_poll(main, SNAPSHOT_NOW);
+        snapshot_job *job = main->snapshot;
+        if (job != NULL && job->pid != 0)
+            reply_printf(&out, "Snapshot running for %.1f ms.\n",
+                         snapshot_running_ms(job));
+        else if (job == NULL || job->written + job->failed == 0)
+            reply_printf(&out, "No snapshot written.\n");
+        else if (job->last_failed)
+            reply_printf(&out, "Snapshot failed.\n");
+        else
+            reply_printf(&out, "Snapshot written in %.1f ms, %ld kB copied "
+                         "on write.\n", job->duration_ns / 1e6, job->cow_kb);
+    }
+    req->text = out.data;
+    req->text_len = out.len;
+}
+
+/**
+ * Runs a parsed request on the load balancer, without formatting its reply
+ * @param main the load balancer
+ * @param req the request
+ */
+void request_run(load_balancer *main, request *req)
+{
+    req->owner = 0;
+    req->found = NULL;
+    req->text = NULL;
+    req->text_len = 0;
+
+    // The child of a background snapshot is collected once it exits
+    if (req->type != REQUEST_SNAPSHOT)
+        snapshot_poll(main, SNAPSHOT_PERIODIC);
+
+    switch (req->type) {
+    case REQUEST_STORE:
+        loader_store(main, req->key, req->value, &req->owner);
+        break;
+    case REQUEST_STORE_TTL:
+        loader_store_ttl(main, req->key, req->value, req->ttl, &req->owner);
+        break;
+    case REQUEST_RETRIEVE:
+        req->found = loader_retrieve(main, req->key, &req->owner);
+        break;
+    case REQUEST_ADD_SERVER:
+        if (req->key[0])
+            loader_add_server_at(main, req->server_id, req->key, req->value);
+        else
+            loader_add_server_weighted(main, req->server_id, req->weight);
+        if (req->node >= 0)
+            loader_set_server_node(main, req->server_id, req->node);
+        break;
+    case REQUEST_REMOVE_SERVER:
+        loader_remove_server(main, req->server_id);
+        break;
+    case REQUEST_STATS: {
+        FILE *mem = open_memstream(&req->text, &req->text_len);
+        DIE(!mem, "stats buffer open failed");
+
+        loader_print_stats(main, mem);
+        fclose(mem);
+        break;
+    }
+    case REQUEST_MSTORE:
+    case REQUEST_MRETRIEVE:
+        run_batch(main, req);
+        break;
+    case REQUEST_TRACE_ON:
+        trace_enable(req->threshold);
+        break;
+    case REQUEST_TRACE_OFF:
+        trace_disable();
+        break;
+    case REQUEST_TRACE_DUMP:
+        run_trace_dump(req);
+        break;
+    case REQUEST_SNAPSHOT:
+        run_snapshot(main, req);
+        break;
+    case REQUEST_UNKNOWN:
+        break;
+    }
+}
+
+/**
+ * Appends the reply (possibly empty) of a request which ran to out
+ * @param req the request
+ * @param out where the reply is written
+ */
+void request_format(request *req, reply_buffer *out)
+{
+    switch (req->type) {
+    case REQUEST_STORE:
+    case REQUEST_STORE_TTL:
+        reply_printf(out, "Stored %s on server %d.\n", req->value, req->owner);
+        break;
+    case REQUEST_RETRIEVE:
+        if (req->found)
+            reply_printf(out, "Retrieved %s from server %d.\n", req->found,
+                         req->owner);
+        else
+            reply_printf(out, "Key %s not present.\n", req->key);
+        break;
+    case REQUEST_STATS:
+    case REQUEST_MSTORE:
+    case REQUEST_MRETRIEVE:
+    case REQUEST_TRACE_DUMP:
+    case REQUEST_SNAPSHOT:
+        reply_append(out, req->text, req->text_len);
+        break;
+    case REQUEST_UNKNOWN:
+        reply_printf(out, "Unknown request.\n");
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Runs a parsed request and appends its reply (possibly empty) to out
+ * @param main the load balancer
+ * @param req the request
+ * @param out where the reply is written
+ */
+void request_execute(load_balancer *main, request *req, reply_buffer *out)
+{
+    request_run(main, req);
+    request_format(req, out);
+    free(req->text);
+}
+
+/**
+ * Makes room for len more bytes (plus a terminator)
+ */
+static void reply_reserve(reply_buffer *out, size_t len)
+{
+    if (out->len + len + 1 <= out->cap)
+        return;
+
+    size_t cap = out->cap ? out->cap : REPLY_INIT_SIZE;
+    while (cap < out->len + len + 1)
+        cap *= 2;
+
+    char *data = (char *)realloc(out->data, cap);
+    DIE(!data, "reply buffer realloc failed");
+    out->data = data;
+    out->cap = cap;
+}
+
+/**
+ * Appends raw bytes to a reply buffer
+ * @param out the buffer
+ * @param data the bytes
+ * @param len number of bytes
+ */
+void reply_append(reply_buffer *out, const char *data, size_t len)
+{
+    reply_reserve(out, len);
+    if (len > 0)
+        memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+/**
+ * Appends formatted text to a reply buffer
+ * @param out the buffer
+ * @param format printf format
+ */
+void reply_printf(reply_buffer *out, const char *format, ...)
+{
+    va_list args;
+
+    // Most replies fit in the space left, the others are formatted twice
+    va_start(args, format);
+    size_t room = out->cap - out->len;
+    int len = vsnprintf(out->cap ? out->data + out->len : NULL, room, format,
+                        args);
+    va_end(args);
+    DIE(len < 0, "reply format failed");
+
+    if ((size_t)len >= room) {
+        reply_reserve(out, len);
+        va_start(args, format);
+        vsnprintf(out->data + out->len, len + 1, format, args);
+        va_end(args);
+    }
+    out->len += len;
+}
+
+/**
+ * Frees the memory of a reply buffer
+ * @param out the buffer
+ */
+void reply_free(reply_buffer *out)
+{
+    free(out->data);
+    out->data = NULL;
+    out->len = out->cap = 0;
+}
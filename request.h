@@ -0,0 +1,89 @@
+#ifndef REQUEST_H_
+#define REQUEST_H_
+
+#include <stddef.h>
+
+#include "load_balancer.h"
+
+// Commands of the text protocol, one per line
+typedef enum request_type {
+    REQUEST_STORE,
+    REQUEST_STORE_TTL,
+    REQUEST_RETRIEVE,
+    REQUEST_ADD_SERVER,
+    REQUEST_REMOVE_SERVER,
+    REQUEST_STATS,
+    REQUEST_MSTORE,
+    REQUEST_MRETRIEVE,
+    REQUEST_TRACE_ON,
+    REQUEST_TRACE_OFF,
+    REQUEST_TRACE_DUMP,
+    // snapshot <file> starts a background snapshot, snapshot reports how
+    // long the running one has taken or how the last one went
+    REQUEST_SNAPSHOT,
+    REQUEST_UNKNOWN
+} request_type;
+
+typedef struct request request;
+
+// A parsed request line and, once it ran, its outcome
+struct request {
+    request_type type;
+    // Buffers provided by the caller, filled by request_parse (add_server:
+    // zone and rack labels, trace dump and snapshot: file, empty if not
+    // given)
+    char *key;
+    char *value;
+    int server_id;
+    // add_server: share of the objects of the server, 1 if not given
+    unsigned int weight;
+    // add_server: NUMA node the memory of the server is placed on, -1 if
+    // not given
+    int node;
+    unsigned long ttl;
+    // trace on: operations faster than this (us) are not recorded
+    unsigned long threshold;
+    // mstore / mretrieve: number of quoted strings, stored one after the
+    // other (each with its terminator) in key
+    unsigned int count;
+    // Server which stored or served the key (set by request_run)
+    int owner;
+    // Retrieved value or NULL, owned by the load balancer and only valid
+    // until its next operation
+    char *found;
+    // Output of stats, trace dump and of the batched requests (malloc'd,
+    // freed by request_execute)
+    char *text;
+    size_t text_len;
+};
+
+typedef struct reply_buffer reply_buffer;
+
+// Growing buffer the replies are formatted into
+struct reply_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+void get_key_value(char *key, char *value, char *line);
+
+void get_key(char *key, char *line);
+
+unsigned int get_strings(char *dest, char *line);
+
+int request_parse(char *line, request *req);
+
+void request_run(load_balancer *main, request *req);
+
+void request_format(request *req, reply_buffer *out);
+
+void request_execute(load_balancer *main, request *req, reply_buffer *out);
+
+void reply_append(reply_buffer *out, const char *data, size_t len);
+
+void reply_printf(reply_buffer *out, const char *format, ...);
+
+void reply_free(reply_buffer *out);
+
+#endif  // REQUEST_H_
@@ -1,41 +1,591 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "lz.h"
+#include "numa.h"
 #include "server.h"
+#include "shm_store.h"
+#include "trace.h"
 #include "utils.h"
 
 #define SERVER_HT_SIZE 100
+// Load factors over which the hashtable doubles and under which it halves
+#define GROW_LOAD_FACTOR 0.75
+#define SHRINK_LOAD_FACTOR 0.1875
+// Initial number of keys a membership filter is sized for
+#define FILTER_INIT_CAPACITY 128
+// Memory charged for every object on top of its key and value
+#define ENTRY_OVERHEAD (sizeof(struct info) + sizeof(ll_node_t))
+// Compressed values start with the length of the value, then the LZ block
+#define COMPRESS_HEADER sizeof(unsigned int)
+// Buckets whose objects are checked when sampling the placement of a server
+#define NUMA_SAMPLE_BUCKETS 256
 
 server_memory* init_server_memory() {
 	server_memory *server = (server_memory *)malloc(sizeof(server_memory));
 	DIE(!server, "server memory malloc failed");
 
-	// Allocate the memory of the server (is be a hashtable)
+	// Allocate the memory of the server (is be a hashtable); its keys are
+	// strings, accessed through the specialized ht_str_ functions
 	server->hashtable = ht_create(SERVER_HT_SIZE, hash_function_string,
 								  compare_function_strings);
+	server->id = -1;
+	server->load = 0;
+	server->filter = NULL;
+	server->filter_removed = 0;
+	server->filter_negatives = 0;
+	server->scratch = NULL;
+	server->scratch_size = 0;
+	server->budget = 0;
+	server->clock_hand = 0;
+	server->evictions = 0;
+	server->evicted_bytes = 0;
+	server->misses = 0;
+	server->clock = NULL;
+	server->expired = 0;
+	server->shm = NULL;
+	server->shm_table = 0;
+	server->compress_threshold = 0;
+	server->compress_buf = NULL;
+	server->compress_raw = 0;
+	server->compress_stored = 0;
+	server->compress_ns = 0;
+	server->decompress_raw = 0;
+	server->decompress_ns = 0;
+	server->numa_node = -1;
+	server->numa_accesses = 0;
 
 	return server;
 }
 
-void server_store(server_memory* server, char* key, char* value) {
-	unsigned int key_size = strlen(key) + 1;
-	unsigned int value_size = strlen(value) + 1;
+/*
+ * Counts an operation on a server placed on a node
+ */
+static void numa_count(server_memory* server) {
+	if (server->numa_node >= 0)
+		server->numa_accesses++;
+}
+
+/*
+ * Counts a store on a server placed on a node and makes the pages it takes
+ * from the kernel come from that node
+ * Returns the node the thread preferred before, for numa_leave
+ */
+static int numa_enter(server_memory* server) {
+	int previous = numa_preferred();
+
+	numa_count(server);
+	if (server->numa_node >= 0)
+		numa_prefer(server->numa_node);
+	return previous;
+}
+
+/*
+ * Gives the thread back the policy it had before numa_enter
+ */
+static void numa_leave(int previous) {
+	numa_prefer(previous);
+}
+
+/*
+ * Keeps the buckets of a server on its node (they are reallocated by
+ * every resize)
+ */
+static void bind_buckets(server_memory* server) {
+	hashtable_t *ht = server->hashtable;
+
+	if (server->numa_node >= 0 && ht->buckets != NULL)
+		numa_bind(ht->buckets, ht->hmax * sizeof(*ht->buckets),
+				  server->numa_node);
+}
+
+void server_set_node(server_memory* server, int node) {
+	server->numa_node = node;
+	bind_buckets(server);
+}
+
+/*
+ * Counts an address of a server, and whether its page is on another node
+ */
+static void sample_page(server_memory* server, const void* addr,
+						unsigned long* sampled, unsigned long* remote) {
+	int node = numa_page_node(addr);
+
+	if (node < 0)
+		return;
+	(*sampled)++;
+	if (node != server->numa_node)
+		(*remote)++;
+}
+
+void server_numa_sample(server_memory* server, unsigned long* sampled,
+						unsigned long* remote) {
+	hashtable_t *ht = server->hashtable;
+
+	*sampled = 0;
+	*remote = 0;
+	if (server->numa_node < 0 || ht->buckets == NULL)
+		return;
+
+	// Buckets spread over the whole array, with the list node, the object
+	// and the value buffer of everything in them
+	unsigned int step = ht->hmax > NUMA_SAMPLE_BUCKETS
+						? ht->hmax / NUMA_SAMPLE_BUCKETS : 1;
+	for (unsigned int b = 0; b < ht->hmax; b += step) {
+		sample_page(server, &ht->buckets[b], sampled, remote);
+		for (ll_node_t *it = ht_bucket_head(ht, b); it; it = it->next) {
+			struct info *obj = (struct info *)it->data;
+
+			sample_page(server, it, sampled, remote);
+			sample_page(server, obj, sampled, remote);
+			if (!obj->value_inline)
+				sample_page(server, obj->value, sampled, remote);
+		}
+	}
+}
+
+static unsigned long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/*
+ * Builds a new filter sized for capacity keys from the keys in the hashtable.
+ * Bloom filters can't forget keys, so this is also how removals are applied.
+ */
+static void rebuild_filter(server_memory* server, unsigned int capacity,
+						   double fp_rate) {
+	hashtable_t *ht = server->hashtable;
+	bloom_t *filter = bloom_create(capacity, fp_rate);
+
+	for (unsigned int i = 0; i < ht->hmax; ++i)
+		for (ll_node_t *it = ht_bucket_head(ht, i); it; it = it->next)
+			bloom_add(filter, bloom_hash(((struct info *)it->data)->key));
+
+	bloom_free(server->filter);
+	server->filter = filter;
+	server->filter_removed = 0;
+}
+
+void server_enable_filter(server_memory* server, double fp_rate) {
+	unsigned int capacity = FILTER_INIT_CAPACITY;
+	while (capacity < 2 * server->hashtable->size)
+		capacity *= 2;
+
+	rebuild_filter(server, capacity, fp_rate);
+}
+
+int server_expired(server_memory* server, struct info* obj) {
+	return obj->expires_at != 0 && server->clock != NULL
+		   && obj->expires_at <= *server->clock;
+}
+
+/*
+ * Marks an object as read for the CLOCK sweep. The bit is only written
+ * when it is clear, so reads leave the page of the object clean: it stays
+ * shared with the child of a background snapshot instead of being copied
+ */
+static void mark_referenced(struct info* obj) {
+	if (!obj->referenced)
+		obj->referenced = 1;
+}
+
+unsigned long server_used_bytes(server_memory* server) {
+	return server->hashtable->bytes
+		   + (unsigned long)server->hashtable->size * ENTRY_OVERHEAD;
+}
+
+/*
+ * CLOCK eviction: the hand walks the buckets, gives referenced objects a
+ * second chance (clearing their bit) and evicts the others until the
+ * server fits in its budget. Expired objects it meets go first, whatever
+ * their bit says.
+ */
+static void evict(server_memory* server) {
+	unsigned long start = trace_begin();
+	unsigned long evictions = server->evictions;
+
+	while (server->hashtable->size > 0
+		   && server_used_bytes(server) > server->budget) {
+		hashtable_t *ht = server->hashtable;
+
+		if (server->clock_hand >= ht->hmax)
+			server->clock_hand = 0;
+
+		ll_node_t *it = ht_bucket_head(ht, server->clock_hand);
+		while (it != NULL && server_used_bytes(server) > server->budget) {
+			ll_node_t *next = it->next;
+			struct info *obj = (struct info *)it->data;
+
+			if (server_expired(server, obj)) {
+				server->expired++;
+				server_remove(server, obj->key);
+			} else if (obj->referenced) {
+				obj->referenced = 0;
+			} else {
+				server->evictions++;
+				server->evicted_bytes += obj->key_size + obj->value_size;
+				server_remove(server, obj->key);
+			}
+			it = next;
+		}
+
+		server->clock_hand++;
+	}
+
+	server_compact(server);
+	trace_end(start, TRACE_EVICT, server->id, 0, 0,
+			  server->evictions - evictions);
+}
+
+void server_attach_shm(server_memory* server, struct shm_store_t* shm) {
+	hashtable_t *ht = server->hashtable;
+
+	server->shm = shm;
+	server->shm_table = shm_table_create(shm);
+	for (unsigned int i = 0; i < ht->hmax; ++i)
+		for (ll_node_t *it = ht_bucket_head(ht, i); it; it = it->next)
+			shm_table_put(shm, server->shm_table, (struct info *)it->data);
+}
+
+/*
+ * Copies an object to the shared memory segment, if there is one
+ */
+static void mirror(server_memory* server, char* key) {
+	if (server->shm == NULL)
+		return;
+
+	struct info *obj = ht_str_get_info(server->hashtable, key);
+	if (obj != NULL)
+		shm_table_put(server->shm, server->shm_table, obj);
+}
+
+void server_compact(server_memory* server) {
+	hashtable_t *ht = server->hashtable;
+	unsigned int hmax = ht->hmax;
+
+	// Halving leaves the load factor at most twice the shrink threshold,
+	// still well under the growth one, so a server whose size goes back
+	// and forth around a power of two doesn't rehash every time
+	while (hmax / 2 >= SERVER_HT_SIZE
+		   && 1.0 * ht->size / hmax < SHRINK_LOAD_FACTOR)
+		hmax /= 2;
 
-	ht_put(server->hashtable, key, key_size, value, value_size);
+	if (hmax != ht->hmax) {
+		unsigned long start = trace_begin();
+		ht_rehash(ht, hmax);
+		bind_buckets(server);
+		trace_end(start, TRACE_RESIZE, server->id, 0, 0, ht->size);
+	}
+}
+
+void server_set_compression(server_memory* server, unsigned int threshold) {
+	server->compress_threshold = threshold;
+}
+
+void server_set_budget(server_memory* server, unsigned long budget) {
+	server->budget = budget;
+	if (budget > 0)
+		evict(server);
+}
+
+/*
+ * Bookkeeping after an object was written: filter and hashtable growth
+ */
+static void after_store(server_memory* server, char* key) {
+	mirror(server, key);
+
+	if (server->filter) {
+		// Double the filter before it gets too full to keep its error rate
+		if (server->hashtable->size > server->filter->capacity)
+			rebuild_filter(server, 2 * server->filter->capacity,
+						   server->filter->fp_rate);
+		else
+			bloom_add(server->filter, bloom_hash(key));
+	}
 
 	// If the load factor is too big, resize the hashtable
 	double load_factor = 1.0 * server->hashtable->size / server->hashtable->hmax;
-	if (load_factor > 0.75)
+	if (load_factor > GROW_LOAD_FACTOR) {
+		unsigned long start = trace_begin();
 		ht_resize_string(&server->hashtable);
+		bind_buckets(server);
+		trace_end(start, TRACE_RESIZE, server->id, 0, 0,
+				  server->hashtable->size);
+	}
+
+	if (server->budget > 0 && server_used_bytes(server) > server->budget)
+		evict(server);
+}
+
+/*
+ * Stores the bytes of a contiguous value as they are, flagged if they are
+ * compressed (the hashtable clears the flag on every put)
+ */
+static void put_value(server_memory* server, char* key, unsigned int key_size,
+					  void* value, unsigned int value_size, int compressed) {
+	ht_str_put(server->hashtable, key, key_size, value, value_size);
+	if (compressed)
+		ht_str_get_info(server->hashtable, key)->compressed = 1;
+}
+
+/*
+ * Stores a value compressed, unless that doesn't save an eighth of it
+ * Returns 1 if it was stored
+ */
+static int store_compressed(server_memory* server, char* key,
+							unsigned int key_size, char* value,
+							unsigned int value_len) {
+	if (value_len - value_len / 8 <= COMPRESS_HEADER)
+		return 0;
+	if (server->compress_buf == NULL) {
+		server->compress_buf = malloc(COMPRESS_HEADER
+									  + LZ_BOUND(VALUE_CHUNK_SIZE));
+		DIE(!server->compress_buf, "server compress malloc failed");
+	}
+
+	// Giving up as soon as the output is too big bounds the time lost on
+	// incompressible values
+	unsigned int cap = value_len - value_len / 8 - COMPRESS_HEADER;
+	unsigned long start = now_ns();
+	unsigned int len = lz_compress(value, value_len,
+								   server->compress_buf + COMPRESS_HEADER, cap);
+	server->compress_ns += now_ns() - start;
+	server->compress_raw += value_len + 1;
+
+	if (len == 0) {
+		server->compress_stored += value_len + 1;
+		return 0;
+	}
+	memcpy(server->compress_buf, &value_len, COMPRESS_HEADER);
+	put_value(server, key, key_size, server->compress_buf,
+			  COMPRESS_HEADER + len, 1);
+	server->compress_stored += COMPRESS_HEADER + len;
+	return 1;
+}
+
+void server_store(server_memory* server, char* key, char* value) {
+	unsigned int key_size = strlen(key) + 1;
+	unsigned int value_size = strlen(value) + 1;
+
+	int previous = numa_enter(server);
+	// Big values are split in chunks, so no single huge buffer is needed
+	if (value_size - 1 > VALUE_CHUNK_SIZE)
+		ht_str_put_chunks(server->hashtable, key, key_size,
+					  value_chunks_from(value, value_size - 1), value_size - 1);
+	else if (server->compress_threshold == 0
+			 || value_size - 1 < server->compress_threshold
+			 || !store_compressed(server, key, key_size, value, value_size - 1))
+		put_value(server, key, key_size, value, value_size, 0);
+
+	after_store(server, key);
+	numa_leave(previous);
+}
+
+void server_store_chunks(server_memory* server, char* key,
+						 value_chunk* chunks, unsigned int value_len) {
+	int previous = numa_enter(server);
+	ht_str_put_chunks(server->hashtable, key, strlen(key) + 1, chunks, value_len);
+	after_store(server, key);
+	numa_leave(previous);
+}
+
+void server_store_object(server_memory* server, struct info* obj) {
+	int previous = numa_enter(server);
+	// Compressed bytes move as they are; values left plain were too small
+	// or incompressible, the same threshold applies here
+	if (obj->chunked)
+		ht_str_put_chunks(server->hashtable, obj->key, obj->key_size,
+					  value_chunks_copy((value_chunk *)obj->value),
+					  obj->value_size);
+	else
+		put_value(server, obj->key, obj->key_size, obj->value,
+				  obj->value_size, obj->compressed);
+	after_store(server, obj->key);
+
+	if (obj->expires_at != 0)
+		server_set_expiry(server, obj->key, obj->expires_at);
+	numa_leave(previous);
+}
+
+int server_set_expiry(server_memory* server, char* key,
+					  unsigned long expires_at) {
+	struct info *obj = ht_str_get_info(server->hashtable, key);
+	if (obj == NULL)
+		return 0;
+
+	obj->expires_at = expires_at;
+	mirror(server, key);
+	return 1;
+}
+
+int server_reap(server_memory* server, char* key, unsigned long expires_at) {
+	struct info *obj = ht_str_get_info(server->hashtable, key);
+	if (obj == NULL || !server_expired(server, obj)
+		|| (expires_at != 0 && obj->expires_at != expires_at))
+		return 0;
+
+	server->expired++;
+	server_remove(server, key);
+	return 1;
+}
+
+unsigned int server_value_length(struct info* obj) {
+	unsigned int len;
+
+	// Contiguous values keep their terminator, chunked ones don't
+	if (obj->chunked)
+		return obj->value_size;
+	if (!obj->compressed)
+		return obj->value_size - 1;
+	memcpy(&len, obj->value, COMPRESS_HEADER);
+	return len;
+}
+
+void server_value_copy(server_memory* server, struct info* obj, char* dest) {
+	if (obj->chunked) {
+		value_chunks_flatten((value_chunk *)obj->value, dest);
+	} else if (obj->compressed) {
+		unsigned int len = server_value_length(obj);
+		unsigned long start = now_ns();
+		int ret = lz_decompress((char *)obj->value + COMPRESS_HEADER,
+								obj->value_size - COMPRESS_HEADER, dest, len);
+		DIE(ret < 0, "corrupt compressed value");
+		if (server != NULL) {
+			server->decompress_ns += now_ns() - start;
+			server->decompress_raw += len;
+		}
+	} else {
+		memcpy(dest, obj->value, obj->value_size - 1);
+	}
+}
+
+/*
+ * Copies the value of an object to the scratch buffer, with a terminator
+ */
+static char* to_scratch(server_memory* server, struct info* obj) {
+	unsigned int len = server_value_length(obj);
+
+	if (len + 1 > server->scratch_size) {
+		char *scratch = realloc(server->scratch, len + 1);
+		DIE(!scratch, "server scratch realloc failed");
+		server->scratch = scratch;
+		server->scratch_size = len + 1;
+	}
+	server_value_copy(server, obj, server->scratch);
+	server->scratch[len] = 0;
+
+	return server->scratch;
+}
+
+int server_value_visit(server_memory* server, struct info* obj,
+					   int (*sink)(void *ctx, const char *data,
+								   unsigned int len),
+					   void* ctx) {
+	if (obj->chunked)
+		return value_chunks_visit((value_chunk *)obj->value, sink, ctx);
+	if (obj->compressed)
+		return sink(ctx, to_scratch(server, obj), server_value_length(obj));
+	return sink(ctx, obj->value, obj->value_size - 1);
 }
 
 void server_remove(server_memory* server, char* key) {
-	ht_remove_entry(server->hashtable, key);
+	unsigned int size = server->hashtable->size;
+
+	// The key may belong to the object, it goes from the segment first
+	if (server->shm != NULL)
+		shm_table_remove(server->shm, server->shm_table, key);
+	ht_str_remove_entry(server->hashtable, key);
+
+	// Removed keys keep answering "maybe" until the filter is rebuilt,
+	// which happens once they are a quarter of the filter's capacity
+	if (server->filter && server->hashtable->size < size
+		&& ++server->filter_removed > server->filter->capacity / 4)
+		rebuild_filter(server, server->filter->capacity,
+					   server->filter->fp_rate);
 }
 
 char* server_retrieve(server_memory* server, char* key) {
-	char *value = ht_get(server->hashtable, key);
-	return value;
+	// Reads allocate nothing the server keeps but its scratch buffer, the
+	// policy of the thread is left alone
+	numa_count(server);
+	// A negative answer of the filter is exact, skip the buckets
+	if (server->filter && !bloom_may_contain(server->filter, bloom_hash(key))) {
+		server->filter_negatives++;
+		return NULL;
+	}
+
+	struct info *obj = ht_str_get_info(server->hashtable, key);
+	if (obj == NULL || server_expired(server, obj)) {
+		server->misses++;
+		return NULL;
+	}
+	mark_referenced(obj);
+	if (!obj->chunked && !obj->compressed)
+		return obj->value;
+
+	// Chunked and compressed values are assembled in the scratch buffer
+	return to_scratch(server, obj);
+}
+
+void server_lookup_batch(server_memory** servers, char** keys,
+						 unsigned int n, struct info** objs) {
+	hashtable_t **hts = (hashtable_t **)malloc((n + 1) * sizeof(hashtable_t *));
+	DIE(!hts, "server batch malloc failed");
+
+	// Keys the filters rule out don't enter the hashtable pipeline
+	for (unsigned int i = 0; i < n; ++i) {
+		server_memory *server = servers[i];
+
+		numa_count(server);
+		hts[i] = server->hashtable;
+		if (server->filter
+			&& !bloom_may_contain(server->filter, bloom_hash(keys[i]))) {
+			server->filter_negatives++;
+			hts[i] = NULL;
+		}
+	}
+
+	ht_get_info_batch(hts, (void **)keys, n, objs);
+
+	for (unsigned int i = 0; i < n; ++i) {
+		if (hts[i] == NULL)
+			continue;
+		if (objs[i] == NULL || server_expired(servers[i], objs[i])) {
+			servers[i]->misses++;
+			objs[i] = NULL;
+		} else {
+			mark_referenced(objs[i]);
+		}
+	}
+
+	free(hts);
+}
+
+int server_retrieve_stream(server_memory* server, char* key,
+						   int (*sink)(void *ctx, const char *data,
+									   unsigned int len),
+						   void* ctx) {
+	numa_count(server);
+	if (server->filter && !bloom_may_contain(server->filter, bloom_hash(key))) {
+		server->filter_negatives++;
+		return 0;
+	}
+
+	struct info *obj = ht_str_get_info(server->hashtable, key);
+	if (obj == NULL || server_expired(server, obj)) {
+		server->misses++;
+		return 0;
+	}
+	mark_referenced(obj);
+
+	server_value_visit(server, obj, sink, ctx);
+	return 1;
 }
 
 void free_server_memory(server_memory* server) {
@@ -43,5 +593,10 @@ void free_server_memory(server_memory* server) {
 		return;
 	if (server->hashtable != NULL)
 		ht_free(server->hashtable);
+	bloom_free(server->filter);
+	if (server->shm != NULL)
+		shm_table_free(server->shm, server->shm_table);
+	free(server->scratch);
+	free(server->compress_buf);
 	free(server);
 }
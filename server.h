@@ -2,18 +2,154 @@
 #define SERVER_H_
 
 #include "Hashtable.h"
+#include "bloom.h"
+
+struct shm_store_t;
 
 typedef struct server_memory server_memory;
 
 struct server_memory {
 	// Memoria unui server este un hashtable
 	hashtable_t *hashtable;
+	// ID of the server in its load balancer (-1 if none), for traces
+	int id;
+	// Number of reads served, used to spread reads across replicas
+	unsigned long load;
+	// Optional approximate membership filter of the keys (NULL if disabled)
+	bloom_t *filter;
+	// Keys removed since the filter was last rebuilt
+	unsigned int filter_removed;
+	// Lookups answered by the filter alone
+	unsigned long filter_negatives;
+	// Buffer where chunked values are assembled by server_retrieve
+	char *scratch;
+	unsigned int scratch_size;
+	// Maximum number of bytes the server may use (0 means no limit)
+	unsigned long budget;
+	// Bucket the CLOCK eviction hand points to
+	unsigned int clock_hand;
+	// Objects (and their key and value bytes) evicted to respect the budget
+	unsigned long evictions;
+	unsigned long evicted_bytes;
+	// Lookups of keys which are not on the server
+	unsigned long misses;
+	// Current time (ms) of the load balancer, NULL if objects never expire
+	const unsigned long *clock;
+	// Expired objects reclaimed from the server
+	unsigned long expired;
+	// Shared memory segment the objects are mirrored to (NULL if none)
+	struct shm_store_t *shm;
+	// Offset of the table of the server in the segment
+	unsigned long shm_table;
+	// Values of at least this many bytes are compressed (0 disables it)
+	unsigned int compress_threshold;
+	// Buffer values are compressed into before they are stored
+	char *compress_buf;
+	// Bytes of the values given to the compressor and bytes stored for
+	// them, time (ns) spent compressing
+	unsigned long compress_raw;
+	unsigned long compress_stored;
+	unsigned long compress_ns;
+	// Bytes decompressed and time (ns) spent on them
+	unsigned long decompress_raw;
+	unsigned long decompress_ns;
+	// NUMA node the server is placed on (-1 if not placed)
+	int numa_node;
+	// Operations on the server since it was placed
+	unsigned long numa_accesses;
 };
 
 server_memory* init_server_memory();
 
 void free_server_memory(server_memory* server);
 
+/**
+ * server_enable_filter() - Puts a Bloom filter in front of the hashtable.
+ * @arg1: Server which performs the task.
+ * @arg2: Target false positive rate of the filter.
+ *
+ * Lookups of keys the filter has never seen return without touching
+ * the buckets. The filter is kept up to date by server_store and
+ * server_remove (so also by remapping).
+ */
+void server_enable_filter(server_memory* server, double fp_rate);
+
+/**
+ * server_set_budget() - Caps the memory used by a server.
+ * @arg1: Server which performs the task.
+ * @arg2: Maximum number of bytes (keys, values and per-object overhead),
+ *        0 for no limit.
+ *
+ * Every store (including the ones done by remapping) which takes the server
+ * over its budget evicts objects with the CLOCK policy until it fits again.
+ */
+void server_set_budget(server_memory* server, unsigned long budget);
+
+/**
+ * server_attach_shm() - Mirrors the objects of a server to shared memory.
+ * @arg1: Server which performs the task.
+ * @arg2: The segment, created by the load balancer.
+ *
+ * The objects already stored are copied, every later store, removal or
+ * expiry change is applied to the copy too.
+ */
+void server_attach_shm(server_memory* server, struct shm_store_t* shm);
+
+/**
+ * server_set_compression() - Compresses the large values of a server.
+ * @arg1: Server which performs the task.
+ * @arg2: Values of at least this many bytes are compressed, 0 disables it.
+ *
+ * Applies to the values stored from now on, and only to contiguous ones
+ * (chunked values are never compressed). A value is kept compressed only
+ * if that saves an eighth of it. Reads decompress into the scratch buffer
+ * of the server; objects copied by remapping keep their compressed bytes.
+ */
+void server_set_compression(server_memory* server, unsigned int threshold);
+
+/**
+ * server_set_node() - Places a server on a NUMA node.
+ * @arg1: Server which performs the task.
+ * @arg2: The node, -1 to stop placing it.
+ *
+ * Only the bucket array is bound to the node: it moves at once and after
+ * every resize. Stores prefer the node while they run, which places the
+ * pages malloc takes from the kernel then, not the ones it reuses; objects
+ * already stored stay where they are. The thread's own policy is restored
+ * after every store.
+ */
+void server_set_node(server_memory* server, int node);
+
+/**
+ * server_numa_sample() - Checks where the memory of a server really is.
+ * @arg1: Server which performs the task.
+ * @arg2: Set to the number of addresses whose node could be read.
+ * @arg3: Set to the number of them on a node other than the server's.
+ *
+ * Asks the kernel for the node of the bucket array and of the list nodes,
+ * objects and value buffers of up to 256 buckets spread over the table.
+ * Both counts are 0 if the server isn't placed.
+ */
+void server_numa_sample(server_memory* server, unsigned long* sampled,
+						unsigned long* remote);
+
+/**
+ * server_compact() - Gives back the buckets a server no longer needs.
+ * @arg1: Server which performs the task.
+ *
+ * Halves the hashtable while its load factor is under a quarter of the
+ * growth threshold (never below the initial size). Removals don't do it
+ * themselves because callers walk the buckets while removing, so it is
+ * called once a walk is over.
+ */
+void server_compact(server_memory* server);
+
+/**
+ * server_used_bytes() - Bytes charged to a server's budget.
+ * @arg1: The server.
+ */
+unsigned long server_used_bytes(server_memory* server);
+
 /**
  * server_store() - Stores a key-value pair to the server.
  * @arg1: Server which performs the task.
@@ -22,6 +158,84 @@ void free_server_memory(server_memory* server);
  */
 void server_store(server_memory* server, char* key, char* value);
 
+/**
+ * server_store_chunks() - Stores a value given as a chain of chunks.
+ * @arg1: Server which performs the task.
+ * @arg2: Key represented as a string.
+ * @arg3: The value (the server takes ownership of the chain).
+ * @arg4: Number of bytes in the chain.
+ */
+void server_store_chunks(server_memory* server, char* key,
+						 value_chunk* chunks, unsigned int value_len);
+
+/**
+ * server_store_object() - Stores a copy of an object of another server.
+ * @arg1: Server which performs the task.
+ * @arg2: The object, with a contiguous or chunked value.
+ */
+void server_store_object(server_memory* server, struct info* obj);
+
+/**
+ * server_set_expiry() - Sets the time when an object expires.
+ * @arg1: Server which performs the task.
+ * @arg2: Key represented as a string.
+ * @arg3: Expiry time in ms (same clock as server->clock), 0 for never.
+ *
+ * Return: 1 if the key was found, 0 otherwise.
+ */
+int server_set_expiry(server_memory* server, char* key,
+					  unsigned long expires_at);
+
+/**
+ * server_expired() - Checks if an object of the server has expired.
+ * @arg1: Server which holds the object.
+ * @arg2: The object.
+ *
+ * Expired objects are invisible to lookups until they are reclaimed.
+ */
+int server_expired(server_memory* server, struct info* obj);
+
+/**
+ * server_reap() - Removes a key if it has expired.
+ * @arg1: Server which performs the task.
+ * @arg2: Key represented as a string.
+ * @arg3: Expiry time the object must have (0 matches any), so a key
+ *        stored again since it was scheduled is left alone.
+ *
+ * Return: 1 if the key was removed, 0 otherwise.
+ */
+int server_reap(server_memory* server, char* key, unsigned long expires_at);
+
+/**
+ * server_value_length() - Length of the value of an object, in bytes.
+ * @arg1: The object.
+ */
+unsigned int server_value_length(struct info* obj);
+
+/**
+ * server_value_copy() - Copies the value of an object, decompressed.
+ * @arg1: Server which holds the object (NULL to skip its statistics).
+ * @arg2: The object.
+ * @arg3: Buffer of at least server_value_length(obj) bytes; no terminator
+ *        is written.
+ */
+void server_value_copy(server_memory* server, struct info* obj, char* dest);
+
+/**
+ * server_value_visit() - Passes the value of an object piece by piece.
+ * @arg1: Server which holds the object.
+ * @arg2: The object.
+ * @arg3: Function called with every piece of the value, in order.
+ * @arg4: Argument passed to the function.
+ *
+ * Compressed values are passed whole, from the scratch buffer of the server.
+ * Return: the first nonzero return of the function, 0 otherwise.
+ */
+int server_value_visit(server_memory* server, struct info* obj,
+					   int (*sink)(void *ctx, const char *data,
+								   unsigned int len),
+					   void* ctx);
+
 /**
  * server_remove() - Removes a key-pair value from the server.
  * @arg1: Server which performs the task.
@@ -36,7 +250,38 @@ void server_remove(server_memory* server, char* key);
  *
  * Return: String value associated with the key
  *         or NULL (in case the key does not exist).
+ *         Chunked and compressed values are copied into a buffer of the
+ *         server which is valid until the next call; use
+ *         server_retrieve_stream to avoid it for chunked values.
  */
 char* server_retrieve(server_memory* server, char* key);
 
+/**
+ * server_lookup_batch() - Looks up many keys with overlapped memory accesses.
+ * @arg1: servers[i] is the server key i is looked up on.
+ * @arg2: The keys.
+ * @arg3: Number of keys.
+ * @arg4: This function will RETURN via this parameter the object of
+ *        every key, or NULL if it is missing (or expired).
+ *
+ * Filters, statistics and CLOCK bits are handled as by server_retrieve;
+ * the values are not copied, the objects are returned as they are.
+ */
+void server_lookup_batch(server_memory** servers, char** keys,
+						 unsigned int n, struct info** objs);
+
+/**
+ * server_retrieve_stream() - Passes the value of a key piece by piece.
+ * @arg1: Server which performs the task.
+ * @arg2: Key represented as a string.
+ * @arg3: Function called with every piece of the value, in order.
+ * @arg4: Argument passed to the function.
+ *
+ * Return: 1 if the key was found, 0 otherwise.
+ */
+int server_retrieve_stream(server_memory* server, char* key,
+						   int (*sink)(void *ctx, const char *data,
+									   unsigned int len),
+						   void* ctx);
+
 #endif  // SERVER_H_
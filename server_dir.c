@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "server_dir.h"
+#include "utils.h"
+
+#define DIR_EMPTY -1
+#define DIR_DELETED -2
+#define DIR_INIT_CAP 16
+
+static unsigned int hash_id(int id)
+{
+    unsigned int h = (unsigned int)id;
+
+    h = ((h >> 16u) ^ h) * 0x45d9f3b;
+    h = ((h >> 16u) ^ h) * 0x45d9f3b;
+    return (h >> 16u) ^ h;
+}
+
+static dir_entry *alloc_map(unsigned int cap)
+{
+    dir_entry *map = (dir_entry *)malloc(cap * sizeof(dir_entry));
+    DIE(!map, "server directory malloc failed");
+
+    for (unsigned int i = 0; i < cap; ++i)
+        map[i].slot = DIR_EMPTY;
+    return map;
+}
+
+/**
+ * Allocs an empty directory
+ */
+server_dir_t *server_dir_create(void)
+{
+    server_dir_t *dir = (server_dir_t *)malloc(sizeof(server_dir_t));
+    DIE(!dir, "server directory malloc failed");
+
+    dir->map = alloc_map(DIR_INIT_CAP);
+    dir->map_cap = DIR_INIT_CAP;
+    dir->map_used = 0;
+
+    dir->slots = (server_slot *)malloc(DIR_INIT_CAP * sizeof(server_slot));
+    dir->free_slots = (int *)malloc(DIR_INIT_CAP * sizeof(int));
+    DIE(!dir->slots || !dir->free_slots, "server directory malloc failed");
+    dir->n_slots = 0;
+    dir->slots_cap = DIR_INIT_CAP;
+    dir->n_free = 0;
+    dir->count = 0;
+
+    return dir;
+}
+
+/**
+ * Returns the slot of a server, or -1 if there is no server with that ID
+ * @param dir the directory
+ * @param id ID of the server
+ */
+int server_dir_find(server_dir_t *dir, int id)
+{
+    unsigned int mask = dir->map_cap - 1;
+
+    for (unsigned int i = hash_id(id) & mask;; i = (i + 1) & mask) {
+        if (dir->map[i].slot == DIR_EMPTY)
+            return -1;
+        if (dir->map[i].slot != DIR_DELETED && dir->map[i].id == id)
+            return dir->map[i].slot;
+    }
+}
+
+/**
+ * Puts an entry in a map which is known not to contain the ID
+ */
+static void map_put(dir_entry *map, unsigned int cap, int id, int slot)
+{
+    unsigned int mask = cap - 1;
+    unsigned int i = hash_id(id) & mask;
+
+    while (map[i].slot >= 0)
+        i = (i + 1) & mask;
+    map[i].id = id;
+    map[i].slot = slot;
+}
+
+/**
+ * Rebuilds the map with the given capacity, dropping deleted entries
+ */
+static void rehash(server_dir_t *dir, unsigned int cap)
+{
+    dir_entry *map = alloc_map(cap);
+
+    for (unsigned int i = 0; i < dir->map_cap; ++i)
+        if (dir->map[i].slot >= 0)
+            map_put(map, cap, dir->map[i].id, dir->map[i].slot);
+
+    free(dir->map);
+    dir->map = map;
+    dir->map_cap = cap;
+    dir->map_used = dir->count;
+}
+
+/**
+ * Adds a server and returns its slot. The ID must not be in the directory.
+ * @param dir the directory
+ * @param id ID of the server
+ * @param server memory of the server
+ */
+int server_dir_insert(server_dir_t *dir, int id, server_memory *server)
+{
+    // Keep the map at most half full (deleted entries included)
+    if (2 * (dir->map_used + 1) > dir->map_cap) {
+        unsigned int cap = dir->map_cap;
+        while (4 * (unsigned int)(dir->count + 1) > cap)
+            cap *= 2;
+        rehash(dir, cap);
+    }
+
+    int slot;
+    if (dir->n_free > 0) {
+        slot = dir->free_slots[--dir->n_free];
+    } else {
+        if (dir->n_slots == dir->slots_cap) {
+            dir->slots_cap *= 2;
+            dir->slots = (server_slot *)realloc(dir->slots, dir->slots_cap
+                                                * sizeof(server_slot));
+            dir->free_slots = (int *)realloc(dir->free_slots, dir->slots_cap
+                                             * sizeof(int));
+            DIE(!dir->slots || !dir->free_slots,
+                "server directory realloc failed");
+        }
+        slot = dir->n_slots++;
+    }
+
+    dir->slots[slot].id = id;
+    dir->slots[slot].server = server;
+
+    // Deleted entries are not reused here, so map_used counts a new one
+    map_put(dir->map, dir->map_cap, id, slot);
+    dir->map_used++;
+    dir->count++;
+
+    return slot;
+}
+
+/**
+ * Removes a server from the directory and returns its memory (which is
+ * not freed), or NULL if there is no such server
+ * @param dir the directory
+ * @param id ID of the server
+ */
+server_memory *server_dir_remove(server_dir_t *dir, int id)
+{
+    unsigned int mask = dir->map_cap - 1;
+
+    for (unsigned int i = hash_id(id) & mask;; i = (i + 1) & mask) {
+        if (dir->map[i].slot == DIR_EMPTY)
+            return NULL;
+        if (dir->map[i].slot != DIR_DELETED && dir->map[i].id == id) {
+            int slot = dir->map[i].slot;
+            server_memory *server = dir->slots[slot].server;
+
+            dir->map[i].slot = DIR_DELETED;
+            dir->slots[slot].id = -1;
+            dir->slots[slot].server = NULL;
+            dir->free_slots[dir->n_free++] = slot;
+            dir->count--;
+
+            return server;
+        }
+    }
+}
+
+/**
+ * Frees the directory and the memory of every server in it
+ * @param dir the directory
+ */
+void server_dir_free(server_dir_t *dir)
+{
+    if (dir == NULL)
+        return;
+
+    for (int i = 0; i < dir->n_slots; ++i)
+        free_server_memory(dir->slots[i].server);
+    free(dir->slots);
+    free(dir->free_slots);
+    free(dir->map);
+    free(dir);
+}
@@ -0,0 +1,51 @@
+#ifndef SERVER_DIR_H_
+#define SERVER_DIR_H_
+
+#include "server.h"
+
+typedef struct server_slot server_slot;
+typedef struct dir_entry dir_entry;
+typedef struct server_dir_t server_dir_t;
+
+// A live server, referenced from the hashring by its index
+struct server_slot {
+    int id;
+    server_memory *server;
+};
+
+// Entry of the ID -> slot map
+struct dir_entry {
+    int id;
+    // Slot index, DIR_EMPTY or DIR_DELETED
+    int slot;
+};
+
+// Maps sparse server IDs to dense slots. Memory is proportional to the
+// number of live servers, not to the biggest ID.
+struct server_dir_t {
+    // Open addressing (linear probing) map, map_cap is a power of two
+    dir_entry *map;
+    unsigned int map_cap;
+    // Used entries, including deleted ones
+    unsigned int map_used;
+    // Dense array of slots, freed slots are reused
+    server_slot *slots;
+    int n_slots;
+    int slots_cap;
+    int *free_slots;
+    int n_free;
+    // Number of live servers
+    int count;
+};
+
+server_dir_t *server_dir_create(void);
+
+int server_dir_find(server_dir_t *dir, int id);
+
+int server_dir_insert(server_dir_t *dir, int id, server_memory *server);
+
+server_memory *server_dir_remove(server_dir_t *dir, int id);
+
+void server_dir_free(server_dir_t *dir);
+
+#endif  // SERVER_DIR_H_
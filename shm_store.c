@@ -0,0 +1,631 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_store.h"
+#include "load_balancer.h"
+#include "load_balancer_utils.h"
+#include "utils.h"
+
+#define SHM_MAGIC 0x4d48534c
+// Buckets of a server table when its first object arrives
+#define SHM_TABLE_SIZE 16
+// Every block starts with its size class
+#define BLOCK_HEADER sizeof(unsigned long)
+
+static unsigned long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *at(shm_store_t *shm, unsigned long off)
+{
+    return shm->base + off;
+}
+
+/*
+ * Reader side: the segment may change under the reader, so every offset
+ * is checked against the mapping before it is followed. Returns NULL if
+ * off is 0 or the range does not fit.
+ */
+static void *checked(shm_store_t *shm, unsigned long off, unsigned long len)
+{
+    if (off == 0 || off > shm->size || len > shm->size - off)
+        return NULL;
+    return shm->base + off;
+}
+
+/*
+ * Allocates len bytes from the segment, returns their offset (0 if the
+ * segment is full, which is reported once)
+ */
+static unsigned long shm_alloc(shm_store_t *shm, unsigned long len)
+{
+    shm_header *h = shm->header;
+    int cls = 0;
+
+    while (cls < SHM_CLASSES && (16ul << cls) < len + BLOCK_HEADER)
+        cls++;
+
+    unsigned long block = cls < SHM_CLASSES ? h->free_lists[cls] : 0;
+    if (block != 0) {
+        h->free_lists[cls] = *(unsigned long *)at(shm, block + BLOCK_HEADER);
+    } else if (cls < SHM_CLASSES && h->brk + (16ul << cls) <= h->size) {
+        block = h->brk;
+        h->brk += 16ul << cls;
+        *(unsigned long *)at(shm, block) = cls;
+    } else {
+        if (!h->full)
+            fprintf(stderr, "shared memory segment is full, readers will "
+                    "miss the objects which don't fit\n");
+        h->full = 1;
+        return 0;
+    }
+
+    return block + BLOCK_HEADER;
+}
+
+static void shm_free(shm_store_t *shm, unsigned long off)
+{
+    if (off == 0)
+        return;
+
+    unsigned long block = off - BLOCK_HEADER;
+    unsigned long cls = *(unsigned long *)at(shm, block);
+
+    *(unsigned long *)at(shm, off) = shm->header->free_lists[cls];
+    shm->header->free_lists[cls] = block;
+}
+
+static shm_store_t *map_segment(const char *name, int fd, unsigned long size,
+                                int writable)
+{
+    shm_store_t *shm = (shm_store_t *)calloc(1, sizeof(shm_store_t));
+    DIE(!shm, "shm malloc failed");
+
+    shm->base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->base == MAP_FAILED) {
+        perror("mmap");
+        free(shm);
+        return NULL;
+    }
+
+    shm->header = (shm_header *)shm->base;
+    shm->size = size;
+    shm->writable = writable;
+    shm->name = strdup(name);
+    DIE(!shm->name, "shm malloc failed");
+
+    return shm;
+}
+
+/**
+ * Creates a shared memory segment the load balancer mirrors into (a
+ * segment left with the same name is replaced). Returns NULL on failure.
+ * @param name POSIX shared memory name ("/something")
+ * @param size size of the segment in bytes
+ */
+shm_store_t *shm_create(const char *name, unsigned long size)
+{
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (size < 2 * sizeof(shm_header) || ftruncate(fd, size) < 0) {
+        fprintf(stderr, "can't size shared memory segment %s\n", name);
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    shm_store_t *shm = map_segment(name, fd, size, 1);
+    if (shm == NULL) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // ftruncate() zeroed the segment
+    shm_header *h = shm->header;
+    h->size = size;
+    h->brk = (sizeof(shm_header) + 15) & ~15ul;
+    h->replicas = 1;
+    __atomic_store_n(&h->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+
+    return shm;
+}
+
+/**
+ * Maps the segment of a load balancer running in another process, to
+ * read from it. Returns NULL if there is no such segment.
+ * @param name POSIX shared memory name given to shm_create
+ */
+shm_store_t *shm_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (unsigned long)st.st_size < sizeof(shm_header)) {
+        fprintf(stderr, "%s is not a load balancer segment\n", name);
+        close(fd);
+        return NULL;
+    }
+
+    shm_store_t *shm = map_segment(name, fd, st.st_size, 0);
+    if (shm == NULL)
+        return NULL;
+
+    if (__atomic_load_n(&shm->header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        fprintf(stderr, "%s is not a load balancer segment\n", name);
+        shm_close(shm);
+        return NULL;
+    }
+
+    return shm;
+}
+
+/**
+ * Unmaps the segment; the process which created it also removes its name
+ * (readers which still map it keep their mapping)
+ * @param shm the segment
+ */
+void shm_close(shm_store_t *shm)
+{
+    if (shm == NULL)
+        return;
+
+    munmap(shm->base, shm->size);
+    if (shm->writable)
+        shm_unlink(shm->name);
+    free(shm->name);
+    free(shm->scratch);
+    free(shm);
+}
+
+/**
+ * Starts a change of the segment. Readers retry until the outermost
+ * change is over, so a membership change with all its object moves looks
+ * atomic to them. Changes nest.
+ * @param shm the segment
+ */
+void shm_write_begin(shm_store_t *shm)
+{
+    shm_header *h = shm->header;
+
+    if (shm->depth++ > 0)
+        return;
+
+    // Another writer process may be attached to the same segment
+    while (__atomic_exchange_n(&h->writer, 1, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Ends a change started by shm_write_begin
+ * @param shm the segment
+ */
+void shm_write_end(shm_store_t *shm)
+{
+    shm_header *h = shm->header;
+
+    if (--shm->depth > 0)
+        return;
+
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->writer, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocates the table of a new server, returns its offset (0 if the
+ * segment is full)
+ * @param shm the segment
+ */
+unsigned long shm_table_create(shm_store_t *shm)
+{
+    shm_write_begin(shm);
+
+    unsigned long off = shm_alloc(shm, sizeof(shm_table));
+    if (off != 0) {
+        shm_table *table = (shm_table *)at(shm, off);
+        table->hmax = SHM_TABLE_SIZE;
+        table->size = 0;
+        table->buckets = 0;
+    }
+
+    shm_write_end(shm);
+    return off;
+}
+
+/**
+ * Frees a server table and its objects
+ * @param shm the segment
+ * @param table offset of the table
+ */
+void shm_table_free(shm_store_t *shm, unsigned long table)
+{
+    if (table == 0)
+        return;
+
+    shm_write_begin(shm);
+
+    shm_table *t = (shm_table *)at(shm, table);
+    for (unsigned int i = 0; t->buckets != 0 && i < t->hmax; ++i) {
+        unsigned long off = ((unsigned long *)at(shm, t->buckets))[i];
+        while (off != 0) {
+            unsigned long next = ((shm_entry *)at(shm, off))->next;
+            shm_free(shm, off);
+            off = next;
+        }
+    }
+    shm_free(shm, t->buckets);
+    shm_free(shm, table);
+
+    shm_write_end(shm);
+}
+
+/*
+ * Unlinks the entry of a key from its bucket and returns its offset, or 0
+ */
+static unsigned long unlink_entry(shm_store_t *shm, shm_table *t, char *key,
+                                  unsigned int key_hash)
+{
+    if (t->buckets == 0)
+        return 0;
+
+    unsigned long *link = (unsigned long *)at(shm, t->buckets)
+                          + key_hash % t->hmax;
+    while (*link != 0) {
+        shm_entry *entry = (shm_entry *)at(shm, *link);
+        if (entry->key_hash == key_hash && !strcmp(entry->data, key)) {
+            unsigned long off = *link;
+            *link = entry->next;
+            t->size--;
+            return off;
+        }
+        link = &entry->next;
+    }
+    return 0;
+}
+
+/*
+ * Gives the table buckets on its first object and doubles them past a
+ * load factor of 0.75. Returns 0 if the segment is full.
+ */
+static int reserve_bucket(shm_store_t *shm, shm_table *t)
+{
+    if (t->buckets != 0 && t->size + 1 <= t->hmax / 4 * 3)
+        return 1;
+
+    unsigned int hmax = t->buckets == 0 ? SHM_TABLE_SIZE : 2 * t->hmax;
+    unsigned long buckets = shm_alloc(shm, hmax * sizeof(unsigned long));
+    if (buckets == 0)
+        return 0;
+
+    unsigned long *slots = (unsigned long *)at(shm, buckets);
+    memset(slots, 0, hmax * sizeof(unsigned long));
+
+    for (unsigned int i = 0; t->buckets != 0 && i < t->hmax; ++i) {
+        unsigned long off = ((unsigned long *)at(shm, t->buckets))[i];
+        while (off != 0) {
+            shm_entry *entry = (shm_entry *)at(shm, off);
+            unsigned long next = entry->next;
+
+            entry->next = slots[entry->key_hash % hmax];
+            slots[entry->key_hash % hmax] = off;
+            off = next;
+        }
+    }
+
+    shm_free(shm, t->buckets);
+    t->buckets = buckets;
+    t->hmax = hmax;
+    return 1;
+}
+
+/**
+ * Copies an object (key, value and expiry time) to a server table,
+ * replacing the previous copy of its key
+ * @param shm the segment
+ * @param table offset of the table of the server
+ * @param obj the object, in the private hashtable of the server
+ */
+void shm_table_put(shm_store_t *shm, unsigned long table, struct info *obj)
+{
+    if (table == 0)
+        return;
+
+    shm_write_begin(shm);
+
+    shm_table *t = (shm_table *)at(shm, table);
+    shm_free(shm, unlink_entry(shm, t, obj->key, obj->key_hash));
+
+    unsigned int value_len = server_value_length(obj);
+    unsigned long off = shm_alloc(shm, sizeof(shm_entry) + obj->key_size
+                                       + value_len);
+
+    if (off != 0 && reserve_bucket(shm, t)) {
+        shm_entry *entry = (shm_entry *)at(shm, off);
+        entry->key_hash = obj->key_hash;
+        entry->key_size = obj->key_size;
+        entry->value_len = value_len;
+        entry->expires_at = obj->expires_at;
+        memcpy(entry->data, obj->key, obj->key_size);
+        server_value_copy(NULL, obj, entry->data + obj->key_size);
+
+        unsigned long *slot = (unsigned long *)at(shm, t->buckets)
+                              + obj->key_hash % t->hmax;
+        entry->next = *slot;
+        *slot = off;
+        t->size++;
+    } else {
+        shm_free(shm, off);
+    }
+
+    shm_write_end(shm);
+}
+
+/**
+ * Removes a key from a server table
+ * @param shm the segment
+ * @param table offset of the table of the server
+ * @param key the key
+ */
+void shm_table_remove(shm_store_t *shm, unsigned long table, char *key)
+{
+    if (table == 0)
+        return;
+
+    shm_write_begin(shm);
+
+    shm_table *t = (shm_table *)at(shm, table);
+    shm_free(shm, unlink_entry(shm, t, key, hash_function_string(key)));
+    if (t->size == 0) {
+        shm_free(shm, t->buckets);
+        t->buckets = 0;
+        t->hmax = SHM_TABLE_SIZE;
+    }
+
+    shm_write_end(shm);
+}
+
+/*
+ * Replaces an array of the segment by a copy of len bytes of src, returns
+ * the new offset (0 if len is 0 or the segment is full)
+ */
+static unsigned long republish(shm_store_t *shm, unsigned long old,
+                               const void *src, unsigned long len)
+{
+    shm_free(shm, old);
+    if (len == 0)
+        return 0;
+
+    unsigned long off = shm_alloc(shm, len);
+    if (off != 0)
+        memcpy(at(shm, off), src, len);
+    return off;
+}
+
+/**
+ * Copies the hashring, the placement settings and the server directory
+ * of the load balancer, after its membership changed
+ * @param shm the segment
+ * @param main the load balancer
+ */
+void shm_publish(shm_store_t *shm, load_balancer *main)
+{
+    shm_header *h = shm->header;
+
+    shm_write_begin(shm);
+
+    h->ring = republish(shm, h->ring, main->hashring,
+                        main->hashring_len * sizeof(hashring_t));
+    h->ring_len = h->ring ? main->hashring_len : 0;
+    h->replicas = main->replicas;
+    h->probes = main->probes;
+
+    rendezvous_t *r = main->rendezvous;
+    int cap = r ? r->cap : 0;
+    h->seeds = republish(shm, h->seeds, r ? r->seeds : NULL,
+                         cap * sizeof(unsigned int));
+    h->inv_weights = republish(shm, h->inv_weights, r ? r->inv_weights : NULL,
+                               cap * sizeof(float));
+    h->weights = republish(shm, h->weights, r ? r->weights : NULL,
+                           cap * sizeof(unsigned int));
+    h->rendezvous_n = r ? r->n : 0;
+    h->rendezvous_cap = cap;
+    h->weighted = r ? r->weighted : 0;
+
+    int zones_len = main->topology ? topology_flat_size(main->topology) : 0;
+    unsigned int *flat = NULL;
+    if (zones_len > 0) {
+        flat = (unsigned int *)malloc(zones_len * sizeof(unsigned int));
+        DIE(!flat, "shm publish malloc failed");
+        topology_flatten(main->topology, flat);
+    }
+    h->zones = republish(shm, h->zones, flat,
+                         zones_len * sizeof(unsigned int));
+    h->zones_len = h->zones ? zones_len : 0;
+    // Without its zones the ring would send readers to the wrong servers
+    if (zones_len > 0 && h->zones == 0)
+        h->ring_len = 0;
+    free(flat);
+
+    server_dir_t *dir = main->servers;
+    if (h->dir_cap < dir->n_slots) {
+        shm_free(shm, h->dir);
+        h->dir_cap = dir->slots_cap;
+        h->dir = shm_alloc(shm, h->dir_cap * sizeof(shm_slot));
+        if (h->dir == 0)
+            h->dir_cap = 0;
+    }
+    shm_slot *slots = (shm_slot *)at(shm, h->dir);
+    for (int i = 0; i < h->dir_cap; ++i) {
+        server_memory *server = i < dir->n_slots ? dir->slots[i].server : NULL;
+        slots[i].id = server ? dir->slots[i].id : -1;
+        slots[i].table = server ? server->shm_table : 0;
+    }
+
+    shm_write_end(shm);
+}
+
+/*
+ * One attempt of shm_retrieve, which may read a segment in the middle of
+ * a change: nothing it reads is trusted further than the bounds of the
+ * mapping. Returns the length of the value, -1 if there is none.
+ */
+static long lookup(shm_store_t *shm, char *key, int *server_id)
+{
+    shm_header *h = shm->header;
+    int len = h->ring_len;
+    hashring_t *ring = (hashring_t *)checked(shm, h->ring,
+                                             (unsigned long)len
+                                             * sizeof(hashring_t));
+
+    *server_id = -1;
+    if (len <= 0 || ring == NULL)
+        return -1;
+
+    // The placement code of the load balancer runs on the copied ring
+    load_balancer view;
+    rendezvous_t r;
+    memset(&view, 0, sizeof(view));
+    view.hashring = ring;
+    view.hashring_len = len;
+    view.replicas = 1;
+    view.probes = h->probes;
+
+    if (h->rendezvous_n > 0) {
+        r.n = h->rendezvous_n;
+        r.cap = h->rendezvous_cap;
+        r.weighted = h->weighted;
+        r.seeds = (unsigned int *)checked(shm, h->seeds,
+                                          r.cap * sizeof(unsigned int));
+        r.inv_weights = (float *)checked(shm, h->inv_weights,
+                                         r.cap * sizeof(float));
+        r.weights = (unsigned int *)checked(shm, h->weights,
+                                            r.cap * sizeof(unsigned int));
+        if (r.n != len || r.cap < r.n || r.cap % HRW_LANES != 0
+            || !r.seeds || !r.inv_weights || !r.weights)
+            return -1;
+        view.rendezvous = &r;
+    }
+
+    // With replication this is the first server of the replica set
+    int pos;
+    if (h->zones_len > 0) {
+        // Zone placement: the ring is sorted by ID
+        int zones_len = h->zones_len;
+        unsigned int *flat = (unsigned int *)checked(
+            shm, h->zones, (unsigned long)zones_len * sizeof(unsigned int));
+        if (flat == NULL)
+            return -1;
+        int id = topology_flat_owner(flat, zones_len,
+                                     hash_function_key(key));
+        pos = server_position(&view, id);
+        if (pos < 0 || pos >= len || ring[pos].id != id)
+            return -1;
+    } else {
+        pos = binary_search_object_pos(&view, hash_function_key(key));
+        if (pos < 0 || pos >= len)
+            return -1;
+    }
+    *server_id = ring[pos].id;
+
+    int slot = ring[pos].slot;
+    shm_slot *dir = (shm_slot *)checked(shm, h->dir, (unsigned long)h->dir_cap
+                                                     * sizeof(shm_slot));
+    if (dir == NULL || slot < 0 || slot >= h->dir_cap)
+        return -1;
+
+    shm_table *t = (shm_table *)checked(shm, dir[slot].table,
+                                        sizeof(shm_table));
+    if (t == NULL || t->hmax == 0)
+        return -1;
+    unsigned long *buckets = (unsigned long *)checked(
+        shm, t->buckets, (unsigned long)t->hmax * sizeof(unsigned long));
+    if (buckets == NULL)
+        return -1;
+
+    unsigned int key_hash = hash_function_string(key);
+    unsigned int key_size = strlen(key) + 1;
+    unsigned long off = buckets[key_hash % t->hmax];
+
+    // A torn chain may loop, but it can't be longer than the table
+    for (unsigned int steps = t->size + 1; off != 0 && steps > 0; --steps) {
+        shm_entry *entry = (shm_entry *)checked(shm, off, sizeof(shm_entry));
+        if (entry == NULL)
+            return -1;
+
+        if (entry->key_hash == key_hash && entry->key_size == key_size
+            && checked(shm, off + sizeof(shm_entry),
+                       (unsigned long)key_size + entry->value_len)
+            && !memcmp(entry->data, key, key_size)) {
+            if (entry->expires_at != 0 && entry->expires_at <= now_ms())
+                return -1;
+
+            unsigned long value_len = entry->value_len;
+            if (value_len + 1 > shm->scratch_size) {
+                char *scratch = realloc(shm->scratch, value_len + 1);
+                DIE(!scratch, "shm scratch realloc failed");
+                shm->scratch = scratch;
+                shm->scratch_size = value_len + 1;
+            }
+            memcpy(shm->scratch, entry->data + key_size, value_len);
+            shm->scratch[value_len] = 0;
+            return value_len;
+        }
+        off = entry->next;
+    }
+
+    return -1;
+}
+
+/**
+ * Same as loader_retrieve, from another process: finds the owner of a key
+ * on the copy of the hashring and reads its table, without asking the
+ * load balancer. The value is valid until the next call. Objects whose
+ * incremental migration is still pending are not found.
+ * @param shm the segment, from shm_attach
+ * @param key the key
+ * @param server_id the ID of the owner is returned through it (-1 if
+ *                  there are no servers)
+ */
+char *shm_retrieve(shm_store_t *shm, char *key, int *server_id)
+{
+    shm_header *h = shm->header;
+
+    for (;;) {
+        unsigned int seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        long len = lookup(shm, key, server_id);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+            return len < 0 ? NULL : shm->scratch;
+    }
+}
@@ -0,0 +1,116 @@
+#ifndef SHM_STORE_H_
+#define SHM_STORE_H_
+
+#include "Hashtable.h"
+
+struct load_balancer;
+
+// Size classes of the shared allocator: blocks of 2^4 .. 2^(SHM_CLASSES+3)
+// bytes
+#define SHM_CLASSES 36
+
+typedef struct shm_header shm_header;
+typedef struct shm_slot shm_slot;
+typedef struct shm_table shm_table;
+typedef struct shm_entry shm_entry;
+typedef struct shm_store_t shm_store_t;
+
+// Start of the segment. Every link inside the segment is an offset from
+// its start (0 means none), so processes may map it anywhere.
+struct shm_header {
+    unsigned int magic;
+    // Seqlock: odd while a writer changes the segment
+    unsigned int seq;
+    // Held by the writer for the whole change
+    unsigned int writer;
+    // Set once an allocation failed, so that is reported only once; the
+    // objects which didn't fit are missing, the others are still served
+    unsigned int full;
+    unsigned long size;
+    // First byte never allocated
+    unsigned long brk;
+    // Freed blocks of every size class
+    unsigned long free_lists[SHM_CLASSES];
+    // Copy of the hashring and of the placement settings
+    unsigned long ring;
+    int ring_len;
+    int replicas;
+    int probes;
+    // Rendezvous scores (n == 0 on the ring), arrays of cap elements
+    int rendezvous_n;
+    int rendezvous_cap;
+    int weighted;
+    unsigned long seeds;
+    unsigned long inv_weights;
+    unsigned long weights;
+    // Zones and their servers as laid out by topology_flatten (len == 0
+    // without zone placement)
+    unsigned long zones;
+    int zones_len;
+    // Table of every server, indexed by its slot in the server directory
+    unsigned long dir;
+    int dir_cap;
+};
+
+struct shm_slot {
+    int id;
+    // Offset of the shm_table of the server, 0 if the slot is free
+    unsigned long table;
+};
+
+// Chained hashtable of a server
+struct shm_table {
+    unsigned int hmax;
+    unsigned int size;
+    // Offset of an array of hmax offsets of shm_entry
+    unsigned long buckets;
+};
+
+// An object: the key (with its terminator) then the value (without)
+struct shm_entry {
+    unsigned long next;
+    unsigned int key_hash;
+    unsigned int key_size;
+    unsigned int value_len;
+    unsigned long expires_at;
+    char data[];
+};
+
+// A mapping of the segment in this process
+struct shm_store_t {
+    char *base;
+    shm_header *header;
+    unsigned long size;
+    // 1 for the process which created the segment and mirrors into it
+    int writable;
+    // Nesting of shm_write_begin in this process
+    int depth;
+    char *name;
+    // Buffer shm_retrieve copies values to
+    char *scratch;
+    unsigned long scratch_size;
+};
+
+shm_store_t *shm_create(const char *name, unsigned long size);
+
+shm_store_t *shm_attach(const char *name);
+
+void shm_close(shm_store_t *shm);
+
+void shm_write_begin(shm_store_t *shm);
+
+void shm_write_end(shm_store_t *shm);
+
+unsigned long shm_table_create(shm_store_t *shm);
+
+void shm_table_free(shm_store_t *shm, unsigned long table);
+
+void shm_table_put(shm_store_t *shm, unsigned long table, struct info *obj);
+
+void shm_table_remove(shm_store_t *shm, unsigned long table, char *key);
+
+void shm_publish(shm_store_t *shm, struct load_balancer *main);
+
+char *shm_retrieve(shm_store_t *shm, char *key, int *server_id);
+
+#endif  // SHM_STORE_H_
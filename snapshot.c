@@ -0,0 +1,556 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "snapshot.h"
+#include "load_balancer.h"
+#include "load_balancer_utils.h"
+#include "trace.h"
+#include "utils.h"
+
+#define SNAPSHOT_MAGIC 0x3453424cu /* "LBS4" */
+#define PATH_LENGTH 4096
+
+static int compare_ids(const void *a, const void *b)
+{
+    int id_a = *(const int *)a;
+    int id_b = *(const int *)b;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * Collects the IDs of the servers on the hashring (each ID once, sorted)
+ * Returns the number of IDs
+ * @param main the load balancer
+ * @param ids array of at least hashring_len elements
+ */
+static int collect_server_ids(load_balancer *main, int *ids)
+{
+    int n = 0;
+
+    for (int i = 0; i < main->hashring_len; ++i)
+        ids[i] = main->hashring[i].id;
+    qsort(ids, main->hashring_len, sizeof(int), compare_ids);
+
+    for (int i = 0; i < main->hashring_len; ++i)
+        if (n == 0 || ids[n - 1] != ids[i])
+            ids[n++] = ids[i];
+
+    return n;
+}
+
+/*
+ * Every live object is written once, by the server its reads go to (the
+ * first replica which still holds it); expired ones are left out
+ */
+static int is_written(load_balancer *main, server_memory *server,
+                      struct info *obj)
+{
+    return object_holder(main, obj->key) == server;
+}
+
+/*
+ * Labels are written as their length and their bytes
+ */
+static void write_label(const char *label, FILE *out)
+{
+    unsigned int len = strlen(label);
+
+    fwrite(&len, sizeof(len), 1, out);
+    fwrite(label, 1, len, out);
+}
+
+/*
+ * Reads a label written by write_label, returns NULL if it is truncated
+ */
+static char *read_label(FILE *in)
+{
+    unsigned int len;
+    if (fread(&len, sizeof(len), 1, in) != 1 || len > PATH_LENGTH)
+        return NULL;
+
+    char *label = (char *)malloc(len + 1);
+    DIE(!label, "snapshot malloc failed");
+    if (fread(label, 1, len, in) != len) {
+        free(label);
+        return NULL;
+    }
+    label[len] = 0;
+    return label;
+}
+
+static int write_piece(void *ctx, const char *data, unsigned int len)
+{
+    return fwrite(data, 1, len, (FILE *)ctx) != len;
+}
+
+/**
+ * Lists the servers whose objects are written: those of the ring, then
+ * the sources of a rebalance which already left it
+ * Returns the number of servers
+ * @param main the load balancer
+ * @param ids IDs of the servers of the ring
+ * @param n_servers number of IDs
+ * @param holders array of at least n_servers + rebalance->n_tasks elements
+ */
+static int collect_holders(load_balancer *main, int *ids, int n_servers,
+                           server_memory **holders)
+{
+    int n = 0;
+
+    for (int s = 0; s < n_servers; ++s)
+        holders[n++] = get_server(main, ids[s]);
+    for (int i = 0; i < main->rebalance->n_tasks; ++i) {
+        migration *task = &main->rebalance->tasks[i];
+        if (get_server(main, task->source_id) != task->source)
+            holders[n++] = task->source;
+    }
+
+    return n;
+}
+
+/**
+ * Writes the membership and every stored object to a snapshot file.
+ * The snapshot is written to a temporary file which replaces the old one
+ * only once it is complete, so a crash never leaves a half-written snapshot.
+ * Nothing is moved: objects a rebalance didn't reach yet are written from
+ * the server still holding them, so a forked child only reads the pages
+ * it shares with its parent.
+ * Returns 0 on success, -1 on failure
+ * @param main the load balancer
+ * @param path path of the snapshot
+ */
+int snapshot_save(load_balancer *main, const char *path)
+{
+    // Named after the process, so a background child and its parent never
+    // write the same file
+    char tmp_path[PATH_LENGTH];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL) {
+        perror("snapshot open failed");
+        return -1;
+    }
+
+    int *ids = (int *)malloc((main->hashring_len + 1) * sizeof(int));
+    server_memory **holders = (server_memory **)malloc(
+        (main->hashring_len + main->rebalance->n_tasks + 1)
+        * sizeof(server_memory *));
+    DIE(!ids || !holders, "snapshot malloc failed");
+    unsigned int n_servers = collect_server_ids(main, ids);
+    int n_holders = collect_holders(main, ids, n_servers, holders);
+
+    unsigned int n_objects = 0;
+    for (int s = 0; s < n_holders; ++s) {
+        server_memory *server = holders[s];
+        hashtable_t *ht = server->hashtable;
+
+        for (unsigned int i = 0; i < ht->hmax; ++i)
+            for (ll_node_t *it = ht_bucket_head(ht, i); it; it = it->next)
+                if (is_written(main, server, it->data))
+                    n_objects++;
+    }
+
+    unsigned int magic = SNAPSHOT_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, out);
+    fwrite(&n_servers, sizeof(n_servers), 1, out);
+    fwrite(ids, sizeof(int), n_servers, out);
+    for (unsigned int s = 0; s < n_servers; ++s) {
+        unsigned int weight = loader_server_weight(main, ids[s]);
+        fwrite(&weight, sizeof(weight), 1, out);
+    }
+    // Zone and rack of every server, empty without zone placement
+    for (unsigned int s = 0; s < n_servers; ++s) {
+        const char *zone, *rack;
+        loader_server_location(main, ids[s], &zone, &rack);
+        write_label(zone, out);
+        write_label(rack, out);
+    }
+    fwrite(&n_objects, sizeof(n_objects), 1, out);
+
+    for (int s = 0; s < n_holders; ++s) {
+        server_memory *server = holders[s];
+        hashtable_t *ht = server->hashtable;
+
+        for (unsigned int i = 0; i < ht->hmax; ++i) {
+            for (ll_node_t *it = ht_bucket_head(ht, i); it; it = it->next) {
+                struct info *obj = (struct info *)it->data;
+                if (!is_written(main, server, obj))
+                    continue;
+
+                unsigned int key_len = strlen((char *)obj->key);
+                unsigned int value_len = server_value_length(obj);
+                uint64_t expires = obj->expires_at;
+
+                fwrite(&key_len, sizeof(key_len), 1, out);
+                fwrite(&value_len, sizeof(value_len), 1, out);
+                fwrite(&expires, sizeof(expires), 1, out);
+                fwrite(obj->key, 1, key_len, out);
+                server_value_visit(server, obj, write_piece, out);
+            }
+        }
+    }
+    free(ids);
+    free(holders);
+
+    int failed = fflush(out) != 0 || ferror(out) || fsync(fileno(out)) < 0;
+    failed |= fclose(out) != 0;
+    if (failed || rename(tmp_path, path) < 0) {
+        perror("snapshot write failed");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Loads a snapshot into an empty load balancer
+ * Returns 0 on success (or if there is no snapshot yet), -1 on failure
+ * @param main the load balancer
+ * @param path path of the snapshot
+ */
+int snapshot_load(load_balancer *main, const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+        return 0;
+
+    unsigned int magic = 0, n_servers = 0, n_objects = 0;
+    int server_id_unused = 0;
+    char *piece = NULL;
+    if (fread(&magic, sizeof(magic), 1, in) != 1 || magic != SNAPSHOT_MAGIC
+        || fread(&n_servers, sizeof(n_servers), 1, in) != 1) {
+        fprintf(stderr, "snapshot: %s is not a snapshot\n", path);
+        fclose(in);
+        return -1;
+    }
+
+    // The ring is built at once, before any object is loaded
+    int *ids = (int *)malloc((n_servers + 1) * sizeof(int));
+    unsigned int *weights = (unsigned int *)malloc((n_servers + 1)
+                                                   * sizeof(int));
+    DIE(!ids || !weights, "snapshot malloc failed");
+    if (fread(ids, sizeof(int), n_servers, in) != n_servers
+        || fread(weights, sizeof(int), n_servers, in) != n_servers) {
+        free(ids);
+        free(weights);
+        goto truncated;
+    }
+    char **labels = (char **)calloc(2 * n_servers + 1, sizeof(char *));
+    DIE(!labels, "snapshot malloc failed");
+    int complete = 1;
+    for (unsigned int i = 0; i < 2 * n_servers && complete; ++i)
+        complete = (labels[i] = read_label(in)) != NULL;
+
+    if (complete && main->topology) {
+        for (unsigned int i = 0; i < n_servers; ++i)
+            loader_add_server_at(main, ids[i],
+                                 labels[2 * i][0] ? labels[2 * i]
+                                                  : DEFAULT_ZONE,
+                                 labels[2 * i + 1]);
+    } else if (complete && main->rendezvous) {
+        for (unsigned int i = 0; i < n_servers; ++i)
+            loader_add_server_weighted(main, ids[i], weights[i]);
+    } else if (complete) {
+        loader_add_servers(main, ids, n_servers);
+    }
+    for (unsigned int i = 0; i < 2 * n_servers; ++i)
+        free(labels[i]);
+    free(labels);
+    free(ids);
+    free(weights);
+    if (!complete)
+        goto truncated;
+
+    if (fread(&n_objects, sizeof(n_objects), 1, in) != 1)
+        goto truncated;
+
+    piece = (char *)malloc(VALUE_CHUNK_SIZE);
+    DIE(!piece, "snapshot malloc failed");
+
+    for (unsigned int i = 0; i < n_objects; ++i) {
+        unsigned int key_len, value_len;
+        uint64_t expires;
+        if (fread(&key_len, sizeof(key_len), 1, in) != 1
+            || fread(&value_len, sizeof(value_len), 1, in) != 1
+            || fread(&expires, sizeof(expires), 1, in) != 1)
+            goto truncated;
+
+        char *key = (char *)malloc(key_len + 1);
+        DIE(!key, "snapshot malloc failed");
+        if (fread(key, 1, key_len, in) != key_len) {
+            free(key);
+            goto truncated;
+        }
+        key[key_len] = 0;
+
+        // Values are streamed, big ones never sit in a single buffer
+        loader_stream *stream = loader_store_begin(main, key);
+        while (value_len > 0) {
+            unsigned int len = value_len < VALUE_CHUNK_SIZE ? value_len
+                                                            : VALUE_CHUNK_SIZE;
+            if (fread(piece, 1, len, in) != len) {
+                loader_store_cancel(stream);
+                free(key);
+                goto truncated;
+            }
+            loader_store_append(stream, piece, len);
+            value_len -= len;
+        }
+        loader_store_end(stream, &server_id_unused);
+
+        if (expires != 0)
+            loader_expire_at(main, key, expires);
+        free(key);
+    }
+    free(piece);
+
+    fclose(in);
+    return 0;
+
+truncated:
+    fprintf(stderr, "snapshot: %s is truncated\n", path);
+    free(piece);
+    fclose(in);
+    return -1;
+}
+
+// What the child of a background snapshot reports to its parent
+typedef struct snapshot_report {
+    int status;
+    unsigned long duration_ns;
+    long cow_kb;
+} snapshot_report;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/*
+ * Returns the memory of the calling process no other process maps (kB),
+ * -1 if the kernel has no smaps_rollup
+ */
+static long private_dirty_kb(void)
+{
+    FILE *in = fopen("/proc/self/smaps_rollup", "r");
+    if (in == NULL)
+        return -1;
+
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), in))
+        if (sscanf(line, "Private_Dirty: %ld kB", &kb) == 1)
+            break;
+    fclose(in);
+    return kb;
+}
+
+/*
+ * Closes the descriptors the child inherited but one: sockets of clients
+ * must not stay open because a snapshot is being written
+ */
+static void close_inherited(int keep)
+{
+#ifdef SYS_close_range
+    if ((keep == 3 || syscall(SYS_close_range, 3, keep - 1, 0) == 0)
+        && syscall(SYS_close_range, keep + 1, ~0u, 0) == 0)
+        return;
+#endif
+    long max = sysconf(_SC_OPEN_MAX);
+    for (long fd = 3; fd < max && fd < 65536; ++fd)
+        if (fd != keep)
+            close(fd);
+}
+
+/*
+ * Body of the child of a background snapshot: writes it, reports and exits
+ * without running the exit handlers or flushing the parent's buffers
+ */
+static void run_child(load_balancer *main, const char *path, int report_fd)
+{
+    snapshot_report report;
+    unsigned long start = now_ns();
+    long private_kb = private_dirty_kb();
+
+    close_inherited(report_fd);
+    trace_disable();
+
+    // The shared memory segment and the log belong to the parent (the
+    // writer thread of the log didn't survive the fork anyway)
+    main->wal = NULL;
+    main->shm = NULL;
+    for (int i = 0; i < main->servers->n_slots; ++i)
+        if (main->servers->slots[i].server != NULL)
+            main->servers->slots[i].server->shm = NULL;
+
+    report.status = snapshot_save(main, path);
+    report.duration_ns = now_ns() - start;
+    long end_kb = private_dirty_kb();
+    report.cow_kb = private_kb >= 0 && end_kb >= 0 ? end_kb - private_kb : -1;
+
+    ssize_t sent = write(report_fd, &report, sizeof(report));
+    _exit(report.status < 0 || sent != sizeof(report));
+}
+
+/**
+ * Starts writing a snapshot in the background. A child process writes it
+ * from its copy-on-write view of the load balancer, while the caller goes
+ * on serving; snapshot_poll collects it. The copy only costs the pages
+ * either process writes meanwhile.
+ * Returns 0 if the child started, -1 if a snapshot is already running or
+ * the fork failed
+ * @param main the load balancer
+ * @param path path of the snapshot
+ */
+int snapshot_start(load_balancer *main, const char *path)
+{
+    if (main->snapshot == NULL) {
+        main->snapshot = (snapshot_job *)calloc(1, sizeof(snapshot_job));
+        DIE(!main->snapshot, "snapshot malloc failed");
+    }
+
+    snapshot_job *job = main->snapshot;
+    if (job->pid != 0) {
+        fprintf(stderr, "snapshot: one is already being written\n");
+        return -1;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        perror("snapshot pipe failed");
+        return -1;
+    }
+
+    unsigned long start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        run_child(main, path, fds[1]);
+    }
+    unsigned long forked = now_ns();
+    close(fds[1]);
+    if (pid < 0) {
+        perror("snapshot fork failed");
+        close(fds[0]);
+        return -1;
+    }
+
+    job->pid = pid;
+    job->report_fd = fds[0];
+    job->polls = 0;
+    job->started_ns = forked;
+    job->fork_ns = forked - start;
+    return 0;
+}
+
+/**
+ * Collects the background snapshot if its child is done. Periodic checks
+ * only look at the child once every SNAPSHOT_POLL_OPS calls, so they can be
+ * made on every request.
+ * Returns 1 if a snapshot was written, -1 if one failed, 0 otherwise
+ * @param main the load balancer
+ * @param how SNAPSHOT_PERIODIC, SNAPSHOT_NOW or SNAPSHOT_WAIT
+ */
+int snapshot_poll(load_balancer *main, int how)
+{
+    snapshot_job *job = main->snapshot;
+
+    if (job == NULL || job->pid == 0
+        || (how == SNAPSHOT_PERIODIC && ++job->polls % SNAPSHOT_POLL_OPS != 0))
+        return 0;
+
+    int status;
+    pid_t done;
+    while ((done = waitpid(job->pid, &status,
+                           how == SNAPSHOT_WAIT ? 0 : WNOHANG)) < 0
+           && errno == EINTR)
+        ;
+    if (done == 0)
+        return 0;
+
+    snapshot_report report;
+    int ok = done == job->pid && WIFEXITED(status)
+             && WEXITSTATUS(status) == 0
+             && read(job->report_fd, &report, sizeof(report))
+                == sizeof(report);
+    close(job->report_fd);
+    job->pid = 0;
+
+    if (!ok) {
+        fprintf(stderr, "snapshot: the background snapshot failed\n");
+        job->failed++;
+        job->last_failed = 1;
+        return -1;
+    }
+    job->written++;
+    job->last_failed = 0;
+    job->duration_ns = report.duration_ns;
+    job->cow_kb = report.cow_kb;
+    return 1;
+}
+
+/**
+ * Returns how long the running background snapshot has taken so far (ms)
+ * @param job the job, with a child running
+ */
+double snapshot_running_ms(const snapshot_job *job)
+{
+    return (now_ns() - job->started_ns) / 1e6;
+}
+
+/**
+ * Prints the figures of the background snapshots, if any was started
+ * @param main the load balancer
+ * @param out where they are printed
+ */
+void snapshot_print_stats(load_balancer *main, FILE *out)
+{
+    snapshot_job *job = main->snapshot;
+
+    if (job == NULL)
+        return;
+
+    if (job->pid != 0)
+        fprintf(out, "Snapshot: running for %.1f ms, fork took %.1f us.\n",
+                snapshot_running_ms(job), job->fork_ns / 1e3);
+    else if (job->last_failed)
+        fprintf(out, "Snapshot: the last one failed.\n");
+    else if (job->written > 0)
+        fprintf(out, "Snapshot: fork took %.1f us, written in %.1f ms, "
+                "%ld kB copied on write.\n", job->fork_ns / 1e3,
+                job->duration_ns / 1e6, job->cow_kb);
+    fprintf(out, "Snapshots: %lu written, %lu failed.\n", job->written,
+            job->failed);
+}
+
+/**
+ * Waits for the running background snapshot, if any, and frees the job
+ * @param job the job (can be NULL)
+ */
+void snapshot_job_free(snapshot_job *job)
+{
+    if (job == NULL)
+        return;
+
+    if (job->pid != 0) {
+        while (waitpid(job->pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        close(job->report_fd);
+    }
+    free(job);
+}
@@ -0,0 +1,59 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+struct load_balancer;
+
+// Requests between two checks of a running background snapshot
+#define SNAPSHOT_POLL_OPS 256
+
+// How snapshot_poll checks the child: once every SNAPSHOT_POLL_OPS calls,
+// right away, or by waiting for it to exit
+#define SNAPSHOT_PERIODIC 0
+#define SNAPSHOT_NOW 1
+#define SNAPSHOT_WAIT 2
+
+typedef struct snapshot_job snapshot_job;
+
+// Snapshots written by a child process from a copy-on-write view of the
+// load balancer, while the parent keeps serving
+struct snapshot_job {
+    // Child writing the snapshot, 0 if none is running
+    pid_t pid;
+    // Read end of the pipe the child reports on
+    int report_fd;
+    // Checks since the child started
+    unsigned long polls;
+    // When the child started (monotonic ns)
+    unsigned long started_ns;
+    unsigned long written;
+    unsigned long failed;
+    // 1 if the last snapshot failed (the figures are those of the one
+    // before, but for fork_ns)
+    int last_failed;
+    // Figures of the last snapshot: how long fork() stopped the parent,
+    // how long the child took, and how much memory the two processes no
+    // longer shared when it finished (pages copied on write), -1 if the
+    // kernel doesn't tell
+    unsigned long fork_ns;
+    unsigned long duration_ns;
+    long cow_kb;
+};
+
+int snapshot_save(struct load_balancer *main, const char *path);
+
+int snapshot_load(struct load_balancer *main, const char *path);
+
+int snapshot_start(struct load_balancer *main, const char *path);
+
+int snapshot_poll(struct load_balancer *main, int how);
+
+double snapshot_running_ms(const snapshot_job *job);
+
+void snapshot_print_stats(struct load_balancer *main, FILE *out);
+
+void snapshot_job_free(snapshot_job *job);
+
+#endif  // SNAPSHOT_H_
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_ring.h"
+#include "utils.h"
+
+/**
+ * Allocs an empty ring
+ * @param capacity minimum number of elements (rounded up to a power of two)
+ * @param elem_size size in bytes of one element
+ */
+spsc_ring_t *spsc_ring_create(unsigned int capacity, unsigned int elem_size)
+{
+    spsc_ring_t *ring = (spsc_ring_t *)malloc(sizeof(spsc_ring_t));
+    DIE(!ring, "spsc ring malloc failed");
+
+    unsigned int real_capacity = 1;
+    while (real_capacity < capacity)
+        real_capacity <<= 1;
+
+    ring->slots = (char *)malloc((size_t)real_capacity * elem_size);
+    DIE(!ring->slots, "spsc ring malloc failed");
+
+    ring->elem_size = elem_size;
+    ring->capacity = real_capacity;
+    ring->mask = real_capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return ring;
+}
+
+/**
+ * Copies an element at the tail of the ring (producer side only)
+ * Returns 1 on success and 0 if the ring is full
+ * @param ring the ring
+ * @param elem pointer to the element that is copied
+ */
+int spsc_ring_push(spsc_ring_t *ring, const void *elem)
+{
+    unsigned long tail = ring->tail;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail - head == ring->capacity)
+        return 0;
+
+    memcpy(ring->slots + (tail & ring->mask) * ring->elem_size, elem,
+           ring->elem_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * Copies the element at the head of the ring out (consumer side only)
+ * Returns 1 on success and 0 if the ring is empty
+ * @param ring the ring
+ * @param elem where the element is copied
+ */
+int spsc_ring_pop(spsc_ring_t *ring, void *elem)
+{
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+        return 0;
+
+    memcpy(elem, ring->slots + (head & ring->mask) * ring->elem_size,
+           ring->elem_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * Returns 1 if the consumer has caught up with the producer
+ * @param ring the ring
+ */
+int spsc_ring_empty(spsc_ring_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+           == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Frees the ring (elements are not touched)
+ * @param ring the ring
+ */
+void spsc_ring_free(spsc_ring_t *ring)
+{
+    if (ring == NULL)
+        return;
+    free(ring->slots);
+    free(ring);
+}
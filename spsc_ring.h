@@ -0,0 +1,37 @@
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#define CACHE_LINE 64
+
+typedef struct spsc_ring_t spsc_ring_t;
+
+// Bounded single-producer/single-consumer queue of fixed-size elements.
+// The producer only writes tail and the consumer only writes head, so the
+// two sides never take a lock; each index lives on its own cache line.
+struct spsc_ring_t {
+    // Storage for capacity elements of elem_size bytes each
+    char *slots;
+    unsigned int elem_size;
+    // Number of slots (always a power of two)
+    unsigned int capacity;
+    unsigned int mask;
+    char pad_0[CACHE_LINE];
+    // Next slot the consumer will read
+    unsigned long head;
+    char pad_1[CACHE_LINE - sizeof(unsigned long)];
+    // Next slot the producer will write
+    unsigned long tail;
+    char pad_2[CACHE_LINE - sizeof(unsigned long)];
+};
+
+spsc_ring_t *spsc_ring_create(unsigned int capacity, unsigned int elem_size);
+
+int spsc_ring_push(spsc_ring_t *ring, const void *elem);
+
+int spsc_ring_pop(spsc_ring_t *ring, void *elem);
+
+int spsc_ring_empty(spsc_ring_t *ring);
+
+void spsc_ring_free(spsc_ring_t *ring);
+
+#endif  // SPSC_RING_H_
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+#include "utils.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/**
+ * Allocs an empty wheel
+ * @param now current time in ticks
+ */
+timer_wheel_t *timer_wheel_create(unsigned long now)
+{
+    timer_wheel_t *wheel = (timer_wheel_t *)calloc(1, sizeof(timer_wheel_t));
+    DIE(!wheel, "timer wheel malloc failed");
+
+    wheel->now = now;
+    return wheel;
+}
+
+/**
+ * Links an entry in the right slot (or in the due / overflow list)
+ * @param wheel the wheel
+ * @param entry the entry
+ */
+static void place(timer_wheel_t *wheel, timer_entry *entry)
+{
+    unsigned long expires = entry->expires;
+
+    if (expires <= wheel->now) {
+        entry->next = wheel->due;
+        wheel->due = entry;
+        return;
+    }
+
+    // Lowest level whose current rotation contains the expiry: the slot
+    // index is then always ahead of the level's current index
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        int shift = WHEEL_BITS * (level + 1);
+
+        if ((expires >> shift) == (wheel->now >> shift)) {
+            unsigned int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+            entry->next = wheel->slots[level][slot];
+            wheel->slots[level][slot] = entry;
+            wheel->occupied[level] |= 1ull << slot;
+            return;
+        }
+    }
+
+    entry->next = wheel->overflow;
+    wheel->overflow = entry;
+}
+
+/**
+ * Schedules a key
+ * @param wheel the wheel
+ * @param key the key (copied)
+ * @param expires time (in ticks) when the key expires
+ */
+void timer_wheel_add(timer_wheel_t *wheel, const char *key,
+                     unsigned long expires)
+{
+    size_t key_size = strlen(key) + 1;
+    timer_entry *entry = (timer_entry *)malloc(sizeof(timer_entry) + key_size);
+    DIE(!entry, "timer entry malloc failed");
+
+    memcpy(entry->key, key, key_size);
+    entry->expires = expires;
+    place(wheel, entry);
+    wheel->count++;
+}
+
+/**
+ * Returns the next time (in ticks) when a slot has to be processed, or
+ * limit if nothing happens before it
+ */
+static unsigned long next_event(timer_wheel_t *wheel, unsigned long limit)
+{
+    unsigned long next = limit;
+
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        int shift = WHEEL_BITS * level;
+        unsigned int current = (wheel->now >> shift) & WHEEL_MASK;
+        // Only slots after the current one can hold entries
+        uint64_t ahead = current == WHEEL_MASK ? 0
+                         : wheel->occupied[level] & (~0ull << (current + 1));
+
+        if (ahead == 0)
+            continue;
+
+        unsigned long slot = __builtin_ctzll(ahead);
+        unsigned long rotation = wheel->now >> (shift + WHEEL_BITS);
+        unsigned long start = ((rotation << WHEEL_BITS) | slot) << shift;
+        if (start < next)
+            next = start;
+    }
+
+    return next;
+}
+
+/**
+ * Moves the time forward. Entries whose time has come are moved to the due
+ * list; the work is proportional to the number of non-empty slots reached,
+ * not to the number of ticks.
+ * @param wheel the wheel
+ * @param now new current time in ticks
+ */
+void timer_wheel_advance(timer_wheel_t *wheel, unsigned long now)
+{
+    if (now <= wheel->now)
+        return;
+
+    while (wheel->now < now) {
+        unsigned long old_top = wheel->now >> (WHEEL_BITS * WHEEL_LEVELS);
+
+        wheel->now = next_event(wheel, now);
+
+        // Entries of the slots reached on the upper levels fall down
+        for (int level = WHEEL_LEVELS - 1; level >= 0; --level) {
+            int shift = WHEEL_BITS * level;
+            unsigned int slot = (wheel->now >> shift) & WHEEL_MASK;
+
+            if ((wheel->now & ((1ul << shift) - 1)) != 0
+                || !(wheel->occupied[level] & (1ull << slot)))
+                continue;
+
+            timer_entry *entry = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            wheel->occupied[level] &= ~(1ull << slot);
+
+            while (entry != NULL) {
+                timer_entry *next = entry->next;
+                place(wheel, entry);
+                entry = next;
+            }
+        }
+
+        // The top level started a new rotation, the overflow may fit now
+        if (wheel->overflow
+            && (wheel->now >> (WHEEL_BITS * WHEEL_LEVELS)) != old_top) {
+            timer_entry *entry = wheel->overflow;
+            wheel->overflow = NULL;
+
+            while (entry != NULL) {
+                timer_entry *next = entry->next;
+                place(wheel, entry);
+                entry = next;
+            }
+        }
+    }
+}
+
+/**
+ * Takes one entry out of the due list (the caller frees it), or NULL
+ * @param wheel the wheel
+ */
+timer_entry *timer_wheel_pop_due(timer_wheel_t *wheel)
+{
+    timer_entry *entry = wheel->due;
+
+    if (entry != NULL) {
+        wheel->due = entry->next;
+        wheel->count--;
+    }
+    return entry;
+}
+
+static void free_entries(timer_entry *entry)
+{
+    while (entry != NULL) {
+        timer_entry *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+}
+
+/**
+ * Frees the wheel and all its entries
+ * @param wheel the wheel
+ */
+void timer_wheel_free(timer_wheel_t *wheel)
+{
+    if (wheel == NULL)
+        return;
+
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot)
+            free_entries(wheel->slots[level][slot]);
+    free_entries(wheel->overflow);
+    free_entries(wheel->due);
+    free(wheel);
+}
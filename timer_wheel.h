@@ -0,0 +1,50 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+// Every level has 64 slots, so a level's occupancy fits in one word
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+// 6 levels of 64 slots cover 2^36 ticks (~795 days of milliseconds)
+#define WHEEL_LEVELS 6
+
+typedef struct timer_entry timer_entry;
+typedef struct timer_wheel_t timer_wheel_t;
+
+// A key which has to be checked for expiry at a given time
+struct timer_entry {
+    timer_entry *next;
+    unsigned long expires;
+    char key[];
+};
+
+// Hierarchical timing wheel. An entry sits on the lowest level whose
+// current rotation contains its expiry and falls to lower levels as
+// time reaches its slot, so every entry is touched at most once per level.
+struct timer_wheel_t {
+    timer_entry *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    // Bit i of occupied[k] is set if slots[k][i] is not empty
+    uint64_t occupied[WHEEL_LEVELS];
+    // Entries too far in the future for the top level
+    timer_entry *overflow;
+    // Entries whose time has come, waiting to be processed
+    timer_entry *due;
+    // Current time, in ticks
+    unsigned long now;
+    // Number of entries in the wheel and in the due list
+    unsigned long count;
+};
+
+timer_wheel_t *timer_wheel_create(unsigned long now);
+
+void timer_wheel_add(timer_wheel_t *wheel, const char *key,
+                     unsigned long expires);
+
+void timer_wheel_advance(timer_wheel_t *wheel, unsigned long now);
+
+timer_entry *timer_wheel_pop_due(timer_wheel_t *wheel);
+
+void timer_wheel_free(timer_wheel_t *wheel);
+
+#endif  // TIMER_WHEEL_H_
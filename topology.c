@@ -0,0 +1,459 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "topology.h"
+#include "utils.h"
+
+// Copies of an object placed at most (MAX_REPLICATION of the load balancer)
+#define MAX_COPIES 16
+// Zones scored on the stack when picking replicas
+#define SMALL_ZONES 16
+
+/*
+ * Finalizer of murmur3, the same score as unweighted rendezvous hashing
+ */
+static unsigned int score(unsigned int seed, unsigned int hash)
+{
+    unsigned int h = seed ^ hash;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * FNV-1a of a label, mixed so that similar names get unrelated seeds
+ */
+static unsigned int label_hash(const char *label)
+{
+    unsigned int h = 2166136261u;
+
+    for (; *label; ++label)
+        h = (h ^ (unsigned char)*label) * 16777619u;
+    return score(h, 0);
+}
+
+static char *copy_label(const char *label)
+{
+    char *copy = strdup(label);
+    DIE(!copy, "topology malloc failed");
+    return copy;
+}
+
+/**
+ * Allocs a topology without zones
+ */
+topology_t *topology_create(void)
+{
+    topology_t *t = (topology_t *)calloc(1, sizeof(topology_t));
+    DIE(!t, "topology malloc failed");
+    t->local_zone = -1;
+
+    return t;
+}
+
+/**
+ * Frees the topology and its labels
+ * @param t the topology
+ */
+void topology_free(topology_t *t)
+{
+    if (t == NULL)
+        return;
+
+    for (int z = 0; z < t->n_zones; ++z) {
+        zone_t *zone = &t->zones[z];
+
+        for (int i = 0; i < zone->n; ++i)
+            free(zone->racks[i]);
+        free(zone->name);
+        free(zone->ids);
+        free(zone->seeds);
+        free(zone->racks);
+        free(zone->rack_hashes);
+    }
+    free(t->zones);
+    free(t);
+}
+
+/**
+ * Returns the index of a zone, -1 if no server was ever added to it
+ * @param t the topology
+ * @param zone name of the zone
+ */
+int topology_find_zone(topology_t *t, const char *zone)
+{
+    for (int z = 0; z < t->n_zones; ++z)
+        if (!strcmp(t->zones[z].name, zone))
+            return z;
+    return -1;
+}
+
+/**
+ * Returns the index of a zone, creating it (empty) if it is new
+ * @param t the topology
+ * @param zone name of the zone
+ */
+int topology_add_zone(topology_t *t, const char *zone)
+{
+    int z = topology_find_zone(t, zone);
+    if (z >= 0)
+        return z;
+
+    if (t->n_zones == t->zones_cap) {
+        t->zones_cap = t->zones_cap ? 2 * t->zones_cap : 4;
+        t->zones = (zone_t *)realloc(t->zones, t->zones_cap * sizeof(zone_t));
+        DIE(!t->zones, "topology realloc failed");
+    }
+
+    zone_t *new_zone = &t->zones[t->n_zones];
+    memset(new_zone, 0, sizeof(zone_t));
+    new_zone->name = copy_label(zone);
+    new_zone->seed = label_hash(zone);
+
+    return t->n_zones++;
+}
+
+/**
+ * Adds a server to its zone, returns the index of the zone
+ * @param t the topology
+ * @param id ID of the server
+ * @param seed seed of the server, it has to be unique
+ * @param zone name of its zone
+ * @param rack name of its rack in the zone
+ */
+int topology_insert(topology_t *t, int id, unsigned int seed,
+                    const char *zone, const char *rack)
+{
+    int z = topology_add_zone(t, zone);
+    zone_t *dest = &t->zones[z];
+
+    if (dest->n == dest->cap) {
+        int cap = dest->cap ? 2 * dest->cap : 4;
+
+        dest->ids = (int *)realloc(dest->ids, cap * sizeof(int));
+        dest->seeds = (unsigned int *)realloc(dest->seeds, cap * sizeof(int));
+        dest->racks = (char **)realloc(dest->racks, cap * sizeof(char *));
+        dest->rack_hashes = (unsigned int *)realloc(dest->rack_hashes,
+                                                    cap * sizeof(int));
+        DIE(!dest->ids || !dest->seeds || !dest->racks || !dest->rack_hashes,
+            "topology realloc failed");
+        dest->cap = cap;
+    }
+
+    dest->ids[dest->n] = id;
+    dest->seeds[dest->n] = seed;
+    dest->racks[dest->n] = copy_label(rack);
+    dest->rack_hashes[dest->n] = label_hash(rack);
+    dest->n++;
+
+    return z;
+}
+
+/**
+ * Returns the zone of a server, -1 if it is not in the topology
+ * @param t the topology
+ * @param id ID of the server
+ * @param index where its position in the zone is returned (can be NULL)
+ */
+int topology_locate(const topology_t *t, int id, int *index)
+{
+    for (int z = 0; z < t->n_zones; ++z) {
+        for (int i = 0; i < t->zones[z].n; ++i) {
+            if (t->zones[z].ids[i] == id) {
+                if (index != NULL)
+                    *index = i;
+                return z;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Removes a server from its zone (the zone stays, even if it is empty)
+ * @param t the topology
+ * @param id ID of the server
+ */
+void topology_remove(topology_t *t, int id)
+{
+    int i;
+    int z = topology_locate(t, id, &i);
+    if (z < 0)
+        return;
+
+    zone_t *zone = &t->zones[z];
+    int after = zone->n - i - 1;
+
+    free(zone->racks[i]);
+    memmove(zone->ids + i, zone->ids + i + 1, after * sizeof(int));
+    memmove(zone->seeds + i, zone->seeds + i + 1, after * sizeof(int));
+    memmove(zone->racks + i, zone->racks + i + 1, after * sizeof(char *));
+    memmove(zone->rack_hashes + i, zone->rack_hashes + i + 1,
+            after * sizeof(int));
+    zone->n--;
+}
+
+static int contains(const int *ids, int n, int id)
+{
+    for (int i = 0; i < n; ++i)
+        if (ids[i] == id)
+            return 1;
+    return 0;
+}
+
+/*
+ * Position in the zone of the server with the best score for an object
+ * (the lowest ID among equal scores), skipping exclude_id. Returns -1 if
+ * there is none.
+ */
+static int best_member(const zone_t *zone, unsigned int hash, int exclude_id)
+{
+    int best = -1;
+    unsigned int best_score = 0;
+
+    for (int i = 0; i < zone->n; ++i) {
+        int id = zone->ids[i];
+        if (id == exclude_id)
+            continue;
+
+        unsigned int s = score(zone->seeds[i], hash);
+        if (best < 0 || s > best_score
+            || (s == best_score && id < zone->ids[best])) {
+            best = i;
+            best_score = s;
+        }
+    }
+    return best;
+}
+
+/*
+ * 1 if zone a ranks before zone b for an object: the higher score, then
+ * the lower seed, then the zone created first
+ */
+static int zone_before(const topology_t *t, int a, int b, unsigned int hash)
+{
+    unsigned int score_a = score(t->zones[a].seed, hash);
+    unsigned int score_b = score(t->zones[b].seed, hash);
+
+    if (score_a != score_b)
+        return score_a > score_b;
+    if (t->zones[a].seed != t->zones[b].seed)
+        return t->zones[a].seed < t->zones[b].seed;
+    return a < b;
+}
+
+/**
+ * Returns the ID of the best server of a zone for an object, -1 if the
+ * zone has no server other than exclude_id
+ * @param t the topology
+ * @param zone index of the zone
+ * @param hash the hash of the object
+ * @param exclude_id server which is ignored (-1 to ignore nothing)
+ */
+int topology_zone_owner(const topology_t *t, int zone, unsigned int hash,
+                        int exclude_id)
+{
+    int i = best_member(&t->zones[zone], hash, exclude_id);
+    return i < 0 ? -1 : t->zones[zone].ids[i];
+}
+
+/**
+ * Returns the ID of the server an object belongs to: the best server of
+ * the best zone which has one. -1 if there are no servers.
+ * @param t the topology
+ * @param hash the hash of the object
+ * @param exclude_id server which is ignored (-1 to ignore nothing)
+ */
+int topology_owner(const topology_t *t, unsigned int hash, int exclude_id)
+{
+    int best = -1;
+
+    for (int z = 0; z < t->n_zones; ++z) {
+        const zone_t *zone = &t->zones[z];
+        if (zone->n == 0 || (zone->n == 1 && zone->ids[0] == exclude_id))
+            continue;
+        if (best < 0 || zone_before(t, z, best, hash))
+            best = z;
+    }
+
+    return best < 0 ? -1 : topology_zone_owner(t, best, hash, exclude_id);
+}
+
+/**
+ * Fills ids with the servers an object is copied to, owner first: the
+ * best server of every zone, best zones first, so copies are in distinct
+ * zones as long as there are enough of them. The remaining copies go to
+ * the best servers left, on racks which hold no copy yet if possible.
+ * Returns the number of servers (smaller if there are not enough).
+ * @param t the topology
+ * @param hash the hash of the object
+ * @param exclude_id server which is ignored (-1 to ignore nothing)
+ * @param ids array of at least replicas elements
+ * @param replicas number of copies wanted
+ */
+int topology_replicas(const topology_t *t, unsigned int hash, int exclude_id,
+                      int *ids, int replicas)
+{
+    int small[SMALL_ZONES];
+    int *owners = small;
+    if (t->n_zones > SMALL_ZONES) {
+        owners = (int *)malloc(t->n_zones * sizeof(int));
+        DIE(!owners, "topology malloc failed");
+    }
+    // Position of the best server of every zone, -1 once it has a copy
+    for (int z = 0; z < t->n_zones; ++z)
+        owners[z] = best_member(&t->zones[z], hash, exclude_id);
+
+    if (replicas > MAX_COPIES)
+        replicas = MAX_COPIES;
+
+    // Racks holding a copy, as (zone, rack hash) pairs
+    int rack_zones[MAX_COPIES];
+    unsigned int racks[MAX_COPIES];
+    int n = 0;
+
+    while (n < replicas) {
+        int best = -1;
+        for (int z = 0; z < t->n_zones; ++z)
+            if (owners[z] >= 0 && (best < 0 || zone_before(t, z, best, hash)))
+                best = z;
+        if (best < 0)
+            break;
+
+        rack_zones[n] = best;
+        racks[n] = t->zones[best].rack_hashes[owners[best]];
+        ids[n++] = t->zones[best].ids[owners[best]];
+        owners[best] = -1;
+    }
+
+    // Fewer zones than copies: one scan per copy for the next best server
+    while (n < replicas) {
+        int best_zone = -1, best = -1, best_new_rack = 0;
+        unsigned int best_score = 0;
+
+        for (int z = 0; z < t->n_zones; ++z) {
+            const zone_t *zone = &t->zones[z];
+
+            for (int i = 0; i < zone->n; ++i) {
+                int id = zone->ids[i];
+                if (id == exclude_id || contains(ids, n, id))
+                    continue;
+
+                int new_rack = 1;
+                for (int c = 0; c < n && new_rack; ++c)
+                    if (rack_zones[c] == z && racks[c] == zone->rack_hashes[i])
+                        new_rack = 0;
+
+                unsigned int s = score(zone->seeds[i], hash);
+                if (best < 0 || new_rack > best_new_rack
+                    || (new_rack == best_new_rack
+                        && (s > best_score
+                            || (s == best_score
+                                && id < t->zones[best_zone].ids[best])))) {
+                    best_zone = z;
+                    best = i;
+                    best_new_rack = new_rack;
+                    best_score = s;
+                }
+            }
+        }
+        if (best < 0)
+            break;
+
+        rack_zones[n] = best_zone;
+        racks[n] = t->zones[best_zone].rack_hashes[best];
+        ids[n++] = t->zones[best_zone].ids[best];
+    }
+
+    if (owners != small)
+        free(owners);
+    return n;
+}
+
+/**
+ * Number of elements topology_flatten writes
+ * @param t the topology
+ */
+int topology_flat_size(const topology_t *t)
+{
+    int size = 0;
+
+    for (int z = 0; z < t->n_zones; ++z)
+        size += 2 + 2 * t->zones[z].n;
+    return size;
+}
+
+/**
+ * Writes what topology_owner needs as an array of integers, for readers
+ * without the topology itself: for every zone its seed, its number of
+ * servers and the ID and seed of each of them
+ * @param t the topology
+ * @param flat array of topology_flat_size(t) elements
+ */
+void topology_flatten(const topology_t *t, unsigned int *flat)
+{
+    for (int z = 0; z < t->n_zones; ++z) {
+        const zone_t *zone = &t->zones[z];
+
+        *flat++ = zone->seed;
+        *flat++ = zone->n;
+        for (int i = 0; i < zone->n; ++i) {
+            *flat++ = (unsigned int)zone->ids[i];
+            *flat++ = zone->seeds[i];
+        }
+    }
+}
+
+/**
+ * Same as topology_owner on an array from topology_flatten. The array may
+ * be inconsistent (read while it changes): nothing is read past len.
+ * Returns -1 if there are no servers or the array is malformed.
+ * @param flat the array
+ * @param len number of elements of the array
+ * @param hash the hash of the object
+ */
+int topology_flat_owner(const unsigned int *flat, int len, unsigned int hash)
+{
+    int best = -1;
+    unsigned int best_score = 0, best_seed = 0, best_n = 0;
+
+    // Zones are in creation order, so keeping the first of equal ones
+    // breaks ties like zone_before
+    for (int at = 0; at + 2 <= len; ) {
+        unsigned int seed = flat[at], n = flat[at + 1];
+        if (n > (unsigned int)(len - at - 2) / 2)
+            return -1;
+
+        unsigned int s = score(seed, hash);
+        if (n > 0 && (best < 0 || s > best_score
+                      || (s == best_score && seed < best_seed))) {
+            best = at;
+            best_score = s;
+            best_seed = seed;
+            best_n = n;
+        }
+        at += 2 + 2 * n;
+    }
+    if (best < 0)
+        return -1;
+
+    int owner = -1;
+    unsigned int owner_score = 0;
+    // The array may change under a reader, so n is not read again
+    for (unsigned int i = 0; i < best_n; ++i) {
+        int id = (int)flat[best + 2 + 2 * i];
+        unsigned int s = score(flat[best + 3 + 2 * i], hash);
+
+        if (i == 0 || s > owner_score || (s == owner_score && id < owner)) {
+            owner = id;
+            owner_score = s;
+        }
+    }
+    return owner;
+}
@@ -0,0 +1,62 @@
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+typedef struct zone_t zone_t;
+typedef struct topology_t topology_t;
+
+// A failure domain and the servers in it
+struct zone_t {
+    char *name;
+    // Mixed with the hash of an object to score the zone
+    unsigned int seed;
+    // Servers of the zone, in the order they were added
+    int *ids;
+    unsigned int *seeds;
+    // Rack of every server: its label and a hash compared instead of it
+    char **racks;
+    unsigned int *rack_hashes;
+    int n;
+    int cap;
+};
+
+// Hierarchical placement: an object goes to the zone with the best
+// rendezvous score for it, then to the best server of that zone. Zones
+// stay once created (empty ones never win), so their indices are stable.
+struct topology_t {
+    zone_t *zones;
+    int n_zones;
+    int zones_cap;
+    // Zone the reads of this load balancer prefer, -1 for none
+    int local_zone;
+};
+
+topology_t *topology_create(void);
+
+void topology_free(topology_t *t);
+
+int topology_find_zone(topology_t *t, const char *zone);
+
+int topology_add_zone(topology_t *t, const char *zone);
+
+int topology_insert(topology_t *t, int id, unsigned int seed,
+                    const char *zone, const char *rack);
+
+void topology_remove(topology_t *t, int id);
+
+int topology_locate(const topology_t *t, int id, int *index);
+
+int topology_zone_owner(const topology_t *t, int zone, unsigned int hash,
+                        int exclude_id);
+
+int topology_owner(const topology_t *t, unsigned int hash, int exclude_id);
+
+int topology_replicas(const topology_t *t, unsigned int hash, int exclude_id,
+                      int *ids, int replicas);
+
+int topology_flat_size(const topology_t *t);
+
+void topology_flatten(const topology_t *t, unsigned int *flat);
+
+int topology_flat_owner(const unsigned int *flat, int len, unsigned int hash);
+
+#endif  // TOPOLOGY_H_
@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+#include "utils.h"
+
+// Spin used to measure the rate of the time stamp counter
+#define CALIBRATE_NS 2000000ul
+
+int trace_enabled;
+
+static const char *type_names[TRACE_TYPES] = {
+    "store", "retrieve", "mstore", "mretrieve", "resize", "remap_insert",
+    "remap_remove", "remap_drain", "rebalance", "evict"
+};
+
+// Guards the list of rings and the settings, never taken to record
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring *rings;
+static int n_rings;
+// Ring of the calling thread, registered by its first event
+static __thread trace_ring *local_ring;
+
+// Events which started before trace_enable are not dumped
+static unsigned long epoch_ticks;
+static unsigned long epoch_ns;
+static double ticks_per_us = 1000;
+// Shorter operations are not recorded
+static unsigned long threshold_ticks;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+/**
+ * Reads the clock events are timed with: the time stamp counter on x86,
+ * which costs a few ns and no system call, the monotonic clock in ns
+ * elsewhere
+ */
+unsigned long trace_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+/*
+ * Rate of trace_ticks between two points of both clocks
+ */
+static double rate(unsigned long ticks, unsigned long ns)
+{
+    return ns > 0 ? 1000.0 * ticks / ns : 1000;
+}
+
+/**
+ * Starts recording every operation which takes at least threshold_us; the
+ * events recorded before are dropped from the dumps
+ * @param threshold_us the threshold, 0 records all of them
+ */
+void trace_enable(unsigned long threshold_us)
+{
+    pthread_mutex_lock(&lock);
+
+    epoch_ns = now_ns();
+    epoch_ticks = trace_ticks();
+    unsigned long end;
+    while ((end = now_ns()) - epoch_ns < CALIBRATE_NS)
+        ;
+    ticks_per_us = rate(trace_ticks() - epoch_ticks, end - epoch_ns);
+    threshold_ticks = (unsigned long)(threshold_us * ticks_per_us);
+
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Stops recording, the events recorded so far can still be dumped
+ */
+void trace_disable(void)
+{
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Starts timing an operation
+ * Returns the time to pass to trace_elapsed or trace_end, 0 if tracing is
+ * off
+ */
+unsigned long trace_begin(void)
+{
+    if (!__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED))
+        return 0;
+    return trace_ticks();
+}
+
+/**
+ * Ends timing an operation
+ * Returns its duration if it has to be recorded, 0 if tracing was off
+ * when it started or it was faster than the threshold
+ * @param start what trace_begin returned
+ */
+unsigned long trace_elapsed(unsigned long start)
+{
+    if (start == 0)
+        return 0;
+
+    unsigned long duration = trace_ticks() - start;
+    return duration > 0 && duration >= threshold_ticks ? duration : 0;
+}
+
+/*
+ * Allocs the ring of the calling thread and adds it to the list
+ */
+static trace_ring *register_ring(void)
+{
+    trace_ring *ring = (trace_ring *)calloc(1, sizeof(trace_ring));
+    DIE(!ring, "trace ring malloc failed");
+
+    pthread_mutex_lock(&lock);
+    ring->tid = ++n_rings;
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&lock);
+
+    return ring;
+}
+
+/**
+ * Records an event in the ring of the calling thread
+ * @param type what the operation was
+ * @param start when it started (trace_begin)
+ * @param duration how long it took (trace_elapsed)
+ * @param server_id server it ran on, -1 if none
+ * @param key_hash hash of its key, 0 if none
+ * @param chain objects walked in the bucket of the key
+ * @param count objects moved, or keys of a batch
+ */
+void trace_record(trace_type type, unsigned long start,
+                  unsigned long duration, int server_id,
+                  unsigned int key_hash, unsigned int chain,
+                  unsigned int count)
+{
+    trace_ring *ring = local_ring;
+    if (ring == NULL)
+        ring = local_ring = register_ring();
+
+    trace_event *event = &ring->events[ring->head % TRACE_RING_EVENTS];
+    event->start = start;
+    event->duration = duration;
+    event->key_hash = key_hash;
+    event->server_id = server_id;
+    event->chain = chain;
+    event->count = count;
+    event->type = type;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Records an operation if it was slow enough
+ * @param start what trace_begin returned
+ * @param type, server_id, key_hash, chain, count as for trace_record
+ */
+void trace_end(unsigned long start, trace_type type, int server_id,
+               unsigned int key_hash, unsigned int chain, unsigned int count)
+{
+    unsigned long duration = trace_elapsed(start);
+
+    if (duration > 0)
+        trace_record(type, start, duration, server_id, key_hash, chain,
+                     count);
+}
+
+/*
+ * Writes the events of a ring kept since the epoch, returns their number
+ */
+static long dump_ring(trace_ring *ring, trace_event *copy, double rate,
+                      FILE *out)
+{
+    // The thread keeps writing: copy its events, then drop the ones it
+    // may have overwritten meanwhile (and the one it may be writing)
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    memcpy(copy, ring->events, sizeof(ring->events));
+    unsigned long last = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long first = last >= TRACE_RING_EVENTS
+                          ? last - TRACE_RING_EVENTS + 1 : 0;
+
+    long n = 0;
+    for (unsigned long i = first; i < head; ++i) {
+        trace_event *event = &copy[i % TRACE_RING_EVENTS];
+        if (event->start < epoch_ticks)
+            continue;
+
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{\"server\":%d,\"key_hash\":%u,\"chain\":%u,"
+                "\"count\":%u}}", type_names[event->type],
+                event->type <= TRACE_MRETRIEVE ? "op" : "maintenance",
+                ring->tid, (event->start - epoch_ticks) / rate,
+                event->duration / rate, event->server_id, event->key_hash,
+                event->chain, event->count);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Writes the recorded events of every thread as Chrome trace-event JSON
+ * (chrome://tracing, Perfetto), times in us since tracing was enabled
+ * Returns the number of events written, -1 if a write failed
+ * @param out where the JSON is written
+ */
+long trace_dump(FILE *out)
+{
+    trace_event *copy = (trace_event *)malloc(sizeof(rings->events));
+    DIE(!copy, "trace dump malloc failed");
+
+    pthread_mutex_lock(&lock);
+
+    // Measured over the whole trace, the rate is more precise than the
+    // one used for the threshold
+    double dump_rate = ticks_per_us;
+    unsigned long ns = now_ns() - epoch_ns;
+    if (epoch_ns != 0 && ns > 100 * CALIBRATE_NS)
+        dump_rate = rate(trace_ticks() - epoch_ticks, ns);
+
+    // Every thread is named by a metadata event, followed by its events
+    long written = 0;
+    fprintf(out, "{\"traceEvents\":[");
+    for (trace_ring *ring = rings; ring != NULL; ring = ring->next) {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                ring == rings ? "" : ",", ring->tid, ring->tid);
+        written += dump_ring(ring, copy, dump_rate, out);
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    pthread_mutex_unlock(&lock);
+    free(copy);
+
+    return ferror(out) ? -1 : written;
+}
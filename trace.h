@@ -0,0 +1,79 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+
+// Events kept by every thread, the oldest ones are overwritten
+#define TRACE_RING_EVENTS 4096
+
+typedef enum trace_type {
+    TRACE_STORE,
+    TRACE_RETRIEVE,
+    TRACE_MSTORE,
+    TRACE_MRETRIEVE,
+    // Hashtable of a server doubled or halved
+    TRACE_RESIZE,
+    // Objects moved by a membership change
+    TRACE_REMAP_INSERT,
+    TRACE_REMAP_REMOVE,
+    TRACE_REMAP_DRAIN,
+    // Buckets moved by an incremental rebalancing step
+    TRACE_REBALANCE,
+    // Objects evicted to respect a memory budget
+    TRACE_EVICT,
+    TRACE_TYPES
+} trace_type;
+
+typedef struct trace_event trace_event;
+
+// A timed operation, in ticks of the clock of trace_ticks
+struct trace_event {
+    unsigned long start;
+    unsigned long duration;
+    unsigned int key_hash;
+    // Server the operation ran on, -1 if none
+    int server_id;
+    // Objects of the bucket walked to find the key
+    unsigned int chain;
+    // Objects moved, or keys of a batch
+    unsigned int count;
+    unsigned int type;
+};
+
+typedef struct trace_ring trace_ring;
+
+// Events of one thread: only the thread writes them, published by head,
+// so recording never takes a lock
+struct trace_ring {
+    trace_event events[TRACE_RING_EVENTS];
+    // Number of events ever recorded
+    unsigned long head;
+    // Thread number shown in the dump
+    int tid;
+    trace_ring *next;
+};
+
+// Set while events are recorded
+extern int trace_enabled;
+
+void trace_enable(unsigned long threshold_us);
+
+void trace_disable(void);
+
+unsigned long trace_ticks(void);
+
+unsigned long trace_begin(void);
+
+unsigned long trace_elapsed(unsigned long start);
+
+void trace_record(trace_type type, unsigned long start,
+                  unsigned long duration, int server_id,
+                  unsigned int key_hash, unsigned int chain,
+                  unsigned int count);
+
+void trace_end(unsigned long start, trace_type type, int server_id,
+               unsigned int key_hash, unsigned int chain, unsigned int count);
+
+long trace_dump(FILE *out);
+
+#endif  // TRACE_H_
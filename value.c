@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "value.h"
+#include "utils.h"
+
+static value_chunk *chunk_create(void)
+{
+    value_chunk *chunk = (value_chunk *)malloc(sizeof(value_chunk)
+                                               + VALUE_CHUNK_SIZE);
+    DIE(!chunk, "value chunk malloc failed");
+
+    chunk->next = NULL;
+    chunk->len = 0;
+    return chunk;
+}
+
+/**
+ * Initializes an empty builder
+ * @param builder the builder
+ */
+void value_builder_init(value_builder *builder)
+{
+    builder->head = NULL;
+    builder->tail = NULL;
+    builder->size = 0;
+}
+
+/**
+ * Appends bytes at the end of the value, filling the last chunk first
+ * @param builder the builder
+ * @param data bytes that are appended
+ * @param len number of bytes
+ */
+void value_builder_append(value_builder *builder, const char *data,
+                          unsigned long len)
+{
+    builder->size += len;
+
+    while (len > 0) {
+        if (builder->tail == NULL || builder->tail->len == VALUE_CHUNK_SIZE) {
+            value_chunk *chunk = chunk_create();
+            if (builder->tail)
+                builder->tail->next = chunk;
+            else
+                builder->head = chunk;
+            builder->tail = chunk;
+        }
+
+        unsigned long room = VALUE_CHUNK_SIZE - builder->tail->len;
+        unsigned long n = len < room ? len : room;
+
+        memcpy(builder->tail->data + builder->tail->len, data, n);
+        builder->tail->len += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * Splits a contiguous buffer into a new chain of chunks
+ * @param data the bytes
+ * @param len number of bytes
+ */
+value_chunk *value_chunks_from(const char *data, unsigned long len)
+{
+    value_builder builder;
+
+    value_builder_init(&builder);
+    value_builder_append(&builder, data, len);
+    return builder.head;
+}
+
+/**
+ * Returns a deep copy of a chain of chunks
+ * @param chunks the chain
+ */
+value_chunk *value_chunks_copy(const value_chunk *chunks)
+{
+    value_builder builder;
+
+    value_builder_init(&builder);
+    for (; chunks != NULL; chunks = chunks->next)
+        value_builder_append(&builder, chunks->data, chunks->len);
+    return builder.head;
+}
+
+/**
+ * Calls visit on every chunk, in order, and stops early if it returns
+ * non-zero. Returns the last value returned by visit.
+ * @param chunks the chain
+ * @param visit function called with every chunk
+ * @param ctx argument passed to visit
+ */
+int value_chunks_visit(const value_chunk *chunks,
+                       int (*visit)(void *ctx, const char *data,
+                                    unsigned int len),
+                       void *ctx)
+{
+    int ret = 0;
+
+    for (; chunks != NULL && ret == 0; chunks = chunks->next)
+        ret = visit(ctx, chunks->data, chunks->len);
+    return ret;
+}
+
+/**
+ * Copies a chain of chunks into a contiguous buffer
+ * @param chunks the chain
+ * @param dest buffer big enough for the whole value
+ */
+void value_chunks_flatten(const value_chunk *chunks, char *dest)
+{
+    for (; chunks != NULL; chunks = chunks->next) {
+        memcpy(dest, chunks->data, chunks->len);
+        dest += chunks->len;
+    }
+}
+
+/**
+ * Frees a chain of chunks
+ * @param chunks the chain
+ */
+void value_chunks_free(value_chunk *chunks)
+{
+    while (chunks != NULL) {
+        value_chunk *next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef VALUE_H_
+#define VALUE_H_
+
+// Values bigger than this are stored as a chain of chunks
+#define VALUE_CHUNK_SIZE (64 * 1024)
+
+typedef struct value_chunk value_chunk;
+
+// One piece of a large value
+struct value_chunk {
+    value_chunk *next;
+    // Number of bytes used in data
+    unsigned int len;
+    char data[];
+};
+
+typedef struct value_builder value_builder;
+
+// Accumulates a value that arrives in pieces into a chain of chunks
+struct value_builder {
+    value_chunk *head;
+    value_chunk *tail;
+    // Total number of bytes appended so far
+    unsigned long size;
+};
+
+void value_builder_init(value_builder *builder);
+
+void value_builder_append(value_builder *builder, const char *data,
+                          unsigned long len);
+
+value_chunk *value_chunks_copy(const value_chunk *chunks);
+
+value_chunk *value_chunks_from(const char *data, unsigned long len);
+
+int value_chunks_visit(const value_chunk *chunks,
+                       int (*visit)(void *ctx, const char *data,
+                                    unsigned int len),
+                       void *ctx);
+
+void value_chunks_flatten(const value_chunk *chunks, char *dest);
+
+void value_chunks_free(value_chunk *chunks);
+
+#endif  // VALUE_H_
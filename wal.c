@@ -0,0 +1,558 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wal.h"
+#include "load_balancer.h"
+#include "snapshot.h"
+#include "utils.h"
+
+// checksum (4) + op (1) + two 32-bit arguments (8)
+#define WAL_HEADER_SIZE 13
+#define WAL_RING_SIZE 4096
+#define WAL_BUFFER_SIZE (1 << 16)
+// How long the writer sleeps when there is nothing to do
+#define WAL_IDLE_NS 20000
+
+// A record handed from the request path to the writer thread
+struct wal_entry {
+    char *data;
+    unsigned int len;
+    unsigned long lsn;
+};
+
+/*
+ * FNV-1a, used to detect torn or corrupted records at the tail of the log
+ */
+static unsigned int wal_checksum(const char *data, unsigned int len,
+                                 unsigned int hash)
+{
+    for (unsigned int i = 0; i < len; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static unsigned long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+}
+
+static void idle_wait(void)
+{
+    struct timespec ts = {0, WAL_IDLE_NS};
+    nanosleep(&ts, NULL);
+}
+
+static void write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, data, len);
+        DIE(ret < 0, "wal write failed");
+        data += ret;
+        len -= ret;
+    }
+}
+
+/**
+ * Body of the writer thread: drains the submission ring into the log file
+ * and decides when to fsync() (group commit)
+ * @param arg the log
+ */
+static void *wal_writer(void *arg)
+{
+    wal_t *wal = (wal_t *)arg;
+    char *buffer = (char *)malloc(WAL_BUFFER_SIZE);
+    DIE(!buffer, "wal buffer malloc failed");
+
+    size_t used = 0;
+    unsigned long written_lsn = wal->durable_lsn;
+    unsigned long synced_lsn = written_lsn;
+    unsigned long last_sync = now_us();
+    unsigned int pending_ops = 0;
+
+    for (;;) {
+        struct wal_entry entry;
+        int got = 0;
+
+        // Take everything that was submitted, but stop at sync_ops records
+        // so one batch never grows past the group commit limit
+        while (pending_ops < wal->sync_ops
+               && spsc_ring_pop(wal->ring, &entry)) {
+            got = 1;
+            if (used + entry.len > WAL_BUFFER_SIZE) {
+                write_all(wal->fd, buffer, used);
+                used = 0;
+            }
+            if (entry.len > WAL_BUFFER_SIZE) {
+                write_all(wal->fd, entry.data, entry.len);
+            } else {
+                memcpy(buffer + used, entry.data, entry.len);
+                used += entry.len;
+            }
+            free(entry.data);
+            written_lsn = entry.lsn;
+            pending_ops++;
+        }
+        if (used > 0) {
+            write_all(wal->fd, buffer, used);
+            used = 0;
+        }
+
+        if (written_lsn != synced_lsn) {
+            int do_sync = 0;
+
+            if (wal->durability == WAL_DURABILITY_SYNC
+                || pending_ops >= wal->sync_ops
+                || now_us() - last_sync >= wal->sync_us
+                || __atomic_load_n(&wal->flush_lsn, __ATOMIC_ACQUIRE)
+                   > synced_lsn
+                || __atomic_load_n(&wal->stop, __ATOMIC_ACQUIRE))
+                do_sync = 1;
+
+            if (wal->durability == WAL_DURABILITY_NONE) {
+                // Nothing is ever synced, being in the kernel is enough
+                synced_lsn = written_lsn;
+                pending_ops = 0;
+                __atomic_store_n(&wal->durable_lsn, synced_lsn,
+                                 __ATOMIC_RELEASE);
+            } else if (do_sync) {
+                DIE(fsync(wal->fd) < 0, "wal fsync failed");
+                synced_lsn = written_lsn;
+                pending_ops = 0;
+                last_sync = now_us();
+                __atomic_store_n(&wal->durable_lsn, synced_lsn,
+                                 __ATOMIC_RELEASE);
+            }
+        }
+
+        if (!got) {
+            if (__atomic_load_n(&wal->stop, __ATOMIC_ACQUIRE)
+                && spsc_ring_empty(wal->ring) && written_lsn == synced_lsn)
+                break;
+            idle_wait();
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Opens (or creates) a log file and starts its writer thread
+ * @param path path of the log file
+ * @param durability when a record counts as persisted
+ * @param sync_ops maximum number of records covered by one fsync()
+ * @param sync_us maximum time in microseconds between two fsync() calls
+ */
+wal_t *wal_open(const char *path, wal_durability durability,
+                unsigned int sync_ops, unsigned int sync_us)
+{
+    wal_t *wal = (wal_t *)malloc(sizeof(wal_t));
+    DIE(!wal, "wal malloc failed");
+
+    wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    DIE(wal->fd < 0, "wal open failed");
+
+    wal->durability = durability;
+    wal->sync_ops = sync_ops > 0 ? sync_ops : 1;
+    wal->sync_us = sync_us;
+    wal->ring = spsc_ring_create(WAL_RING_SIZE, sizeof(struct wal_entry));
+    wal->submitted_lsn = 0;
+    wal->durable_lsn = 0;
+    wal->flush_lsn = 0;
+    wal->stop = 0;
+
+    DIE(pthread_create(&wal->writer, NULL, wal_writer, wal) != 0,
+        "wal writer thread failed");
+
+    return wal;
+}
+
+/**
+ * Waits until every record up to lsn is durable
+ * @param wal the log
+ * @param lsn sequence number of the record
+ */
+static void wal_wait(wal_t *wal, unsigned long lsn)
+{
+    while (__atomic_load_n(&wal->durable_lsn, __ATOMIC_ACQUIRE) < lsn)
+        idle_wait();
+}
+
+/**
+ * Hands an encoded record to the writer thread. The call only waits for
+ * the disk in WAL_DURABILITY_SYNC mode (or if the ring is full).
+ * @param wal the log
+ * @param data encoded record (ownership passes to the writer)
+ * @param len length of the record in bytes
+ */
+static void wal_submit(wal_t *wal, char *data, unsigned int len)
+{
+    struct wal_entry entry = {data, len, wal->submitted_lsn + 1};
+
+    while (!spsc_ring_push(wal->ring, &entry))
+        sched_yield();
+    wal->submitted_lsn = entry.lsn;
+
+    if (wal->durability == WAL_DURABILITY_SYNC)
+        wal_wait(wal, entry.lsn);
+}
+
+/**
+ * Allocs a record and fills its header, the payload is written by the caller
+ * @param op operation type
+ * @param a first argument (key length or server ID)
+ * @param b second argument (value length)
+ * @param payload_len number of bytes after the header
+ */
+static char *wal_record(enum wal_op op, unsigned int a, unsigned int b,
+                        unsigned int payload_len)
+{
+    char *record = (char *)malloc(WAL_HEADER_SIZE + payload_len);
+    DIE(!record, "wal record malloc failed");
+
+    record[4] = (char)op;
+    memcpy(record + 5, &a, sizeof(a));
+    memcpy(record + 9, &b, sizeof(b));
+
+    return record;
+}
+
+/**
+ * Computes the checksum of a complete record and hands it to the writer
+ * @param wal the log
+ * @param record the record
+ * @param payload_len number of bytes after the header
+ */
+static void wal_seal(wal_t *wal, char *record, unsigned int payload_len)
+{
+    unsigned int checksum = wal_checksum(record + 4,
+                                         WAL_HEADER_SIZE - 4 + payload_len,
+                                         2166136261u);
+    memcpy(record, &checksum, sizeof(checksum));
+
+    wal_submit(wal, record, WAL_HEADER_SIZE + payload_len);
+}
+
+/**
+ * Logs a store operation
+ * @param wal the log
+ * @param key the key
+ * @param value the value
+ */
+void wal_log_store(wal_t *wal, const char *key, const char *value)
+{
+    unsigned int key_len = strlen(key);
+    unsigned int value_len = strlen(value);
+
+    char *record = wal_record(WAL_OP_STORE, key_len, value_len,
+                              key_len + value_len);
+    memcpy(record + WAL_HEADER_SIZE, key, key_len);
+    memcpy(record + WAL_HEADER_SIZE + key_len, value, value_len);
+    wal_seal(wal, record, key_len + value_len);
+}
+
+/**
+ * Logs a store operation whose value is a chain of chunks
+ * @param wal the log
+ * @param key the key
+ * @param chunks the value
+ * @param value_len number of bytes in the chain
+ */
+void wal_log_store_chunks(wal_t *wal, const char *key,
+                          const value_chunk *chunks, unsigned int value_len)
+{
+    unsigned int key_len = strlen(key);
+
+    char *record = wal_record(WAL_OP_STORE, key_len, value_len,
+                              key_len + value_len);
+    memcpy(record + WAL_HEADER_SIZE, key, key_len);
+    value_chunks_flatten(chunks, record + WAL_HEADER_SIZE + key_len);
+    wal_seal(wal, record, key_len + value_len);
+}
+
+/**
+ * Logs a membership change
+ * @param wal the log
+ * @param op WAL_OP_ADD_SERVER or WAL_OP_REMOVE_SERVER
+ * @param server_id ID of the server
+ * @param weight weight of an added server (logs written before weights
+ *               existed have 0, which is read as 1)
+ */
+void wal_log_server(wal_t *wal, enum wal_op op, int server_id,
+                    unsigned int weight)
+{
+    char *record = wal_record(op, (unsigned int)server_id, weight, 0);
+    wal_seal(wal, record, 0);
+}
+
+/**
+ * Logs a server added with a location
+ * @param wal the log
+ * @param server_id ID of the server
+ * @param zone its zone
+ * @param rack its rack
+ */
+void wal_log_server_at(wal_t *wal, int server_id, const char *zone,
+                       const char *rack)
+{
+    // Both labels keep their terminator
+    unsigned int zone_size = strlen(zone) + 1;
+    unsigned int len = zone_size + strlen(rack) + 1;
+
+    char *record = wal_record(WAL_OP_ADD_SERVER_AT, (unsigned int)server_id,
+                              len, len);
+    memcpy(record + WAL_HEADER_SIZE, zone, zone_size);
+    memcpy(record + WAL_HEADER_SIZE + zone_size, rack, len - zone_size);
+    wal_seal(wal, record, len);
+}
+
+/**
+ * Logs a change of the expiry time of a key
+ * @param wal the log
+ * @param key the key
+ * @param expires_at expiry time in ms, 0 if the key no longer expires
+ */
+void wal_log_expire(wal_t *wal, const char *key, unsigned long expires_at)
+{
+    unsigned int key_len = strlen(key);
+    uint64_t expires = expires_at;
+
+    // The key is followed by the 64-bit expiry time
+    char *record = wal_record(WAL_OP_EXPIRE, key_len, 0,
+                              key_len + sizeof(expires));
+    memcpy(record + WAL_HEADER_SIZE, key, key_len);
+    memcpy(record + WAL_HEADER_SIZE + key_len, &expires, sizeof(expires));
+    wal_seal(wal, record, key_len + sizeof(expires));
+}
+
+/**
+ * Blocks until every record submitted so far is durable
+ * @param wal the log
+ */
+void wal_flush(wal_t *wal)
+{
+    if (wal == NULL)
+        return;
+
+    // Forces the writer to sync whatever it already has
+    __atomic_store_n(&wal->flush_lsn, wal->submitted_lsn, __ATOMIC_RELEASE);
+    wal_wait(wal, wal->submitted_lsn);
+}
+
+/**
+ * Drops every record from the log (after they were covered by a snapshot)
+ * Returns 0 on success, -1 on failure
+ * @param wal the log
+ */
+int wal_truncate(wal_t *wal)
+{
+    wal_flush(wal);
+    if (ftruncate(wal->fd, 0) < 0) {
+        perror("wal truncate failed");
+        return -1;
+    }
+    return fsync(wal->fd);
+}
+
+/**
+ * Flushes the log, stops the writer thread and frees the log
+ * @param wal the log
+ */
+void wal_close(wal_t *wal)
+{
+    if (wal == NULL)
+        return;
+
+    __atomic_store_n(&wal->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(wal->writer, NULL);
+
+    close(wal->fd);
+    spsc_ring_free(wal->ring);
+    free(wal);
+}
+
+/**
+ * Applies one decoded record to the load balancer. Membership records are
+ * skipped if they are already reflected in the balancer, so a log can be
+ * replayed on top of a snapshot which already contains part of it.
+ */
+static void wal_apply(load_balancer *main, enum wal_op op, unsigned int a,
+                      unsigned int b, char *key, char *value,
+                      unsigned long expires_at)
+{
+    int server_id = (int)a;
+    int index_server = 0;
+
+    switch (op) {
+    case WAL_OP_STORE:
+        if (main->hashring_len > 0)
+            loader_store(main, key, value, &index_server);
+        break;
+    case WAL_OP_ADD_SERVER:
+        if (!loader_has_server(main, server_id))
+            loader_add_server_weighted(main, server_id, b ? b : 1);
+        break;
+    case WAL_OP_ADD_SERVER_AT:
+        if (!loader_has_server(main, server_id))
+            loader_add_server_at(main, server_id, key, value);
+        break;
+    case WAL_OP_REMOVE_SERVER:
+        if (loader_has_server(main, server_id))
+            loader_remove_server(main, server_id);
+        break;
+    case WAL_OP_EXPIRE:
+        if (main->hashring_len > 0)
+            loader_expire_at(main, key, expires_at);
+        break;
+    }
+}
+
+/**
+ * Replays a log file on top of the current state of the load balancer.
+ * A torn or corrupted tail (crash in the middle of a write) is cut off.
+ * Returns the number of replayed records or -1 if the file can't be read.
+ * @param main the load balancer
+ * @param path path of the log file
+ */
+long wal_replay(load_balancer *main, const char *path)
+{
+    FILE *log = fopen(path, "rb");
+    if (log == NULL)
+        return 0;
+
+    long replayed = 0;
+    long good_offset = 0;
+    char header[WAL_HEADER_SIZE];
+
+    // Lengths are read before the checksum can vouch for them: a record
+    // can't be longer than what is left of the file
+    fseek(log, 0, SEEK_END);
+    long file_len = ftell(log);
+    rewind(log);
+
+    while (fread(header, 1, WAL_HEADER_SIZE, log) == WAL_HEADER_SIZE) {
+        unsigned int checksum, a, b;
+        enum wal_op op = (enum wal_op)header[4];
+
+        memcpy(&checksum, header, sizeof(checksum));
+        memcpy(&a, header + 5, sizeof(a));
+        memcpy(&b, header + 9, sizeof(b));
+
+        unsigned long payload_len = 0;
+        if (op == WAL_OP_STORE)
+            payload_len = (unsigned long)a + b;
+        else if (op == WAL_OP_ADD_SERVER_AT)
+            payload_len = b;
+        else if (op == WAL_OP_EXPIRE)
+            payload_len = (unsigned long)a + sizeof(uint64_t);
+        else if (op != WAL_OP_ADD_SERVER && op != WAL_OP_REMOVE_SERVER)
+            break;
+        if (payload_len > (unsigned long)(file_len - good_offset
+                                          - WAL_HEADER_SIZE))
+            break;
+
+        // Key and value are stored back to back, without terminators
+        char *payload = (char *)malloc(payload_len + 2);
+        if (payload == NULL)
+            break;
+        if (fread(payload, 1, payload_len, log) != payload_len) {
+            free(payload);
+            break;
+        }
+
+        unsigned int expected = wal_checksum(header + 4, WAL_HEADER_SIZE - 4,
+                                             2166136261u);
+        expected = wal_checksum(payload, payload_len, expected);
+        if (expected != checksum) {
+            free(payload);
+            break;
+        }
+
+        char *key = NULL, *value = NULL;
+        uint64_t expires = 0;
+        if (op == WAL_OP_STORE) {
+            memmove(payload + a + 1, payload + a, b);
+            payload[a] = 0;
+            payload[a + 1 + b] = 0;
+            key = payload;
+            value = payload + a + 1;
+        } else if (op == WAL_OP_EXPIRE) {
+            memcpy(&expires, payload + a, sizeof(expires));
+            payload[a] = 0;
+            key = payload;
+        } else if (op == WAL_OP_ADD_SERVER_AT) {
+            // Zone then rack; the checksum matched, but don't trust the
+            // terminators to be there
+            payload[b] = 0;
+            payload[b + 1] = 0;
+            key = payload;
+            value = payload + strlen(payload) + 1;
+        }
+        wal_apply(main, op, a, b, key, value, expires);
+        free(payload);
+
+        replayed++;
+        good_offset += WAL_HEADER_SIZE + payload_len;
+    }
+
+    fclose(log);
+
+    if (good_offset < file_len) {
+        fprintf(stderr, "wal: dropping %ld bytes of torn log tail\n",
+                file_len - good_offset);
+        if (truncate(path, good_offset) < 0)
+            perror("wal truncate failed");
+    }
+
+    return replayed;
+}
+
+/**
+ * Rebuilds the state of a (fresh) load balancer: loads the latest snapshot,
+ * if there is one, and replays the log on top of it.
+ * Returns the number of replayed log records or -1 on failure.
+ * @param main the load balancer
+ * @param snapshot_path path of the snapshot (can be NULL)
+ * @param wal_path path of the log file
+ */
+long wal_recover(load_balancer *main, const char *snapshot_path,
+                 const char *wal_path)
+{
+    if (snapshot_path != NULL && snapshot_load(main, snapshot_path) < 0)
+        return -1;
+
+    return wal_replay(main, wal_path);
+}
+
+/**
+ * Writes a snapshot of the load balancer and empties the log
+ * Returns 0 on success, -1 on failure (the log is kept in that case)
+ * @param wal the log
+ * @param main the load balancer
+ * @param snapshot_path where the snapshot is written
+ */
+int wal_checkpoint(wal_t *wal, load_balancer *main, const char *snapshot_path)
+{
+    // A background snapshot finishing later would rename an older view of
+    // the load balancer over this one
+    snapshot_poll(main, SNAPSHOT_WAIT);
+    // Nothing shares these pages, the pending moves can be done first
+    loader_rebalance_finish(main);
+    wal_flush(wal);
+    if (snapshot_save(main, snapshot_path) < 0)
+        return -1;
+
+    return wal_truncate(wal);
+}
@@ -0,0 +1,83 @@
+#ifndef WAL_H_
+#define WAL_H_
+
+#include <pthread.h>
+
+#include "spsc_ring.h"
+#include "value.h"
+
+struct load_balancer;
+
+typedef struct wal_t wal_t;
+
+// How long a loader call may return before its record reaches the disk
+typedef enum wal_durability {
+    // Records are written to the kernel, the disk is never explicitly synced
+    WAL_DURABILITY_NONE,
+    // fsync() once every sync_ops records or every sync_us microseconds
+    WAL_DURABILITY_GROUP,
+    // The loader call waits until the fsync() covering its record is done
+    WAL_DURABILITY_SYNC
+} wal_durability;
+
+// Operation types recorded in the log
+enum wal_op {
+    WAL_OP_STORE = 1,
+    WAL_OP_ADD_SERVER = 2,
+    WAL_OP_REMOVE_SERVER = 3,
+    WAL_OP_EXPIRE = 4,
+    // Server added with a zone and a rack
+    WAL_OP_ADD_SERVER_AT = 5
+};
+
+struct wal_t {
+    // File descriptor of the log file (opened in append mode)
+    int fd;
+    wal_durability durability;
+    // Group commit limits
+    unsigned int sync_ops;
+    unsigned int sync_us;
+    // Submission ring between the request path and the writer thread
+    spsc_ring_t *ring;
+    pthread_t writer;
+    // Sequence number of the last submitted record (producer side)
+    unsigned long submitted_lsn;
+    // Sequence number of the last record which is on disk (writer side)
+    unsigned long durable_lsn;
+    // Records up to this sequence number must be synced as soon as possible
+    unsigned long flush_lsn;
+    // Set when the writer has to drain the ring and exit
+    int stop;
+};
+
+wal_t *wal_open(const char *path, wal_durability durability,
+                unsigned int sync_ops, unsigned int sync_us);
+
+void wal_log_store(wal_t *wal, const char *key, const char *value);
+
+void wal_log_store_chunks(wal_t *wal, const char *key,
+                          const value_chunk *chunks, unsigned int value_len);
+
+void wal_log_server(wal_t *wal, enum wal_op op, int server_id,
+                    unsigned int weight);
+
+void wal_log_server_at(wal_t *wal, int server_id, const char *zone,
+                       const char *rack);
+
+void wal_log_expire(wal_t *wal, const char *key, unsigned long expires_at);
+
+void wal_flush(wal_t *wal);
+
+int wal_truncate(wal_t *wal);
+
+void wal_close(wal_t *wal);
+
+long wal_replay(struct load_balancer *main, const char *path);
+
+long wal_recover(struct load_balancer *main, const char *snapshot_path,
+                 const char *wal_path);
+
+int wal_checkpoint(wal_t *wal, struct load_balancer *main,
+                   const char *snapshot_path);
+
+#endif  // WAL_H_